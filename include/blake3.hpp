@@ -0,0 +1,49 @@
+#ifndef BLAKE3_SSFTP
+#define BLAKE3_SSFTP
+
+#include <cstddef>
+
+#include "utils.hpp"
+
+/*
+    BLAKE3, a fast cryptographic hash, offered as an alternative to SHA-256 for the
+    integrity check at the end of every transfer (see Crypto::CalculateHash())
+
+    SHA-256 processes its input one block after another, each block depending on the
+    one before it, so there's no way to spread the work out. BLAKE3 instead cuts the
+    input into 1 KB chunks, hashes every chunk independently, and then combines the
+    results pairwise in a binary tree up to a single root:
+
+                       root
+                     /      \
+                parent      parent
+                /    \      /    \
+            chunk0 chunk1 chunk2 chunk3
+
+    Independent chunks means we can hash
+    - several chunks at once on one core, with SIMD: each 32-bit lane of a vector
+      register works on a different chunk, 8 chunks at a time
+    - different subtrees on different cores, with threads
+
+    This is a from scratch, portable implementation of the BLAKE3 spec
+    (https://github.com/BLAKE3-team/BLAKE3-specs), producing the standard 32 byte
+    output. The SIMD part uses the compiler's vector extensions instead of hand written
+    intrinsics, and is compiled once per instruction set (baseline, AVX2, AVX-512),
+    the right version being picked at startup for the CPU we're running on.
+*/
+namespace Blake3 {
+
+    // Size of a BLAKE3 hash, same as SHA-256
+    constexpr size_t outputSize = 32;
+
+    /*
+        Hash a buffer
+        @param data: bytes to hash
+        @param size: number of bytes
+        @param output: where to write the 32 byte hash
+        @param threads: at most this many threads are used, large inputs only
+    */
+    void Hash(const Byte* data, size_t size, Byte* output, unsigned threads = 1);
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef CHUNK_TUNER_SSFTP
+#define CHUNK_TUNER_SSFTP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/*
+    Picks the size of the chunks we hand to `send()`, while the transfer is running
+
+    Small chunks mean lots of system calls, which caps how fast we can go on a fast link.
+    Large chunks mean coarse pacing and long turns for each file (see rate_limiter.hpp),
+    which hurts small files waiting behind a large one. The best size depends on the link,
+    so instead of hard coding one, we measure and adjust:
+
+    - Goodput: how many bytes per second `send()` actually takes from us. Every sample
+      window, the chunk size is doubled or halved in whichever direction made goodput go
+      up last time, and left alone once goodput stops changing (hill climbing)
+    - Send queue depth (TIOCOUTQ): how much data is sitting in the socket's send buffer,
+      not yet acknowledged. A nearly full buffer means the network is the bottleneck, and
+      changing the chunk size won't make a difference, so we don't chase the noise
+    - Round trip time (TCP_INFO): goodput x RTT is the amount of data "in flight" on the
+      link (the bandwidth-delay product). On a long fat link we keep the chunks at least
+      a quarter of that, so a few writes per round trip are enough to keep the link busy
+
+    Linux only (TIOCOUTQ and TCP_INFO), elsewhere it just sticks with its initial size.
+*/
+class ChunkTuner {
+public:
+    // Chunk sizes are kept within these bounds, and start off at `initialChunkSize`
+    static constexpr size_t minChunkSize = 4 * 1024;
+    static constexpr size_t maxChunkSize = 1024 * 1024;
+    static constexpr size_t initialChunkSize = 32 * 1024;
+
+    // What the tuner has seen, for reporting
+    struct Metrics {
+        size_t chunkSize;
+        double goodputBytesPerSecond;
+        uint32_t rttMicros;
+        uint32_t sendQueueBytes;
+        uint32_t adjustments;
+        uint64_t samples;
+        uint64_t bytesSent;
+    };
+
+private:
+    // Decide at most once per this much time spent in send()
+    static constexpr std::chrono::milliseconds sampleWindow{20};
+    // Goodput changes smaller than this (10%) are treated as noise
+    static constexpr double tolerance = 0.10;
+
+    size_t chunkSize;
+    int direction;
+    double lastGoodput;
+
+    // The current sample window
+    std::chrono::steady_clock::duration windowTime;
+    uint64_t windowBytes;
+
+    Metrics metrics;
+
+    void Adjust(int socketFD, double goodput);
+
+public:
+    ChunkTuner();
+
+    // Start over, used for every new connection
+    void Reset();
+
+    // Size to use for the next chunk
+    size_t ChunkSize() const {
+        return chunkSize;
+    }
+
+    /*
+        Report a chunk that went out
+        @param socketFD: socket it was sent on, queried for its queue depth and RTT
+        @param bytes: size of the chunk
+        @param sendTime: how long send() took (not counting any time spent rate limited)
+    */
+    void OnChunkSent(int socketFD, size_t bytes, std::chrono::steady_clock::duration sendTime);
+
+    const Metrics& GetMetrics() const {
+        return metrics;
+    }
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef CPU_FEATURES_SSFTP
+#define CPU_FEATURES_SSFTP
+
+#include <string>
+
+namespace Cpu {
+
+    /*
+        The instruction set extensions we care about when picking a cipher suite
+
+        AES-NI (and the ARMv8 Crypto Extensions) make AES several times faster than a
+        plain software implementation. PCLMULQDQ/PMULL speed up the GHASH part of GCM,
+        and VAES lets AVX2/AVX-512 registers run several AES rounds side by side.
+
+        ChaCha20 does not need any special instructions, it just likes wide SIMD registers
+        (SSE/AVX2/AVX-512/NEON), which is why it is the go-to cipher on hosts without AES-NI
+    */
+    struct Features {
+        bool aes = false;
+        bool carrylessMultiply = false;
+        bool vectorAes = false;
+        bool avx2 = false;
+        bool avx512 = false;
+        bool neon = false;
+    };
+
+    /*
+        Probe the CPU we're running on
+        @return the features supported by the current CPU
+
+        The result is cached, so calling this repeatedly is cheap
+    */
+    const Features& DetectFeatures();
+
+    /*
+        Format the detected features as a human readable string
+        @param features: features to describe
+        @return something like "aes pclmul vaes avx2"
+    */
+    std::string DescribeFeatures(const Features& features);
+};
+
+#endif
@@ -3,7 +3,13 @@
 
 #include <vector>
 #include <array>
+#include <span>
+#include <string>
+#include <cstdint>
+#include <functional>
+#include <sys/types.h>
 #include "utils.hpp"
+#include "cpu_features.hpp"
 
 namespace Crypto {
 
@@ -17,6 +23,12 @@ namespace Crypto {
         and then use that secret to derive the key and IV using a key derivation function (KDF).
 
         For this implementation, we will use a pre-shared key and IV for AES-256 encryption.
+
+        Update: the sender and receiver now run an X25519 key exchange when they connect
+        (see key_exchange.hpp), and derive fresh keys for every session. The pre-shared key
+        is still mixed into that derivation, so only peers that know it end up with matching
+        keys. The pre-shared key and IV are also still used directly when nothing else is
+        specified, see `preSharedSessionKeys` below.
     */
 
     // Random 32 bytes = 256 bits key
@@ -33,33 +45,213 @@ namespace Crypto {
         0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
     };
 
+    // The symmetric key and IV used to encrypt a session's data
+    struct SessionKeys {
+        std::array<Byte, 32> key;
+        std::array<Byte, 16> iv;
+    };
+
+    // What EncryptData()/DecryptData() use when no session keys were negotiated
+    const SessionKeys preSharedSessionKeys = {preSharedKey, preSharedIV};
+
+    /*
+        The cipher suites both ends know how to speak
+
+        The values are sent over the wire during the handshake, so don't renumber them.
+        `None` is never negotiated, it's what the receiver answers with when the two ends
+        have nothing in common.
+
+        - AES-256-CBC: the original cipher of this program, no authentication
+        - AES-256-GCM: authenticated, very fast with AES-NI + PCLMULQDQ (even more so with VAES)
+        - ChaCha20-Poly1305: authenticated, fast in plain software, the best pick without AES-NI
+
+        Both AEAD suites use a random 12 byte nonce per message, which is sent in front of the
+        ciphertext, and a 16 byte tag, which is sent after it.
+
+        - Caesar, NULL: no protection at all, for teaching and for benchmarking the transport
+                        alone. Only offered when both ends are started with --cipher naming them
+
+        How each one works is in its policy, see crypto_policies.hpp
+    */
+    enum class CipherSuite : uint8_t {
+        None = 0,
+        Aes256Cbc = 1,
+        Aes256Gcm = 2,
+        ChaCha20Poly1305 = 3,
+        Caesar = 4,
+        Null = 5
+    };
+
+    // A suite together with how fast we think it runs on this machine (roughly MB/s)
+    struct SuiteScore {
+        CipherSuite suite;
+        uint32_t score;
+    };
+
     /*
-        Encrypts the plaintext using AES-256 in CBC mode
+        Get a printable name for a cipher suite
+        @param suite: the cipher suite
+        @return name of the suite, like "AES-256-GCM"
+    */
+    std::string CipherSuiteName(CipherSuite suite);
+
+    /*
+        Parse the name of a cipher suite, as given on the command line
+        @param name: "aes256gcm", "chacha20poly1305", "aes256cbc", "caesar" or "null"
+        @param suite: the parsed suite
+        @return true if the name is known, false otherwise
+    */
+    bool ParseCipherSuite(const std::string& name, CipherSuite& suite);
+
+    /*
+        Rank the cipher suites we support for the given CPU, fastest first
+        @param features: features of the CPU we're running on
+        @param benchmark: measure every suite instead of estimating from the CPU features
+        @param only: rank just these suites, empty for every real one (never Caesar or NULL)
+        @return every supported suite along with its score, sorted by score
+    */
+    std::vector<SuiteScore> RankCipherSuites(const Cpu::Features& features, bool benchmark,
+        const std::vector<CipherSuite>& only = {});
+
+    /*
+        Pick the suite that runs fastest on both ends
+        @param local: our own ranking, see RankCipherSuites()
+        @param remote: the ranking the other end advertised
+        @return the chosen suite, or CipherSuite::None if there's nothing in common
+    */
+    CipherSuite ChooseCipherSuite(const std::vector<SuiteScore>& local, const std::vector<SuiteScore>& remote);
+
+    /*
+        Encrypts the plaintext using the given cipher suite
         @param plaintext: the plaintext to be encrypted
         @param ciphertext: the encrypted data
-        @param key: the encryption key
-        @param iv: the initialization vector
+        @param suite: the cipher suite to use, AES-256-CBC by default
+        @param keys: the key and IV to use, the pre-shared ones by default
         @return true if encryption is successful, false otherwise
     */
-    bool EncryptData(const std::vector<Byte>& plaintext, std::vector<Byte>& ciphertext);
+    bool EncryptData(const std::vector<Byte>& plaintext, std::vector<Byte>& ciphertext,
+        CipherSuite suite = CipherSuite::Aes256Cbc, const SessionKeys& keys = preSharedSessionKeys);
 
     /*
-        Decrypts the ciphertext using AES-256 in CBC mode
+        Decrypts the ciphertext using the given cipher suite
         @param ciphertext: the ciphertext to be decrypted
         @param plaintext: the decrypted data
-        @param key: the decryption key
-        @param iv: the initialization vector
+        @param suite: the cipher suite to use, AES-256-CBC by default
+        @param keys: the key and IV to use, the pre-shared ones by default
         @return true if decryption is successful, false otherwise
     */
-    bool DecryptData(const std::vector<Byte>& ciphertext, std::vector<Byte>& plaintext);
+    bool DecryptData(const std::vector<Byte>& ciphertext, std::vector<Byte>& plaintext,
+        CipherSuite suite = CipherSuite::Aes256Cbc, const SessionKeys& keys = preSharedSessionKeys);
+
+    /*
+        The same, for data that doesn't live in a vector: an mmap'd file, a pooled buffer,
+        part of a larger buffer, an array on the stack. Nothing is allocated or resized, the
+        output goes into the span it's given, which must hold at least MaxEncryptedSize()
+        (or MaxDecryptedSize()) bytes.
+        @param plaintext/ciphertext: the input
+        @param ciphertext/plaintext: where the output goes
+        @param suite, keys: as above
+        @return how many bytes of the output were written, -1 on error
+    */
+    ssize_t EncryptData(std::span<const Byte> plaintext, std::span<Byte> ciphertext,
+        CipherSuite suite = CipherSuite::Aes256Cbc, const SessionKeys& keys = preSharedSessionKeys);
+    ssize_t DecryptData(std::span<const Byte> ciphertext, std::span<Byte> plaintext,
+        CipherSuite suite = CipherSuite::Aes256Cbc, const SessionKeys& keys = preSharedSessionKeys);
 
     /*
-        Calculates the SHA-256 hash of the given data
+        Called by the windowed DecryptData() below as the plaintext is written, in order
+        @param offset: where the new plaintext starts in the output
+        @param length: how much of it there is
+    */
+    using DecryptedWindow = std::function<void(size_t offset, size_t length)>;
+
+    /*
+        DecryptData() into a span, a window of ciphertext at a time, telling `onWindow`
+        about each stretch of plaintext as soon as it's written. The caller can start on the
+        start of the output (writing it back to disk, say) while the rest is still being
+        decrypted. The output is the same as the DecryptData() above.
+        @param window: ciphertext to decrypt at a time, in bytes
+        @param onWindow: called after each window, and for whatever the end adds
+
+        The cipher itself streams, only checking the authentication tag (or the padding) at
+        the very end. So the plaintext handed to `onWindow` isn't known to be genuine yet,
+        only once this returns successfully: keep it out of sight until then
+    */
+    ssize_t DecryptData(std::span<const Byte> ciphertext, std::span<Byte> plaintext, CipherSuite suite,
+        const SessionKeys& keys, size_t window, const DecryptedWindow& onWindow);
+
+    /*
+        How much room the output of EncryptData()/DecryptData() needs, at most
+        @param size: size of the input
+        @param suite: the cipher suite
+        @return size of the output buffer to provide, 0 for an unknown suite (or a
+                ciphertext too short to hold a nonce and a tag)
+    */
+    size_t MaxEncryptedSize(size_t size, CipherSuite suite);
+    size_t MaxDecryptedSize(size_t size, CipherSuite suite);
+
+    /*
+        The hash algorithms used to check that a file arrived intact
+
+        Like the cipher suites, the values go over the wire during the handshake, so don't
+        renumber them. `None` is what the receiver answers with when there's nothing in common.
+
+        - SHA-256: the original hash of this program, hashes the data one block after another
+        - BLAKE3: splits the data into independent chunks, which can be hashed several at a
+                  time with SIMD, and on several threads, see blake3.hpp
+
+        Both produce a 32 byte hash, so nothing else on the wire changes.
+    */
+    enum class HashAlgorithm : uint8_t {
+        None = 0,
+        Sha256 = 1,
+        Blake3 = 2
+    };
+
+    // Size of the hashes produced by every supported algorithm
+    constexpr size_t hashSize = 32;
+
+    // A hash, fixed size so that it can live on the stack or inside a struct
+    using Digest = std::array<Byte, hashSize>;
+
+    /*
+        Get a printable name for a hash algorithm
+        @param algorithm: the hash algorithm
+        @return name of the algorithm, like "SHA-256"
+    */
+    std::string HashAlgorithmName(HashAlgorithm algorithm);
+
+    /*
+        Parse the name of a hash algorithm, as given on the command line
+        @param name: "sha256" or "blake3"
+        @param algorithm: the parsed algorithm
+        @return true if the name is known, false otherwise
+    */
+    bool ParseHashAlgorithm(const std::string& name, HashAlgorithm& algorithm);
+
+    /*
+        Pick the hash algorithm to use
+        @param local: the algorithms we support, most preferred first
+        @param remote: the algorithms the other end advertised
+        @return our most preferred algorithm that the other end supports too,
+                or HashAlgorithm::None if there's nothing in common
+    */
+    HashAlgorithm ChooseHashAlgorithm(const std::vector<HashAlgorithm>& local, const std::vector<HashAlgorithm>& remote);
+
+    /*
+        Calculates the hash of the given data
         @param data: data to be hashed
-        @param hash: hash of the data
+        @param hash: hash of the data, must already hold `hashSize` bytes
+        @param algorithm: the hash algorithm to use, SHA-256 by default
+        @param threads: threads to use, BLAKE3 only (SHA-256 can't be split up)
         @return If operation was successful or not
     */
-    bool CalculateHash(const std::vector<Byte>& data, std::vector<Byte>& hash);
+    bool CalculateHash(const std::vector<Byte>& data, std::vector<Byte>& hash,
+        HashAlgorithm algorithm = HashAlgorithm::Sha256, unsigned threads = 1);
+
+    // The same, for data anywhere in memory, into a Digest
+    bool CalculateHash(std::span<const Byte> data, Digest& hash,
+        HashAlgorithm algorithm = HashAlgorithm::Sha256, unsigned threads = 1);
 };
 
 #endif
\ No newline at end of file
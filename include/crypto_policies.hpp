@@ -0,0 +1,241 @@
+#ifndef CRYPTO_POLICIES_SSFTP
+#define CRYPTO_POLICIES_SSFTP
+
+#include <span>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <optional>
+#include <type_traits>
+#include <sys/types.h>
+
+#include "crypto.hpp"
+#include "blake3.hpp"
+#include "utils.hpp"
+
+/*
+    Cipher and hash policies
+
+    Every cipher suite and hash algorithm is a small struct, a "policy": its sizes are
+    compile time constants, and static functions do the actual work. Code written once as
+    a template over a policy (see Encrypt() and Decrypt() in crypto.cpp) is compiled
+    separately for each one, so everything that depends on the sizes (is there a nonce to
+    generate? a tag to check? how much padding?) is settled at compile time, and the
+    simple ciphers below are inlined right into the loop that uses them.
+
+    Which suite a session uses is only known once the two ends have agreed on one (see
+    FileReceiver::PerformHandshake()), so the CipherSuite value is turned into a policy with
+    WithCipher(), once per call. Everything inside that call (usually a whole file) then
+    runs without any further dispatch.
+
+    To try another algorithm, write a policy for it, give it a CipherSuite (or
+    HashAlgorithm) value, and add it to WithCipher() (or WithHash()). Nothing else in
+    the program has to change.
+
+    Besides the real suites, there are two that are never offered unless both ends are
+    started with --cipher naming them:
+    - CaesarCipher: every byte shifted by 3, to show how little a cipher needs to plug in
+    - NullCipher: copies the data as is, so that benchmarks measure the transport alone
+    Neither one protects anything.
+*/
+namespace Crypto::Policy {
+
+    /*
+        A cipher policy has
+        - suite: its value on the wire
+        - blockSize: 1 for stream ciphers, which never pad
+        - nonceSize, tagSize: what an authenticated cipher puts before and after the data
+        - Encrypt(plaintext, ciphertext, keys), Decrypt(ciphertext, plaintext, keys):
+          the output span has room for MaxEncryptedSize()/MaxDecryptedSize() bytes,
+          and they return how many they wrote, -1 on error
+        - DecryptInWindows(ciphertext, plaintext, keys, window, onWindow): Decrypt(), a
+          window at a time, see the windowed DecryptData() in crypto.hpp
+    */
+
+    /*
+        DecryptInWindows() for the ciphers without any state (no nonce, no tag, no blocks):
+        every window is decrypted on its own, by the cipher's Decrypt()
+    */
+    template <typename Cipher>
+    ssize_t DecryptEachWindow(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys,
+        size_t window, const DecryptedWindow& onWindow) {
+        for (size_t offset = 0; offset < ciphertext.size(); offset += window) {
+            const size_t length = std::min(window, ciphertext.size() - offset);
+            if (Cipher::Decrypt(ciphertext.subspan(offset, length), plaintext.subspan(offset, length), keys) < 0)
+                return -1;
+            onWindow(offset, length);
+        }
+        return ciphertext.size();
+    }
+
+    // OpenSSL's AES-256 in CBC mode, unauthenticated, PKCS#7 padding
+    struct Aes256CbcCipher {
+        static constexpr CipherSuite suite = CipherSuite::Aes256Cbc;
+        static constexpr size_t blockSize = 16;
+        static constexpr size_t nonceSize = 0;
+        static constexpr size_t tagSize = 0;
+
+        static ssize_t Encrypt(std::span<const Byte> plaintext, std::span<Byte> ciphertext, const SessionKeys& keys);
+        static ssize_t Decrypt(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys);
+        static ssize_t DecryptInWindows(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys,
+            size_t window, const DecryptedWindow& onWindow);
+    };
+
+    // OpenSSL's AES-256-GCM, [12 byte nonce][data][16 byte tag]
+    struct Aes256GcmCipher {
+        static constexpr CipherSuite suite = CipherSuite::Aes256Gcm;
+        static constexpr size_t blockSize = 1;
+        static constexpr size_t nonceSize = 12;
+        static constexpr size_t tagSize = 16;
+
+        static ssize_t Encrypt(std::span<const Byte> plaintext, std::span<Byte> ciphertext, const SessionKeys& keys);
+        static ssize_t Decrypt(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys);
+        static ssize_t DecryptInWindows(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys,
+            size_t window, const DecryptedWindow& onWindow);
+    };
+
+    // OpenSSL's ChaCha20-Poly1305, laid out like GCM
+    struct ChaCha20Poly1305Cipher {
+        static constexpr CipherSuite suite = CipherSuite::ChaCha20Poly1305;
+        static constexpr size_t blockSize = 1;
+        static constexpr size_t nonceSize = 12;
+        static constexpr size_t tagSize = 16;
+
+        static ssize_t Encrypt(std::span<const Byte> plaintext, std::span<Byte> ciphertext, const SessionKeys& keys);
+        static ssize_t Decrypt(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys);
+        static ssize_t DecryptInWindows(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys,
+            size_t window, const DecryptedWindow& onWindow);
+    };
+
+    // The Caesar cipher, every byte shifted by 3. For teaching only, it hides nothing
+    struct CaesarCipher {
+        static constexpr CipherSuite suite = CipherSuite::Caesar;
+        static constexpr size_t blockSize = 1;
+        static constexpr size_t nonceSize = 0;
+        static constexpr size_t tagSize = 0;
+        static constexpr Byte shift = 3;
+
+        static ssize_t Encrypt(std::span<const Byte> plaintext, std::span<Byte> ciphertext, const SessionKeys&) {
+            for (size_t i = 0; i < plaintext.size(); i++)
+                ciphertext[i] = static_cast<Byte>(plaintext[i] + shift);
+            return plaintext.size();
+        }
+        static ssize_t Decrypt(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys&) {
+            for (size_t i = 0; i < ciphertext.size(); i++)
+                plaintext[i] = static_cast<Byte>(ciphertext[i] - shift);
+            return ciphertext.size();
+        }
+        static ssize_t DecryptInWindows(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys,
+            size_t window, const DecryptedWindow& onWindow) {
+            return DecryptEachWindow<CaesarCipher>(ciphertext, plaintext, keys, window, onWindow);
+        }
+    };
+
+    // No encryption at all, for measuring everything but the cipher
+    struct NullCipher {
+        static constexpr CipherSuite suite = CipherSuite::Null;
+        static constexpr size_t blockSize = 1;
+        static constexpr size_t nonceSize = 0;
+        static constexpr size_t tagSize = 0;
+
+        static ssize_t Encrypt(std::span<const Byte> plaintext, std::span<Byte> ciphertext, const SessionKeys&) {
+            if (plaintext.empty() == false && plaintext.data() != ciphertext.data())
+                std::memmove(ciphertext.data(), plaintext.data(), plaintext.size());
+            return plaintext.size();
+        }
+        static ssize_t Decrypt(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys) {
+            return Encrypt(ciphertext, plaintext, keys);
+        }
+        static ssize_t DecryptInWindows(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys,
+            size_t window, const DecryptedWindow& onWindow) {
+            return DecryptEachWindow<NullCipher>(ciphertext, plaintext, keys, window, onWindow);
+        }
+    };
+
+    // Whether a cipher authenticates what it encrypts
+    template <typename Cipher>
+    constexpr bool isAuthenticated = Cipher::tagSize > 0;
+
+    // What a cipher adds to every message, padding aside
+    template <typename Cipher>
+    constexpr size_t overhead = Cipher::nonceSize + Cipher::tagSize;
+
+    // Most bytes Encrypt() writes for `size` bytes of plaintext: padding adds up to a whole block
+    template <typename Cipher>
+    constexpr size_t MaxEncryptedSize(size_t size) {
+        return size + overhead<Cipher> + (Cipher::blockSize > 1 ? Cipher::blockSize : 0);
+    }
+
+    // Most bytes Decrypt() writes for `size` bytes of ciphertext, padding only comes off at the end
+    template <typename Cipher>
+    constexpr size_t MaxDecryptedSize(size_t size) {
+        return size >= overhead<Cipher> ? size - overhead<Cipher> : 0;
+    }
+
+    /*
+        A hash policy has
+        - algorithm: its value on the wire
+        - digestSize: always hashSize, which is what goes on the wire
+        - Hash(data, digest, threads)
+    */
+
+    // OpenSSL's SHA-256, one block after another
+    struct Sha256Hash {
+        static constexpr HashAlgorithm algorithm = HashAlgorithm::Sha256;
+        static constexpr size_t digestSize = 32;
+
+        static bool Hash(std::span<const Byte> data, Digest& hash, unsigned threads);
+    };
+
+    // Our own BLAKE3, see blake3.hpp
+    struct Blake3Hash {
+        static constexpr HashAlgorithm algorithm = HashAlgorithm::Blake3;
+        static constexpr size_t digestSize = ::Blake3::outputSize;
+
+        static bool Hash(std::span<const Byte> data, Digest& hash, unsigned threads) {
+            ::Blake3::Hash(data.data(), data.size(), hash.data(), threads);
+            return true;
+        }
+    };
+
+    static_assert(Sha256Hash::digestSize == hashSize && Blake3Hash::digestSize == hashSize);
+
+    /*
+        Run `function` with the policy of a suite known only at run time
+        @param suite: the cipher suite
+        @param function: called once, as function(Policy{})
+        @return what `function` returned, nothing for a suite without a policy
+    */
+    template <typename Function>
+    auto WithCipher(CipherSuite suite, Function&& function) -> std::optional<std::invoke_result_t<Function, NullCipher>> {
+        switch (suite) {
+            case CipherSuite::Aes256Cbc:
+                return function(Aes256CbcCipher{});
+            case CipherSuite::Aes256Gcm:
+                return function(Aes256GcmCipher{});
+            case CipherSuite::ChaCha20Poly1305:
+                return function(ChaCha20Poly1305Cipher{});
+            case CipherSuite::Caesar:
+                return function(CaesarCipher{});
+            case CipherSuite::Null:
+                return function(NullCipher{});
+            default:
+                return std::nullopt;
+        }
+    }
+
+    // Same for hash algorithms
+    template <typename Function>
+    auto WithHash(HashAlgorithm algorithm, Function&& function) -> std::optional<std::invoke_result_t<Function, Sha256Hash>> {
+        switch (algorithm) {
+            case HashAlgorithm::Sha256:
+                return function(Sha256Hash{});
+            case HashAlgorithm::Blake3:
+                return function(Blake3Hash{});
+            default:
+                return std::nullopt;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef FILE_INDEX_SSFTP
+#define FILE_INDEX_SSFTP
+
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
+
+#include "tree.hpp"
+#include "utils.hpp"
+
+/*
+    Incremental directory transfers (-d with --incremental)
+
+    Sending the same directory every night means reading, encrypting and sending every file
+    again, even though most of them haven't changed. Instead, the sender keeps an index of
+    what it sent last time: for every entry, its path, size, modification time, inode,
+    permissions and content hash. On the next run, a file whose size, modification time
+    and inode are still the same is assumed to be unchanged (the same test rsync and make
+    use), and isn't even opened.
+
+    That's only safe if the receiver still has what the index says it has. So instead of
+    sending the whole index, the sender sends a summary of it (a hash over every path, size
+    and content hash, and the number of entries), and the receiver compares it with the
+    summary it saved in the directory at the end of the last transfer that completed.
+    - Same summary: the receiver has exactly what the index describes, and only new or
+      changed entries are sent
+    - Different or missing (another sender, an interrupted transfer, a fresh directory):
+      everything is sent, as without --incremental
+    Either way, both ends save the new summary once the transfer is complete.
+
+    The index is kept sorted by path, so that looking an entry up is a binary search
+    (about 20 string comparisons for a million entries), and loading or saving it is a
+    single read or write of a flat file. Scanning the tree costs far more than that.
+
+    Files deleted on the sender are dropped from the index, but not deleted on the receiver.
+*/
+namespace FileIndex {
+
+    // Where the receiver keeps the summary, inside the destination directory
+    const std::string syncStateName = ".ssftp_sync";
+
+    // What the index knows about an entry
+    struct Record {
+        std::string relativePath;
+        Tree::EntryKind kind;
+        uint32_t mode;
+        uint64_t size;
+        int64_t modifiedNanos;
+        uint64_t inode;
+        // Hash of the contents, as sent, zero for directories
+        std::array<Byte, 32> hash;
+    };
+
+    // What the sender and the receiver compare, see Index::Summarize()
+    struct Summary {
+        uint64_t entries;
+        std::array<Byte, 32> digest;
+
+        bool operator==(const Summary&) const = default;
+    };
+
+    /*
+        Make a record for an entry found by Tree::ParallelScan()
+        @param entry: the entry
+        @param hash: hash of its contents, zero for directories (or if not known yet)
+        @return the record
+    */
+    Record MakeRecord(const Tree::Entry& entry, const std::array<Byte, 32>& hash = {});
+
+    /*
+        Check whether an entry looks the same as when it was recorded
+        @param record: what the index says
+        @param entry: what the scan found
+        @return true if it's unchanged, false if it has to be sent again
+    */
+    bool Unchanged(const Record& record, const Tree::Entry& entry);
+
+    class Index {
+    private:
+        // Sorted by path
+        std::vector<Record> records;
+
+    public:
+        /*
+            Load an index saved by Save()
+            @param path: file to load, a missing file is an empty index
+            @return true if loaded (or missing), false if the file is damaged
+        */
+        bool Load(const std::string& path);
+
+        /*
+            Save the index, replacing the old file in one step (written next to it, then renamed)
+            @param path: file to save to
+            @return true if successful, false otherwise
+        */
+        bool Save(const std::string& path) const;
+
+        /*
+            Replace the index's contents
+            @param newRecords: the records, in any order
+        */
+        void Assign(std::vector<Record>&& newRecords);
+
+        /*
+            Look an entry up
+            @param relativePath: its path, relative to the root of the transfer
+            @return the record, nullptr if it isn't in the index
+        */
+        const Record* Find(const std::string& relativePath) const;
+
+        // The summary both ends compare, the same index always gives the same summary
+        Summary Summarize() const;
+
+        size_t Size() const {
+            return records.size();
+        }
+    };
+
+    /*
+        Receiver: read/write/remove the summary saved in a destination directory
+        @param directory: the destination directory
+        @param summary: the summary
+        @return true if successful, false otherwise (Load: none saved)
+    */
+    bool LoadSyncState(const std::string& directory, Summary& summary);
+    bool SaveSyncState(const std::string& directory, const Summary& summary);
+    void ClearSyncState(const std::string& directory);
+};
+
+#endif
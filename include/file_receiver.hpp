@@ -0,0 +1,276 @@
+#ifndef FILE_RECEIVER_SSFTP
+#define FILE_RECEIVER_SSFTP
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <netinet/in.h>
+
+#include "crypto.hpp"
+#include "key_exchange.hpp"
+#include "memory_budget.hpp"
+#include "shm_ring.hpp"
+#include "udp_transport.hpp"
+#include "utils.hpp"
+
+/*
+    [IMPORTANT NOTE]
+    1. This implementation of SFTP is not a complete implementation of the SFTP protocol.
+    2. This is not secure, and should not be used in production.
+    3. This is meant for educational purposes only.
+*/
+
+/*
+    `FileReceiver` is a class to receive files from the sender
+    
+    Throughout the program, the term "client" is used to refer to the sender, and
+    "server" is used to refer to the receiver.
+
+    However, normally, the client AND the server can do both; send and receive files.
+    I have not called the class `Server` for this very reason, a client can receive files
+    as well. The class `FileReceiver` is not called `Client` for the same reason.
+    
+    In this implementation, the client is the sender, and the server is the receiver.
+    Get used to it for this program, but remember that this is not the case in a real SFTP.
+*/
+class FileReceiver {
+private:
+    // Socket FD for the sender (client)
+    int clientSocket;
+
+    // Receiver (server) information
+    int serverFD;
+    sockaddr_in address;
+    int addrlen;
+    int serverPort;
+
+    /*
+        Unix socket to listen on for senders on this host, instead of TCP, and the size
+        of the shared memory ring each of them gets for the file data, see shm_ring.hpp
+        The ring is behind a pointer so that the daemon's sessions (copies of the
+        listener, see below) can each have their own
+    */
+    std::string sharedMemoryPath;
+    uint64_t ringCapacity;
+    std::shared_ptr<ShmRing::Ring> ring;
+
+    // Take file data over UDP instead (--udp), on the same port number, see udp_transport.hpp
+    bool useUdp;
+    int udpFD;
+    std::shared_ptr<Udp::Channel> udp;
+
+    // Cipher suite agreed upon with the sender, see PerformHandshake()
+    Crypto::CipherSuite cipherSuite;
+    // Our own ranking of the cipher suites, computed once in InitializeServer()
+    std::vector<Crypto::SuiteScore> localSuites;
+    // Only rank (and accept) these suites, empty for every real one, see SetCipherSuites()
+    std::vector<Crypto::CipherSuite> allowedSuites;
+    // Measure the cipher suites at startup instead of guessing from the CPU features
+    bool benchmarkSuites;
+
+    // Hash algorithm agreed upon with the sender, and the ones we accept, most preferred first
+    Crypto::HashAlgorithm hashAlgorithm;
+    std::vector<Crypto::HashAlgorithm> localHashes;
+    // Threads used to hash a single file, BLAKE3 only
+    unsigned hashThreads;
+
+    // Keys for this session, derived during the handshake
+    Crypto::SessionKeys sessionKeys;
+    // Key used to seal session tickets, and the file it's kept in (empty = random per run)
+    KeyExchange::Secret ticketKey;
+    std::string ticketKeyFile;
+
+    /*
+        Buffer ReceiveFile() reads the ciphertext into. It's kept around between files,
+        so a long running receiver (-D) doesn't allocate and free a file sized buffer
+        for every single file. Only up to maxRetainedBuffer though, anything bigger
+        is freed once the file is saved, since it isn't covered by the memory budget then.
+        There's no buffer for the plaintext, it's decrypted straight into the mapped file
+    */
+    static constexpr size_t maxRetainedBuffer = 1024 * 1024;
+    std::vector<Byte> encryptedBuffer;
+
+    /*
+        Once a file's plaintext is bigger than this, ReceiveFile() decrypts it a window at a
+        time and writes each window back to disk as soon as it's decrypted (see WriteBehind),
+        instead of leaving the whole file dirty in memory for the kernel to get to eventually.
+        The file is dropped from the page cache once it's verified
+    */
+    static constexpr size_t writebackWindow = 8 * 1024 * 1024;
+
+    /*
+        Files whose plaintext is at least this large are written with O_DIRECT, bypassing
+        the page cache, see UseDirectIo() and SaveDirect(). The default never does
+    */
+    uint64_t directIoThreshold;
+    // Alignment of the buffer, offsets and lengths of direct writes, and how they're queued
+    static constexpr size_t directAlignment = 4096;
+    static constexpr size_t directWriteSize = 1024 * 1024;
+    static constexpr size_t directQueueDepth = 4;
+
+    /*
+        A daemon session (-D) whose sender sends nothing for this many seconds is dropped,
+        so that a sender that went quiet can't hold up a graceful shutdown forever.
+        0 waits forever, see SetIdleTimeout()
+    */
+    unsigned idleTimeout;
+
+    /*
+        Agree on a cipher suite and session keys with the sender, right after accepting
+        the connection. See key_exchange.hpp for how the keys are derived
+    */
+    bool PerformHandshake();
+
+    /*
+        There are three main steps involved in receiving data from the client
+        (in this implementation of SFTP)
+        1. Read the file size, and file sent by the client
+        2. Decrypt the file data, straight into the file (There isn't a function for this, its done in ReceiveFile())
+        3. Verify the hash of the decrypted data
+        4. Keep the file (No function for this either, its done in ReceiveFile())
+
+        Although these steps can be combined into a single function, they are kept separate
+        for better readability and maintainability
+
+        These are private functions since they are only used internally by the class
+        and are not meant to be called by the user
+    */
+    // Step 1
+    bool ReadFromClient(std::vector<Byte>& encryptedData, MemoryBudget::Reservation* reservation = nullptr,
+        size_t maxSize = SIZE_MAX, size_t plaintextHeld = SIZE_MAX);
+    // Step 3
+    bool ReadAndVerifyHash(std::span<const Byte> decryptedData);
+    // Steps 2 to 4 of ReceiveFile(), into a mapping of the file, or with direct I/O
+    bool SaveMapped(int fd, size_t capacity, size_t& savedSize);
+    bool SaveDirect(int fd, size_t capacity, size_t& savedSize);
+
+    /*
+        Read file data, from the shared memory ring or the UDP channel if there is one,
+        the socket otherwise. ReadPayloadSome() takes whatever has arrived, like read()
+    */
+    bool ReadPayload(Byte* data, size_t size);
+    ssize_t ReadPayloadSome(Byte* data, size_t size);
+
+    // The TCP half of InitializeServer(), and the shared memory half of accepting a sender
+    bool OpenTcpListener();
+    bool OfferSharedMemory();
+    // Open the UDP data channel for the sender that just connected, after the handshake
+    bool OfferUdpChannel();
+
+    // Serve one sender's named files until it ends the session, see RunDaemon()
+    bool ReceiveNamedFiles(const std::filesystem::path& directory, uint64_t& filesReceived);
+    // One chunk of a named file (Protocol::MessageType::NamedFileChunk), written into `<filename>.partial`
+    bool ReceiveFileChunk(const std::string& filename, uint64_t offset, uint64_t& length);
+
+    /*
+        A receiver for a single connection the daemon (-D) accepted, sharing the listener's
+        configuration (suite ranking, hash algorithms, ticket key) but with keys and
+        buffers of its own, so that several senders can be served at once.
+        Plain copies are private since the receiver owns sockets, this is the only one made
+    */
+    FileReceiver(const FileReceiver&) = default;
+    FileReceiver(const FileReceiver& listener, const int socket) : FileReceiver(listener) {
+        clientSocket = socket;
+        serverFD = -1;
+        udpFD = -1;
+        ring = nullptr;
+        udp = nullptr;
+        encryptedBuffer = {};
+    }
+
+public:
+    FileReceiver(const int port, const bool benchmark = false) {
+
+        clientSocket = -1;
+
+        serverFD = -1;
+        address = {};
+        addrlen = sizeof(address);
+        serverPort = port;
+        ringCapacity = ShmRing::defaultCapacity;
+        useUdp = false;
+        udpFD = -1;
+
+        cipherSuite = Crypto::CipherSuite::Aes256Cbc;
+        benchmarkSuites = benchmark;
+
+        hashAlgorithm = Crypto::HashAlgorithm::Sha256;
+        localHashes = {Crypto::HashAlgorithm::Blake3, Crypto::HashAlgorithm::Sha256};
+        hashThreads = 1;
+
+        sessionKeys = Crypto::preSharedSessionKeys;
+        ticketKey = {};
+        directIoThreshold = UINT64_MAX;
+        idleTimeout = 300;
+     
+        return;
+    }
+    
+    ~FileReceiver() {
+        CloseConnection();
+    }
+    FileReceiver& operator=(const FileReceiver&) = delete;
+
+    bool InitializeServer();
+    bool AcceptConnection();
+    bool ReceiveFile(const std::string& filename);
+    bool ReceiveDirectory(const std::string& destination, const unsigned threads);
+    bool ReceivePackedFiles(const std::string& directory, const int numberOfFiles);
+    bool ReceiveSparseFile(const std::string& filename);
+    bool StoreFile(const std::string& filename);
+    bool RunDaemon(const std::string& directory, const std::atomic<bool>& stopRequested);
+    void DisconnectClient();
+    void CloseConnection();
+
+    /*
+        Serve senders on this host through a Unix socket and shared memory rings, instead
+        of TCP, see shm_ring.hpp. Call before InitializeServer()
+    */
+    void UseSharedMemory(const std::string& socketPath, const uint64_t capacity = ShmRing::defaultCapacity) {
+        sharedMemoryPath = socketPath;
+        ringCapacity = capacity;
+    }
+
+    // Take file data over UDP, see udp_transport.hpp. Call before InitializeServer()
+    void UseUdp(const bool enable) {
+        useUdp = enable;
+    }
+
+    /*
+        Write files of at least `minimumSize` bytes with O_DIRECT, so that they don't go through
+        the page cache (0 for every file, UINT64_MAX for none, the default). Smaller files
+        still go through it, they're cheap to cache and O_DIRECT would make them slower
+    */
+    void UseDirectIo(const uint64_t minimumSize) {
+        directIoThreshold = minimumSize;
+    }
+
+    // Drop daemon sessions that send nothing for this many seconds, 0 to wait forever
+    void SetIdleTimeout(const unsigned seconds) {
+        idleTimeout = seconds;
+    }
+
+    // Only accept these cipher suites, the only way to get Caesar or NULL. Call before InitializeServer()
+    void SetCipherSuites(const std::vector<Crypto::CipherSuite>& suites) {
+        allowedSuites = suites;
+    }
+
+    // Only accept these hash algorithms, most preferred first
+    void SetHashAlgorithms(const std::vector<Crypto::HashAlgorithm>& algorithms) {
+        localHashes = algorithms;
+    }
+
+    // Hash each file (-f, -n) with up to this many threads
+    void SetHashThreads(const unsigned threads) {
+        hashThreads = std::max(threads, 1u);
+    }
+
+    // Keep the ticket key in a file, so that tickets survive a restart. Call before InitializeServer()
+    void UseTicketKeyFile(const std::string& path) {
+        ticketKeyFile = path;
+    }
+};
+
+#endif
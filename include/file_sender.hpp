@@ -0,0 +1,256 @@
+#ifndef FILE_SENDER_SSFTP
+#define FILE_SENDER_SSFTP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <span>
+#include <netinet/in.h>
+
+#include "chunk_tuner.hpp"
+#include "crypto.hpp"
+#include "file_index.hpp"
+#include "rate_limiter.hpp"
+#include "scheduler.hpp"
+#include "shm_ring.hpp"
+#include "udp_transport.hpp"
+#include "utils.hpp"
+
+/*
+    [IMPORTANT NOTE]
+    1. This implementation of SFTP is not a complete implementation of the SFTP protocol.
+    2. This is not secure, and should not be used in production.
+    3. This is meant for educational purposes only.
+*/
+
+/*
+    `FileSender` is a class to send files to the receiver
+    
+    Throughout the program, the term "client" is used to refer to the sender, and
+    "server" is used to refer to the receiver.
+
+    However, normally, the client AND the server can do both; send and receive files.
+    I have not called the class `Client` for this very reason, a server can send files
+    as well. The class `FileReceiver` is not called `Server` for the same reason.
+    
+    In this implementation, the client is the sender, and the server is the receiver.
+    Get used to it for this program, but remember that this is not the case in a real SFTP.
+*/
+
+class FileSender {
+private:
+    // Sender (client) socket
+    int socketFD;
+
+    // Receiver (server) address information
+    sockaddr_in serverAddr;
+    std::string serverIP;
+    int serverPort;
+
+    // Unix socket of a receiver on this host, file data then goes through `ring`, see shm_ring.hpp
+    std::string sharedMemoryPath;
+    ShmRing::Ring ring;
+
+    // Send file data over UDP instead, with our own congestion control, see udp_transport.hpp
+    bool useUdp;
+    std::unique_ptr<Udp::Channel> udp;
+
+    // Cipher suite agreed upon with the receiver, see PerformHandshake()
+    Crypto::CipherSuite cipherSuite;
+    // Our own ranking of the cipher suites, computed on the first connection
+    std::vector<Crypto::SuiteScore> localSuites;
+    // Only rank (and offer) these suites, empty for every real one, see SetCipherSuites()
+    std::vector<Crypto::CipherSuite> allowedSuites;
+    // Measure the cipher suites at startup instead of guessing from the CPU features
+    bool benchmarkSuites;
+
+    // Hash algorithm agreed upon with the receiver, and the ones we offer
+    Crypto::HashAlgorithm hashAlgorithm;
+    std::vector<Crypto::HashAlgorithm> localHashes;
+    // Threads used to hash a single file, BLAKE3 only
+    unsigned hashThreads;
+
+    // Keys for this session, derived during the handshake
+    Crypto::SessionKeys sessionKeys;
+    // Where the session ticket is kept between runs, empty to always do a full handshake
+    std::string sessionFile;
+    // Whether the last handshake was resumed, and how long it took
+    bool lastHandshakeResumed;
+    double lastHandshakeMicros;
+
+    // Limits everything we send, see rate_limiter.hpp
+    RateLimit::TokenBucket globalBucket;
+    // Limit of each file in the directory mode, 0 for unlimited
+    uint64_t transferRate;
+    // Where to re-read the rates from on SIGHUP, empty to ignore SIGHUP
+    std::string rateConfigFile;
+
+    // Re-read the rate config if SIGHUP arrived, returns true if the rates changed
+    bool ReloadRatesIfRequested();
+
+    // Picks the size of the chunks we send, see chunk_tuner.hpp
+    ChunkTuner chunkTuner;
+
+    // Index of what the last directory transfer sent, empty to always send everything, see file_index.hpp
+    std::string indexFile;
+    /*
+        Send the receiver the summary of the index, and find out whether it still has what the index says
+        @param index: the index, loaded from `indexFile`
+        @param receiverInSync: true if only new or changed entries need to be sent
+        @return true if successful, false otherwise
+    */
+    bool ExchangeIndexSummary(FileIndex::Index& index, bool& receiverInSync);
+
+    // The two halves of ConnectToServer(), depending on whether we use shared memory
+    bool OpenTcpConnection();
+    bool OpenSharedMemoryConnection();
+    // Open the UDP data channel (--udp), right after the handshake
+    bool OpenUdpChannel();
+
+    /*
+        Agree on a cipher suite and session keys with the receiver, right after connecting
+        See key_exchange.hpp for how the keys are derived
+    */
+    bool PerformHandshake();
+
+    /*
+        There are three main steps involved in sending data to the server
+        (in this implementation of SFTP)
+        1. Load the file contents into a vector
+        2. Encrypt the file contents and send it to the server
+        3. Calculate hash of the file and send it to the server
+
+        Although these steps can be combined into a single function, they are kept separate
+        for better readability and maintainability
+
+        These are private functions since they are only used internally by the class
+        and are not meant to be called by the user
+    */
+    // Step 1
+    bool LoadFileIntoVector(const std::string& filename, std::vector<Byte>& data);
+    // Step 2
+    bool EncryptAndSend(std::span<const Byte> data);
+    // Step 3
+    bool CalculateHashAndSend(std::span<const Byte> data);
+
+    // The sending half of step 2, also used by the directory transfer
+    bool SendEncryptedData(const std::vector<Byte>& encryptedData);
+
+    // Step 1 for part of a file, a chunk of SendScheduledFiles()
+    bool LoadFileRange(const std::string& filename, uint64_t offset, uint64_t length, std::vector<Byte>& data);
+    // Steps 2 and 3 of a named file or chunk, after its message type and header
+    bool SendNamedMessage(Byte type, const std::vector<Byte>& header, std::span<const Byte> data);
+
+    /*
+        Send file data, through the shared memory ring or the UDP channel if there is one,
+        the socket otherwise. SendPayloadSome() takes as much as fits, like send()
+    */
+    bool SendPayload(const Byte* data, size_t size);
+    ssize_t SendPayloadSome(const Byte* data, size_t size);
+
+public:
+    FileSender(const std::string& ip, const int port, const bool benchmark = false) {
+
+        socketFD = -1;
+
+        serverAddr = {};
+        serverIP = ip;
+        serverPort = port;
+        useUdp = false;
+
+        cipherSuite = Crypto::CipherSuite::Aes256Cbc;
+        benchmarkSuites = benchmark;
+
+        hashAlgorithm = Crypto::HashAlgorithm::Sha256;
+        localHashes = {Crypto::HashAlgorithm::Blake3, Crypto::HashAlgorithm::Sha256};
+        hashThreads = 1;
+
+        sessionKeys = Crypto::preSharedSessionKeys;
+        sessionFile = ".ssftp_session";
+        lastHandshakeResumed = false;
+        lastHandshakeMicros = 0;
+
+        transferRate = 0;
+
+        return;
+    }
+
+    ~FileSender() {
+        CloseConnection();
+    }
+
+    bool ConnectToServer();
+    bool SendFile(const std::string& fileName);
+    bool SendDirectory(const std::string& root, const unsigned threads);
+    bool SendPackedFiles(const std::vector<std::string>& fileNames);
+    bool SendSparseFile(const std::string& filename);
+    bool SendNamedFile(const std::string& filename, const std::string& name);
+    bool SendNamedData(std::span<const Byte> data, const std::string& name);
+    bool SendNamedChunk(std::span<const Byte> data, const std::string& name, uint64_t fileSize, uint64_t offset);
+    bool SendScheduledFiles(const std::vector<std::string>& fileNames, const std::vector<double>& weights,
+        Schedule::Policy policy, uint64_t chunkSize);
+    bool EndSession();
+    void CloseConnection();
+
+    // Connect to a receiver on this host through its Unix socket and a shared memory ring, see shm_ring.hpp
+    void UseSharedMemory(const std::string& socketPath) {
+        sharedMemoryPath = socketPath;
+    }
+
+    // Send file data over UDP, see udp_transport.hpp. The receiver has to be started with --udp too
+    void UseUdp(const bool enable) {
+        useUdp = enable;
+    }
+
+    // Set where the session ticket is stored, an empty path disables resumption
+    void UseSessionFile(const std::string& path) {
+        sessionFile = path;
+    }
+
+    // Only send the entries of a directory that changed since the transfer this index was saved by
+    void UseIndex(const std::string& path) {
+        indexFile = path;
+    }
+
+    // Limit how fast we send (bytes per second, 0 for unlimited), overall and per file
+    void SetRates(const uint64_t globalRate, const uint64_t perTransferRate) {
+        globalBucket.SetRate(globalRate);
+        transferRate = perTransferRate;
+    }
+
+    // Re-read the rates from this file whenever SIGHUP arrives, see RateLimit::InstallReloadSignal()
+    void UseRateConfig(const std::string& path) {
+        rateConfigFile = path;
+    }
+
+    // Only offer these cipher suites to the receiver, the only way to get Caesar or NULL
+    void SetCipherSuites(const std::vector<Crypto::CipherSuite>& suites) {
+        allowedSuites = suites;
+        localSuites.clear();
+    }
+
+    // Only offer these hash algorithms to the receiver
+    void SetHashAlgorithms(const std::vector<Crypto::HashAlgorithm>& algorithms) {
+        localHashes = algorithms;
+    }
+
+    // Hash each file (-f, -n) with up to this many threads
+    void SetHashThreads(const unsigned threads) {
+        hashThreads = std::max(threads, 1u);
+    }
+
+    // Whether we're connected, a failed SendNamedFile() closes the connection
+    bool IsConnected() const {
+        return socketFD != -1;
+    }
+
+    // How the last connection's handshake went, used for the handshake benchmark
+    bool LastHandshakeResumed() const {
+        return lastHandshakeResumed;
+    }
+    double LastHandshakeMicros() const {
+        return lastHandshakeMicros;
+    }
+};
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef KEY_EXCHANGE_SSFTP
+#define KEY_EXCHANGE_SSFTP
+
+#include <array>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include "crypto.hpp"
+#include "utils.hpp"
+
+/*
+    Session key agreement
+
+    Instead of encrypting everything with the pre-shared key and IV, the sender and
+    receiver now agree on fresh keys every time they connect:
+
+    1. Both ends generate a throwaway (ephemeral) X25519 key pair and swap public keys
+    2. Each end combines its own private key with the other end's public key, and both
+       arrive at the same shared secret, without it ever crossing the network
+    3. The shared secret goes through HKDF (a key derivation function) together with the
+       pre-shared key and some random bytes from both ends, which gives us the session's
+       AES/ChaCha key and IV
+
+    Mixing the pre-shared key into step 3 means someone sitting in the middle can still do
+    the X25519 dance, but won't end up with the right keys, so decryption fails on both ends.
+
+    Session resumption
+    The X25519 operations are by far the most expensive part of connecting. A sender that
+    reconnects over and over (batch jobs) can skip them with a session ticket:
+    - At the end of every handshake, the receiver derives a "resumption secret", encrypts it
+      with a key only it knows (the ticket key), and hands the result to the sender
+    - The sender stores the ticket along with the resumption secret
+    - On the next connection, the sender presents the ticket. The receiver decrypts it,
+      gets the resumption secret back, and both ends derive new keys from it
+
+    The receiver doesn't keep any per-client state, everything it needs is inside the
+    ticket, which is why these are called "stateless" tickets.
+
+    Note: a real implementation would also need to authenticate the handshake transcript
+    and protect against ticket replays, which are left out here for simplicity.
+*/
+namespace KeyExchange {
+
+    using PublicKey = std::array<Byte, 32>;
+    using Random = std::array<Byte, 32>;
+    using Secret = std::array<Byte, 32>;
+
+    // How long a session ticket can be used for
+    constexpr uint64_t ticketLifetimeSeconds = 24 * 60 * 60;
+    // Tickets larger than this are rejected without even looking at them
+    constexpr size_t maxTicketSize = 256;
+
+    // An X25519 key pair
+    struct KeyPair {
+        Secret privateKey;
+        PublicKey publicKey;
+    };
+
+    // What the sender remembers between connections to resume a session
+    struct ClientSession {
+        Secret resumptionSecret;
+        uint64_t expiry;
+        std::vector<Byte> ticket;
+    };
+
+    /*
+        Fill a buffer with cryptographically secure random bytes
+        @param random: buffer to fill
+        @return true if successful, false otherwise
+    */
+    bool GenerateRandom(Random& random);
+
+    /*
+        Generate an ephemeral X25519 key pair
+        @param keyPair: the generated key pair
+        @return true if successful, false otherwise
+    */
+    bool GenerateKeyPair(KeyPair& keyPair);
+
+    /*
+        Compute the X25519 shared secret
+        @param ours: our key pair
+        @param theirs: the other end's public key
+        @param shared: the shared secret, identical on both ends
+        @return true if successful, false otherwise
+    */
+    bool DeriveSharedSecret(const KeyPair& ours, const PublicKey& theirs, Secret& shared);
+
+    /*
+        Derive the master secret of a session
+        @param inputSecret: the X25519 shared secret, or the resumption secret from a ticket
+        @param resumed: true if `inputSecret` is a resumption secret
+        @param clientRandom: random bytes picked by the sender
+        @param serverRandom: random bytes picked by the receiver
+        @param masterSecret: the derived master secret
+        @return true if successful, false otherwise
+    */
+    bool DeriveMasterSecret(const Secret& inputSecret, bool resumed, const Random& clientRandom,
+        const Random& serverRandom, Secret& masterSecret);
+
+    /*
+        Derive the session's encryption key and IV from the master secret
+        @param masterSecret: see DeriveMasterSecret()
+        @param keys: the derived key and IV
+        @return true if successful, false otherwise
+    */
+    bool DeriveSessionKeys(const Secret& masterSecret, Crypto::SessionKeys& keys);
+
+    /*
+        Derive the secret that goes into the session ticket
+        @param masterSecret: see DeriveMasterSecret()
+        @param resumptionSecret: the derived resumption secret
+        @return true if successful, false otherwise
+    */
+    bool DeriveResumptionSecret(const Secret& masterSecret, Secret& resumptionSecret);
+
+    /*
+        Seal a resumption secret into a ticket, only the holder of `ticketKey` can open it
+        @param ticketKey: the receiver's ticket key
+        @param resumptionSecret: the secret to seal
+        @param ticket: the sealed ticket
+        @return true if successful, false otherwise
+    */
+    bool IssueTicket(const Secret& ticketKey, const Secret& resumptionSecret, std::vector<Byte>& ticket);
+
+    /*
+        Open a ticket issued by IssueTicket()
+        @param ticketKey: the receiver's ticket key
+        @param ticket: the ticket presented by the sender
+        @param resumptionSecret: the secret sealed inside
+        @return true if the ticket is genuine and hasn't expired, false otherwise
+    */
+    bool RedeemTicket(const Secret& ticketKey, const std::vector<Byte>& ticket, Secret& resumptionSecret);
+
+    /*
+        Load the receiver's ticket key from a file, creating a random one if it doesn't exist
+        Keeping the key in a file lets tickets survive receiver restarts
+        @param path: file holding the key
+        @param ticketKey: the loaded key
+        @return true if successful, false otherwise
+    */
+    bool LoadOrCreateTicketKey(const std::string& path, Secret& ticketKey);
+
+    /*
+        Load a previously saved client session
+        @param path: file the session was saved to
+        @param session: the loaded session
+        @return true if a usable (present and not expired) session was loaded, false otherwise
+    */
+    bool LoadClientSession(const std::string& path, ClientSession& session);
+
+    /*
+        Save a client session for the next connection
+        @param path: file to save the session to
+        @param session: the session to save
+        @return true if successful, false otherwise
+    */
+    bool SaveClientSession(const std::string& path, const ClientSession& session);
+
+    /*
+        Seconds since the Unix epoch, used for ticket expiry
+    */
+    uint64_t CurrentTime();
+};
+
+#endif
@@ -11,6 +11,9 @@ namespace Log {
     void Success(const std::string& functionName, const std::string& message);
     void Info(const std::string& functionName, const std::string& message);
     void Warning(const std::string& functionName, const std::string& message);
+
+    // Only print errors and warnings from now on, for runs that would print thousands of lines
+    void SetQuiet(bool quiet);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,93 @@
+#ifndef MEMORY_BUDGET_SSFTP
+#define MEMORY_BUDGET_SSFTP
+
+#include <cstdint>
+#include <string>
+
+/*
+    A process wide limit on the memory held by transfers in flight
+
+    A file's ciphertext is read into memory whole before it's decrypted. Files received one
+    by one (-f, -n and -D) are decrypted straight into the mapped output file, a window at
+    a time, so only two windows of plaintext are in memory at once on top of it (see
+    FileReceiver::ReceiveFile()). Everything else (-d, --pack, --sparse, interleaved chunks,
+    and O_DIRECT) decrypts into a second buffer the size of the file, about twice the file
+    size in all. With many senders at once (receiver.out -D), one large upload on top of
+    the others is enough to run the receiver out of memory.
+
+    Instead, every transfer reserves what it's about to hold against a single budget,
+    *before* reading any of it. When the budget is used up, the reservation waits until
+    other transfers give some back, and while it waits nothing is read from its socket.
+    The kernel's receive buffer for that socket fills up, TCP's flow control tells the
+    sender to stop, and the sender's send() blocks. So a receiver that's short on memory
+    slows its senders down, rather than allocating more.
+
+    - A reservation larger than the whole budget (or, without a budget, than the machine's
+      physical memory) is refused right away, see MaxReservation(). The sizes come straight
+      off the socket, and nothing that large could be held in memory anyway
+    - Reservations are RAII, the memory is given back when the Reservation goes away
+    - A limit of 0 means unlimited (receiver.out's default), usage is still tracked
+
+    Only the per-file buffers are counted, not small fixed things like headers.
+*/
+namespace MemoryBudget {
+
+    /*
+        Set the budget, can be changed at any time (waiting reservations are re-checked)
+        @param bytes: the budget in bytes, 0 for unlimited
+    */
+    void SetLimit(uint64_t bytes);
+    uint64_t Limit();
+
+    // The largest reservation that can ever go through: the budget, or the physical memory without one
+    uint64_t MaxReservation();
+
+    // Bytes reserved right now, and the most that was ever reserved at once
+    uint64_t CurrentUsage();
+    uint64_t PeakUsage();
+    // How many reservations had to wait for room
+    uint64_t Waits();
+
+    // Usage, peak and waits in a human readable form, for logging
+    std::string Describe();
+
+    /*
+        Memory reserved against the budget, given back when this goes away
+    */
+    class Reservation {
+    private:
+        uint64_t bytes;
+        bool granted = true;
+
+    public:
+        Reservation() : bytes(0) {}
+
+        /*
+            Reserve memory
+            @param size: bytes to reserve
+            @param wait: wait for room if the budget is used up, or reserve it right away
+                         regardless (going over the budget). Only pass false when waiting
+                         could deadlock, i.e. when the caller itself holds reservations that
+                         are only given back after this one goes through
+            Check Granted() afterwards, anything larger than MaxReservation() is refused
+        */
+        explicit Reservation(uint64_t size, bool wait = true);
+        ~Reservation();
+
+        Reservation(Reservation&& other) noexcept;
+        Reservation& operator=(Reservation&& other) noexcept;
+        Reservation(const Reservation&) = delete;
+        Reservation& operator=(const Reservation&) = delete;
+
+        uint64_t Size() const {
+            return bytes;
+        }
+
+        // False if the reservation was refused, and nothing is reserved
+        bool Granted() const {
+            return granted;
+        }
+    };
+};
+
+#endif
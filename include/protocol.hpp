@@ -0,0 +1,352 @@
+#ifndef PROTOCOL_SSFTP
+#define PROTOCOL_SSFTP
+
+#include <vector>
+#include <string>
+#include <cstddef>
+
+#include "crypto.hpp"
+#include "key_exchange.hpp"
+#include "sparse.hpp"
+#include "tree.hpp"
+#include "utils.hpp"
+
+/*
+    Helpers shared by the sender and the receiver for talking over the socket
+
+    `send()` and `read()` are allowed to move fewer bytes than asked for, which the
+    file transfer loops deal with themselves. The handshake messages are small, and
+    it's a lot easier to read the handshake code when it can just say "send these N
+    bytes" and "read exactly N bytes", which is what SendAll() and ReadAll() do.
+*/
+namespace Protocol {
+
+    // Upper limit on the number of suites a peer may advertise, anything more is garbage
+    constexpr size_t maxAdvertisedSuites = 16;
+    // Same for hash algorithms
+    constexpr size_t maxAdvertisedHashes = 16;
+
+    /*
+        How the session keys are being agreed upon, see key_exchange.hpp
+        - Full: X25519 key exchange
+        - Resume: the sender presents a session ticket instead of a public key
+        - RetryFull: the receiver couldn't use the ticket (expired, or issued by someone else),
+          and asks the sender to send a public key after all
+    */
+    enum class HandshakeMode : uint8_t {
+        Full = 0,
+        Resume = 1,
+        RetryFull = 2
+    };
+
+    /*
+        Sent by the sender right after its suite list and hash list
+        Wire format: [u8 mode][32 byte random] then either
+            Full:   [32 byte public key]
+            Resume: [u16 ticket size][ticket]
+    */
+    struct KeyHello {
+        HandshakeMode mode;
+        KeyExchange::Random clientRandom;
+        KeyExchange::PublicKey clientPublicKey;
+        std::vector<Byte> ticket;
+    };
+
+    /*
+        Sent by the receiver right after the chosen suite and hash algorithm (one byte each)
+        Wire format: [u8 mode], and unless the mode is RetryFull
+            [32 byte random][32 byte public key, Full only][u16 ticket size][new ticket]
+    */
+    struct KeyReply {
+        HandshakeMode mode;
+        KeyExchange::Random serverRandom;
+        KeyExchange::PublicKey serverPublicKey;
+        std::vector<Byte> ticket;
+    };
+
+    /*
+        Messages used by the directory transfer mode (-d)
+        Every message starts with one of these as a single byte
+
+        - TreeEntries: a batch of directory/file entries, see SerializeTreeEntries()
+                       [u64 encrypted size][encrypted batch]
+        - TreeFile: the contents of a file from an earlier batch are on their way
+                    [u32 id][u64 encrypted size][32 byte hash]
+        - TreeFileData: a chunk of a file's encrypted contents, chunks of different files
+                        may be interleaved, but each file's chunks arrive in order
+                        [u32 id][u32 length][chunk]
+        - TreeFileSkipped: a file from an earlier batch couldn't be read, and isn't coming
+                           [u32 id]
+        - TreeEnd: nothing else is coming
+                   [u64 number of files sent]
+
+        With --incremental (see file_index.hpp), the transfer starts and ends with a summary
+        - IndexSummary: what the sender's index says the receiver has, before anything else
+                        [u64 entries][32 byte digest]
+                        answered with [u8 1 if the directory matches, so only changes are sent]
+        - IndexUpdate: what the receiver will have once this transfer is complete, right before TreeEnd
+                       [u64 entries][32 byte digest]
+
+        And by the named transfers a receiver daemon (-D) expects, see SendNamedFile()
+        - NamedFile: a file is coming, along with the name to save it as
+                     [u64 encrypted size][encrypted header, see SerializeNamedFileHeader()]
+                     followed by the file itself, exactly as with -f
+        - NamedFileChunk: part of a file, so that several files can take turns (see scheduler.hpp)
+                          [u64 encrypted size][encrypted header, see SerializeNamedChunkHeader()]
+                          followed by the part itself, exactly as with -f. A file's chunks come
+                          in order, and it's saved once the last one is in
+        - SessionEnd: the sender is done, and is about to disconnect
+    */
+    enum class MessageType : uint8_t {
+        TreeEntries = 1,
+        TreeFile = 2,
+        TreeEnd = 3,
+        TreeFileData = 4,
+        NamedFile = 5,
+        SessionEnd = 6,
+        IndexSummary = 7,
+        IndexUpdate = 8,
+        NamedFileChunk = 9,
+        TreeFileSkipped = 10
+    };
+
+    // Upper limit on the length of a path in a tree entry
+    constexpr size_t maxPathLength = 4096;
+
+    /*
+        Upper limits on the (encrypted) messages that only carry metadata, the receiver turns
+        down anything larger before allocating for it
+        - a NamedFile or NamedFileChunk header: a name and a few sizes
+        - a batch of TreeEntries: 1024 entries (see FileSender::SendDirectory()) with the
+          longest possible paths come to about 4.2 MB
+    */
+    constexpr size_t maxHeaderSize = 64 * 1024;
+    constexpr size_t maxEntryBatchSize = 8 * 1024 * 1024;
+
+    /*
+        Small file packing (-n with --pack)
+
+        Sending a 1 KB file on its own costs a size, a payload and a hash on the wire, and
+        an encryption setup and a file open on each end. For small files all of that costs
+        more than the data itself, so instead many files are packed into one "segment",
+        which is encrypted, sent and hashed like a single file.
+
+        Segment layout (before encryption):
+            [contents of file 1][contents of file 2]...[contents of file N]
+            N x [u16 name length][name][u64 offset][u64 length]
+            [u64 size of all the contents][u32 N]
+        The index goes at the end so that the sender can append file contents as it loads
+        them, without knowing up front how many files will fit. The fixed size trailer tells
+        the receiver where the index starts.
+    */
+    struct PackedFile {
+        std::string name;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    // A segment is sent once it holds this many bytes or files, whichever comes first
+    constexpr size_t maxPackedSegmentSize = 1024 * 1024;
+    constexpr size_t maxPackedFiles = 1024;
+
+    /*
+        Sparse files (-f with --sparse), see sparse.hpp
+        Only the data extents of the file are sent, behind a map of where they go.
+        Map and data are encrypted, sent and hashed together, like a single file would be:
+            [u64 file size][u32 N] N x [u64 offset][u64 length]
+            [contents of extent 1]...[contents of extent N]
+    */
+    constexpr size_t extentMapHeaderSize = sizeof(uint64_t) + sizeof(uint32_t);
+    constexpr size_t extentMapEntrySize = 2 * sizeof(uint64_t);
+
+    /*
+        Store mode (--store on the receiver), see store.hpp
+        The ciphertext is saved exactly as it came off the wire, and everything needed to
+        decrypt and verify it later goes into a small sidecar file:
+            [8 byte magic][u8 cipher suite][u8 hash algorithm][u64 encrypted size]
+            [32 byte expected hash][u16 sealed keys size][sealed session keys]
+    */
+    struct StoredFileInfo {
+        Crypto::CipherSuite suite;
+        Crypto::HashAlgorithm hashAlgorithm;
+        uint64_t encryptedSize;
+        std::vector<Byte> expectedHash;
+        std::vector<Byte> sealedKeys;
+    };
+
+    /*
+        Send exactly `size` bytes
+        @param socketFD: socket to send on
+        @param data: bytes to send
+        @param size: number of bytes to send
+        @return true if everything was sent, false otherwise
+    */
+    bool SendAll(int socketFD, const void* data, size_t size);
+
+    /*
+        Read exactly `size` bytes
+        @param socketFD: socket to read from
+        @param data: buffer to read into, must hold at least `size` bytes
+        @param size: number of bytes to read
+        @return true if everything was read, false on error or if the peer hung up
+    */
+    bool ReadAll(int socketFD, void* data, size_t size);
+
+    /*
+        Advertise the cipher suites we support, along with their scores
+        Wire format: [u8 count] then count x [u8 suite][u32 score]
+        @param socketFD: socket to send on
+        @param suites: suites to advertise, see Crypto::RankCipherSuites()
+        @return true if sent successfully, false otherwise
+    */
+    bool SendSuiteList(int socketFD, const std::vector<Crypto::SuiteScore>& suites);
+
+    /*
+        Read the list of cipher suites the other end advertised, see SendSuiteList()
+        @param socketFD: socket to read from
+        @param suites: the advertised suites
+        @return true if read successfully, false otherwise
+    */
+    bool ReadSuiteList(int socketFD, std::vector<Crypto::SuiteScore>& suites);
+
+    /*
+        Advertise the hash algorithms we support, most preferred first
+        Wire format: [u8 count] then count x [u8 algorithm]
+        @param socketFD: socket to send on
+        @param algorithms: algorithms to advertise
+        @return true if sent successfully, false otherwise
+    */
+    bool SendHashList(int socketFD, const std::vector<Crypto::HashAlgorithm>& algorithms);
+
+    /*
+        Read the list of hash algorithms the other end advertised, see SendHashList()
+        @param socketFD: socket to read from
+        @param algorithms: the advertised algorithms
+        @return true if read successfully, false otherwise
+    */
+    bool ReadHashList(int socketFD, std::vector<Crypto::HashAlgorithm>& algorithms);
+
+    /*
+        Send/read the sender's half of the key exchange, see KeyHello
+        @param socketFD: socket to use
+        @param hello: the message
+        @return true if successful, false otherwise
+    */
+    bool SendKeyHello(int socketFD, const KeyHello& hello);
+    bool ReadKeyHello(int socketFD, KeyHello& hello);
+
+    /*
+        Send/read the receiver's half of the key exchange, see KeyReply
+        @param socketFD: socket to use
+        @param reply: the message
+        @return true if successful, false otherwise
+    */
+    bool SendKeyReply(int socketFD, const KeyReply& reply);
+    bool ReadKeyReply(int socketFD, KeyReply& reply);
+
+    /*
+        Pack a batch of tree entries into bytes (before encryption)
+        Layout: [u32 count] then count x [u32 id][u8 kind][u64 size][u32 mode][u16 path length][path]
+        @param entries: entries to pack, only the relative path is sent
+        @param batch: the packed bytes
+    */
+    void SerializeTreeEntries(const std::vector<Tree::Entry>& entries, std::vector<Byte>& batch);
+
+    /*
+        Unpack a batch made by SerializeTreeEntries()
+        @param batch: the packed bytes
+        @param entries: the unpacked entries
+        @return true if the batch is well formed, false otherwise
+    */
+    bool ParseTreeEntries(const std::vector<Byte>& batch, std::vector<Tree::Entry>& entries);
+
+    /*
+        Append the index to a segment whose file contents are already in place
+        @param segment: file contents, packed back to back, the index is appended to it
+        @param index: where each file is within the segment
+    */
+    void FinishPackedSegment(std::vector<Byte>& segment, const std::vector<PackedFile>& index);
+
+    /*
+        Read the index of a segment made by FinishPackedSegment()
+        @param segment: the decrypted segment
+        @param index: where each file is within the segment
+        @return true if the segment is well formed (every file lies within the contents), false otherwise
+    */
+    bool ParsePackedSegment(const std::vector<Byte>& segment, std::vector<PackedFile>& index);
+
+    /*
+        Write the extent map of a sparse file at the start of a buffer
+        @param fileSize: size of the file, holes included
+        @param extents: the file's data extents
+        @param buffer: the map is appended here, followed by the extents' contents later on
+    */
+    void SerializeExtentMap(uint64_t fileSize, const std::vector<Sparse::Extent>& extents, std::vector<Byte>& buffer);
+
+    /*
+        Read an extent map written by SerializeExtentMap()
+        @param buffer: the decrypted map and contents
+        @param fileSize: size of the file, holes included
+        @param extents: the file's data extents
+        @param dataOffset: where the extents' contents start in `buffer`
+        @return true if the map is well formed (extents in order, inside the file, and
+                exactly as much data as they add up to), false otherwise
+    */
+    bool ParseExtentMap(const std::vector<Byte>& buffer, uint64_t& fileSize,
+        std::vector<Sparse::Extent>& extents, size_t& dataOffset);
+
+    /*
+        Write the sidecar of a stored file
+        @param info: what to write
+        @param buffer: the sidecar's contents
+    */
+    void SerializeStoredFileInfo(const StoredFileInfo& info, std::vector<Byte>& buffer);
+
+    /*
+        Read a sidecar written by SerializeStoredFileInfo()
+        @param buffer: the sidecar's contents
+        @param info: what was in it
+        @return true if the sidecar is well formed, false otherwise
+    */
+    bool ParseStoredFileInfo(const std::vector<Byte>& buffer, StoredFileInfo& info);
+
+    /*
+        Build the header of a named transfer (before encryption)
+        Layout: [u64 file size][u16 name length][name]
+        @param name: where to save the file, relative to the receiver's directory
+        @param fileSize: size of the file (before encryption)
+        @param buffer: the header
+    */
+    void SerializeNamedFileHeader(const std::string& name, uint64_t fileSize, std::vector<Byte>& buffer);
+
+    /*
+        Read a header built by SerializeNamedFileHeader()
+        @param buffer: the decrypted header
+        @param name: where to save the file, not checked for safety yet
+        @param fileSize: size of the file
+        @return true if the header is well formed, false otherwise
+    */
+    bool ParseNamedFileHeader(const std::vector<Byte>& buffer, std::string& name, uint64_t& fileSize);
+
+    /*
+        Build the header of a chunk of a named transfer (before encryption)
+        Layout: [u64 offset][u64 file size][u16 name length][name]
+        @param name: where to save the file, relative to the receiver's directory
+        @param fileSize: size of the whole file (before encryption)
+        @param offset: where in the file this chunk goes
+        @param buffer: the header
+    */
+    void SerializeNamedChunkHeader(const std::string& name, uint64_t fileSize, uint64_t offset, std::vector<Byte>& buffer);
+
+    /*
+        Read a header built by SerializeNamedChunkHeader()
+        @param buffer: the decrypted header
+        @param name: where to save the file, not checked for safety yet
+        @param fileSize: size of the whole file
+        @param offset: where in the file this chunk goes
+        @return true if the header is well formed, false otherwise
+    */
+    bool ParseNamedChunkHeader(const std::vector<Byte>& buffer, std::string& name, uint64_t& fileSize, uint64_t& offset);
+};
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef RATE_LIMITER_SSFTP
+#define RATE_LIMITER_SSFTP
+
+#include <string>
+#include <deque>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/*
+    Bandwidth shaping and fair scheduling
+
+    Left alone, the sender pushes data out as fast as `send()` accepts it, which is great
+    until the link is shared with other people. Two things help with that:
+
+    1. Token buckets limit how fast we send. A bucket fills up with "tokens" (bytes) at a
+       fixed rate, and sending a chunk takes that many tokens out. When the bucket is
+       empty, we wait until it has refilled enough. There is one global bucket for
+       everything the sender sends, and (in the directory mode) one per file, so a
+       single file can be held to a lower rate than the whole transfer.
+
+    2. Deficit round robin (DRR) decides whose turn it is when several files are ready
+       to go at once. Every file takes turns sending up to a fixed number of bytes (the
+       quantum), so a 1 KB file that shows up behind a 1 GB file goes out within one
+       round instead of waiting for the whole gigabyte.
+
+    Rates are in bytes per second, 0 means unlimited. They can be changed while a transfer
+    is running, see InstallReloadSignal().
+*/
+namespace RateLimit {
+
+    using Clock = std::chrono::steady_clock;
+
+    /*
+        A token bucket
+        Tokens are allowed to go negative: a chunk is sent as soon as the bucket isn't in
+        debt, however large it is, and the debt is paid off by waiting before the next one.
+        That keeps the long term rate exact without having to split chunks to fit the bucket.
+
+        Not thread safe, each bucket is only used by the thread that sends.
+    */
+    class TokenBucket {
+    private:
+        uint64_t rate;
+        double tokens;
+        double capacity;
+        Clock::time_point lastRefill;
+
+        void Refill(Clock::time_point now);
+
+    public:
+        explicit TokenBucket(uint64_t bytesPerSecond = 0);
+
+        /*
+            Change the rate, takes effect from the next chunk
+            @param bytesPerSecond: new rate, 0 for unlimited
+        */
+        void SetRate(uint64_t bytesPerSecond);
+        uint64_t Rate() const {
+            return rate;
+        }
+
+        /*
+            How long until the bucket is out of debt, and a chunk can be sent
+            @return zero if a chunk can be sent right now
+        */
+        Clock::duration TimeUntilReady();
+
+        /*
+            Take tokens for a chunk that is about to be sent
+            @param bytes: size of the chunk
+        */
+        void Consume(size_t bytes);
+
+        /*
+            Sleep until a chunk can be sent, then take its tokens
+            @param bytes: size of the chunk
+        */
+        void Acquire(size_t bytes);
+    };
+
+    /*
+        Deficit round robin between the files (flows) currently being sent
+
+        Each flow has a deficit counter. When a flow's turn comes up, its counter grows by
+        one quantum, and it may send chunks until the counter runs out (or it has nothing
+        left to send), then it goes to the back of the line. A flow that's being held back
+        by its own token bucket is skipped, and keeps its place in the next round.
+    */
+    class FairScheduler {
+    private:
+        struct Flow {
+            uint32_t id;
+            uint64_t remaining;
+            uint64_t deficit;
+            TokenBucket bucket;
+        };
+
+        std::deque<Flow> flows;
+        size_t quantum;
+        uint64_t flowRate;
+
+    public:
+        /*
+            @param quantumBytes: how much each flow may send per turn
+            @param bytesPerSecondPerFlow: token bucket rate of every flow, 0 for unlimited
+        */
+        FairScheduler(size_t quantumBytes, uint64_t bytesPerSecondPerFlow);
+
+        // Change the rate of every flow, current and future
+        void SetFlowRate(uint64_t bytesPerSecondPerFlow);
+
+        // Change how much each flow may send per turn, takes effect from the next turn
+        void SetQuantum(size_t quantumBytes);
+
+        // Add a flow with `bytes` to send, `id` is handed back by Next()
+        void AddFlow(uint32_t id, uint64_t bytes);
+
+        bool Empty() const {
+            return flows.empty();
+        }
+
+        /*
+            Pick the next chunk to send
+            @param id: flow the chunk belongs to
+            @param length: size of the chunk, the flow is done once it has sent all of its bytes
+            @param wait: when nothing can be sent because every flow is held back by its own
+                         rate, how long until one of them can
+            @return true if a chunk was picked, false if every flow is waiting (or there are none)
+        */
+        bool Next(uint32_t& id, size_t& length, Clock::duration& wait);
+    };
+
+    /*
+        Parse a rate like "500K", "10M" or "1G" (bytes per second, powers of 1024)
+        @param text: the rate, a plain number is in bytes per second, "0" is unlimited
+        @param bytesPerSecond: the parsed rate
+        @return true if the rate is valid, false otherwise
+    */
+    bool ParseRate(const std::string& text, uint64_t& bytesPerSecond);
+
+    /*
+        Read the rates from a config file, one "<name> <rate>" per line:
+            rate 10M
+            transfer-rate 2M
+        Missing lines leave the corresponding rate unchanged
+        @param path: file to read
+        @param globalRate: rate of the global bucket
+        @param transferRate: rate of each file's bucket
+        @return true if the file was read, false otherwise
+    */
+    bool LoadRateConfig(const std::string& path, uint64_t& globalRate, uint64_t& transferRate);
+
+    /*
+        Ask for the rate config to be re-read whenever the process gets SIGHUP
+        (`kill -HUP <pid>`). The signal handler only sets a flag, the sending loop checks
+        it between chunks with TakeReloadRequest(), and re-reads the file itself.
+    */
+    void InstallReloadSignal();
+
+    /*
+        @return true if SIGHUP arrived since the last call, false otherwise
+    */
+    bool TakeReloadRequest();
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef SCHEDULER_SSFTP
+#define SCHEDULER_SSFTP
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+    Ordering a batch of files before it's sent (-l, and -n with --named)
+
+    Files sent one after another over a single connection each have to wait for every
+    file in front of them. Send a 1 GB file first, and the hundred 10 KB files behind it
+    all finish a gigabyte late, even though together they'd have taken a millisecond.
+    What's measured here is each file's completion time, from the start of the batch until
+    its last byte is out, and its mean and tail over the whole batch. Three policies:
+
+    - FIFO: in the order given, what the sender has always done
+    - Shortest job first (SJF): smallest files first. With everything known up front this
+      gives the lowest possible mean completion time, at the cost of the largest files,
+      which always go last
+    - Weighted fair queuing (WFQ): every file gets a share of the connection in proportion
+      to its weight. Each piece a file sends gets a virtual finish time (the bytes the file
+      has sent so far, divided by its weight), and the piece with the earliest one goes
+      next. With equal weights and whole files, that's SJF. Interleaved (see below), all
+      files move along together, so small files finish early while large ones are never
+      starved. A higher weight gets a file through sooner
+
+    Interleaving (--interleave <size>) splits files larger than <size> into chunks of that
+    size, and sends whole small files in between them, so a large file in front no longer
+    holds up the small files behind it. Under FIFO a large file's chunks take turns with the
+    small files that come after it; under WFQ every file is chunked. SJF already sends the
+    small files first, so interleaving changes nothing there.
+
+    The plan is made up front, from the file sizes alone. The receiver needs nothing extra
+    for whole files, chunks go out as Protocol::MessageType::NamedFileChunk.
+*/
+namespace Schedule {
+
+    enum class Policy : uint8_t {
+        Fifo,
+        ShortestFirst,
+        WeightedFair
+    };
+
+    // A file to be sent: its size, and its weight (WFQ only)
+    struct Job {
+        uint64_t size;
+        double weight;
+    };
+
+    // What to send next: `length` bytes of job `job`, starting at `offset`
+    struct Slice {
+        size_t job;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    /*
+        Parse a policy name: fifo, sjf or wfq
+        @param name: the name
+        @param policy: the parsed policy
+        @return true if the name is valid, false otherwise
+    */
+    bool ParsePolicy(const std::string& name, Policy& policy);
+    const char* PolicyName(Policy policy);
+
+    /*
+        Decide the order a batch is sent in
+        @param jobs: the files, in the order they were given
+        @param policy: the policy to order them by
+        @param chunkSize: interleave files larger than this, in chunks of this size, 0 to never split a file
+        @return the slices to send, in order. Every byte of every job is in exactly one slice,
+                and the slices of a job are in order. A job that isn't split has a single
+                slice with all of it (an empty file too)
+    */
+    std::vector<Slice> Plan(const std::vector<Job>& jobs, Policy policy, uint64_t chunkSize);
+
+    /*
+        When each job would complete if the plan was sent at a constant rate, to compare
+        policies without sending the batch once for each
+        @param jobs: the files
+        @param plan: the slices, from Plan()
+        @return for each job, the bytes sent up to and including its last slice
+    */
+    std::vector<uint64_t> CompletionBytes(const std::vector<Job>& jobs, const std::vector<Slice>& plan);
+
+    // Mean and tail of a set of completion times
+    struct Latency {
+        double mean;
+        double p50;
+        double p95;
+        double p99;
+        double max;
+    };
+
+    /*
+        Summarize per-file completion times
+        @param seconds: completion time of each file, in any order
+        @return their mean and percentiles, all zero for an empty set
+    */
+    Latency Summarize(std::vector<double> seconds);
+};
+
+#endif
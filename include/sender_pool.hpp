@@ -0,0 +1,129 @@
+#ifndef SENDER_POOL_SSFTP
+#define SENDER_POOL_SSFTP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <future>
+#include <functional>
+#include <coroutine>
+
+#include "crypto.hpp"
+#include "file_sender.hpp"
+#include "work_queue.hpp"
+
+/*
+    Asynchronous, pooled sending, for programs that link libssftp instead of running sender.out
+
+    FileSender is blocking and owns a single connection: SendFile() returns once the file
+    is out, and nothing else can be sent over that connection in the meantime.
+    SenderPool keeps several connections to a receiver daemon (receiver.out -D) open, each
+    with its own thread, and hands them the files to send as they come:
+
+        Ssftp::SenderPool pool({.connections = 4});
+        pool.Start();
+
+        // A future...
+        std::future<bool> sent = pool.SendFile("report.pdf", "reports/report.pdf");
+
+        // ...a callback, called on one of the pool's threads once the file is out...
+        pool.SendFile("a.txt", "a.txt", [](bool sent) { ... });
+
+        // ...or from a coroutine, which resumes on one of the pool's threads
+        bool sent = co_await pool.SendFileAsync("b.txt", "b.txt");
+
+    Files are sent with FileSender::SendNamedFile(), so the receiver saves them under the
+    name given here. Connections stay open between files, so the handshake is paid once
+    per connection, not once per file, and a connection that fails is reopened for the
+    next file.
+
+    Callbacks (and coroutines resumed by the pool) run on the pool's threads, and hold up
+    that connection until they return, keep them short.
+*/
+namespace Ssftp {
+
+    // Called with whether the file was sent
+    using Completion = std::function<void(bool)>;
+
+    struct PoolOptions {
+        std::string serverIP = "127.0.0.1";
+        int serverPort = 8080;
+        // Unix socket of a receiver on this host, to send through shared memory instead of TCP, see shm_ring.hpp
+        std::string sharedMemoryPath;
+        // Number of connections, which is also the number of files sent at once
+        size_t connections = 4;
+        // Files waiting for a connection, SendFile() blocks past this
+        size_t maxQueued = 1024;
+        // Where to keep the session tickets, one file per connection ("<file>.<n>"), empty to always do a full handshake
+        std::string sessionFile;
+        // Hash algorithms to offer the receiver, most preferred first
+        std::vector<Crypto::HashAlgorithm> hashes = {Crypto::HashAlgorithm::Blake3, Crypto::HashAlgorithm::Sha256};
+        // Cipher suites to offer, empty for every real one, see FileSender::SetCipherSuites()
+        std::vector<Crypto::CipherSuite> suites;
+    };
+
+    class SenderPool;
+
+    /*
+        What SendFileAsync() returns, `co_await` it to send a file from a coroutine
+        The coroutine is suspended while the file waits for a connection and is sent,
+        and resumes on the pool thread that sent it, with whether it was sent
+    */
+    class SendAwaitable {
+    private:
+        SenderPool& pool;
+        std::string filename;
+        std::string name;
+        bool sent;
+
+    public:
+        SendAwaitable(SenderPool& senderPool, std::string file, std::string nameToSaveAs)
+            : pool(senderPool), filename(std::move(file)), name(std::move(nameToSaveAs)), sent(false) {}
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+        // Returns false (resume right away) if the pool isn't accepting files
+        bool await_suspend(std::coroutine_handle<> handle);
+        bool await_resume() const noexcept {
+            return sent;
+        }
+    };
+
+    class SenderPool {
+    private:
+        // A file waiting for a connection
+        struct Job {
+            std::string filename;
+            std::string name;
+            Completion done;
+        };
+
+        PoolOptions options;
+        std::vector<std::unique_ptr<FileSender>> senders;
+        std::vector<std::thread> workers;
+        WorkQueue<Job> jobs;
+        std::atomic<bool> started;
+        std::atomic<bool> stopped;
+
+        // Send every job that comes along over one connection, until the queue is closed
+        void Work(FileSender& sender);
+
+    public:
+        explicit SenderPool(const PoolOptions& poolOptions);
+        ~SenderPool();
+
+        SenderPool(const SenderPool&) = delete;
+        SenderPool& operator=(const SenderPool&) = delete;
+
+        bool Start();
+        bool SendFile(const std::string& filename, const std::string& name, Completion done);
+        std::future<bool> SendFile(const std::string& filename, const std::string& name);
+        SendAwaitable SendFileAsync(const std::string& filename, const std::string& name);
+        void Shutdown();
+    };
+};
+
+#endif
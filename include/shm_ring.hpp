@@ -0,0 +1,141 @@
+#ifndef SHM_RING_SSFTP
+#define SHM_RING_SSFTP
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include "utils.hpp"
+
+/*
+    Shared memory transport, for a sender and a receiver on the same host
+
+    Over TCP, even on 127.0.0.1, every byte is copied into the sender's socket buffer,
+    walked through the loopback stack, and copied out of the receiver's socket buffer,
+    with a system call on both ends for every chunk. When both ends are on the same
+    machine (containers sharing a tmpfs, say), none of that is needed:
+
+    - The connection itself is a Unix domain socket (at a path both ends can see, like
+      /dev/shm/ssftp.sock). Everything small goes over it exactly as it would over TCP:
+      the handshake, message types, sizes, hashes
+    - The receiver creates a ring buffer in anonymous shared memory (memfd_create()),
+      and hands it to the sender over that socket (SCM_RIGHTS), right after accepting
+    - File data goes through the ring instead of the socket: the sender copies it in,
+      the receiver copies it out, and that's all. One copy each, no system calls while
+      the ring has room (or data)
+
+    The ring has a single producer (the sender) and a single consumer (the receiver), so
+    it needs no locks at all: the sender only ever moves `head`, the receiver only ever
+    moves `tail`, and both are counters of bytes that only go up.
+
+    Neither side trusts what the other writes into the shared memory, any more than what
+    it sends over a socket. Each keeps its own counter in private memory and only
+    publishes it, and the other side's counter is checked before every copy: the data
+    in the ring (head - tail) is never more than the ring holds. A ring that breaks that
+    rule is closed, which ends the connection and nothing else. The memory itself is
+    sealed (memfd F_SEAL_SHRINK/F_SEAL_GROW), so that neither side can shrink it under the
+    other's mapping, where the next access would SIGBUS.
+
+    When the ring is full (or empty) the side that's stuck sleeps on an eventfd, and the
+    other side only pays for a write() to it if it sees the sleeper's "waiting" flag.
+    An eventfd rather than a futex so that the sleeper can watch the control socket at
+    the same time, and notice a peer that died instead of sleeping forever.
+
+    Both ends have to be started in this mode (--shm <socket path> on both).
+*/
+namespace ShmRing {
+
+    // Default size of the ring, a few times the largest chunk the sender sends at once
+    constexpr uint64_t defaultCapacity = 8 * 1024 * 1024;
+
+    /*
+        Connect to, or listen on, a Unix domain socket
+        @param path: path of the socket
+        @return the socket, or -1 on error
+    */
+    int ConnectUnixSocket(const std::string& path);
+    int ListenUnixSocket(const std::string& path, int backlog);
+
+    /*
+        The ring, one per connection
+        Move-only, the memory and the eventfds are released when it goes away
+    */
+    class Ring {
+    private:
+        struct Header;
+
+        Header* header;
+        Byte* data;
+        uint64_t capacity;
+        size_t mappedSize;
+        // Our own counter, head for the sender and tail for the receiver, the one in the
+        // header is only ever written (for the other side to see), never read back
+        uint64_t head;
+        uint64_t tail;
+
+        int memoryFD;
+        // Written to wake up a receiver waiting for data, and a sender waiting for room
+        int dataEvent;
+        int spaceEvent;
+        // The control socket, watched while sleeping to notice the other end going away
+        int peerFD;
+
+        bool Map(int fd, size_t size);
+        bool WaitFor(bool forData);
+        void Wake(bool forData);
+        bool CheckPeer(uint64_t headNow, uint64_t tailNow, const char* function);
+
+    public:
+        Ring();
+        ~Ring();
+        Ring(Ring&& other) noexcept;
+        Ring& operator=(Ring&& other) noexcept;
+        Ring(const Ring&) = delete;
+        Ring& operator=(const Ring&) = delete;
+
+        /*
+            Receiver: create a ring and hand it to the sender
+            @param socket: the connection's control socket
+            @param size: capacity of the ring in bytes
+            @return true if successful, false otherwise
+        */
+        bool Offer(int socket, uint64_t size = defaultCapacity);
+
+        /*
+            Sender: take the ring the receiver offered
+            @param socket: the connection's control socket
+            @return true if successful, false otherwise
+        */
+        bool Accept(int socket);
+
+        bool IsOpen() const {
+            return header != nullptr;
+        }
+        void Close();
+
+        /*
+            Sender: copy as much of `bytes` into the ring as fits, waiting for room if it's full
+            @return how many bytes went in, 0 if the receiver went away (like send())
+        */
+        size_t WriteSome(const Byte* bytes, size_t size);
+
+        /*
+            Receiver: copy up to `size` bytes out of the ring, waiting for some if it's empty
+            @return how many bytes came out, 0 if the sender went away (like read())
+        */
+        size_t ReadSome(Byte* bytes, size_t size);
+
+        // Exactly `size` bytes, in or out
+        bool Write(const void* bytes, size_t size);
+        bool Read(void* bytes, size_t size);
+
+        /*
+            Receiver: write exactly `size` bytes from the ring straight into a file, without
+            copying them anywhere else first (the ring's counterpart of Store::SpliceToFile())
+            @return true if everything was written, false otherwise
+        */
+        bool ReadToFile(int fileFD, uint64_t size);
+    };
+};
+
+#endif
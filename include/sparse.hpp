@@ -0,0 +1,61 @@
+#ifndef SPARSE_SSFTP
+#define SPARSE_SSFTP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "utils.hpp"
+
+/*
+    Sparse file helpers, used by the sparse transfer mode (-f with --sparse)
+
+    A sparse file has "holes": ranges that were never written, which take up no space on
+    disk and read back as zeros. VM disk images are the classic example, a 64 GB image
+    might only have a few GB of actual data in it.
+
+    Reading such a file normally (see FileSender::LoadFileIntoVector()) turns every hole
+    into real zeros, which we'd then encrypt, hash and send for nothing. Instead, we ask
+    the file system where the data is with `lseek(SEEK_DATA)` and `lseek(SEEK_HOLE)`, and
+    only send those ranges (extents), along with a map of where they go.
+*/
+namespace Sparse {
+
+    // A range of a file that holds data
+    struct Extent {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    /*
+        Find the data extents of a file
+        @param fd: file to map, open for reading
+        @param fileSize: size of the file
+        @param extents: the data extents, in order
+        @return true if successful, false otherwise
+
+        File systems that don't support SEEK_DATA report the whole file as a single extent
+    */
+    bool MapDataExtents(int fd, uint64_t fileSize, std::vector<Extent>& extents);
+
+    /*
+        Read the given extents of a file, appending them to a buffer back to back
+        @param fd: file to read from
+        @param extents: the extents to read, see MapDataExtents()
+        @param data: buffer to append to
+        @return true if successful, false otherwise
+    */
+    bool ReadExtents(int fd, const std::vector<Extent>& extents, std::vector<Byte>& data);
+
+    /*
+        Recreate a sparse file from its data extents
+        @param path: file to create (or replace)
+        @param fileSize: size of the file, including any trailing hole
+        @param extents: where each piece of data goes
+        @param data: the extents' contents, back to back, as produced by ReadExtents()
+        @return true if successful, false otherwise
+    */
+    bool WriteExtents(const std::string& path, uint64_t fileSize, const std::vector<Extent>& extents, const Byte* data);
+};
+
+#endif
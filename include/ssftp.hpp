@@ -0,0 +1,18 @@
+#ifndef SSFTP_SSFTP
+#define SSFTP_SSFTP
+
+/*
+    libssftp, everything sender.out and receiver.out are made of, minus their main()
+
+    Link against the `ssftp` CMake target and include this header:
+    - FileSender: blocking, one connection, every kind of transfer (file_sender.hpp)
+    - FileReceiver: the receiving end, including the daemon mode (file_receiver.hpp)
+    - Ssftp::SenderPool: asynchronous sending over a pool of connections, with futures,
+      callbacks or coroutines (sender_pool.hpp)
+*/
+
+#include "file_receiver.hpp"
+#include "file_sender.hpp"
+#include "sender_pool.hpp"
+
+#endif
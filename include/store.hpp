@@ -0,0 +1,72 @@
+#ifndef STORE_SSFTP
+#define STORE_SSFTP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "crypto.hpp"
+#include "utils.hpp"
+
+/*
+    Store mode, for receivers that are only a staging point
+
+    Normally the receiver reads every byte into memory, decrypts it, hashes it, and writes
+    it back out. A box that just collects files to forward them later doesn't need the
+    plaintext yet, so in store mode it skips all of that:
+
+    - The ciphertext is moved from the socket into a file with `splice()`, through a pipe.
+      The data stays inside the kernel (socket buffer -> pipe -> page cache), it's never
+      copied into our memory at all
+    - The framing metadata (cipher suite, hash algorithm, size, expected hash) goes into a
+      sidecar file next to it, along with the session keys, sealed under the pre-shared key
+    - Decrypting and verifying happen later, either on demand (`receiver.out -u <file>`)
+      or on a background thread while the transfer is still going (--background-unseal)
+
+    For a file saved as "name", the stored pair is "name.sealed" and "name.sealed.meta".
+    Unseal() turns them into "name", and removes them once the hash checks out.
+
+    Note that anyone who knows the pre-shared key can unseal a stored file, same as anyone
+    who knows it could have joined the session in the first place. A real deployment would
+    seal the session keys with a key of its own instead, kept in a KMS or an HSM.
+*/
+namespace Store {
+
+    const std::string dataSuffix = ".sealed";
+    const std::string metadataSuffix = ".sealed.meta";
+
+    /*
+        Move exactly `size` bytes from a socket into a file, without copying them into user space
+        @param socketFD: socket to read from
+        @param fileFD: file to write to, at its current offset
+        @param size: number of bytes to move
+        @return true if everything was moved, false on error or if the peer hung up
+
+        Falls back to plain read()/write() where splice() isn't available
+    */
+    bool SpliceToFile(int socketFD, int fileFD, uint64_t size);
+
+    /*
+        Write the sidecar of a stored file
+        @param filename: the file's final name, the sidecar goes next to "<filename>.sealed"
+        @param suite: cipher suite the data was encrypted with
+        @param hashAlgorithm: algorithm of `expectedHash`
+        @param keys: the session's keys, sealed before they're written
+        @param encryptedSize: size of the stored ciphertext
+        @param expectedHash: hash of the plaintext, as sent by the sender
+        @return true if successful, false otherwise
+    */
+    bool SaveMetadata(const std::string& filename, Crypto::CipherSuite suite, Crypto::HashAlgorithm hashAlgorithm,
+        const Crypto::SessionKeys& keys, uint64_t encryptedSize, const std::vector<Byte>& expectedHash);
+
+    /*
+        Decrypt and verify a stored file, and replace the stored pair with the plaintext
+        @param filename: the file's final name, as given to the receiver
+        @param threads: threads used to hash it, BLAKE3 only
+        @return true if the file was decrypted and its hash matched, false otherwise
+                (the stored pair is left alone on failure)
+    */
+    bool Unseal(const std::string& filename, unsigned threads = 1);
+};
+
+#endif
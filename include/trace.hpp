@@ -0,0 +1,111 @@
+#ifndef TRACE_SSFTP
+#define TRACE_SSFTP
+
+#include <cstdint>
+
+/*
+    Static tracepoints (USDT probes), to see inside a running transfer without a debugger
+
+    The probes are compiled in with systemtap's <sys/sdt.h> (package systemtap-sdt-dev or
+    systemtap-sdt-devel), and show up in the binaries as provider "ssftp":
+
+        sudo bpftrace -l 'usdt:./receiver.out:ssftp:*'
+
+    A probe is a single `nop` instruction until someone attaches to it, so the cost when
+    nobody is tracing is nothing at all. Each probe also has a semaphore, a counter the
+    tracer bumps while it's attached, and the probe's arguments (the timestamp in
+    particular) are only computed while it's non-zero.
+
+    Every probe's first argument is a CLOCK_MONOTONIC timestamp in nanoseconds, the same
+    clock as bpftrace's `nsecs`. Most of them carry a file id next: the tree entry id of a
+    directory transfer (-d), a per-process counter for everything else (which lines up
+    between sender and receiver for -f and -n).
+
+        connect_begin(ts, port)                     sender, before connect()
+        connect_end(ts, fd, ok, resumed)            sender, after the handshake
+        accept_begin(ts, fd)                        receiver, after accept()
+        accept_end(ts, fd, ok)                      receiver, after the handshake
+        chunk_send(ts, file, bytes, offset)         every send() of file data
+        chunk_recv(ts, file, bytes, offset)         every read() of file data
+        encrypt_begin(ts, file, bytes)              around Crypto::EncryptData()
+        encrypt_end(ts, file, bytes, ok)
+        decrypt_begin(ts, file, bytes)              around Crypto::DecryptData()
+        decrypt_end(ts, file, bytes, ok)
+        hash_begin(ts, file, bytes, algorithm)      around Crypto::CalculateHash()
+        hash_end(ts, file, bytes, ok)
+        file_open(ts, file, path, size)             a file is opened to be read or written
+        file_read(ts, file, bytes)                  sender, the file is loaded
+        file_write(ts, file, bytes)                 receiver, the file is written
+        file_close(ts, file)
+
+    Example scripts are in tools/trace/. Without <sys/sdt.h> (or with SSFTP_DISABLE_TRACE
+    defined) the probes compile to nothing.
+*/
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>) && !defined(SSFTP_DISABLE_TRACE)
+#define SSFTP_TRACE_ENABLED 1
+#endif
+#endif
+
+// Every probe, X(name) for each
+#define SSFTP_TRACE_PROBES(X) \
+    X(connect_begin) X(connect_end) X(accept_begin) X(accept_end) \
+    X(chunk_send) X(chunk_recv) \
+    X(encrypt_begin) X(encrypt_end) X(decrypt_begin) X(decrypt_end) X(hash_begin) X(hash_end) \
+    X(file_open) X(file_read) X(file_write) X(file_close)
+
+#ifdef SSFTP_TRACE_ENABLED
+
+// Ask <sys/sdt.h> to tie every probe to its semaphore, ssftp_<name>_semaphore
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define SSFTP_TRACE_DECLARE_SEMAPHORE(name) extern "C" volatile unsigned short ssftp_##name##_semaphore;
+SSFTP_TRACE_PROBES(SSFTP_TRACE_DECLARE_SEMAPHORE)
+#undef SSFTP_TRACE_DECLARE_SEMAPHORE
+
+/*
+    Fire a probe, the timestamp is added in front of the arguments
+    Usage: SSFTP_TRACE(chunk_send, fileId, bytes, offset);
+*/
+#define SSFTP_TRACE(name, ...) \
+    do { \
+        if (__builtin_expect(ssftp_##name##_semaphore != 0, 0)) \
+            STAP_PROBEV(ssftp, name, Trace::Now(), __VA_ARGS__); \
+    } while (0)
+
+#else
+
+// The arguments are still type checked (and count as used), but never evaluated
+#define SSFTP_TRACE(name, ...) \
+    do { \
+        if (false) \
+            Trace::Ignore(__VA_ARGS__); \
+    } while (0)
+
+#endif
+
+namespace Trace {
+
+    // Nanoseconds on CLOCK_MONOTONIC, the probes' timestamp
+    uint64_t Now();
+
+    // Start a new file on this thread, and return its id (see CurrentFile())
+    uint64_t BeginFile();
+
+    // Make `id` this thread's current file, for transfers that have ids of their own (-d)
+    void SetFile(uint64_t id);
+
+    /*
+        The file this thread is working on, the id the probes report
+        Set by whoever starts working on a file, so that code further down (encryption,
+        hashing) can tag its probes without being told about files at all
+    */
+    uint64_t CurrentFile();
+
+    template <typename... Args>
+    inline void Ignore(const Args&...) {}
+};
+
+#endif
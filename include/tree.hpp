@@ -0,0 +1,60 @@
+#ifndef TREE_SSFTP
+#define TREE_SSFTP
+
+#include <string>
+#include <functional>
+#include <cstdint>
+
+/*
+    Directory tree helpers, used by the directory transfer mode (-d)
+
+    The sender walks the tree with several threads at once, since on big trees (hundreds
+    of thousands of entries) the walk is mostly waiting on the file system for directory
+    listings and stat() results, and several threads can wait at the same time.
+*/
+namespace Tree {
+
+    // The kinds of entries we transfer, symlinks and special files are skipped
+    enum class EntryKind : uint8_t {
+        Directory = 1,
+        File = 2
+    };
+
+    /*
+        An entry in the tree
+        `relativePath` is what goes over the wire, relative to the root of the transfer
+        `fullPath` is only meaningful on the sender, where the entry is read from, and so
+        are `modifiedNanos` and `inode`, which the incremental mode uses (see file_index.hpp)
+        `id` is assigned by the sender, the receiver uses it to match contents to entries
+    */
+    struct Entry {
+        uint32_t id;
+        EntryKind kind;
+        uint64_t size;
+        uint32_t mode;
+        std::string relativePath;
+        std::string fullPath;
+        int64_t modifiedNanos;
+        uint64_t inode;
+    };
+
+    /*
+        Walk a directory tree using several threads
+        @param root: directory to walk
+        @param threads: number of threads to walk with
+        @param onEntry: called for every directory and regular file below `root`. It is
+                        called from the walking threads, concurrently, so it must be thread safe.
+                        A directory is always reported before anything inside it.
+        @return true if the whole tree was walked, false if some of it couldn't be read
+    */
+    bool ParallelScan(const std::string& root, unsigned threads, const std::function<void(Entry&&)>& onEntry);
+
+    /*
+        Check that a path received over the network stays inside the destination directory
+        @param relativePath: path to check
+        @return true if the path is relative and has no ".." components, false otherwise
+    */
+    bool IsSafeRelativePath(const std::string& relativePath);
+};
+
+#endif
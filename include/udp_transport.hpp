@@ -0,0 +1,253 @@
+#ifndef UDP_TRANSPORT_SSFTP
+#define UDP_TRANSPORT_SSFTP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <netinet/in.h>
+
+#include "utils.hpp"
+
+/*
+    UDP data channel, for long and lossy links
+
+    A single TCP connection treats every lost packet as a sign of congestion and halves its
+    sending rate. Over a long link with a few percent of random loss (radio, a congested
+    peering point) it never gets its rate back, it spends most of its time recovering.
+    TCP also delivers in order, so everything behind a lost packet waits for it.
+
+    With --udp on both ends, the handshake and every control message still go over the TCP
+    connection, but file data goes over UDP instead, with reliability and congestion control
+    of our own, in the style of QUIC and UDT:
+
+    - Packet numbers are never reused, a retransmission goes out under a new one. So an
+      acknowledgement is never ambiguous, and every one of them is a clean RTT sample
+    - The receiver acknowledges ranges of packet numbers (selective acknowledgements), so
+      the sender knows exactly what's missing. A packet is declared lost once three later
+      ones have been acknowledged, or once it's been outstanding for longer than an RTT.
+      Its data is queued to be sent again, and the stream keeps going around the hole
+    - Congestion control is rate based (a simplified BBR): the sender measures how fast
+      data is being delivered, and paces packets out at about that rate, probing for more
+      every few round trips. It keeps at most two bandwidth-delay products in flight.
+      Loss alone doesn't slow it down, which is what keeps it going on a lossy link
+    - Packets go out in batches, with one sendmmsg() call (or a single GSO send, when the
+      kernel can split one large buffer into packets itself), and come in with recvmmsg()
+    - The receiver advertises how far into the stream it has room for, so a slow reader
+      holds the sender back (flow control), like TCP's receive window
+
+    The channel carries a byte stream, like the socket it stands in for: the sender writes
+    into a buffer that a worker thread packetizes and sends, the receiver's worker thread
+    puts packets back in order and the reader reads from there. The receiver uses its TCP
+    port number for UDP too, and every packet carries a token it hands out over TCP, so
+    that stray packets from an earlier connection are ignored.
+*/
+namespace Udp {
+
+    // Payload of a single packet, small enough to fit a 1500 byte MTU with the headers
+    constexpr size_t maxPayload = 1400;
+    // Bytes buffered on each side, the most that can be in flight
+    constexpr size_t bufferSize = 16 * 1024 * 1024;
+
+    /*
+        Open the receiver's UDP socket, on the same port as its TCP listener
+        @param port: the port
+        @return the socket, or -1 on error
+    */
+    int ListenSocket(int port);
+
+    // What the channel has been up to, for logging
+    struct Stats {
+        uint64_t packetsSent = 0;
+        uint64_t packetsRetransmitted = 0;
+        uint64_t packetsLost = 0;
+        uint64_t packetsReceived = 0;
+        uint64_t duplicates = 0;
+        uint64_t acksSent = 0;
+        double minRttMicros = 0;
+        double smoothedRttMicros = 0;
+        double bandwidth = 0;
+    };
+
+    class Channel {
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        // A packet that's been sent and not yet acknowledged or declared lost
+        struct SentPacket {
+            uint64_t offset;
+            uint32_t length;
+            Clock::time_point sentTime;
+            // Bytes delivered when it was sent, when that was, and when the packet delivered
+            // last was sent, for the delivery rate
+            uint64_t delivered;
+            Clock::time_point deliveredTime;
+            Clock::time_point firstSentTime;
+            bool appLimited;
+        };
+
+        enum class Mode { Startup, Drain, ProbeBandwidth };
+
+        bool isSender = false;
+        int udpFD = -1;
+        int controlFD = -1;
+        // Written to wake the worker thread up
+        int wakeFD = -1;
+        uint32_t token = 0;
+        bool useGso = false;
+
+        std::thread worker;
+        std::atomic<bool> stopping = false;
+
+        // Everything below that both the worker and the user touch is behind `mutex`
+        mutable std::mutex mutex;
+        std::condition_variable changed;
+        bool peerGone = false;
+        Stats stats;
+
+        // The stream, a ring buffer of bufferSize bytes, stream offset x is at x % bufferSize
+        std::vector<Byte> buffer;
+
+        // Sender: written by the user up to here, acknowledged (all of it) up to here
+        uint64_t writeOffset = 0;
+        uint64_t ackedOffset = 0;
+
+        // Sender, worker only
+        std::vector<Byte> outgoing;
+        uint64_t knownWriteOffset = 0;
+        uint64_t sentOffset = 0;
+        uint64_t peerLimit = bufferSize;
+        std::map<uint64_t, uint64_t> ackedRanges;
+        std::deque<std::pair<uint64_t, uint64_t>> lostRanges;
+        std::map<uint64_t, SentPacket> inFlight;
+        uint64_t bytesInFlight = 0;
+        uint64_t nextPacketNumber = 0;
+        uint64_t largestAcked = 0;
+        bool anyAcked = false;
+        unsigned probeTimeouts = 0;
+        Clock::time_point lastSendTime;
+        Clock::time_point nextSendTime;
+
+        // Round trip time, in microseconds
+        double minRtt = 0;
+        double smoothedRtt = 0;
+        double rttVariance = 0;
+        double latestRtt = 0;
+
+        // Delivery rate and the congestion controller's state
+        uint64_t delivered = 0;
+        Clock::time_point deliveredTime;
+        Clock::time_point firstSentTime;
+        uint64_t round = 0;
+        uint64_t nextRoundDelivered = 0;
+        std::array<double, 10> roundBandwidth = {};
+        double bottleneckBandwidth = 0;
+        double fullBandwidth = 0;
+        unsigned fullBandwidthRounds = 0;
+        uint64_t appLimitedUntil = 0;
+        Mode mode = Mode::Startup;
+        size_t cycleIndex = 0;
+        Clock::time_point cycleStart;
+
+        // Receiver: read by the user up to here, received without gaps up to here,
+        // and the sender was told it can send up to here
+        uint64_t readOffset = 0;
+        uint64_t contiguousOffset = 0;
+        uint64_t advertisedLimit = bufferSize;
+        // Receiver, worker only
+        uint64_t receivedOffset = 0;
+        std::map<uint64_t, uint64_t> receivedRanges;
+        std::map<uint64_t, uint64_t> receivedPackets;
+        uint64_t largestReceived = 0;
+        Clock::time_point largestReceivedTime;
+        Clock::time_point lastAckSent;
+        // Packets not acknowledged yet, whether to do it right away, or else by when
+        unsigned unackedPackets = 0;
+        bool ackNow = false;
+        Clock::time_point ackDeadline;
+        sockaddr_in peer = {};
+        bool havePeer = false;
+
+        void Start(int socket, uint32_t channelToken, int control, bool sender);
+        void Wake();
+
+        void SenderLoop();
+        bool SendPackets(Clock::time_point now);
+        void Transmit(const Byte* packets, const std::vector<size_t>& sizes);
+        void OnAck(const Byte* packet, size_t size, Clock::time_point now);
+        void OnPacketAcked(const SentPacket& packet, Clock::time_point now);
+        void DetectLosses(Clock::time_point now);
+        void MarkLost(std::map<uint64_t, SentPacket>::iterator packet);
+        void UpdateModel(Clock::time_point now, bool roundStart);
+        double PacingRate() const;
+        uint64_t CongestionWindow() const;
+
+        void ReceiverLoop();
+        bool OnData(const Byte* packet, size_t size, uint64_t limit, Clock::time_point now);
+        void SendAck(Clock::time_point now);
+
+    public:
+        Channel() = default;
+        ~Channel();
+        Channel(const Channel&) = delete;
+        Channel& operator=(const Channel&) = delete;
+
+        /*
+            Sender: start sending to the receiver's UDP port
+            @param ip, port: the receiver's address, the same as its TCP address
+            @param channelToken: the token the receiver sent over TCP
+            @param control: the TCP socket, watched to notice the receiver going away
+            @return true if successful, false otherwise
+        */
+        bool Connect(const std::string& ip, int port, uint32_t channelToken, int control);
+
+        /*
+            Receiver: start receiving on a UDP socket (taken over by the channel)
+            @param socket: the socket, see ListenSocket()
+            @param channelToken: the token we sent the sender over TCP
+            @param control: the TCP socket, watched to notice the sender going away
+            @return true if successful, false otherwise
+        */
+        bool Listen(int socket, uint32_t channelToken, int control);
+
+        /*
+            Sender: add as much of `bytes` to the stream as there's room for, waiting for room
+            @return how many bytes were taken, 0 if the receiver went away (like send())
+        */
+        size_t WriteSome(const Byte* bytes, size_t size);
+
+        /*
+            Receiver: take up to `size` bytes from the stream, waiting for some
+            @return how many bytes were read, 0 if the sender went away (like read())
+        */
+        size_t ReadSome(Byte* bytes, size_t size);
+
+        // Exactly `size` bytes, in or out
+        bool Write(const void* bytes, size_t size);
+        bool Read(void* bytes, size_t size);
+
+        // Receiver: write exactly `size` bytes of the stream into a file
+        bool ReadToFile(int fileFD, uint64_t size);
+
+        /*
+            Sender: wait until the receiver has everything we've written
+            @return true if it has, false if it went away or stopped answering
+        */
+        bool Flush();
+
+        // Stop the worker thread and close the socket
+        void Close();
+
+        Stats GetStats() const;
+        std::string Describe() const;
+    };
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef WORK_QUEUE_SSFTP
+#define WORK_QUEUE_SSFTP
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <optional>
+#include <cstddef>
+
+/*
+    A thread safe FIFO queue with a maximum size, used to hand work between threads
+
+    - Push() blocks while the queue is full, which stops a fast producer from running
+      arbitrarily far ahead of a slow consumer (and using up all the memory doing so)
+    - Pop() blocks while the queue is empty, and returns std::nullopt once the queue has
+      been closed and everything in it has been taken out
+    - Close() is how the producer says "that's all", it wakes everyone up
+
+    Everything is done under a single mutex, which is plenty for the handful of threads
+    and the per-file (not per-byte) granularity we use it with.
+*/
+template <typename T>
+class WorkQueue {
+private:
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+
+public:
+    explicit WorkQueue(const size_t maxItems) {
+        capacity = maxItems;
+        closed = false;
+    }
+
+    /*
+        Add an item, waiting for room if the queue is full
+        @param item: the item to add
+        @return false if the queue was closed (the item is dropped), true otherwise
+    */
+    bool Push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed)
+            return false;
+
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /*
+        Take the oldest item, waiting for one if the queue is empty
+        @return the item, or std::nullopt if the queue is closed and drained
+    */
+    std::optional<T> Pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return closed || items.empty() == false; });
+        return TakeFront();
+    }
+
+    /*
+        Take the oldest item if there is one, without waiting
+        @return the item, or std::nullopt if the queue is currently empty
+    */
+    std::optional<T> TryPop() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return TakeFront();
+    }
+
+    /*
+        No more items will be pushed, Pop() returns std::nullopt once the queue drains
+    */
+    void Close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    // Remove and return the front item, the caller must hold the lock
+    std::optional<T> TakeFront() {
+        if (items.empty())
+            return std::nullopt;
+
+        std::optional<T> item(std::move(items.front()));
+        items.pop_front();
+        notFull.notify_one();
+        return item;
+    }
+};
+
+#endif
@@ -0,0 +1,434 @@
+#include <cstring>
+#include <cstdint>
+#include <bit>
+#include <thread>
+#include <algorithm>
+
+#include "../include/blake3.hpp"
+
+/*
+    BLAKE3, see blake3.hpp for the big picture
+
+    The building block is the compression function, which mixes a 64 byte block of the
+    message into a 32 byte chaining value (CV). Hashing a 1 KB chunk is 16 compressions,
+    each feeding its output CV into the next. Combining two children into their parent
+    is one more compression, with the two 32 byte CVs as the 64 byte block.
+
+    Flags tell the compression function where in the tree a block sits (first/last block
+    of a chunk, parent node, root), so that the same bytes hash to different values in
+    different positions. The counter is the index of the chunk, for the same reason.
+
+    The compression function is written once, as templates over the word type:
+    - `uint32_t`: one compression at a time, used for partial chunks and parent nodes
+    - `Lanes`: a vector of 8 `uint32_t`, one per chunk, used to hash 8 full chunks at once.
+      GCC/Clang let us use +, ^, >> and << on these directly, and turn them into SSE, AVX2
+      or AVX-512 instructions, depending on what we compile for.
+*/
+
+namespace Blake3 {
+
+    constexpr size_t blockSize = 64;
+    constexpr size_t chunkSize = 1024;
+
+    // Same as SHA-256's initial hash values
+    constexpr uint32_t IV[8] = {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+        0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+    };
+
+    /*
+        Which message word goes where in each of the 7 rounds
+
+        The spec permutes the message words between rounds; these are the permutations
+        already applied 0, 1, ..., 6 times, so every round can index the original block
+    */
+    constexpr uint8_t messageSchedule[7][16] = {
+        {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+        {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+        {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+        {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+        {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+        {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+        {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}
+    };
+
+    // Position of a block in the tree
+    constexpr uint32_t ChunkStart = 1;
+    constexpr uint32_t ChunkEnd = 2;
+    constexpr uint32_t Parent = 4;
+    constexpr uint32_t Root = 8;
+
+    // Below this many bytes, a subtree isn't worth a thread of its own
+    constexpr size_t minParallelSize = 256 * 1024;
+    // Subtrees with at most this many chunks are hashed in one go, without recursing further
+    constexpr size_t maxBatchChunks = 64;
+
+    // 8 words, processed side by side
+    constexpr size_t lanes = 8;
+    typedef uint32_t Lanes __attribute__((vector_size(lanes * sizeof(uint32_t))));
+
+    // Read a little endian word, compilers turn this into a single load on little endian CPUs
+    static inline uint32_t LoadWord(const Byte* bytes) {
+        return static_cast<uint32_t>(bytes[0]) | static_cast<uint32_t>(bytes[1]) << 8 |
+            static_cast<uint32_t>(bytes[2]) << 16 | static_cast<uint32_t>(bytes[3]) << 24;
+    }
+
+    static inline void StoreWord(uint32_t word, Byte* bytes) {
+        bytes[0] = static_cast<Byte>(word);
+        bytes[1] = static_cast<Byte>(word >> 8);
+        bytes[2] = static_cast<Byte>(word >> 16);
+        bytes[3] = static_cast<Byte>(word >> 24);
+    }
+
+    // Rotate every 32-bit word right by `bits`, in place
+    template <typename Word>
+    [[gnu::always_inline]] static inline void RotateRight(Word& x, int bits) {
+        x = (x >> bits) | (x << (32 - bits));
+    }
+
+    // The quarter round, mixes two message words into four state words
+    template <typename Word>
+    [[gnu::always_inline]] static inline void Mix(Word* state, int a, int b, int c, int d, const Word& x, const Word& y) {
+        state[a] += state[b] + x;
+        state[d] ^= state[a];
+        RotateRight(state[d], 16);
+        state[c] += state[d];
+        state[b] ^= state[c];
+        RotateRight(state[b], 12);
+        state[a] += state[b] + y;
+        state[d] ^= state[a];
+        RotateRight(state[d], 8);
+        state[c] += state[d];
+        state[b] ^= state[c];
+        RotateRight(state[b], 7);
+    }
+
+    /*
+        The 7 rounds of the compression function
+        @param state: 16 word state, initialized by the caller
+        @param message: the 16 words of the block
+    */
+    template <typename Word>
+    [[gnu::always_inline]] static inline void Rounds(Word* state, const Word* message) {
+        for (const uint8_t* schedule : messageSchedule) {
+            // Columns
+            Mix(state, 0, 4, 8, 12, message[schedule[0]], message[schedule[1]]);
+            Mix(state, 1, 5, 9, 13, message[schedule[2]], message[schedule[3]]);
+            Mix(state, 2, 6, 10, 14, message[schedule[4]], message[schedule[5]]);
+            Mix(state, 3, 7, 11, 15, message[schedule[6]], message[schedule[7]]);
+            // Diagonals
+            Mix(state, 0, 5, 10, 15, message[schedule[8]], message[schedule[9]]);
+            Mix(state, 1, 6, 11, 12, message[schedule[10]], message[schedule[11]]);
+            Mix(state, 2, 7, 8, 13, message[schedule[12]], message[schedule[13]]);
+            Mix(state, 3, 4, 9, 14, message[schedule[14]], message[schedule[15]]);
+        }
+    }
+
+    /*
+        Compress one block, the scalar version
+        @param cv: chaining value going in
+        @param block: the 16 message words
+        @param counter: chunk index (0 for parent nodes)
+        @param blockLength: bytes of the block actually used, the rest is zero padding
+        @param flags: position of the block in the tree
+        @param output: the 8 word chaining value coming out
+    */
+    static void Compress(const uint32_t cv[8], const uint32_t block[16], uint64_t counter,
+        uint32_t blockLength, uint32_t flags, uint32_t output[8]) {
+
+        uint32_t state[16] = {
+            cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+            IV[0], IV[1], IV[2], IV[3],
+            static_cast<uint32_t>(counter), static_cast<uint32_t>(counter >> 32), blockLength, flags
+        };
+        Rounds(state, block);
+
+        for (int i = 0; i < 8; i++)
+            output[i] = state[i] ^ state[i + 8];
+    }
+
+    /*
+        Everything needed for the last compression of a node
+
+        The last compression is held back until we know whether the node is the root,
+        which needs the `Root` flag on top of its usual flags
+    */
+    struct Output {
+        uint32_t cv[8];
+        uint32_t block[16];
+        uint64_t counter;
+        uint32_t blockLength;
+        uint32_t flags;
+
+        // Chaining value of a node that isn't the root
+        void ChainingValue(uint32_t output[8]) const {
+            Compress(cv, block, counter, blockLength, flags, output);
+        }
+
+        // The final hash, if this node is the root
+        void RootBytes(Byte output[outputSize]) const {
+            uint32_t words[8];
+            Compress(cv, block, 0, blockLength, flags | Root, words);
+            for (int i = 0; i < 8; i++)
+                StoreWord(words[i], output + 4 * i);
+        }
+    };
+
+    /*
+        Hash a chunk up to its last block, the scalar version
+        @param data: the chunk
+        @param size: its size, at most 1 KB (only the last chunk of the input can be smaller)
+        @param counter: index of the chunk
+        @return the last compression, still to be done
+    */
+    static Output ChunkOutput(const Byte* data, size_t size, uint64_t counter) {
+
+        Output output;
+        std::copy(std::begin(IV), std::end(IV), output.cv);
+
+        // An empty input is a single chunk with a single, empty block
+        const size_t blocks = std::max<size_t>((size + blockSize - 1) / blockSize, 1);
+        for (size_t i = 0; i + 1 < blocks; i++) {
+            uint32_t block[16];
+            for (int word = 0; word < 16; word++)
+                block[word] = LoadWord(data + i * blockSize + 4 * word);
+            Compress(output.cv, block, counter, blockSize, i == 0 ? ChunkStart : 0, output.cv);
+        }
+
+        // The last block is zero padded
+        Byte lastBlock[blockSize] = {};
+        const size_t lastOffset = (blocks - 1) * blockSize;
+        if (size > lastOffset)
+            std::memcpy(lastBlock, data + lastOffset, size - lastOffset);
+        for (int word = 0; word < 16; word++)
+            output.block[word] = LoadWord(lastBlock + 4 * word);
+
+        output.counter = counter;
+        output.blockLength = static_cast<uint32_t>(size - lastOffset);
+        output.flags = ChunkEnd | (blocks == 1 ? ChunkStart : 0);
+        return output;
+    }
+
+    /*
+        The parent node of two children
+        @param left: chaining value of the left child
+        @param right: chaining value of the right child
+        @return the parent's compression, still to be done
+    */
+    static Output ParentOutput(const uint32_t left[8], const uint32_t right[8]) {
+        Output output;
+        std::copy(std::begin(IV), std::end(IV), output.cv);
+        std::copy(left, left + 8, output.block);
+        std::copy(right, right + 8, output.block + 8);
+        output.counter = 0;
+        output.blockLength = blockSize;
+        output.flags = Parent;
+        return output;
+    }
+
+    /*
+        Turn 8 rows of 8 words into 8 columns: rows[i][j] ends up in columns[j][i]
+        Three rounds of shuffles, each interleaving pairs of vectors, twice as coarse every round
+    */
+    [[gnu::always_inline]] static inline void Transpose(const Lanes rows[8], Lanes columns[8]) {
+        Lanes pairs[8], quads[8];
+        for (int i = 0; i < 8; i += 2) {
+            pairs[i] = __builtin_shufflevector(rows[i], rows[i + 1], 0, 8, 1, 9, 4, 12, 5, 13);
+            pairs[i + 1] = __builtin_shufflevector(rows[i], rows[i + 1], 2, 10, 3, 11, 6, 14, 7, 15);
+        }
+        for (int i = 0; i < 8; i += 4) {
+            quads[i] = __builtin_shufflevector(pairs[i], pairs[i + 2], 0, 1, 8, 9, 4, 5, 12, 13);
+            quads[i + 1] = __builtin_shufflevector(pairs[i], pairs[i + 2], 2, 3, 10, 11, 6, 7, 14, 15);
+            quads[i + 2] = __builtin_shufflevector(pairs[i + 1], pairs[i + 3], 0, 1, 8, 9, 4, 5, 12, 13);
+            quads[i + 3] = __builtin_shufflevector(pairs[i + 1], pairs[i + 3], 2, 3, 10, 11, 6, 7, 14, 15);
+        }
+        for (int i = 0; i < 4; i++) {
+            columns[i] = __builtin_shufflevector(quads[i], quads[i + 4], 0, 1, 2, 3, 8, 9, 10, 11);
+            columns[i + 4] = __builtin_shufflevector(quads[i], quads[i + 4], 4, 5, 6, 7, 12, 13, 14, 15);
+        }
+    }
+
+    /*
+        Load the same block of 8 consecutive chunks, one chunk per lane
+        @param data: the block in the first chunk, the others follow 1 KB apart
+        @param message: message[i] = word i of the block, from each of the 8 chunks
+
+        Loading word by word into the lanes would take 128 separate loads per block. Instead,
+        each chunk's block is loaded as two whole vectors, and then transposed.
+    */
+    [[gnu::always_inline]] static inline void LoadMessage(const Byte* data, Lanes message[16]) {
+        if constexpr (std::endian::native == std::endian::little) {
+            Lanes low[8], high[8];
+            for (size_t lane = 0; lane < lanes; lane++) {
+                std::memcpy(&low[lane], data + lane * chunkSize, sizeof(Lanes));
+                std::memcpy(&high[lane], data + lane * chunkSize + sizeof(Lanes), sizeof(Lanes));
+            }
+            Transpose(low, message);
+            Transpose(high, message + 8);
+        }
+        else {
+            for (int word = 0; word < 16; word++)
+                for (size_t lane = 0; lane < lanes; lane++)
+                    message[word][lane] = LoadWord(data + lane * chunkSize + 4 * word);
+        }
+    }
+
+    /*
+        Hash 8 full chunks at once, one per lane
+        @param data: the 8 chunks, back to back
+        @param counter: index of the first chunk
+        @param cvs: chaining values of the 8 chunks
+
+        Compiled three times on x86-64: baseline (SSE2), x86-64-v3 (AVX2) and x86-64-v4
+        (AVX-512, which also has a rotate instruction). The dynamic loader picks the best
+        one this CPU supports the first time it's called
+    */
+#if defined(__x86_64__) && defined(__linux__)
+    __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#endif
+    void HashChunks8(const Byte* data, uint64_t counter, uint32_t cvs[lanes][8]) {
+
+        Lanes cv[8];
+        for (int i = 0; i < 8; i++)
+            cv[i] = Lanes{} + IV[i];
+
+        Lanes counterLow, counterHigh;
+        for (size_t lane = 0; lane < lanes; lane++) {
+            counterLow[lane] = static_cast<uint32_t>(counter + lane);
+            counterHigh[lane] = static_cast<uint32_t>((counter + lane) >> 32);
+        }
+
+        for (size_t block = 0; block < chunkSize / blockSize; block++) {
+            // message[i] = word i of this block, from each of the 8 chunks
+            Lanes message[16];
+            LoadMessage(data + block * blockSize, message);
+
+            uint32_t flags = 0;
+            if (block == 0)
+                flags |= ChunkStart;
+            if (block == chunkSize / blockSize - 1)
+                flags |= ChunkEnd;
+
+            Lanes state[16] = {
+                cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+                Lanes{} + IV[0], Lanes{} + IV[1], Lanes{} + IV[2], Lanes{} + IV[3],
+                counterLow, counterHigh, Lanes{} + static_cast<uint32_t>(blockSize), Lanes{} + flags
+            };
+            Rounds(state, message);
+
+            for (int i = 0; i < 8; i++)
+                cv[i] = state[i] ^ state[i + 8];
+        }
+
+        for (size_t lane = 0; lane < lanes; lane++)
+            for (int i = 0; i < 8; i++)
+                cvs[lane][i] = cv[i][lane];
+    }
+
+    /*
+        Combine the chaining values of consecutive chunks into the CV of their subtree
+        @param cvs: one chaining value per chunk
+        @param count: number of chunks, at least 2
+        @param output: chaining value of the subtree
+
+        The left subtree always gets the largest power of two number of chunks that
+        leaves at least one chunk for the right, that's what fixes the shape of the tree
+    */
+    static void MergeChainingValues(const uint32_t (*cvs)[8], size_t count, uint32_t output[8]) {
+        if (count == 1) {
+            std::copy(cvs[0], cvs[0] + 8, output);
+            return;
+        }
+
+        const size_t leftCount = std::bit_floor(count - 1);
+        uint32_t left[8], right[8];
+        MergeChainingValues(cvs, leftCount, left);
+        MergeChainingValues(cvs + leftCount, count - leftCount, right);
+        ParentOutput(left, right).ChainingValue(output);
+    }
+
+    /*
+        Chaining value of a subtree that isn't the root
+        @param data: bytes covered by the subtree
+        @param size: their size, a single chunk is fine too
+        @param counter: index of the subtree's first chunk
+        @param threads: how many threads this subtree may use
+        @param output: chaining value of the subtree
+
+        Small subtrees are hashed chunk by chunk (8 at a time where possible) and merged.
+        Large ones are split in two like the tree itself is, and when threads are available
+        the left half is hashed on a new thread while this one does the right half.
+    */
+    static void SubtreeChainingValue(const Byte* data, size_t size, uint64_t counter,
+        unsigned threads, uint32_t output[8]) {
+
+        const size_t chunks = (size + chunkSize - 1) / chunkSize;
+        if (chunks <= maxBatchChunks) {
+            uint32_t cvs[maxBatchChunks][8];
+            const size_t fullChunks = size / chunkSize;
+
+            size_t chunk = 0;
+            for (; chunk + lanes <= fullChunks; chunk += lanes)
+                HashChunks8(data + chunk * chunkSize, counter + chunk, cvs + chunk);
+            for (; chunk < chunks; chunk++) {
+                const size_t length = std::min(chunkSize, size - chunk * chunkSize);
+                ChunkOutput(data + chunk * chunkSize, length, counter + chunk).ChainingValue(cvs[chunk]);
+            }
+
+            MergeChainingValues(cvs, chunks, output);
+            return;
+        }
+
+        const size_t leftSize = std::bit_floor(chunks - 1) * chunkSize;
+        const uint64_t rightCounter = counter + leftSize / chunkSize;
+        uint32_t left[8], right[8];
+
+        if (threads > 1 && size >= minParallelSize) {
+            const unsigned leftThreads = threads / 2;
+            std::thread leftThread(SubtreeChainingValue, data, leftSize, counter, leftThreads, left);
+            SubtreeChainingValue(data + leftSize, size - leftSize, rightCounter, threads - leftThreads, right);
+            leftThread.join();
+        }
+        else {
+            SubtreeChainingValue(data, leftSize, counter, 1, left);
+            SubtreeChainingValue(data + leftSize, size - leftSize, rightCounter, 1, right);
+        }
+
+        ParentOutput(left, right).ChainingValue(output);
+    }
+
+    /*
+        Hash a buffer
+        @param data: bytes to hash
+        @param size: number of bytes
+        @param output: where to write the 32 byte hash
+        @param threads: at most this many threads are used, large inputs only
+    */
+    void Hash(const Byte* data, size_t size, Byte* output, unsigned threads) {
+
+        // A single chunk is its own root
+        if (size <= chunkSize) {
+            ChunkOutput(data, size, 0).RootBytes(output);
+            return;
+        }
+
+        // Otherwise the root is the parent of the two top level subtrees
+        const size_t chunks = (size + chunkSize - 1) / chunkSize;
+        const size_t leftSize = std::bit_floor(chunks - 1) * chunkSize;
+        const uint64_t rightCounter = leftSize / chunkSize;
+        uint32_t left[8], right[8];
+
+        if (threads > 1 && size >= minParallelSize) {
+            const unsigned leftThreads = threads / 2;
+            std::thread leftThread(SubtreeChainingValue, data, leftSize, 0, leftThreads, left);
+            SubtreeChainingValue(data + leftSize, size - leftSize, rightCounter, threads - leftThreads, right);
+            leftThread.join();
+        }
+        else {
+            SubtreeChainingValue(data, leftSize, 0, 1, left);
+            SubtreeChainingValue(data + leftSize, size - leftSize, rightCounter, 1, right);
+        }
+
+        ParentOutput(left, right).RootBytes(output);
+    }
+};
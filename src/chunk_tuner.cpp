@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <sys/socket.h>
+
+#if defined(__linux__)
+    #include <sys/ioctl.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+#endif
+
+#include "../include/chunk_tuner.hpp"
+
+ChunkTuner::ChunkTuner() {
+    Reset();
+}
+
+// Start over, used for every new connection
+void ChunkTuner::Reset() {
+    chunkSize = initialChunkSize;
+    direction = 1;
+    lastGoodput = 0;
+
+    windowTime = std::chrono::steady_clock::duration::zero();
+    windowBytes = 0;
+
+    metrics = {};
+    metrics.chunkSize = chunkSize;
+}
+
+/*
+    Report a chunk that went out
+    @param socketFD: socket it was sent on, queried for its queue depth and RTT
+    @param bytes: size of the chunk
+    @param sendTime: how long send() took (not counting any time spent rate limited)
+
+    Only the time spent in send() counts towards goodput. The time spent loading and
+    encrypting files in between would otherwise make small files look like a slow link.
+*/
+void ChunkTuner::OnChunkSent(int socketFD, size_t bytes, std::chrono::steady_clock::duration sendTime) {
+
+    metrics.bytesSent += bytes;
+    windowBytes += bytes;
+    windowTime += sendTime;
+    if (windowTime < sampleWindow)
+        return;
+
+    const double goodput = windowBytes / std::chrono::duration<double>(windowTime).count();
+    windowBytes = 0;
+    windowTime = std::chrono::steady_clock::duration::zero();
+
+    Adjust(socketFD, goodput);
+}
+
+/*
+    Pick the chunk size for the next sample window
+    @param socketFD: socket to query
+    @param goodput: bytes per second over the window that just ended
+*/
+void ChunkTuner::Adjust(int socketFD, double goodput) {
+
+    metrics.samples++;
+    metrics.goodputBytesPerSecond = goodput;
+
+#if defined(__linux__)
+    // Bytes in the send buffer that the other end hasn't acknowledged yet
+    int queued = 0;
+    if (ioctl(socketFD, TIOCOUTQ, &queued) == 0)
+        metrics.sendQueueBytes = std::max(queued, 0);
+
+    int sendBufferSize = 0;
+    socklen_t optionLength = sizeof(sendBufferSize);
+    getsockopt(socketFD, SOL_SOCKET, SO_SNDBUF, &sendBufferSize, &optionLength);
+
+    // Smoothed round trip time, as measured by the kernel
+    tcp_info info = {};
+    optionLength = sizeof(info);
+    if (getsockopt(socketFD, IPPROTO_TCP, TCP_INFO, &info, &optionLength) == 0)
+        metrics.rttMicros = info.tcpi_rtt;
+
+    const bool networkBound = sendBufferSize > 0 && metrics.sendQueueBytes > static_cast<uint32_t>(sendBufferSize) * 3 / 4;
+#else
+    (void)socketFD;
+    const bool networkBound = true;
+#endif
+
+    /*
+        Hill climbing
+        - Goodput went up: keep going the same way
+        - Goodput went down: the last step was a mistake, turn around
+        - Roughly the same: we're on a plateau, stay put
+    */
+    size_t nextChunkSize = chunkSize;
+    if (networkBound == false) {
+        bool step = lastGoodput == 0 || goodput > lastGoodput * (1 + tolerance);
+        if (lastGoodput > 0 && goodput < lastGoodput * (1 - tolerance)) {
+            direction = -direction;
+            step = true;
+        }
+
+        if (step)
+            nextChunkSize = direction > 0 ? chunkSize * 2 : chunkSize / 2;
+    }
+    lastGoodput = goodput;
+
+    // On a long fat link, a handful of chunks per round trip should fill the pipe
+    const double bandwidthDelayProduct = goodput * metrics.rttMicros / 1e6;
+    nextChunkSize = std::max(nextChunkSize, static_cast<size_t>(bandwidthDelayProduct / 4));
+
+    nextChunkSize = std::clamp(nextChunkSize, minChunkSize, maxChunkSize);
+    if (nextChunkSize != chunkSize) {
+        chunkSize = nextChunkSize;
+        metrics.adjustments++;
+    }
+    metrics.chunkSize = chunkSize;
+}
@@ -0,0 +1,85 @@
+#include <string>
+
+#if defined(__aarch64__)
+    #include <sys/auxv.h>
+    #include <asm/hwcap.h>
+#endif
+
+#include "../include/cpu_features.hpp"
+
+/*
+    CPU feature detection
+
+    On x86, GCC and Clang provide `__builtin_cpu_supports()`, which runs CPUID once at
+    startup and lets us query individual feature bits by name.
+
+    On 64-bit ARM, the kernel tells us what the CPU supports through the auxiliary vector,
+    which we read with `getauxval(AT_HWCAP)`.
+
+    Anything else is treated as a plain CPU with no acceleration at all.
+*/
+
+namespace Cpu {
+
+    /*
+        Does the actual probing, see DetectFeatures()
+    */
+    static Features Probe() {
+
+        Features features;
+
+    #if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        features.aes = __builtin_cpu_supports("aes");
+        features.carrylessMultiply = __builtin_cpu_supports("pclmul");
+        features.vectorAes = __builtin_cpu_supports("vaes");
+        features.avx2 = __builtin_cpu_supports("avx2");
+        features.avx512 = __builtin_cpu_supports("avx512f");
+    #elif defined(__aarch64__)
+        unsigned long hwcap = getauxval(AT_HWCAP);
+        features.aes = (hwcap & HWCAP_AES) != 0;
+        features.carrylessMultiply = (hwcap & HWCAP_PMULL) != 0;
+        features.neon = (hwcap & HWCAP_ASIMD) != 0;
+    #endif
+
+        return features;
+    }
+
+    /*
+        Probe the CPU we're running on
+        @return the features supported by the current CPU
+    */
+    const Features& DetectFeatures() {
+        // Static local, initialized once in a thread safe manner
+        static const Features features = Probe();
+        return features;
+    }
+
+    /*
+        Format the detected features as a human readable string
+        @param features: features to describe
+        @return something like "aes pclmul vaes avx2"
+    */
+    std::string DescribeFeatures(const Features& features) {
+
+        std::string description;
+        auto append = [&description](bool present, const char* name) {
+            if (present == false)
+                return;
+            if (description.empty() == false)
+                description += ' ';
+            description += name;
+        };
+
+        append(features.aes, "aes");
+        append(features.carrylessMultiply, "pclmul");
+        append(features.vectorAes, "vaes");
+        append(features.avx2, "avx2");
+        append(features.avx512, "avx512");
+        append(features.neon, "neon");
+
+        if (description.empty())
+            description = "none";
+        return description;
+    }
+};
@@ -5,15 +5,22 @@
 #include <vector>
 #include <array>
 #include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <optional>
 
+#include "../include/blake3.hpp"
 #include "../include/crypto.hpp"
+#include "../include/crypto_policies.hpp"
 #include "../include/logger.hpp"
+#include "../include/trace.hpp"
 #include "../include/utils.hpp"
 
 /*
     Big block, ik, but just go through it.
 
     This file performs the main Encryption and Decryption operations using AES-256 in CBC mode
+    (or AES-256-GCM / ChaCha20-Poly1305, whichever cipher suite the two ends agreed upon)
     We're using the library OpenSSL for this purpose.
 
     While it looks complicated, its far simpler to understand than implementing our own version
@@ -25,13 +32,11 @@
     If you want to experiment with using some other cryptographic algorithms, or maybe try
     some other modes of operation, you can do so by changing the encryption and decryption functions.
 
-    Try putting something as simple as a Caesar cipher in there, and see how it works.
-    The only thing you need to keep in mind is that the input and output of the functions should
-    remain the same. The input is a vector of bytes, and the output is also a vector of bytes.
-
-    If you change the function signature (the parameters and return type), you'll have to make
-    changes in the header file and where you call the function accordingly. The rest of the program
-    will remain the same.
+    Every algorithm is a "policy" now, see crypto_policies.hpp. There's a Caesar cipher among
+    them, look at how little it takes, then try adding your own: write a policy, give it a
+    CipherSuite value, add it to WithCipher(), and pick it with --cipher on both ends.
+    EncryptData() and DecryptData() below don't have to change, they only check the sizes
+    and hand the work to whichever policy the suite maps to.
 
     The library provides a lot of cryptographic functions and algorithms. We're using the EVP
     (Envelope) interface here.
@@ -49,141 +54,657 @@
 
 
 namespace Crypto {
+
     /*
-        Encrypts the plaintext using AES-256 in CBC mode
-        @param plaintext: the plaintext to be encrypted
-        @param ciphertext: the encrypted data
-        @return true if encryption is successful, false otherwise
+        Map a cipher suite to the OpenSSL cipher implementing it
+        @param suite: the cipher suite
+        @return the EVP cipher, or nullptr if the suite is unknown
+
+        Note that OpenSSL itself does runtime dispatch on the CPU features as well;
+        EVP_aes_256_gcm() will pick the AES-NI/VAES code paths if they're available.
+        What OpenSSL can't do for us is pick a different *algorithm*, which is what the
+        cipher suite negotiation is about.
     */
-    bool EncryptData(const std::vector<Byte>& plaintext, std::vector<Byte>& ciphertext) {
+    static const EVP_CIPHER* GetCipher(CipherSuite suite) {
+    #if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        /*
+            With OpenSSL 3, EVP_aes_256_gcm() and friends make every init look the cipher up
+            in the provider tables again. Fetching each one once up front skips that, which
+            adds up when a session is thousands of small files.
+            Function local statics are initialized once, in a thread safe manner
+        */
+        static EVP_CIPHER* const aes256Cbc = EVP_CIPHER_fetch(nullptr, "AES-256-CBC", nullptr);
+        static EVP_CIPHER* const aes256Gcm = EVP_CIPHER_fetch(nullptr, "AES-256-GCM", nullptr);
+        static EVP_CIPHER* const chaCha20Poly1305 = EVP_CIPHER_fetch(nullptr, "ChaCha20-Poly1305", nullptr);
+    #else
+        static const EVP_CIPHER* const aes256Cbc = EVP_aes_256_cbc();
+        static const EVP_CIPHER* const aes256Gcm = EVP_aes_256_gcm();
+        static const EVP_CIPHER* const chaCha20Poly1305 = EVP_chacha20_poly1305();
+    #endif
+
+        switch (suite) {
+            case CipherSuite::Aes256Cbc:
+                return aes256Cbc;
+            case CipherSuite::Aes256Gcm:
+                return aes256Gcm;
+            case CipherSuite::ChaCha20Poly1305:
+                return chaCha20Poly1305;
+            default:
+                return nullptr;
+        }
+    }
 
-        const std::array<Byte, 32>& key = preSharedKey;
-        const std::array<Byte, 16>& iv = preSharedIV;
-        
-        // Create a new context
-        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-        if (ctx == nullptr) {
-            Log::Error("EncryptData()", "Error creating cipher context\n");
+    /*
+        Get this thread's cipher context
+        @return the context, or nullptr if it couldn't be created
+
+        Creating and freeing a context for every message costs a couple of allocations
+        each time, so every thread keeps one around and resets it after each use
+        (EVP_CIPHER_CTX_reset() clears the keys out of it, but keeps the memory).
+        A long running receiver (-D) reuses the same contexts for its whole lifetime.
+    */
+    static EVP_CIPHER_CTX* GetCipherContext() {
+        struct ContextHolder {
+            EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+            ~ContextHolder() {
+                EVP_CIPHER_CTX_free(ctx);
+            }
+        };
+        thread_local ContextHolder holder;
+        return holder.ctx;
+    }
+
+    /*
+        Get a printable name for a cipher suite
+        @param suite: the cipher suite
+        @return name of the suite, like "AES-256-GCM"
+    */
+    std::string CipherSuiteName(CipherSuite suite) {
+        switch (suite) {
+            case CipherSuite::Aes256Cbc:
+                return "AES-256-CBC";
+            case CipherSuite::Aes256Gcm:
+                return "AES-256-GCM";
+            case CipherSuite::ChaCha20Poly1305:
+                return "ChaCha20-Poly1305";
+            case CipherSuite::Caesar:
+                return "Caesar";
+            case CipherSuite::Null:
+                return "NULL";
+            default:
+                return "None";
+        }
+    }
+
+    /*
+        Parse the name of a cipher suite, as given on the command line
+        @param name: "aes256gcm", "chacha20poly1305", "aes256cbc", "caesar" or "null"
+        @param suite: the parsed suite
+        @return true if the name is known, false otherwise
+    */
+    bool ParseCipherSuite(const std::string& name, CipherSuite& suite) {
+        if (name == "aes256gcm")
+            suite = CipherSuite::Aes256Gcm;
+        else if (name == "chacha20poly1305")
+            suite = CipherSuite::ChaCha20Poly1305;
+        else if (name == "aes256cbc")
+            suite = CipherSuite::Aes256Cbc;
+        else if (name == "caesar")
+            suite = CipherSuite::Caesar;
+        else if (name == "null")
+            suite = CipherSuite::Null;
+        else
             return false;
+        return true;
+    }
+
+
+    /*
+        How much room the output of EncryptData()/DecryptData() needs, at most
+        @param size: size of the input
+        @param suite: the cipher suite
+        @return size of the output buffer to provide, 0 for an unknown suite (or a
+                ciphertext too short to hold a nonce and a tag)
+
+        Encrypting adds the nonce and tag (AEAD) or up to a block of padding (CBC).
+        Decrypting never produces more than the encrypted body, CBC's padding is only
+        taken off at the very end. See the policies in crypto_policies.hpp
+    */
+    size_t MaxEncryptedSize(size_t size, CipherSuite suite) {
+        return Policy::WithCipher(suite, [size]<typename Cipher>(Cipher) {
+            return Policy::MaxEncryptedSize<Cipher>(size);
+        }).value_or(0);
+    }
+
+    size_t MaxDecryptedSize(size_t size, CipherSuite suite) {
+        return Policy::WithCipher(suite, [size]<typename Cipher>(Cipher) {
+            return Policy::MaxDecryptedSize<Cipher>(size);
+        }).value_or(0);
+    }
+
+
+    /*
+        Encrypt with one of OpenSSL's ciphers, the work behind the EVP cipher policies
+        @param plaintext: the plaintext to be encrypted
+        @param ciphertext: where the encrypted data goes, at least MaxEncryptedSize() bytes
+        @param keys: the key and IV to use
+        @return how many bytes of `ciphertext` were written, -1 on error
+
+        For the AEAD suites, the output is laid out as
+            [12 byte nonce][encrypted data][16 byte tag]
+        so that the receiver has everything it needs in the one buffer.
+        Whether there's a nonce and a tag is known at compile time, for each Cipher
+    */
+    template <typename Cipher>
+    static ssize_t EvpEncrypt(std::span<const Byte> plaintext, std::span<Byte> ciphertext, const SessionKeys& keys) {
+
+        constexpr bool aead = Policy::isAuthenticated<Cipher>;
+        const std::array<Byte, 32>& key = keys.key;
+        const std::array<Byte, 16>& iv = keys.iv;
+
+        const EVP_CIPHER* cipher = GetCipher(Cipher::suite);
+        if (cipher == nullptr) {
+            Log::Error("EncryptData()", "Cipher not available\n");
+            return -1;
         }
-        
+
         /*
-            Initialize the encryption operation with a cipher type, key, and IV
-            Here, we're using AES-256 in CBC mode
-            NULL is passed for the cipher type to use the default
+            CBC uses the session IV, same as it always has.
+
+            GCM and ChaCha20-Poly1305 break completely if a (key, nonce) pair is ever reused,
+            so every message gets a fresh random nonce instead, which is sent along with it.
+            It goes straight into the front of the output
         */
-        int initStatus = EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key.data(), iv.data());
+        if constexpr (aead) {
+            if (RAND_bytes(ciphertext.data(), Cipher::nonceSize) != 1) {
+                Log::Error("EncryptData()", "Error generating nonce\n");
+                return -1;
+            }
+        }
+
+        // Take this thread's context, see GetCipherContext()
+        EVP_CIPHER_CTX* ctx = GetCipherContext();
+        if (ctx == nullptr) {
+            Log::Error("EncryptData()", "Error creating cipher context\n");
+            return -1;
+        }
+
+        // Initialize the encryption operation with a cipher type, key, and IV (or nonce)
+        const Byte* ivOrNonce = aead ? ciphertext.data() : iv.data();
+        int initStatus = EVP_EncryptInit_ex(ctx, cipher, NULL, key.data(), ivOrNonce);
         if (initStatus != 1) {
             Log::Error("EncryptData()", "Error initializing encryption operation\n");
-            EVP_CIPHER_CTX_free(ctx);
-            return false;
+            EVP_CIPHER_CTX_reset(ctx);
+            return -1;
         }
-        
-        // Resize the ciphertext vector to accommodate the encrypted data
-        ciphertext.resize(plaintext.size() + EVP_CIPHER_block_size(EVP_aes_256_cbc()));
-        
+
         /*
             Encrypts the plaintext data
-            The ciphertext is written to the ciphertext vector
+            The ciphertext is written to the output, right after the nonce
             The length of the ciphertext is returned in len
         */
         int len;
-        int encryptionStatus = EVP_EncryptUpdate(ctx, ciphertext.data(), &len, plaintext.data(), plaintext.size());
+        int encryptionStatus = EVP_EncryptUpdate(ctx, ciphertext.data() + Cipher::nonceSize, &len, plaintext.data(), plaintext.size());
         if (encryptionStatus != 1) {
             Log::Error("EncryptData()", "Error encrypting data\n");
-            EVP_CIPHER_CTX_free(ctx);
-            return false;
+            EVP_CIPHER_CTX_reset(ctx);
+            return -1;
         }
-        
+
         // Encrypts the "final" data; any data that remains in a partial block. It also writes out the padding.
         int ciphertextLen = len;
-        int finalEncryptionStatus = EVP_EncryptFinal_ex(ctx, ciphertext.data() + len, &len);
+        int finalEncryptionStatus = EVP_EncryptFinal_ex(ctx, ciphertext.data() + Cipher::nonceSize + len, &len);
         if (finalEncryptionStatus != 1) {
             Log::Error("EncryptData()", "Error encrypting final data\n");
-            EVP_CIPHER_CTX_free(ctx);
-            return false;
+            EVP_CIPHER_CTX_reset(ctx);
+            return -1;
         }
-        
         ciphertextLen += len;
-        ciphertext.resize(ciphertextLen);
-        
-        // Free the context
-        EVP_CIPHER_CTX_free(ctx);
-        return true;
+
+        // Append the authentication tag, the receiver uses it to detect tampering
+        if constexpr (aead) {
+            Byte* tag = ciphertext.data() + Cipher::nonceSize + ciphertextLen;
+            if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, Cipher::tagSize, tag) != 1) {
+                Log::Error("EncryptData()", "Error retrieving authentication tag\n");
+                EVP_CIPHER_CTX_reset(ctx);
+                return -1;
+            }
+        }
+
+        // Reset the context for the next message
+        EVP_CIPHER_CTX_reset(ctx);
+        return Policy::overhead<Cipher> + ciphertextLen;
     }
-    
-    
+
+
+    // Most ciphertext EvpDecrypt() hands to EVP_DecryptUpdate() at once, which takes an int
+    static constexpr size_t maxUpdateSize = 1024 * 1024 * 1024;
+
     /*
-        Decrypts the ciphertext using AES-256 in CBC mode
-        @param ciphertext: the ciphertext to be decrypted
-        @param plaintext: the decrypted data
-        @return true if decryption is successful, false otherwise
+        Decrypt with one of OpenSSL's ciphers, the work behind the EVP cipher policies
+        @param ciphertext: the ciphertext to be decrypted, at least a nonce and a tag long
+        @param plaintext: where the decrypted data goes, at least MaxDecryptedSize() bytes
+        @param keys: the key and IV to use
+        @param window: ciphertext to hand to EVP_DecryptUpdate() at a time
+        @param onWindow: if given, told about the plaintext after every EVP_DecryptUpdate(), and EVP_DecryptFinal_ex()
+        @return how many bytes of `plaintext` were written, -1 on error
+
+        EVP_DecryptUpdate() takes an int, so even without `onWindow` the ciphertext goes
+        in pieces, or a file over 2 GB would be cut short
     */
-    bool DecryptData(const std::vector<Byte>& ciphertext, std::vector<Byte>& plaintext) {
+    template <typename Cipher>
+    static ssize_t EvpDecrypt(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys,
+        size_t window = maxUpdateSize, const DecryptedWindow* onWindow = nullptr) {
+
+        constexpr bool aead = Policy::isAuthenticated<Cipher>;
+        const std::array<Byte, 32>& key = keys.key;
+        const std::array<Byte, 16>& iv = keys.iv;
+
+        const EVP_CIPHER* cipher = GetCipher(Cipher::suite);
+        if (cipher == nullptr) {
+            Log::Error("DecryptData()", "Cipher not available\n");
+            return -1;
+        }
+
+        // Split off the nonce and tag for the AEAD suites, see EvpEncrypt()
+        const Byte* body = ciphertext.data() + Cipher::nonceSize;
+        const size_t bodySize = ciphertext.size() - Policy::overhead<Cipher>;
 
-        const std::array<Byte, 32>& key = preSharedKey;
-        const std::array<Byte, 16>& iv = preSharedIV;
-        
-        // Create a new context
-        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+        // Take this thread's context, see GetCipherContext()
+        EVP_CIPHER_CTX* ctx = GetCipherContext();
         if (ctx == nullptr) {
             Log::Error("DecryptData()", "Error creating cipher context\n");
-            return false;
+            return -1;
         }
-        
-        // Initialize the decryption operation with a cipher type, key, and IV
-        int initStatus = EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key.data(), iv.data());
+
+        // Initialize the decryption operation with a cipher type, key, and IV (or nonce)
+        const Byte* ivOrNonce = aead ? ciphertext.data() : iv.data();
+        int initStatus = EVP_DecryptInit_ex(ctx, cipher, NULL, key.data(), ivOrNonce);
         if (initStatus != 1) {
             Log::Error("DecryptData()", "Error initializing decryption operation\n");
-            EVP_CIPHER_CTX_free(ctx);
-            return false;
+            EVP_CIPHER_CTX_reset(ctx);
+            return -1;
         }
-        
-        // Resize the plaintext vector to accommodate the decrypted data
-        plaintext.resize(ciphertext.size());
-
-        // Log the sizes of the ciphertext and plaintext
-        // Log::Info("DecryptData()", "Ciphertext size: " + std::to_string(ciphertext.size()));
-        // Log::Info("DecryptData()", "Plaintext size:  " + std::to_string(plaintext.size()));
-        
+
         /*
-            Decrypts the ciphertext data
-            The plaintext is written to the plaintext vector
-            The length of the plaintext is returned in len
+            Decrypts the ciphertext data, a window at a time
+            The plaintext is written to the output, right after what the previous window wrote
+            The length of the plaintext is returned in len. With CBC it runs up to a block
+            behind the ciphertext, the last block is held back until the end (it has the padding)
         */
         int len;
-        int decryptionStatus = EVP_DecryptUpdate(ctx, plaintext.data(), &len, ciphertext.data(), ciphertext.size());
-        if (decryptionStatus != 1) {
-            Log::Error("DecryptData()", "Error decrypting data\n");
-            EVP_CIPHER_CTX_free(ctx);
-            return false;
+        size_t plaintextLen = 0;
+        for (size_t consumed = 0; consumed < bodySize;) {
+            const size_t piece = std::min({window, bodySize - consumed, maxUpdateSize});
+            int decryptionStatus = EVP_DecryptUpdate(ctx, plaintext.data() + plaintextLen, &len, body + consumed, piece);
+            if (decryptionStatus != 1) {
+                Log::Error("DecryptData()", "Error decrypting data\n");
+                EVP_CIPHER_CTX_reset(ctx);
+                return -1;
+            }
+            if (onWindow != nullptr && len > 0)
+                (*onWindow)(plaintextLen, len);
+            plaintextLen += len;
+            consumed += piece;
+        }
+
+        // Hand the expected tag to OpenSSL, EVP_DecryptFinal_ex() will check it for us
+        if constexpr (aead) {
+            Byte* tag = const_cast<Byte*>(body + bodySize);
+            if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, Cipher::tagSize, tag) != 1) {
+                Log::Error("DecryptData()", "Error setting authentication tag\n");
+                EVP_CIPHER_CTX_reset(ctx);
+                return -1;
+            }
         }
 
-        
         // Decrypts the "final" data; any data that remains in a partial block. It also writes out the padding.
-        int plaintextLen = len;
-        int finalDecryptionStatus = EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &len);
+        // For the AEAD suites this is also where a tampered message gets rejected
+        int finalDecryptionStatus = EVP_DecryptFinal_ex(ctx, plaintext.data() + plaintextLen, &len);
         if (finalDecryptionStatus != 1) {
-            Log::Error("DecryptData()", "Error decrypting final data\n");
-            EVP_CIPHER_CTX_free(ctx);
-            return false;
+            Log::Error("DecryptData()", aead ? "Authentication failed, data was tampered with\n" : "Error decrypting final data\n");
+            EVP_CIPHER_CTX_reset(ctx);
+            return -1;
         }
-        
+        if (onWindow != nullptr && len > 0)
+            (*onWindow)(plaintextLen, len);
+
         plaintextLen += len;
-        plaintext.resize(plaintextLen);
-        
-        // Free the context
-        EVP_CIPHER_CTX_free(ctx);
+
+        // Reset the context for the next message
+        EVP_CIPHER_CTX_reset(ctx);
+        return plaintextLen;
+    }
+
+    // The policies backed by OpenSSL, one instantiation of EvpEncrypt()/EvpDecrypt() each
+    ssize_t Policy::Aes256CbcCipher::Encrypt(std::span<const Byte> plaintext, std::span<Byte> ciphertext, const SessionKeys& keys) {
+        return EvpEncrypt<Aes256CbcCipher>(plaintext, ciphertext, keys);
+    }
+    ssize_t Policy::Aes256CbcCipher::Decrypt(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys) {
+        return EvpDecrypt<Aes256CbcCipher>(ciphertext, plaintext, keys);
+    }
+    ssize_t Policy::Aes256CbcCipher::DecryptInWindows(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys,
+        size_t window, const DecryptedWindow& onWindow) {
+        return EvpDecrypt<Aes256CbcCipher>(ciphertext, plaintext, keys, window, &onWindow);
+    }
+    ssize_t Policy::Aes256GcmCipher::Encrypt(std::span<const Byte> plaintext, std::span<Byte> ciphertext, const SessionKeys& keys) {
+        return EvpEncrypt<Aes256GcmCipher>(plaintext, ciphertext, keys);
+    }
+    ssize_t Policy::Aes256GcmCipher::Decrypt(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys) {
+        return EvpDecrypt<Aes256GcmCipher>(ciphertext, plaintext, keys);
+    }
+    ssize_t Policy::Aes256GcmCipher::DecryptInWindows(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys,
+        size_t window, const DecryptedWindow& onWindow) {
+        return EvpDecrypt<Aes256GcmCipher>(ciphertext, plaintext, keys, window, &onWindow);
+    }
+    ssize_t Policy::ChaCha20Poly1305Cipher::Encrypt(std::span<const Byte> plaintext, std::span<Byte> ciphertext, const SessionKeys& keys) {
+        return EvpEncrypt<ChaCha20Poly1305Cipher>(plaintext, ciphertext, keys);
+    }
+    ssize_t Policy::ChaCha20Poly1305Cipher::Decrypt(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys) {
+        return EvpDecrypt<ChaCha20Poly1305Cipher>(ciphertext, plaintext, keys);
+    }
+    ssize_t Policy::ChaCha20Poly1305Cipher::DecryptInWindows(std::span<const Byte> ciphertext, std::span<Byte> plaintext, const SessionKeys& keys,
+        size_t window, const DecryptedWindow& onWindow) {
+        return EvpDecrypt<ChaCha20Poly1305Cipher>(ciphertext, plaintext, keys, window, &onWindow);
+    }
+
+
+    /*
+        Encrypts the plaintext using the given cipher suite
+        @param plaintext: the plaintext to be encrypted
+        @param ciphertext: where the encrypted data goes, at least MaxEncryptedSize() bytes
+        @param suite: the cipher suite to use
+        @param keys: the key and IV to use
+        @return how many bytes of `ciphertext` were written, -1 on error
+
+        The suite picks a policy once, the rest is that policy's own code
+    */
+    static ssize_t Encrypt(std::span<const Byte> plaintext, std::span<Byte> ciphertext, CipherSuite suite, const SessionKeys& keys) {
+
+        const std::optional<ssize_t> written = Policy::WithCipher(suite, [&]<typename Cipher>(Cipher) -> ssize_t {
+            // There has to be room for the nonce, encrypted data, padding and tag
+            if (ciphertext.size() < Policy::MaxEncryptedSize<Cipher>(plaintext.size())) {
+                Log::Error("EncryptData()", "Output buffer too small\n");
+                return -1;
+            }
+            return Cipher::Encrypt(plaintext, ciphertext, keys);
+        });
+
+        if (written.has_value() == false) {
+            Log::Error("EncryptData()", "Unknown cipher suite\n");
+            return -1;
+        }
+        return *written;
+    }
+
+
+    // Encrypt(), between the encrypt_begin and encrypt_end probes
+    ssize_t EncryptData(std::span<const Byte> plaintext, std::span<Byte> ciphertext, CipherSuite suite, const SessionKeys& keys) {
+        SSFTP_TRACE(encrypt_begin, Trace::CurrentFile(), plaintext.size());
+        const ssize_t written = Encrypt(plaintext, ciphertext, suite, keys);
+        SSFTP_TRACE(encrypt_end, Trace::CurrentFile(), plaintext.size(), written >= 0);
+        return written;
+    }
+
+    // Into a vector, sized to fit
+    bool EncryptData(const std::vector<Byte>& plaintext, std::vector<Byte>& ciphertext, CipherSuite suite, const SessionKeys& keys) {
+        ciphertext.resize(MaxEncryptedSize(plaintext.size(), suite));
+        const ssize_t written = EncryptData(std::span<const Byte>(plaintext), std::span<Byte>(ciphertext), suite, keys);
+        if (written < 0)
+            return false;
+        ciphertext.resize(written);
+        return true;
+    }
+
+
+    /*
+        Decrypts the ciphertext using the given cipher suite
+        @param ciphertext: the ciphertext to be decrypted
+        @param plaintext: where the decrypted data goes, at least MaxDecryptedSize() bytes
+        @param suite: the cipher suite to use
+        @param keys: the key and IV to use
+        @param window, onWindow: if given, decrypt a window at a time, see the windowed DecryptData()
+        @return how many bytes of `plaintext` were written, -1 on error
+    */
+    static ssize_t Decrypt(std::span<const Byte> ciphertext, std::span<Byte> plaintext, CipherSuite suite, const SessionKeys& keys,
+        size_t window = 0, const DecryptedWindow* onWindow = nullptr) {
+
+        const std::optional<ssize_t> written = Policy::WithCipher(suite, [&]<typename Cipher>(Cipher) -> ssize_t {
+            if (ciphertext.size() < Policy::overhead<Cipher>) {
+                Log::Error("DecryptData()", "Ciphertext is too short\n");
+                return -1;
+            }
+            if (plaintext.size() < Policy::MaxDecryptedSize<Cipher>(ciphertext.size())) {
+                Log::Error("DecryptData()", "Output buffer too small\n");
+                return -1;
+            }
+            if (onWindow != nullptr)
+                return Cipher::DecryptInWindows(ciphertext, plaintext, keys, window, *onWindow);
+            return Cipher::Decrypt(ciphertext, plaintext, keys);
+        });
+
+        if (written.has_value() == false) {
+            Log::Error("DecryptData()", "Unknown cipher suite\n");
+            return -1;
+        }
+        return *written;
+    }
+
+
+    // Decrypt(), between the decrypt_begin and decrypt_end probes
+    ssize_t DecryptData(std::span<const Byte> ciphertext, std::span<Byte> plaintext, CipherSuite suite, const SessionKeys& keys) {
+        SSFTP_TRACE(decrypt_begin, Trace::CurrentFile(), ciphertext.size());
+        const ssize_t written = Decrypt(ciphertext, plaintext, suite, keys);
+        SSFTP_TRACE(decrypt_end, Trace::CurrentFile(), ciphertext.size(), written >= 0);
+        return written;
+    }
+
+    // A window at a time, between the same probes
+    ssize_t DecryptData(std::span<const Byte> ciphertext, std::span<Byte> plaintext, CipherSuite suite,
+        const SessionKeys& keys, size_t window, const DecryptedWindow& onWindow) {
+        SSFTP_TRACE(decrypt_begin, Trace::CurrentFile(), ciphertext.size());
+        const ssize_t written = Decrypt(ciphertext, plaintext, suite, keys, std::max<size_t>(window, 1), &onWindow);
+        SSFTP_TRACE(decrypt_end, Trace::CurrentFile(), ciphertext.size(), written >= 0);
+        return written;
+    }
+
+    // Into a vector, sized to fit
+    bool DecryptData(const std::vector<Byte>& ciphertext, std::vector<Byte>& plaintext, CipherSuite suite, const SessionKeys& keys) {
+        plaintext.resize(MaxDecryptedSize(ciphertext.size(), suite));
+        const ssize_t written = DecryptData(std::span<const Byte>(ciphertext), std::span<Byte>(plaintext), suite, keys);
+        if (written < 0)
+            return false;
+        plaintext.resize(written);
         return true;
     }
 
+
+    /*
+        Estimate how fast a suite runs on a CPU, in roughly MB/s per core
+
+        These are ballpark figures for OpenSSL 3 on a modern core, they don't have to be
+        accurate, they just have to put the suites in the right order.
+        - CBC encryption can't be parallelized (every block depends on the previous one),
+          so even with AES-NI it stays well behind GCM
+        - Without AES-NI, AES falls back to constant time table-free code which is slow,
+          while ChaCha20 only needs ordinary SIMD additions, rotations and XORs
+    */
+    static uint32_t EstimateSuiteScore(CipherSuite suite, const Cpu::Features& features) {
+        switch (suite) {
+            case CipherSuite::Aes256Cbc:
+                return features.aes ? 1000 : 100;
+
+            case CipherSuite::Aes256Gcm:
+                if (features.aes && features.carrylessMultiply && features.vectorAes)
+                    return 8000;
+                if (features.aes && features.carrylessMultiply)
+                    return 4000;
+                return 80;
+
+            case CipherSuite::ChaCha20Poly1305:
+                if (features.avx512)
+                    return 2500;
+                if (features.avx2 || features.neon)
+                    return 1800;
+                return 500;
+
+            // Not real ciphers, only ever used when asked for, see crypto_policies.hpp
+            case CipherSuite::Caesar:
+                return 3000;
+            case CipherSuite::Null:
+                return 20000;
+
+            default:
+                return 0;
+        }
+    }
+
+    /*
+        Measure how fast a suite encrypts on this machine
+        @param suite: the cipher suite to measure
+        @return throughput in MB/s
+
+        Encrypts a 1 MiB buffer over and over for ~20 ms, which is long enough to get past
+        the CPU's frequency ramp-up but short enough not to delay startup noticeably
+    */
+    static uint32_t BenchmarkCipherSuite(CipherSuite suite) {
+
+        const std::vector<Byte> plaintext(1 << 20, 0x5a);
+        std::vector<Byte> ciphertext;
+
+        const auto start = std::chrono::steady_clock::now();
+        const auto deadline = start + std::chrono::milliseconds(20);
+        size_t bytesEncrypted = 0;
+
+        while (std::chrono::steady_clock::now() < deadline) {
+            if (EncryptData(plaintext, ciphertext, suite) == false)
+                return 0;
+            bytesEncrypted += plaintext.size();
+        }
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return static_cast<uint32_t>(bytesEncrypted / seconds / 1e6);
+    }
+
     /*
-        Calculates the SHA-256 hash of the given data
+        Rank the cipher suites we support for the given CPU, fastest first
+        @param features: features of the CPU we're running on
+        @param benchmark: measure every suite instead of estimating from the CPU features
+        @param only: rank just these suites (--cipher), empty for every real one
+        @return every supported suite along with its score, sorted by score
+
+        Caesar and NULL protect nothing, so they're never offered unless named in `only`
+    */
+    std::vector<SuiteScore> RankCipherSuites(const Cpu::Features& features, bool benchmark, const std::vector<CipherSuite>& only) {
+
+        const std::vector<CipherSuite> allSuites = only.empty() == false ? only : std::vector<CipherSuite>{
+            CipherSuite::Aes256Gcm,
+            CipherSuite::ChaCha20Poly1305,
+            CipherSuite::Aes256Cbc
+        };
+
+        std::vector<SuiteScore> ranking;
+        for (CipherSuite suite : allSuites) {
+            uint32_t score = benchmark ? BenchmarkCipherSuite(suite) : EstimateSuiteScore(suite, features);
+            ranking.push_back({suite, score});
+        }
+
+        // stable_sort, so that suites with equal scores keep the order of `allSuites`
+        std::stable_sort(ranking.begin(), ranking.end(), [](const SuiteScore& a, const SuiteScore& b) {
+            return a.score > b.score;
+        });
+
+        return ranking;
+    }
+
+    /*
+        Pick the suite that runs fastest on both ends
+        @param local: our own ranking, see RankCipherSuites()
+        @param remote: the ranking the other end advertised
+        @return the chosen suite, or CipherSuite::None if there's nothing in common
+
+        A transfer is only as fast as the slower of the two ends, so each common suite is
+        judged by the lower of its two scores. If two suites end up with the same score,
+        the one that comes first in our own ranking wins.
+    */
+    CipherSuite ChooseCipherSuite(const std::vector<SuiteScore>& local, const std::vector<SuiteScore>& remote) {
+
+        CipherSuite bestSuite = CipherSuite::None;
+        uint32_t bestScore = 0;
+
+        for (const SuiteScore& mine : local) {
+            for (const SuiteScore& theirs : remote) {
+                if (mine.suite != theirs.suite)
+                    continue;
+
+                uint32_t score = std::min(mine.score, theirs.score);
+                if (bestSuite == CipherSuite::None || score > bestScore) {
+                    bestSuite = mine.suite;
+                    bestScore = score;
+                }
+            }
+        }
+
+        return bestSuite;
+    }
+
+    /*
+        Get a printable name for a hash algorithm
+        @param algorithm: the hash algorithm
+        @return name of the algorithm, like "SHA-256"
+    */
+    std::string HashAlgorithmName(HashAlgorithm algorithm) {
+        switch (algorithm) {
+            case HashAlgorithm::Sha256:
+                return "SHA-256";
+            case HashAlgorithm::Blake3:
+                return "BLAKE3";
+            default:
+                return "None";
+        }
+    }
+
+    /*
+        Parse the name of a hash algorithm, as given on the command line
+        @param name: "sha256" or "blake3"
+        @param algorithm: the parsed algorithm
+        @return true if the name is known, false otherwise
+    */
+    bool ParseHashAlgorithm(const std::string& name, HashAlgorithm& algorithm) {
+        if (name == "sha256")
+            algorithm = HashAlgorithm::Sha256;
+        else if (name == "blake3")
+            algorithm = HashAlgorithm::Blake3;
+        else
+            return false;
+        return true;
+    }
+
+    /*
+        Pick the hash algorithm to use
+        @param local: the algorithms we support, most preferred first
+        @param remote: the algorithms the other end advertised
+        @return our most preferred algorithm that the other end supports too
+
+        Unlike the cipher suites there are no scores to compare here, BLAKE3 is faster than
+        SHA-256 nearly everywhere, so the receiver's order of preference simply decides
+    */
+    HashAlgorithm ChooseHashAlgorithm(const std::vector<HashAlgorithm>& local, const std::vector<HashAlgorithm>& remote) {
+        for (HashAlgorithm mine : local) {
+            if (std::find(remote.begin(), remote.end(), mine) != remote.end())
+                return mine;
+        }
+        return HashAlgorithm::None;
+    }
+
+    /*
+        SHA-256 through OpenSSL, the work behind the Sha256Hash policy
         @param data: data to be hashed
         @param hash: hash of the data
         @return If operation was successful or not
     */
-    bool CalculateHash(const std::vector<Byte>& data, std::vector<Byte>& hash) {
+    bool Policy::Sha256Hash::Hash(std::span<const Byte> data, Digest& hash, unsigned) {
+
         // Create a context for the hash operation
         EVP_MD_CTX* ctx = EVP_MD_CTX_new();
         if (ctx == nullptr) {
@@ -222,41 +743,52 @@ namespace Crypto {
         return true;
     }
 
-
     /*
-        Below are functions implemention one of the most basic encryption algorithms, the Caesar cipher.
-        The Caesar cipher is a substitution cipher where each letter in the plaintext is shifted by a
-        fixed number of positions in the alphabet. In this case, we're using a shift of 3.
-        This is just an example to show how you can implement your own encryption and decryption functions.
-        You can replace these functions with any other encryption algorithm you want.
-        The EncryptData and DecryptData functions are the same as the ones above, but they use the Caesar cipher
-        instead of AES-256.
-
-        Note that this is not a secure encryption method and should not be used for any real-world applications.
+        Calculates the hash of the given data
+        @param data: data to be hashed
+        @param hash: hash of the data
+        @param algorithm: the hash algorithm to use
+        @param threads: threads to use, BLAKE3 only
+        @return If operation was successful or not
+
+        BLAKE3 is our own code (see blake3.cpp), SHA-256 comes from OpenSSL
     */
-    /*
-    bool EncryptData(const std::vector<Byte>& plaintext, std::vector<Byte>& ciphertext) {
+    static bool Hash(std::span<const Byte> data, Digest& hash, HashAlgorithm algorithm, unsigned threads) {
+
+        const std::optional<bool> hashed = Policy::WithHash(algorithm, [&]<typename Hasher>(Hasher) {
+            return Hasher::Hash(data, hash, threads);
+        });
 
-        const int shift = 3; // Shift value for Caesar cipher
-        ciphertext.resize(plaintext.size());
-        for (size_t i = 0; i < plaintext.size(); ++i) {
-            ciphertext[i] = plaintext[i] + shift;
+        if (hashed.has_value() == false) {
+            Log::Error("CalculateHash()", "Unknown hash algorithm");
+            return false;
         }
+        return *hashed;
+    }
 
-        return true;
+
+    // Hash(), between the hash_begin and hash_end probes
+    bool CalculateHash(std::span<const Byte> data, Digest& hash, HashAlgorithm algorithm, unsigned threads) {
+        SSFTP_TRACE(hash_begin, Trace::CurrentFile(), data.size(), static_cast<int>(algorithm));
+        const bool ok = Hash(data, hash, algorithm, threads);
+        SSFTP_TRACE(hash_end, Trace::CurrentFile(), data.size(), ok);
+        return ok;
     }
-    
-    bool DecryptData(const std::vector<Byte>& ciphertext, std::vector<Byte>& plaintext) {
 
-        const int shift = 3; // Shift value for Caesar cipher
-        plaintext.resize(ciphertext.size());
-        for (size_t i = 0; i < ciphertext.size(); ++i) {
-            plaintext[i] = ciphertext[i] - shift;
+    // Into a vector, which must already hold `hashSize` bytes
+    bool CalculateHash(const std::vector<Byte>& data, std::vector<Byte>& hash, HashAlgorithm algorithm, unsigned threads) {
+        if (hash.size() < hashSize) {
+            Log::Error("CalculateHash()", "Hash buffer too small");
+            return false;
         }
 
+        Digest digest;
+        if (CalculateHash(std::span<const Byte>(data), digest, algorithm, threads) == false)
+            return false;
+        std::copy(digest.begin(), digest.end(), hash.begin());
         return true;
     }
-    */
+
 
     /*
         Basic hash function that calculates a simple hash of the data
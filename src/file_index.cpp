@@ -0,0 +1,279 @@
+#include <fstream>
+#include <format>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+#include "../include/file_index.hpp"
+#include "../include/blake3.hpp"
+#include "../include/logger.hpp"
+
+namespace FileIndex {
+
+    // First bytes of an index file and of a receiver's sync state
+    constexpr char indexMagic[8] = {'S', 'S', 'F', 'T', 'P', 'I', 'D', 'X'};
+    constexpr char syncMagic[8] = {'S', 'S', 'F', 'T', 'P', 'S', 'Y', 'N'};
+
+    /*
+        Append a value to a buffer, as its raw bytes
+        @param buffer: where to append
+        @param value: what to append
+    */
+    template <typename T>
+    static void Append(std::vector<Byte>& buffer, const T& value) {
+        const Byte* bytes = reinterpret_cast<const Byte*>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+    }
+
+    /*
+        Take a value off the front of a buffer, see Append()
+        @param buffer: where to read from
+        @param offset: where the value starts, moved past it
+        @param value: the value
+        @return true if the buffer held enough bytes, false otherwise
+    */
+    template <typename T>
+    static bool Take(const std::vector<Byte>& buffer, size_t& offset, T& value) {
+        if (buffer.size() - offset < sizeof(value))
+            return false;
+        std::memcpy(&value, buffer.data() + offset, sizeof(value));
+        offset += sizeof(value);
+        return true;
+    }
+
+    /*
+        Make a record for an entry found by Tree::ParallelScan()
+        @param entry: the entry
+        @param hash: hash of its contents, zero for directories (or if not known yet)
+        @return the record
+    */
+    Record MakeRecord(const Tree::Entry& entry, const std::array<Byte, 32>& hash) {
+        return {entry.relativePath, entry.kind, entry.mode, entry.size, entry.modifiedNanos, entry.inode, hash};
+    }
+
+    /*
+        Check whether an entry looks the same as when it was recorded
+        @param record: what the index says
+        @param entry: what the scan found
+        @return true if it's unchanged, false if it has to be sent again
+
+        A directory's modification time changes whenever something inside it does, which
+        says nothing about the directory entry itself, so only its permissions count.
+        A file that's replaced by another one (a new inode) counts as changed even if its
+        size and time happen to match, which is what editors and `cp` over a file do.
+    */
+    bool Unchanged(const Record& record, const Tree::Entry& entry) {
+
+        if (record.kind != entry.kind || record.mode != entry.mode)
+            return false;
+        if (entry.kind == Tree::EntryKind::Directory)
+            return true;
+
+        return record.size == entry.size && record.modifiedNanos == entry.modifiedNanos && record.inode == entry.inode;
+    }
+
+    /*
+        Load an index saved by Save()
+        @param path: file to load, a missing file is an empty index
+        @return true if loaded (or missing), false if the file is damaged
+
+        Layout: [8 byte magic][u64 count] then count x
+            [u16 path length][path][u8 kind][u32 mode][u64 size][i64 modified][u64 inode][32 byte hash]
+    */
+    bool Index::Load(const std::string& path) {
+
+        records.clear();
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (file.fail())
+            return true;
+
+        std::vector<Byte> data(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(data.data()), data.size());
+
+        size_t offset = sizeof(indexMagic);
+        uint64_t count = 0;
+        if (file.fail() || data.size() < sizeof(indexMagic) || std::memcmp(data.data(), indexMagic, sizeof(indexMagic)) != 0 ||
+            Take(data, offset, count) == false) {
+            Log::Error("Index::Load()", std::format("'{}' is not an index file", path));
+            return false;
+        }
+
+        // Every record takes at least this many bytes, so a damaged count can't make us reserve terabytes
+        constexpr size_t minimumRecordSize = sizeof(uint16_t) + 1 + sizeof(uint32_t) + 3 * sizeof(uint64_t) + 32;
+        records.reserve(static_cast<size_t>(std::min<uint64_t>(count, data.size() / minimumRecordSize)));
+
+        for (uint64_t i = 0; i < count; i++) {
+            Record record = {};
+            uint16_t pathLength = 0;
+            uint8_t kind = 0;
+            if (Take(data, offset, pathLength) == false || data.size() - offset < pathLength) {
+                records.clear();
+                Log::Error("Index::Load()", std::format("'{}' is damaged", path));
+                return false;
+            }
+            record.relativePath.assign(reinterpret_cast<const char*>(data.data() + offset), pathLength);
+            offset += pathLength;
+
+            bool parsed =
+                Take(data, offset, kind) &&
+                Take(data, offset, record.mode) &&
+                Take(data, offset, record.size) &&
+                Take(data, offset, record.modifiedNanos) &&
+                Take(data, offset, record.inode) &&
+                Take(data, offset, record.hash);
+            if (parsed == false) {
+                records.clear();
+                Log::Error("Index::Load()", std::format("'{}' is damaged", path));
+                return false;
+            }
+            record.kind = static_cast<Tree::EntryKind>(kind);
+            records.push_back(std::move(record));
+        }
+
+        // Saved sorted, but don't let a file edited by hand break the lookups
+        const auto byPath = [](const Record& a, const Record& b) { return a.relativePath < b.relativePath; };
+        if (std::is_sorted(records.begin(), records.end(), byPath) == false)
+            std::sort(records.begin(), records.end(), byPath);
+        return true;
+    }
+
+    /*
+        Save the index, replacing the old file in one step (written next to it, then renamed)
+        @param path: file to save to
+        @return true if successful, false otherwise
+
+        An interrupted save leaves the old index in place, never half of a new one
+    */
+    bool Index::Save(const std::string& path) const {
+
+        std::vector<Byte> data(indexMagic, indexMagic + sizeof(indexMagic));
+        Append(data, static_cast<uint64_t>(records.size()));
+        for (const Record& record : records) {
+            Append(data, static_cast<uint16_t>(record.relativePath.size()));
+            data.insert(data.end(), record.relativePath.begin(), record.relativePath.end());
+            Append(data, static_cast<uint8_t>(record.kind));
+            Append(data, record.mode);
+            Append(data, record.size);
+            Append(data, record.modifiedNanos);
+            Append(data, record.inode);
+            Append(data, record.hash);
+        }
+
+        const std::string temporaryPath = path + ".tmp";
+        {
+            std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(data.data()), data.size());
+            if (file.fail()) {
+                Log::Error("Index::Save()", std::format("Failed to write '{}'", temporaryPath));
+                return false;
+            }
+        }
+
+        if (std::rename(temporaryPath.c_str(), path.c_str()) != 0) {
+            Log::Error("Index::Save()", std::format("Failed to replace '{}'", path));
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /*
+        Replace the index's contents
+        @param newRecords: the records, in any order (the scan finds them in no particular one)
+    */
+    void Index::Assign(std::vector<Record>&& newRecords) {
+        records = std::move(newRecords);
+        std::sort(records.begin(), records.end(), [](const Record& a, const Record& b) {
+            return a.relativePath < b.relativePath;
+        });
+    }
+
+    /*
+        Look an entry up
+        @param relativePath: its path, relative to the root of the transfer
+        @return the record, nullptr if it isn't in the index
+
+        Only reads the index, so any number of scanner threads can look entries up at once
+    */
+    const Record* Index::Find(const std::string& relativePath) const {
+        auto record = std::lower_bound(records.begin(), records.end(), relativePath, [](const Record& a, const std::string& path) {
+            return a.relativePath < path;
+        });
+        if (record == records.end() || record->relativePath != relativePath)
+            return nullptr;
+        return &*record;
+    }
+
+    /*
+        The summary both ends compare
+        @return the number of entries, and a BLAKE3 hash over every entry's path, kind,
+                permissions, size and content hash, in path order
+
+        Modification times and inodes are left out, they describe the sender's copy and
+        the receiver's copy has its own. Changing them alone doesn't change what the
+        receiver should have.
+    */
+    Summary Index::Summarize() const {
+
+        std::vector<Byte> data;
+        for (const Record& record : records) {
+            Append(data, static_cast<uint16_t>(record.relativePath.size()));
+            data.insert(data.end(), record.relativePath.begin(), record.relativePath.end());
+            Append(data, static_cast<uint8_t>(record.kind));
+            Append(data, record.mode);
+            Append(data, record.size);
+            Append(data, record.hash);
+        }
+
+        Summary summary = {records.size(), {}};
+        Blake3::Hash(data.data(), data.size(), summary.digest.data());
+        return summary;
+    }
+
+    /*
+        Receiver: read the summary saved in a destination directory
+        @param directory: the destination directory
+        @param summary: the summary
+        @return true if there is one, false otherwise
+        Layout: [8 byte magic][u64 entries][32 byte digest]
+    */
+    bool LoadSyncState(const std::string& directory, Summary& summary) {
+
+        std::ifstream file(directory + "/" + syncStateName, std::ios::binary);
+        char magic[sizeof(syncMagic)] = {};
+        file.read(magic, sizeof(magic));
+        file.read(reinterpret_cast<char*>(&summary.entries), sizeof(summary.entries));
+        file.read(reinterpret_cast<char*>(summary.digest.data()), summary.digest.size());
+
+        return file.good() && std::memcmp(magic, syncMagic, sizeof(magic)) == 0;
+    }
+
+    /*
+        Receiver: save the summary of what a destination directory now holds
+        @param directory: the destination directory
+        @param summary: the summary
+        @return true if successful, false otherwise
+    */
+    bool SaveSyncState(const std::string& directory, const Summary& summary) {
+
+        const std::string path = directory + "/" + syncStateName;
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(syncMagic, sizeof(syncMagic));
+        file.write(reinterpret_cast<const char*>(&summary.entries), sizeof(summary.entries));
+        file.write(reinterpret_cast<const char*>(summary.digest.data()), summary.digest.size());
+        if (file.fail()) {
+            Log::Error("SaveSyncState()", std::format("Failed to write '{}'", path));
+            return false;
+        }
+        return true;
+    }
+
+    /*
+        Receiver: forget the saved summary, once the directory starts changing
+        @param directory: the destination directory
+    */
+    void ClearSyncState(const std::string& directory) {
+        std::remove((directory + "/" + syncStateName).c_str());
+    }
+};
@@ -0,0 +1,1649 @@
+#include <iostream>
+#include <memory>
+#include <fstream>
+#include <format>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+#include <unordered_map>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "../include/cpu_features.hpp"
+#include "../include/crypto.hpp"
+#include "../include/file_index.hpp"
+#include "../include/file_receiver.hpp"
+#include "../include/key_exchange.hpp"
+#include "../include/logger.hpp"
+#include "../include/protocol.hpp"
+#include "../include/sparse.hpp"
+#include "../include/store.hpp"
+#include "../include/trace.hpp"
+#include "../include/tree.hpp"
+#include "../include/utils.hpp"
+#include "../include/work_queue.hpp"
+
+/*
+    Listen for senders over TCP
+    @return true if successful, false otherwise
+*/
+bool FileReceiver::OpenTcpListener() {
+        
+    /*
+        Set server address information
+        AF_INET: IPv4
+        INADDR_ANY: Bind to any address
+        htons: Convert port number to network byte order
+    */
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(serverPort);
+    
+    // Create socket file descriptor
+    serverFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (serverFD == 0) {
+        Log::Error("InitializeServer()", "Socket creation error");
+        return false;
+    }
+
+    /*
+        Allow binding to the port even if connections from a previous run are still in
+        TIME_WAIT, which otherwise makes a restarted receiver fail with "Bind error" for
+        a minute or so after the handshake benchmark
+    */
+    int reuseAddress = 1;
+    setsockopt(serverFD, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress));
+
+    // Bind the socket to the port
+    int bindStatus = bind(serverFD, (struct sockaddr*)&address, sizeof(address));   
+    if (bindStatus < 0) {
+        Log::Error("InitializeServer()", "Bind error");
+        return false;
+    }
+
+    /*
+        Start listening for connections
+        A daemon (-D) gets senders in bursts. With a short queue, the connections that don't
+        fit are dropped and only retried a second later, see tools/load_generator.cpp
+    */
+    int listenStatus = listen(serverFD, SOMAXCONN);
+    if (listenStatus < 0) {
+        Log::Error("InitializeServer()", "Listen error");
+        return false;
+    }
+    return true;
+}
+
+/*
+    Initialize the server
+    @return true if initialization is successful, false otherwise
+*/
+bool FileReceiver::InitializeServer() {
+
+    // Over TCP, or a Unix socket for senders on this host (--shm)
+    if (sharedMemoryPath.empty() == false) {
+        serverFD = ShmRing::ListenUnixSocket(sharedMemoryPath, 64);
+        if (serverFD < 0) {
+            Log::Error("InitializeServer()", std::format("Could not listen on '{}'", sharedMemoryPath));
+            return false;
+        }
+    }
+    else if (OpenTcpListener() == false)
+        return false;
+
+    // UDP for the file data, on the same port number as TCP
+    if (useUdp) {
+        udpFD = Udp::ListenSocket(serverPort);
+        if (udpFD < 0)
+            return false;
+    }
+
+    /*
+        Rank our cipher suites once, up front
+        The CPU isn't going to change between connections, and if the self benchmark is
+        enabled we don't want to pay for it on every accept()
+    */
+    const Cpu::Features& features = Cpu::DetectFeatures();
+    localSuites = Crypto::RankCipherSuites(features, benchmarkSuites, allowedSuites);
+    Log::Info("InitializeServer()", std::format("CPU features: {}", Cpu::DescribeFeatures(features)));
+
+    /*
+        Get the key that seals session tickets
+        Without a key file, a random key is made for this run only, which means senders
+        holding tickets from an earlier run fall back to a full handshake
+    */
+    bool haveTicketKey = ticketKeyFile.empty()
+        ? KeyExchange::GenerateRandom(ticketKey)
+        : KeyExchange::LoadOrCreateTicketKey(ticketKeyFile, ticketKey);
+    if (haveTicketKey == false) {
+        Log::Error("InitializeServer()", "Error setting up session ticket key");
+        return false;
+    }
+
+    if (sharedMemoryPath.empty() == false)
+        Log::Info("InitializeServer()", std::format("Server listening on {}, with {} KB shared memory rings",
+            sharedMemoryPath, ringCapacity / 1024));
+    else
+        Log::Info("InitializeServer()", std::format("Server listening on port {}{}", serverPort, useUdp ? " (TCP and UDP)" : ""));
+    return true;
+}
+
+/*
+    Accept a connection
+    @return true if connection is accepted, false otherwise
+*/
+bool FileReceiver::AcceptConnection() {
+
+    // Only one client at a time, let go of the previous one if there was one
+    DisconnectClient();
+    
+    // Accept a connection from the client
+    clientSocket = accept(serverFD, (struct sockaddr*)&address, (socklen_t*)&addrlen);
+    
+    if (clientSocket < 0) {
+        Log::Error("AcceptConnection()", "Accept error");
+        return false;
+    }
+    SSFTP_TRACE(accept_begin, clientSocket);
+
+    // Agree on how to decrypt everything that follows
+    if (OfferSharedMemory() == false || PerformHandshake() == false || OfferUdpChannel() == false) {
+        Log::Error("AcceptConnection()", "Handshake failed");
+        SSFTP_TRACE(accept_end, clientSocket, false);
+        return false;
+    }
+    SSFTP_TRACE(accept_end, clientSocket, true);
+    
+    return true;
+}
+
+/*
+    Give the sender that just connected a shared memory ring for the file data, if we're
+    serving senders on this host (--shm), see shm_ring.hpp
+    @return true if successful (or not needed), false otherwise
+*/
+bool FileReceiver::OfferSharedMemory() {
+    if (sharedMemoryPath.empty())
+        return true;
+
+    ring = std::make_shared<ShmRing::Ring>();
+    return ring->Offer(clientSocket, ringCapacity);
+}
+
+/*
+    Open a UDP channel for the file data, if we take it over UDP (--udp), see udp_transport.hpp
+    The channel gets a random token, which we tell the sender over the connection. Packets
+    without it (left over from an earlier sender, say) are ignored
+    @return true if successful (or not needed), false otherwise
+*/
+bool FileReceiver::OfferUdpChannel() {
+    if (useUdp == false)
+        return true;
+
+    KeyExchange::Random random = {};
+    uint32_t token = 0;
+    if (KeyExchange::GenerateRandom(random) == false)
+        return false;
+    std::memcpy(&token, random.data(), sizeof(token));
+
+    // The channel gets its own descriptor for the socket, and closes it when it's done
+    udp = std::make_shared<Udp::Channel>();
+    if (udp->Listen(dup(udpFD), token, clientSocket) == false)
+        return false;
+    return Protocol::SendAll(clientSocket, &token, sizeof(token));
+}
+
+/*
+    Agree on a cipher suite and session keys with the sender
+    @return true if both ends agreed, false otherwise
+
+    The sender advertises its suites along with how fast each one runs on its end.
+    We pick the suite that's fastest on *both* ends (see Crypto::ChooseCipherSuite()),
+    and send our choice back as a single byte. The hash algorithm is picked the same way
+    from the sender's list (see Crypto::ChooseHashAlgorithm()), and goes right behind it.
+
+    Then comes the key exchange, the sender either
+    - sends an X25519 public key (full handshake), in which case we answer with our own, or
+    - presents a session ticket we issued earlier (resumed handshake). If it opens with our
+      ticket key and hasn't expired, both ends skip X25519. Otherwise, we ask the sender to
+      retry with a public key.
+    Either way, we hand out a fresh ticket at the end.
+
+    If there's no suite (or hash) in common, we still answer (with CipherSuite::None or
+    HashAlgorithm::None) so that the sender gets a clean error instead of waiting forever.
+*/
+bool FileReceiver::PerformHandshake() {
+
+    // Step 1: Read what the sender supports, and its half of the key exchange
+    std::vector<Crypto::SuiteScore> remoteSuites;
+    std::vector<Crypto::HashAlgorithm> remoteHashes;
+    if (Protocol::ReadSuiteList(clientSocket, remoteSuites) == false ||
+        Protocol::ReadHashList(clientSocket, remoteHashes) == false)
+        return false;
+
+    Protocol::KeyHello hello = {};
+    if (Protocol::ReadKeyHello(clientSocket, hello) == false)
+        return false;
+
+    // Step 2: Pick the best common suite and hash, and let the sender know
+    cipherSuite = Crypto::ChooseCipherSuite(localSuites, remoteSuites);
+    hashAlgorithm = Crypto::ChooseHashAlgorithm(localHashes, remoteHashes);
+
+    const Byte choice[2] = {static_cast<Byte>(cipherSuite), static_cast<Byte>(hashAlgorithm)};
+    if (Protocol::SendAll(clientSocket, choice, sizeof(choice)) == false) {
+        Log::Error("PerformHandshake()", "Error sending chosen cipher suite");
+        return false;
+    }
+
+    if (cipherSuite == Crypto::CipherSuite::None) {
+        Log::Error("PerformHandshake()", "No cipher suite in common with the sender");
+        return false;
+    }
+    if (hashAlgorithm == Crypto::HashAlgorithm::None) {
+        Log::Error("PerformHandshake()", "No hash algorithm in common with the sender");
+        return false;
+    }
+
+    // Step 3: Try the ticket, if the sender brought one
+    Protocol::KeyReply reply = {};
+    KeyExchange::Secret inputSecret = {};
+    bool resumed = false;
+
+    if (hello.mode == Protocol::HandshakeMode::Resume) {
+        resumed = KeyExchange::RedeemTicket(ticketKey, hello.ticket, inputSecret);
+
+        if (resumed == false) {
+            // Ask for a public key instead, and wait for it
+            reply.mode = Protocol::HandshakeMode::RetryFull;
+            if (Protocol::SendKeyReply(clientSocket, reply) == false)
+                return false;
+            if (Protocol::ReadAll(clientSocket, hello.clientPublicKey.data(), hello.clientPublicKey.size()) == false) {
+                Log::Error("PerformHandshake()", "Error reading public key");
+                return false;
+            }
+        }
+    }
+
+    // Step 4: Full handshake, answer with our own public key
+    if (resumed == false) {
+        KeyExchange::KeyPair keyPair = {};
+        if (KeyExchange::GenerateKeyPair(keyPair) == false)
+            return false;
+        if (KeyExchange::DeriveSharedSecret(keyPair, hello.clientPublicKey, inputSecret) == false)
+            return false;
+        reply.serverPublicKey = keyPair.publicKey;
+    }
+
+    // Step 5: Derive this session's keys, and seal the next ticket
+    KeyExchange::Secret masterSecret = {};
+    KeyExchange::Secret resumptionSecret = {};
+    reply.mode = resumed ? Protocol::HandshakeMode::Resume : Protocol::HandshakeMode::Full;
+    bool derived =
+        KeyExchange::GenerateRandom(reply.serverRandom) &&
+        KeyExchange::DeriveMasterSecret(inputSecret, resumed, hello.clientRandom, reply.serverRandom, masterSecret) &&
+        KeyExchange::DeriveSessionKeys(masterSecret, sessionKeys) &&
+        KeyExchange::DeriveResumptionSecret(masterSecret, resumptionSecret) &&
+        KeyExchange::IssueTicket(ticketKey, resumptionSecret, reply.ticket);
+    if (derived == false) {
+        Log::Error("PerformHandshake()", "Error deriving session keys");
+        return false;
+    }
+
+    if (Protocol::SendKeyReply(clientSocket, reply) == false)
+        return false;
+
+    Log::Info("PerformHandshake()", std::format("{} handshake, using cipher suite {}, hash {}",
+        resumed ? "Resumed" : "Full", Crypto::CipherSuiteName(cipherSuite), Crypto::HashAlgorithmName(hashAlgorithm)));
+    return true;
+}
+
+
+/*
+    Read the file size, and file sent by the client
+    @param encryptedData: vector to store the encrypted data
+    @param reservation: if given, memory for the data and the plaintext it decrypts into
+                        is reserved here first, see memory_budget.hpp
+    @param maxSize: most bytes to accept, for messages that aren't files (headers...)
+    @param plaintextHeld: most of the plaintext the caller holds in memory at once, the
+                          whole file unless it's decrypted into a mapped file (ReceiveFile())
+    @return true if data is read successfully, false otherwise
+
+    The size comes straight off the socket, before anything is authenticated, so it's
+    checked before a single byte is allocated for it: against `maxSize`, and against the
+    memory budget or the machine's memory. Without that, a sender claiming 2^62 bytes
+    would have the receiver throw std::bad_alloc
+*/
+bool FileReceiver::ReadFromClient(std::vector<Byte>& encryptedData, MemoryBudget::Reservation* reservation, size_t maxSize,
+    size_t plaintextHeld) {
+    
+    // Read the size of file to be received
+    size_t fileSize = -1;
+    if (Protocol::ReadAll(clientSocket, &fileSize, sizeof(fileSize)) == false) {
+        // This ensures that the file size is read correctly, and is not corrupted
+        Log::Error("ReadFromClient()", "Error reading file size");
+        return false;
+    }
+    if (fileSize > maxSize || (reservation == nullptr && fileSize > MemoryBudget::MaxReservation())) {
+        Log::Error("ReadFromClient()", std::format("Refusing a message of {} bytes, {} at most", fileSize,
+            std::min<uint64_t>(maxSize, MemoryBudget::MaxReservation())));
+        return false;
+    }
+
+    /*
+        Wait for room in the memory budget before reading a single byte of the file
+        While we wait the data stays in the socket, and TCP holds the sender back
+    */
+    if (reservation != nullptr) {
+        // The size isn't authenticated, anything that could never fit is turned down outright
+        const uint64_t maxReservation = MemoryBudget::MaxReservation();
+        const uint64_t plaintext = std::min(fileSize, plaintextHeld);
+        const bool canFit = fileSize <= maxReservation && plaintext <= maxReservation - fileSize;
+        if (canFit)
+            *reservation = MemoryBudget::Reservation(fileSize + plaintext);
+        if (canFit == false || reservation->Granted() == false) {
+            Log::Error("ReadFromClient()", std::format("A file of {} bytes doesn't fit in the memory budget (--memory-budget)", fileSize));
+            return false;
+        }
+    }
+
+    /*
+        Read the file data based on the file size
+        The data is read straight into `encryptedData`, which is sized up front. Each read()
+        asks for everything that's left, and the kernel hands over however much it has
+        at the moment, so there's no fixed buffer (or buffer size) involved at all, and
+        no copying from a buffer into `encryptedData` either.
+    */
+    ssize_t bytesRead;
+    size_t totalBytesRead = 0;
+    const size_t alreadyRead = encryptedData.size();
+    encryptedData.resize(alreadyRead + fileSize);
+
+    // Main loop to read file data
+    while (totalBytesRead < fileSize) {
+        /*
+            While reading file data, we might accidently read any further data that
+            the client will send as well (in this program, we're reading the hash of 
+            file later as well).
+            To avoid this, we never ask for more than what's yet to be read.
+        */
+        size_t bytesToRead = fileSize - totalBytesRead;
+        bytesRead = ReadPayloadSome(encryptedData.data() + alreadyRead + totalBytesRead, bytesToRead);
+
+        if (bytesRead <= 0) {
+            Log::Error("ReadFromClient()", "Error reading file data");
+            return false;
+        }
+        SSFTP_TRACE(chunk_recv, Trace::CurrentFile(), bytesRead, totalBytesRead);
+
+        totalBytesRead += bytesRead;
+    }
+
+    /*
+        The following code is equivalent to the above while loop, but is more readable
+        It does not read the file in chunks, instead opting to read it out all at once
+
+        This is not recommended for operation however, as it can lead to memory issues
+        Still, if you feel like the above loop is too complicated, you can use this instead
+    */
+    /* 
+        bytesRead = read(clientSocket, encryptedData.data() + alreadyRead, fileSize);
+        if (bytesRead < 0) {
+            Log::Error("ReadFromClient()", "Error reading file data");
+            return false;
+        }
+        totalBytesRead = bytesRead;
+    */ 
+
+    // Verify that the file data was read correctly
+    if (totalBytesRead != fileSize) {
+        Log::Error("ReadFromClient()", std::format("File size mismatch, expected {} bytes, but read {} bytes", fileSize, totalBytesRead));
+        return false;
+    }
+
+    return true;
+}
+
+/*
+    Verify the hash of the decrypted data
+    @param decryptedData: decrypted data, in a buffer or a mapped file
+    @return true if hash is verified successfully, false otherwise
+*/
+bool FileReceiver::ReadAndVerifyHash(std::span<const Byte> decryptedData) {
+
+    // Read hash sent by sender
+    Crypto::Digest receivedHash;
+    if (Protocol::ReadAll(clientSocket, receivedHash.data(), receivedHash.size()) == false) {
+        Log::Error("ReadAndVerifyHash()", "Error reading hash");
+        return false;
+    }
+
+    // Calculate hash of decrypted data
+    Crypto::Digest hash;
+    bool hashStatus = Crypto::CalculateHash(decryptedData, hash, hashAlgorithm, hashThreads);
+    if (hashStatus == false) {
+        Log::Error("ReadAndVerifyHash()", "Error calculating hash");
+        return false;
+    }
+
+    // Compare the received hash with the calculated hash
+    if (hash != receivedHash) {
+        Log::Error("ReadAndVerifyHash()", "Hash mismatch, file contents are invalid");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+    Read file data, from the shared memory ring or the UDP channel if there is one,
+    the socket otherwise
+    @param data: where to put it
+    @param size: how many bytes
+    @return true if everything was read, false otherwise
+*/
+bool FileReceiver::ReadPayload(Byte* data, size_t size) {
+    if (ring)
+        return ring->Read(data, size);
+    if (udp)
+        return udp->Read(data, size);
+    return Protocol::ReadAll(clientSocket, data, size);
+}
+
+/*
+    Same as ReadPayload(), but only what has arrived so far (waiting for at least a byte)
+    @return how many bytes were read, 0 or less on error (like read())
+*/
+ssize_t FileReceiver::ReadPayloadSome(Byte* data, size_t size) {
+    if (ring)
+        return static_cast<ssize_t>(ring->ReadSome(data, size));
+    if (udp)
+        return static_cast<ssize_t>(udp->ReadSome(data, size));
+    return read(clientSocket, data, size);
+}
+
+
+
+/*
+    Writes a file back to disk while it's being filled in through a mapping, one window at a time
+
+    As each window of the mapping is filled, its writeback is started, and the window
+    before it (which has had all that time to get to disk) is waited for and unmapped with
+    MADV_DONTNEED. So only the window being filled and the one on its way to disk are ever
+    dirty, however large the file, instead of the whole file waiting for the kernel.
+    The pages stay in the page cache, clean, for the hash to read back
+*/
+class WriteBehind {
+private:
+    int fd;
+    Byte* mapping;
+    size_t window;
+    // Where the next window starts, and the window whose writeback was started last
+    size_t next = 0;
+    size_t lastOffset = 0;
+    size_t lastLength = 0;
+
+    // Start writing a window back, and wait for the one before it
+    void Start(size_t offset, size_t length) {
+        sync_file_range(fd, offset, length, SYNC_FILE_RANGE_WRITE);
+        Wait();
+        lastOffset = offset;
+        lastLength = length;
+    }
+
+    // Wait for the last window started, and unmap it
+    void Wait() {
+        if (lastLength == 0)
+            return;
+        sync_file_range(fd, lastOffset, lastLength,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        madvise(mapping + lastOffset, lastLength, MADV_DONTNEED);
+        lastLength = 0;
+    }
+
+public:
+    WriteBehind(int fd, Byte* mapping, size_t window) : fd(fd), mapping(mapping), window(window) {}
+
+    // Everything before `end` is in the mapping
+    void FilledUpTo(size_t end) {
+        while (end >= next + window) {
+            Start(next, window);
+            next += window;
+        }
+    }
+
+    // Everything is in, write back the rest and wait for all of it
+    void Finish(size_t size) {
+        if (size > next) {
+            Start(next, size - next);
+            next = size;
+        }
+        Wait();
+    }
+};
+
+/*
+    Steps 2 to 4 of ReceiveFile() through a mapping of the file, see ReceiveFile()
+    @param fd: the file, opened for reading and writing, empty
+    @param capacity: room the plaintext needs, at most (Crypto::MaxDecryptedSize())
+    @param savedSize: the size of the plaintext, once it's verified and in the file
+    @return true if the data was decrypted, verified and saved, false otherwise
+*/
+bool FileReceiver::SaveMapped(int fd, size_t capacity, size_t& savedSize) {
+
+    /*
+        posix_fallocate() gets the blocks up front, so running out of disk space shows up
+        here instead of as a SIGBUS halfway through decrypting. Not every file system
+        supports it, ftruncate() alone is enough to map the file
+    */
+    if (capacity > 0) {
+        int allocateStatus = posix_fallocate(fd, 0, capacity);
+        if (allocateStatus == ENOSPC) {
+            Log::Error("SaveMapped()", "Not enough disk space");
+            return false;
+        }
+        if (allocateStatus != 0 && ftruncate(fd, capacity) != 0) {
+            Log::Error("SaveMapped()", "Failed to size the file");
+            return false;
+        }
+    }
+
+    // mmap() can't map 0 bytes, an empty file decrypts into an empty span
+    Byte* mapping = nullptr;
+    if (capacity > 0) {
+        void* mapped = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            Log::Error("SaveMapped()", std::format("Failed to map the file: {}", strerror(errno)));
+            return false;
+        }
+        mapping = static_cast<Byte*>(mapped);
+    }
+
+    // -- Step 2 --
+    // Decrypt the Data, straight into the file, writing it back as it goes once it's large
+    ssize_t decryptedSize;
+    if (capacity > writebackWindow) {
+        WriteBehind writeBehind(fd, mapping, writebackWindow);
+        decryptedSize = Crypto::DecryptData(encryptedBuffer, std::span<Byte>(mapping, capacity), cipherSuite, sessionKeys,
+            writebackWindow, [&](size_t offset, size_t length) {
+                writeBehind.FilledUpTo(offset + length);
+            });
+        if (decryptedSize >= 0)
+            writeBehind.Finish(decryptedSize);
+    }
+    else
+        decryptedSize = Crypto::DecryptData(encryptedBuffer, std::span<Byte>(mapping, capacity), cipherSuite, sessionKeys);
+
+    // -- Step 3 --
+    // Verify the hash of the decrypted data, reading it back from the mapping
+    bool hashStatus = decryptedSize >= 0 &&
+        ReadAndVerifyHash(std::span<const Byte>(mapping, static_cast<size_t>(decryptedSize)));
+    if (mapping != nullptr)
+        munmap(mapping, capacity);
+    if (decryptedSize < 0) {
+        Log::Error("SaveMapped()", "Decryption failed");
+        return false;
+    }
+    if (hashStatus == false) {
+        Log::Error("SaveMapped()", "Error verifying hash");
+        return false;
+    }
+
+    // -- Step 4 --
+    // Cut off what the plaintext didn't need (the padding room)
+    if (ftruncate(fd, decryptedSize) != 0) {
+        Log::Error("SaveMapped()", "Failed to size the file");
+        return false;
+    }
+    // It's all on disk already (see WriteBehind), and won't be read again
+    if (capacity > writebackWindow)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    savedSize = decryptedSize;
+    return true;
+}
+
+/*
+    Steps 2 to 4 of ReceiveFile() with direct I/O, see UseDirectIo()
+    @param fd: the file, opened with O_DIRECT, empty
+    @param capacity: room the plaintext needs, at most (Crypto::MaxDecryptedSize())
+    @param savedSize: the size of the plaintext, once it's verified and in the file
+    @return true if the data was decrypted, verified and saved, false otherwise
+
+    O_DIRECT moves data between our buffer and the disk without the page cache, but only
+    in whole blocks: the buffer, the offset and the length must all be multiples of the
+    device's block size (directAlignment covers every common device). So:
+    - the plaintext is decrypted into a buffer that's aligned, and rounded up to a whole
+      number of blocks
+    - the unaligned tail is written as a whole block, padded with zeros, and the file is
+      truncated back to its real size afterwards (ftruncate() has no alignment rules)
+    - the buffer is written in directWriteSize pieces by up to directQueueDepth threads at
+      once. A direct write only returns once the device has the data, so one at a time
+      would leave the device idle between writes, several keep its queue full
+*/
+bool FileReceiver::SaveDirect(int fd, size_t capacity, size_t& savedSize) {
+
+    const size_t bufferSize = std::max((capacity + directAlignment - 1) / directAlignment * directAlignment, directAlignment);
+    std::unique_ptr<Byte, decltype(&free)> buffer(static_cast<Byte*>(std::aligned_alloc(directAlignment, bufferSize)), &free);
+    if (buffer == nullptr) {
+        Log::Error("SaveDirect()", "Error allocating an aligned buffer");
+        return false;
+    }
+
+    // -- Step 2 --
+    ssize_t decryptedSize = Crypto::DecryptData(encryptedBuffer, std::span<Byte>(buffer.get(), capacity), cipherSuite, sessionKeys);
+    if (decryptedSize < 0) {
+        Log::Error("SaveDirect()", "Decryption failed");
+        return false;
+    }
+
+    // -- Step 3 --
+    if (ReadAndVerifyHash(std::span<const Byte>(buffer.get(), decryptedSize)) == false) {
+        Log::Error("SaveDirect()", "Error verifying hash");
+        return false;
+    }
+
+    // -- Step 4 --
+    // Pad the tail out to a whole block
+    const size_t writeSize = (decryptedSize + directAlignment - 1) / directAlignment * directAlignment;
+    std::memset(buffer.get() + decryptedSize, 0, writeSize - decryptedSize);
+    posix_fallocate(fd, 0, writeSize);
+
+    std::atomic<size_t> next = 0;
+    std::atomic<bool> failed = false;
+    auto writer = [&]() {
+        for (size_t offset = next.fetch_add(directWriteSize); offset < writeSize && failed == false; offset = next.fetch_add(directWriteSize)) {
+            const size_t length = std::min(directWriteSize, writeSize - offset);
+            size_t done = 0;
+            while (done < length) {
+                ssize_t bytesWritten = pwrite(fd, buffer.get() + offset + done, length - done, offset + done);
+                if (bytesWritten <= 0) {
+                    failed = true;
+                    return;
+                }
+                done += bytesWritten;
+            }
+        }
+    };
+
+    // This thread is one of the writers
+    const size_t pieces = (writeSize + directWriteSize - 1) / directWriteSize;
+    std::vector<std::thread> writers;
+    for (size_t i = 1; i < std::min(pieces, directQueueDepth); i++)
+        writers.emplace_back(writer);
+    writer();
+    for (std::thread& thread : writers)
+        thread.join();
+
+    if (failed || ftruncate(fd, decryptedSize) != 0) {
+        Log::Error("SaveDirect()", std::format("Failed to write the file: {}", strerror(errno)));
+        return false;
+    }
+
+    savedSize = decryptedSize;
+    return true;
+}
+
+/*
+    Receive a file from the client
+    @param filename: path to the file to save
+    @return true if file is received successfully, false otherwise
+
+    The plaintext never goes through a buffer of ours. The file is created at its final
+    size (or just above it, see Crypto::MaxDecryptedSize()) and mapped, the ciphertext is
+    decrypted straight into the mapping, and hashed right there. So every byte of plaintext
+    is written once, by the cipher, instead of once into a vector and again by write().
+    See SaveMapped().
+
+    Files of at least the size given to UseDirectIo() are written with O_DIRECT instead,
+    see SaveDirect(), so that they don't go through (and crowd out) the page cache.
+
+    Until the hash is verified the file is kept as `<filename>.partial`, so a file that fails
+    to decrypt or verify never shows up under its real name, and never replaces an older one
+*/
+bool FileReceiver::ReceiveFile(const std::string& filename) {
+
+    const uint64_t fileId = Trace::BeginFile();
+
+    std::vector<Byte>& encryptedData = encryptedBuffer;
+    // ReadFromClient() appends, so start from an empty buffer (the capacity stays)
+    encryptedData.clear();
+    MemoryBudget::Reservation memory;
+
+    /*
+        -- Step 1 --
+        Read the file size, and file sent by the client
+        Through a mapping, no more than two windows of plaintext are ever in memory at
+        once (see WriteBehind), so only those count against the budget. With O_DIRECT
+        the whole plaintext goes through a buffer of ours
+    */
+    const size_t plaintextHeld = directIoThreshold == UINT64_MAX ? 2 * writebackWindow : SIZE_MAX;
+    bool readStatus = ReadFromClient(encryptedData, &memory, SIZE_MAX, plaintextHeld);
+    if (readStatus == false) {
+        Log::Error("ReceiveFile()", "Error reading file sent by client");
+        return false;
+    }
+
+    // Create the file, with O_DIRECT if it's large enough and the file system supports it
+    const std::string partialName = filename + ".partial";
+    const size_t capacity = Crypto::MaxDecryptedSize(encryptedData.size(), cipherSuite);
+    bool direct = capacity >= directIoThreshold;
+    int fd = open(partialName.c_str(), (direct ? O_WRONLY | O_DIRECT : O_RDWR) | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0 && direct && errno == EINVAL) {
+        static std::atomic<bool> warned = false;
+        if (warned.exchange(true) == false)
+            Log::Warning("ReceiveFile()", "The file system doesn't support O_DIRECT, writing through the page cache");
+        direct = false;
+        fd = open(partialName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    if (fd < 0) {
+        Log::Error("ReceiveFile()", std::format("Failed to create file '{}'", filename));
+        return false;
+    }
+    SSFTP_TRACE(file_open, fileId, filename.c_str(), capacity);
+
+    // -- Steps 2 to 4 --
+    size_t savedSize = 0;
+    bool saved = direct ? SaveDirect(fd, capacity, savedSize) : SaveMapped(fd, capacity, savedSize);
+    close(fd);
+    if (saved == false) {
+        Log::Error("ReceiveFile()", std::format("Failed to save file '{}'", filename));
+        unlink(partialName.c_str());
+        return false;
+    }
+    SSFTP_TRACE(file_write, fileId, savedSize);
+
+    // Keep the file
+    if (rename(partialName.c_str(), filename.c_str()) != 0) {
+        Log::Error("ReceiveFile()", std::format("Failed to save file as '{}': {}", filename, strerror(errno)));
+        unlink(partialName.c_str());
+        return false;
+    }
+    SSFTP_TRACE(file_close, fileId);
+
+    // Our reservation ends here, so don't hold on to a large buffer past it
+    if (encryptedData.capacity() > maxRetainedBuffer)
+        encryptedData = {};
+
+    Log::Success("ReceiveFile()", std::format("File saved as {} successfully!", filename));
+    return true;
+}
+
+/*
+    Receive a sparse file from the client, see FileSender::SendSparseFile()
+    @param filename: path to the file to save
+    @return true if file is received successfully, false otherwise
+
+    Steps 1 to 3 are the same as ReceiveFile(), what we get out of them is the extent map
+    followed by the data. Step 4 writes the data where the map says, and leaves everything
+    else as holes, so the saved file is just as sparse as the original
+*/
+bool FileReceiver::ReceiveSparseFile(const std::string& filename) {
+
+    Trace::BeginFile();
+    std::vector<Byte> encryptedData;
+    std::vector<Byte> decryptedData;
+    MemoryBudget::Reservation memory;
+
+    // -- Steps 1 to 3 --
+    bool received =
+        ReadFromClient(encryptedData, &memory) &&
+        Crypto::DecryptData(encryptedData, decryptedData, cipherSuite, sessionKeys) &&
+        ReadAndVerifyHash(decryptedData);
+    if (received == false) {
+        Log::Error("ReceiveSparseFile()", "Error receiving file");
+        return false;
+    }
+
+    uint64_t fileSize = 0;
+    size_t dataOffset = 0;
+    std::vector<Sparse::Extent> extents;
+    if (Protocol::ParseExtentMap(decryptedData, fileSize, extents, dataOffset) == false) {
+        Log::Error("ReceiveSparseFile()", "Malformed extent map");
+        return false;
+    }
+
+    // -- Step 4 --
+    // Write the data extents, and leave holes everywhere else
+    if (Sparse::WriteExtents(filename, fileSize, extents, decryptedData.data() + dataOffset) == false)
+        return false;
+
+    Log::Success("ReceiveSparseFile()", std::format("File saved as {} successfully! {} bytes in {} extents, {} bytes total",
+        filename, decryptedData.size() - dataOffset, extents.size(), fileSize));
+    return true;
+}
+
+/*
+    Receive a file from the client without decrypting it, see store.hpp
+    @param filename: the file's final name, the ciphertext is saved as "<filename>.sealed"
+    @return true if file is stored successfully, false otherwise
+
+    Step 1 without the vector: the ciphertext goes straight from the socket into the file.
+    Steps 2 and 3 are put off until Store::Unseal(), so the hash is only read here, and
+    saved in the metadata for later. Step 4 is Store::Unseal() as well.
+*/
+bool FileReceiver::StoreFile(const std::string& filename) {
+
+    Trace::BeginFile();
+    uint64_t fileSize = 0;
+    if (Protocol::ReadAll(clientSocket, &fileSize, sizeof(fileSize)) == false) {
+        Log::Error("StoreFile()", "Error reading file size");
+        return false;
+    }
+
+    const std::string dataPath = filename + Store::dataSuffix;
+    int fd = open(dataPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        Log::Error("StoreFile()", std::format("Failed to create file '{}'", dataPath));
+        return false;
+    }
+    // From the shared memory ring or the UDP channel it's a single write() per piece, with nothing to splice
+    const bool moved = ring ? ring->ReadToFile(fd, fileSize)
+        : udp ? udp->ReadToFile(fd, fileSize)
+        : Store::SpliceToFile(clientSocket, fd, fileSize);
+    close(fd);
+    if (moved == false)
+        return false;
+
+    std::vector<Byte> receivedHash(Crypto::hashSize);
+    if (Protocol::ReadAll(clientSocket, receivedHash.data(), receivedHash.size()) == false) {
+        Log::Error("StoreFile()", "Error reading hash");
+        return false;
+    }
+
+    if (Store::SaveMetadata(filename, cipherSuite, hashAlgorithm, sessionKeys, fileSize, receivedHash) == false)
+        return false;
+
+    Log::Success("StoreFile()", std::format("File stored as {} ({} bytes, not decrypted yet)", dataPath, fileSize));
+    return true;
+}
+
+/*
+    Receive a whole directory tree from the client
+    @param destination: directory to save the tree into, created if it doesn't exist
+    @param threads: number of threads used to decrypt, verify and write files
+    @return true if the tree is received successfully, false otherwise
+
+    See FileSender::SendDirectory() for the other end. Messages arrive as
+    - TreeEntries: directories are created right away, and files are created and
+      preallocated to their final size, long before their contents arrive. Preallocating
+      lets the file system lay each file out in one piece instead of growing it bit by bit.
+    - TreeFile and TreeFileData: the contents of a file we've already seen an entry for,
+      in chunks, possibly interleaved with the chunks of other files. The main thread
+      only reads them off the socket, decrypting, verifying and writing are handed to a
+      pool of writer threads so that reading can carry on in the meantime.
+    - TreeEnd: the sender is done
+    - IndexSummary and IndexUpdate: the sender only sends what changed, if the directory
+      still holds what it sent last time, see file_index.hpp
+*/
+bool FileReceiver::ReceiveDirectory(const std::string& destination, const unsigned threads) {
+
+    // Files read off the socket, but not yet written, at most
+    constexpr size_t maxFilesInFlight = 64;
+
+    struct ReceivedFile {
+        Tree::Entry entry;
+        std::vector<Byte> encryptedData;
+        Crypto::Digest hash;
+        uint64_t expectedSize;
+        // Its ciphertext, and the plaintext the writer decrypts it into
+        MemoryBudget::Reservation memory;
+    };
+
+    std::error_code error;
+    std::filesystem::create_directories(destination, error);
+    if (error) {
+        Log::Error("ReceiveDirectory()", std::format("Failed to create directory '{}'", destination));
+        return false;
+    }
+
+    // Files announced by the sender, by id, and the directories (whose permissions are set at the end)
+    std::unordered_map<uint32_t, Tree::Entry> announcedFiles;
+    std::vector<Tree::Entry> directories;
+    // Files whose contents are on their way, several of them can be arriving at once
+    std::unordered_map<uint32_t, ReceivedFile> incomingFiles;
+
+    WorkQueue<ReceivedFile> writeQueue(maxFilesInFlight);
+    std::atomic<bool> writeFailed = false;
+
+    const auto startTime = std::chrono::steady_clock::now();
+
+    // Writer threads: decrypt, verify, and write a file into its preallocated spot
+    auto writer = [&]() {
+        while (std::optional<ReceivedFile> file = writeQueue.Pop()) {
+            Trace::SetFile(file->entry.id);
+            std::vector<Byte> decryptedData;
+            Crypto::Digest hash;
+            bool verified =
+                Crypto::DecryptData(file->encryptedData, decryptedData, cipherSuite, sessionKeys) &&
+                Crypto::CalculateHash(decryptedData, hash, hashAlgorithm) &&
+                hash == file->hash;
+            if (verified == false) {
+                Log::Error("ReceiveDirectory()", std::format("File '{}' failed verification", file->entry.relativePath));
+                writeFailed = true;
+                continue;
+            }
+
+            // The file already exists (see below), so open it without truncating
+            const std::string path = destination + "/" + file->entry.relativePath;
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT, file->entry.mode & 0777);
+            bool written = fd >= 0;
+            size_t offset = 0;
+            SSFTP_TRACE(file_open, file->entry.id, path.c_str(), decryptedData.size());
+            while (written && offset < decryptedData.size()) {
+                ssize_t bytesWritten = pwrite(fd, decryptedData.data() + offset, decryptedData.size() - offset, offset);
+                written = bytesWritten > 0;
+                offset += std::max<ssize_t>(bytesWritten, 0);
+            }
+            SSFTP_TRACE(file_write, file->entry.id, offset);
+
+            // Trim the preallocated space, in case the file shrank after the sender scanned it
+            written = written && ftruncate(fd, decryptedData.size()) == 0;
+            if (fd >= 0)
+                close(fd);
+            SSFTP_TRACE(file_close, file->entry.id);
+
+            if (written == false) {
+                Log::Error("ReceiveDirectory()", std::format("Failed to write file '{}'", path));
+                writeFailed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> writers;
+    for (unsigned i = 0; i < std::max(threads, 1u); i++)
+        writers.emplace_back(writer);
+
+    // Stop the writer threads, used on the way out whether things went well or not
+    auto stopWriters = [&]() {
+        writeQueue.Close();
+        for (std::thread& thread : writers)
+            thread.join();
+    };
+
+    uint64_t filesReceived = 0, bytesReceived = 0, filesExpected = 0, filesSkipped = 0;
+    bool done = false;
+    // What the directory will hold once this transfer is complete, with --incremental on the sender
+    FileIndex::Summary newSyncState = {};
+    bool haveNewSyncState = false;
+    while (done == false) {
+
+        Byte type = 0;
+        if (Protocol::ReadAll(clientSocket, &type, sizeof(type)) == false) {
+            Log::Error("ReceiveDirectory()", "Connection lost during directory transfer");
+            stopWriters();
+            return false;
+        }
+
+        switch (static_cast<Protocol::MessageType>(type)) {
+
+            // A batch of entries, create directories and preallocate files
+            case Protocol::MessageType::TreeEntries: {
+                std::vector<Byte> encryptedBatch, plainBatch;
+                std::vector<Tree::Entry> entries;
+                bool parsed =
+                    ReadFromClient(encryptedBatch, nullptr, Protocol::maxEntryBatchSize) &&
+                    Crypto::DecryptData(encryptedBatch, plainBatch, cipherSuite, sessionKeys) &&
+                    Protocol::ParseTreeEntries(plainBatch, entries);
+                if (parsed == false) {
+                    Log::Error("ReceiveDirectory()", "Error reading directory entries");
+                    stopWriters();
+                    return false;
+                }
+
+                for (Tree::Entry& entry : entries) {
+                    if (Tree::IsSafeRelativePath(entry.relativePath) == false) {
+                        Log::Error("ReceiveDirectory()", std::format("Refusing unsafe path '{}'", entry.relativePath));
+                        stopWriters();
+                        return false;
+                    }
+
+                    const std::string path = destination + "/" + entry.relativePath;
+                    if (entry.kind == Tree::EntryKind::Directory) {
+                        std::filesystem::create_directories(path, error);
+                        directories.push_back(std::move(entry));
+                        continue;
+                    }
+
+                    // posix_fallocate() may not be supported by the file system, which is fine
+                    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, entry.mode & 0777);
+                    if (fd < 0) {
+                        Log::Error("ReceiveDirectory()", std::format("Failed to create file '{}'", path));
+                        stopWriters();
+                        return false;
+                    }
+                    if (entry.size > 0)
+                        posix_fallocate(fd, 0, entry.size);
+                    close(fd);
+
+                    announcedFiles[entry.id] = std::move(entry);
+                }
+                break;
+            }
+
+            // A file's contents are about to arrive, in TreeFileData chunks
+            case Protocol::MessageType::TreeFile: {
+                ReceivedFile file = {{}, {}, {}, 0, {}};
+                uint32_t id = 0;
+                bool readStatus =
+                    Protocol::ReadAll(clientSocket, &id, sizeof(id)) &&
+                    Protocol::ReadAll(clientSocket, &file.expectedSize, sizeof(file.expectedSize)) &&
+                    Protocol::ReadAll(clientSocket, file.hash.data(), file.hash.size());
+
+                auto announced = announcedFiles.find(id);
+                if (readStatus == false || announced == announcedFiles.end()) {
+                    Log::Error("ReceiveDirectory()", "Error reading file contents");
+                    stopWriters();
+                    return false;
+                }
+
+                file.entry = std::move(announced->second);
+                announcedFiles.erase(announced);
+
+                /*
+                    Reserve the file's memory before any of its data arrives. Only wait for
+                    room when no other file is half received: those only give their memory
+                    back once they're complete, which needs us to keep reading
+                */
+                const bool canFit = file.expectedSize <= MemoryBudget::MaxReservation() / 2;
+                if (canFit)
+                    file.memory = MemoryBudget::Reservation(2 * file.expectedSize, incomingFiles.empty());
+                if (canFit == false || file.memory.Granted() == false) {
+                    Log::Error("ReceiveDirectory()", std::format("File '{}' of {} bytes doesn't fit in the memory budget (--memory-budget)",
+                        file.entry.relativePath, file.expectedSize));
+                    stopWriters();
+                    return false;
+                }
+
+                // Nothing to wait for, straight to a writer thread
+                filesReceived++;
+                if (file.expectedSize == 0)
+                    writeQueue.Push(std::move(file));
+                else
+                    incomingFiles.emplace(id, std::move(file));
+                break;
+            }
+
+            // The sender couldn't read a file it announced, so it isn't coming
+            case Protocol::MessageType::TreeFileSkipped: {
+                uint32_t id = 0;
+                const bool readStatus = Protocol::ReadAll(clientSocket, &id, sizeof(id));
+
+                auto announced = announcedFiles.find(id);
+                if (readStatus == false || announced == announcedFiles.end()) {
+                    Log::Error("ReceiveDirectory()", "Error reading directory entries");
+                    stopWriters();
+                    return false;
+                }
+
+                // Its preallocated spot holds nothing but zeros
+                const std::string path = destination + "/" + announced->second.relativePath;
+                std::filesystem::remove(path, error);
+                Log::Warning("ReceiveDirectory()", std::format("The sender couldn't read '{}', skipped", announced->second.relativePath));
+                announcedFiles.erase(announced);
+                filesSkipped++;
+                break;
+            }
+
+            // A chunk of a file's contents, once a file is complete, hand it to a writer thread
+            case Protocol::MessageType::TreeFileData: {
+                uint32_t id = 0, length = 0;
+                bool readStatus =
+                    Protocol::ReadAll(clientSocket, &id, sizeof(id)) &&
+                    Protocol::ReadAll(clientSocket, &length, sizeof(length));
+
+                auto incoming = incomingFiles.find(id);
+                if (readStatus == false || incoming == incomingFiles.end() ||
+                    length > incoming->second.expectedSize - incoming->second.encryptedData.size()) {
+                    Log::Error("ReceiveDirectory()", "Error reading file contents");
+                    stopWriters();
+                    return false;
+                }
+
+                std::vector<Byte>& encryptedData = incoming->second.encryptedData;
+                const size_t offset = encryptedData.size();
+                encryptedData.resize(offset + length);
+                if (ReadPayload(encryptedData.data() + offset, length) == false) {
+                    Log::Error("ReceiveDirectory()", "Error reading file contents");
+                    stopWriters();
+                    return false;
+                }
+                SSFTP_TRACE(chunk_recv, id, length, offset);
+
+                bytesReceived += length;
+                if (encryptedData.size() == incoming->second.expectedSize) {
+                    writeQueue.Push(std::move(incoming->second));
+                    incomingFiles.erase(incoming);
+                }
+                break;
+            }
+
+            /*
+                Does the directory still hold what the sender's index says it sent? Either
+                way it's about to change, so the saved summary goes until the transfer is
+                complete, an interrupted one must not leave it matching
+            */
+            case Protocol::MessageType::IndexSummary: {
+                FileIndex::Summary summary = {}, saved = {};
+                if (Protocol::ReadAll(clientSocket, &summary.entries, sizeof(summary.entries)) == false ||
+                    Protocol::ReadAll(clientSocket, summary.digest.data(), summary.digest.size()) == false) {
+                    Log::Error("ReceiveDirectory()", "Error reading the index summary");
+                    stopWriters();
+                    return false;
+                }
+
+                const Byte inSync = FileIndex::LoadSyncState(destination, saved) && saved == summary;
+                FileIndex::ClearSyncState(destination);
+                if (Protocol::SendAll(clientSocket, &inSync, sizeof(inSync)) == false) {
+                    Log::Error("ReceiveDirectory()", "Error answering the index summary");
+                    stopWriters();
+                    return false;
+                }
+                Log::Info("ReceiveDirectory()", inSync
+                    ? std::format("In sync with the sender's index ({} entries), receiving only what changed", summary.entries)
+                    : "Not in sync with the sender's index, receiving everything");
+                break;
+            }
+
+            case Protocol::MessageType::IndexUpdate:
+                if (Protocol::ReadAll(clientSocket, &newSyncState.entries, sizeof(newSyncState.entries)) == false ||
+                    Protocol::ReadAll(clientSocket, newSyncState.digest.data(), newSyncState.digest.size()) == false) {
+                    Log::Error("ReceiveDirectory()", "Error reading the index summary");
+                    stopWriters();
+                    return false;
+                }
+                haveNewSyncState = true;
+                break;
+
+            case Protocol::MessageType::TreeEnd:
+                if (Protocol::ReadAll(clientSocket, &filesExpected, sizeof(filesExpected)) == false) {
+                    Log::Error("ReceiveDirectory()", "Error reading end of directory transfer");
+                    stopWriters();
+                    return false;
+                }
+                done = true;
+                break;
+
+            default:
+                Log::Error("ReceiveDirectory()", std::format("Unexpected message type {}", type));
+                stopWriters();
+                return false;
+        }
+    }
+
+    stopWriters();
+
+    /*
+        Apply directory permissions last, deepest first
+        A read-only directory would otherwise stop us from creating anything inside it
+    */
+    std::sort(directories.begin(), directories.end(), [](const Tree::Entry& a, const Tree::Entry& b) {
+        return a.relativePath.size() > b.relativePath.size();
+    });
+    for (const Tree::Entry& directory : directories)
+        chmod((destination + "/" + directory.relativePath).c_str(), directory.mode & 07777);
+
+    if (writeFailed || filesReceived != filesExpected || announcedFiles.empty() == false || incomingFiles.empty() == false) {
+        Log::Error("ReceiveDirectory()", std::format("Directory transfer incomplete, received {} of {} files",
+            filesReceived, filesExpected));
+        return false;
+    }
+
+    // Everything is in place, the next incremental transfer can build on it
+    if (haveNewSyncState)
+        FileIndex::SaveSyncState(destination, newSyncState);
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    Log::Success("ReceiveDirectory()", std::format(
+        "Received {} files and {} directories ({:.1f} MB) into {} in {:.2f} s: {:.0f} files/s, {:.1f} MB/s",
+        filesReceived, directories.size(), bytesReceived / 1e6, destination, seconds,
+        filesReceived / seconds, bytesReceived / 1e6 / seconds));
+    if (filesSkipped > 0)
+        Log::Warning("ReceiveDirectory()", std::format("{} files the sender couldn't read were skipped", filesSkipped));
+    return true;
+}
+
+/*
+    Receive many small files, packed together into segments by FileSender::SendPackedFiles()
+    @param directory: directory to save the files into
+    @param numberOfFiles: number of files to receive
+    @return true if all the files are received successfully, false otherwise
+
+    A segment arrives just like a single file would (see ReceiveFile()), and is decrypted
+    and verified in one go. The files inside are then written straight out of the segment,
+    without copying each of them into a buffer of their own first.
+*/
+bool FileReceiver::ReceivePackedFiles(const std::string& directory, const int numberOfFiles) {
+
+    int filesReceived = 0;
+    while (filesReceived < numberOfFiles) {
+
+        // Read, decrypt and verify a whole segment, same as ReceiveFile()
+        std::vector<Byte> encryptedSegment, segment;
+        MemoryBudget::Reservation memory;
+        bool received =
+            ReadFromClient(encryptedSegment, &memory) &&
+            Crypto::DecryptData(encryptedSegment, segment, cipherSuite, sessionKeys) &&
+            ReadAndVerifyHash(segment);
+        if (received == false) {
+            Log::Error("ReceivePackedFiles()", "Error receiving segment");
+            return false;
+        }
+
+        std::vector<Protocol::PackedFile> index;
+        if (Protocol::ParsePackedSegment(segment, index) == false || index.empty()) {
+            Log::Error("ReceivePackedFiles()", "Malformed segment");
+            return false;
+        }
+
+        for (const Protocol::PackedFile& file : index) {
+            // Only plain file names are accepted, nothing that points into another directory
+            if (file.name.find('/') != std::string::npos || Tree::IsSafeRelativePath(file.name) == false) {
+                Log::Error("ReceivePackedFiles()", std::format("Refusing unsafe file name '{}'", file.name));
+                return false;
+            }
+
+            const std::string path = directory + "/" + file.name;
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            bool written = fd >= 0;
+            size_t offset = 0;
+            while (written && offset < file.length) {
+                ssize_t bytesWritten = write(fd, segment.data() + file.offset + offset, file.length - offset);
+                written = bytesWritten > 0;
+                offset += std::max<ssize_t>(bytesWritten, 0);
+            }
+            if (fd >= 0)
+                close(fd);
+
+            if (written == false) {
+                Log::Error("ReceivePackedFiles()", std::format("Failed to write file '{}'", path));
+                return false;
+            }
+        }
+
+        filesReceived += index.size();
+        Log::Info("ReceivePackedFiles()", std::format("Unpacked a segment of {} files", index.size()));
+    }
+
+    Log::Success("ReceivePackedFiles()", std::format("{} files saved into {} successfully!", filesReceived, directory));
+    return true;
+}
+
+/*
+    Receive named files from one sender, until it ends the session
+    @param directory: directory the names are relative to
+    @param filesReceived: incremented for every file saved
+    @return true if the sender ended the session cleanly, false otherwise
+
+    Each file is announced with a NamedFile message, whose encrypted header carries the
+    name and the size of the file (see FileSender::SendNamedFile()). The name comes from
+    the other end of a socket, so it gets the same checks as a path in a directory tree.
+*/
+bool FileReceiver::ReceiveNamedFiles(const std::filesystem::path& directory, uint64_t& filesReceived) {
+
+    std::vector<Byte> encryptedHeader, header;
+
+    /*
+        Files sent in chunks (see scheduler.hpp) that aren't complete yet, and how much of
+        each has arrived. Their chunks come in order, but other files may come in between
+    */
+    std::unordered_map<std::string, uint64_t> chunkedFiles;
+
+    // Remove what we have of the half received files, they'll never be complete now
+    auto abandonChunkedFiles = [&]() {
+        std::error_code error;
+        for (const auto& [path, received] : chunkedFiles)
+            std::filesystem::remove(path + ".partial", error);
+        chunkedFiles.clear();
+        return false;
+    };
+
+    // A chunk of a file, the file is saved once its last chunk is in
+    auto receiveChunk = [&]() {
+        std::string name;
+        uint64_t fileSize = 0, offset = 0, length = 0;
+        encryptedHeader.clear();
+        bool parsed =
+            ReadFromClient(encryptedHeader, nullptr, Protocol::maxHeaderSize) &&
+            Crypto::DecryptData(encryptedHeader, header, cipherSuite, sessionKeys) &&
+            Protocol::ParseNamedChunkHeader(header, name, fileSize, offset);
+        if (parsed == false || Tree::IsSafeRelativePath(name) == false) {
+            Log::Error("ReceiveNamedFiles()", "Malformed or unsafe chunk header");
+            return false;
+        }
+
+        const std::filesystem::path path = directory / name;
+        auto known = chunkedFiles.find(path.string());
+        const uint64_t expectedOffset = known == chunkedFiles.end() ? 0 : known->second;
+        if (offset != expectedOffset) {
+            Log::Error("ReceiveNamedFiles()", std::format("Chunk of '{}' at {}, expected one at {}", name, offset, expectedOffset));
+            return false;
+        }
+
+        std::error_code error;
+        std::filesystem::create_directories(path.parent_path(), error);
+        chunkedFiles[path.string()] = offset;
+        if (error || ReceiveFileChunk(path.string(), offset, length) == false)
+            return false;
+        if (offset + length > fileSize) {
+            Log::Error("ReceiveNamedFiles()", std::format("'{}' is larger than the {} bytes its header said", name, fileSize));
+            return false;
+        }
+
+        if (offset + length < fileSize) {
+            chunkedFiles[path.string()] = offset + length;
+            return true;
+        }
+
+        // That was the last chunk
+        chunkedFiles.erase(path.string());
+        std::filesystem::rename(path.string() + ".partial", path, error);
+        if (error) {
+            Log::Error("ReceiveNamedFiles()", std::format("Failed to save file as '{}': {}", path.string(), error.message()));
+            return false;
+        }
+        Log::Success("ReceiveNamedFiles()", std::format("File saved as {} successfully!", path.string()));
+        filesReceived++;
+        return true;
+    };
+
+    while (true) {
+        Byte type = 0;
+        errno = 0;
+        if (Protocol::ReadAll(clientSocket, &type, sizeof(type)) == false) {
+            // EAGAIN is the idle timeout, see RunDaemon()
+            Log::Error("ReceiveNamedFiles()", errno == EAGAIN || errno == EWOULDBLOCK
+                ? "Sender went quiet, dropping the session"
+                : "Sender disconnected without ending the session");
+            return abandonChunkedFiles();
+        }
+
+        if (type == static_cast<Byte>(Protocol::MessageType::SessionEnd)) {
+            if (chunkedFiles.empty())
+                return true;
+            Log::Error("ReceiveNamedFiles()", std::format("Session ended with {} files half received", chunkedFiles.size()));
+            return abandonChunkedFiles();
+        }
+        if (type == static_cast<Byte>(Protocol::MessageType::NamedFileChunk)) {
+            if (receiveChunk() == false)
+                return abandonChunkedFiles();
+            continue;
+        }
+        if (type != static_cast<Byte>(Protocol::MessageType::NamedFile)) {
+            Log::Error("ReceiveNamedFiles()", std::format("Unexpected message type {}", type));
+            return abandonChunkedFiles();
+        }
+
+        // The header: where to save the file, and how big it is
+        std::string name;
+        uint64_t fileSize = 0;
+        encryptedHeader.clear();
+        bool parsed =
+            ReadFromClient(encryptedHeader, nullptr, Protocol::maxHeaderSize) &&
+            Crypto::DecryptData(encryptedHeader, header, cipherSuite, sessionKeys) &&
+            Protocol::ParseNamedFileHeader(header, name, fileSize);
+        if (parsed == false) {
+            Log::Error("ReceiveNamedFiles()", "Malformed file header");
+            return abandonChunkedFiles();
+        }
+        if (Tree::IsSafeRelativePath(name) == false) {
+            Log::Error("ReceiveNamedFiles()", std::format("Refusing unsafe file name '{}'", name));
+            return abandonChunkedFiles();
+        }
+
+        const std::filesystem::path path = directory / name;
+        std::error_code error;
+        std::filesystem::create_directories(path.parent_path(), error);
+        if (error) {
+            Log::Error("ReceiveNamedFiles()", std::format("Failed to create '{}': {}", path.parent_path().string(), error.message()));
+            return abandonChunkedFiles();
+        }
+
+        if (ReceiveFile(path.string()) == false)
+            return abandonChunkedFiles();
+
+        // The hash already vouches for the contents, this catches a header that lied about them
+        const uintmax_t savedSize = std::filesystem::file_size(path, error);
+        if (error || savedSize != fileSize) {
+            Log::Error("ReceiveNamedFiles()", std::format("'{}' is {} bytes, the header said {}", name, savedSize, fileSize));
+            std::filesystem::remove(path, error);
+            return abandonChunkedFiles();
+        }
+        filesReceived++;
+    }
+}
+
+/*
+    Receive a chunk of a file sent in chunks, see Protocol::MessageType::NamedFileChunk
+    @param filename: path to the file to save, the chunk goes into `<filename>.partial` for now
+    @param offset: where in the file the chunk goes, the file is started over at 0
+    @param length: the size of the chunk, once decrypted
+    @return true if the chunk is received and written successfully, false otherwise
+
+    The same steps as ReceiveFile(), except that a chunk is decrypted into a buffer and
+    written at its offset. A chunk is no larger than the sender's --interleave size, so the
+    buffer stays small, and unlike a whole file, the room the plaintext needs is only known
+    once it's decrypted, where it would overlap the next chunk's place in the file
+*/
+bool FileReceiver::ReceiveFileChunk(const std::string& filename, uint64_t offset, uint64_t& length) {
+
+    std::vector<Byte>& encryptedData = encryptedBuffer;
+    encryptedData.clear();
+    MemoryBudget::Reservation memory;
+
+    // -- Steps 1 to 3 --
+    std::vector<Byte> decryptedData;
+    bool verified =
+        ReadFromClient(encryptedData, &memory) &&
+        Crypto::DecryptData(encryptedData, decryptedData, cipherSuite, sessionKeys) &&
+        ReadAndVerifyHash(decryptedData);
+    if (verified == false) {
+        Log::Error("ReceiveFileChunk()", "Error receiving chunk");
+        return false;
+    }
+
+    // -- Step 4 --
+    const std::string partialName = filename + ".partial";
+    int fd = open(partialName.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (offset == 0 ? O_TRUNC : 0), 0666);
+    bool written = fd >= 0;
+    size_t done = 0;
+    while (written && done < decryptedData.size()) {
+        ssize_t bytesWritten = pwrite(fd, decryptedData.data() + done, decryptedData.size() - done, offset + done);
+        written = bytesWritten > 0;
+        done += std::max<ssize_t>(bytesWritten, 0);
+    }
+    if (fd >= 0)
+        close(fd);
+    if (written == false) {
+        Log::Error("ReceiveFileChunk()", std::format("Failed to write file '{}'", partialName));
+        return false;
+    }
+
+    if (encryptedData.capacity() > maxRetainedBuffer)
+        encryptedData = {};
+
+    length = decryptedData.size();
+    return true;
+}
+
+/*
+    Run as a daemon: serve one sender after another, saving their files by name
+    @param directory: directory to save the files into
+    @param stopRequested: set (from a signal handler) to shut down
+    @return true if the daemon shut down cleanly, false otherwise
+
+    Everything that's expensive to set up happens once, instead of once per transfer:
+    the listening socket, the cipher suite ranking, the ticket key, the cipher contexts
+    (see Crypto::GetCipherContext()) and the file buffers (see ReceiveFile()).
+
+    Each sender gets a thread of its own, so a sender with a pool of connections
+    (see Ssftp::SenderPool) is served on all of them at once. Up to maxSessions senders
+    are served at a time, the rest wait in the listen queue.
+
+    Shutting down is graceful. Once a stop is requested no new senders are accepted, but
+    senders that are already connected are served until they end their sessions, so no
+    transfer is ever cut off halfway through.
+
+    One sender can't take the others down with it: an exception in a session only ends
+    that session, and a sender that sends nothing for idleTimeout seconds is dropped
+    (SO_RCVTIMEO makes the read fail), so it can't hold up the drain either.
+*/
+bool FileReceiver::RunDaemon(const std::string& directory, const std::atomic<bool>& stopRequested) {
+
+    constexpr size_t maxSessions = 64;
+
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (error) {
+        Log::Error("RunDaemon()", std::format("Failed to create '{}': {}", directory, error.message()));
+        return false;
+    }
+
+    Log::Info("RunDaemon()", std::format("Saving files into {}, send SIGTERM or SIGINT to stop", directory));
+
+    // A session's thread, and whether it's done (so it can be joined without waiting)
+    struct Session {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> finished;
+    };
+    std::vector<Session> running;
+    std::atomic<uint64_t> totalFiles = 0;
+    uint64_t sessions = 0;
+
+    const auto joinFinished = [&](const bool all) {
+        for (auto it = running.begin(); it != running.end();) {
+            if (all || *it->finished) {
+                it->thread.join();
+                it = running.erase(it);
+            }
+            else
+                it++;
+        }
+    };
+
+    while (stopRequested == false) {
+        joinFinished(false);
+
+        /*
+            Wait for a sender in short slices rather than blocking in accept(), so that
+            a stop request is noticed even if no sender ever shows up again.
+            When we're already serving as many senders as we allow, only wait for one of
+            them to finish
+        */
+        if (running.size() >= maxSessions) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        pollfd listener = {serverFD, POLLIN, 0};
+        const int ready = poll(&listener, 1, 500);
+        if (ready < 0 && errno != EINTR) {
+            Log::Error("RunDaemon()", "Error waiting for connections");
+            break;
+        }
+        if (ready <= 0)
+            continue;
+
+        const int socket = accept(serverFD, nullptr, nullptr);
+        if (socket < 0) {
+            Log::Error("RunDaemon()", "Accept error");
+            continue;
+        }
+
+        const uint64_t id = ++sessions;
+        auto finished = std::make_shared<std::atomic<bool>>(false);
+        // Reads and writes that make no progress for idleTimeout seconds fail
+        if (idleTimeout > 0) {
+            const timeval timeout = {static_cast<time_t>(idleTimeout), 0};
+            setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        }
+
+        std::thread thread([this, socket, id, finished, &directory, &totalFiles]() {
+            FileReceiver session(*this, socket);
+
+            // A failed handshake is that sender's problem, not a reason to stop serving everyone else
+            uint64_t filesReceived = 0;
+            try {
+                SSFTP_TRACE(accept_begin, socket);
+                const bool handshake = session.OfferSharedMemory() && session.PerformHandshake();
+                SSFTP_TRACE(accept_end, socket, handshake);
+                if (handshake == false)
+                    Log::Error("RunDaemon()", std::format("Session {}: handshake failed", id));
+                else if (session.ReceiveNamedFiles(directory, filesReceived))
+                    Log::Info("RunDaemon()", std::format("Session {}: {} files received ({} in total), memory: {}", id, filesReceived,
+                        totalFiles += filesReceived, MemoryBudget::Describe()));
+                else {
+                    totalFiles += filesReceived;
+                    Log::Error("RunDaemon()", std::format("Session {} ended early after {} files", id, filesReceived));
+                }
+            }
+            // Same for anything thrown on the way (std::bad_alloc, std::filesystem::filesystem_error...)
+            catch (const std::exception& exception) {
+                totalFiles += filesReceived;
+                Log::Error("RunDaemon()", std::format("Session {} failed after {} files: {}", id, filesReceived, exception.what()));
+            }
+
+            *finished = true;
+        });
+        running.push_back({std::move(thread), std::move(finished)});
+    }
+
+    // Drain: let every connected sender finish
+    joinFinished(false);
+    if (running.empty() == false)
+        Log::Info("RunDaemon()", std::format("Waiting for {} sessions to end", running.size()));
+    joinFinished(true);
+
+    Log::Success("RunDaemon()", std::format("Shut down after {} sessions and {} files", sessions, totalFiles.load()));
+    Log::Info("RunDaemon()", std::format("Memory: {}", MemoryBudget::Describe()));
+    return true;
+}
+
+/*
+    Close the connection to the current client, but keep listening for new ones
+*/
+void FileReceiver::DisconnectClient() {
+
+    ring = nullptr;
+    if (udp) {
+        Log::Info("DisconnectClient()", std::format("UDP channel: {}", udp->Describe()));
+        udp = nullptr;
+    }
+    if (clientSocket != -1) {
+        close(clientSocket);
+        clientSocket = -1;
+    }
+
+    return;
+}
+
+/*
+    Close the connection
+*/
+void FileReceiver::CloseConnection() {
+    
+    DisconnectClient();
+
+    if (serverFD != -1) {
+        close(serverFD);
+        serverFD = -1;
+
+        // Don't leave the Unix socket behind
+        if (sharedMemoryPath.empty() == false)
+            unlink(sharedMemoryPath.c_str());
+    }
+    if (udpFD != -1) {
+        close(udpFD);
+        udpFD = -1;
+    }
+
+    return;
+}
@@ -0,0 +1,1330 @@
+#include <iostream>
+#include <fstream>
+#include <format>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <variant>
+#include <semaphore>
+#include <filesystem>
+#include <unordered_map>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/chunk_tuner.hpp"
+#include "../include/cpu_features.hpp"
+#include "../include/crypto.hpp"
+#include "../include/file_index.hpp"
+#include "../include/file_sender.hpp"
+#include "../include/key_exchange.hpp"
+#include "../include/logger.hpp"
+#include "../include/protocol.hpp"
+#include "../include/rate_limiter.hpp"
+#include "../include/scheduler.hpp"
+#include "../include/sparse.hpp"
+#include "../include/trace.hpp"
+#include "../include/tree.hpp"
+#include "../include/utils.hpp"
+#include "../include/work_queue.hpp"
+
+/*
+    Open a TCP connection to the server
+    @return true if connection is successful, false otherwise
+*/
+bool FileSender::OpenTcpConnection() {
+        
+    // Set server information
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(serverPort);
+
+    // Create a socket - IPv4, TCP
+    socketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (socketFD < 0) {
+        Log::Error("ConnectToServer()", "Socket creation error");
+        return false;
+    }
+
+    // Convert addresses from text to binary form
+    int inetStatus = inet_pton(AF_INET, serverIP.c_str(), &serverAddr.sin_addr);
+    if (inetStatus <= 0) {
+        Log::Error("ConnectToServer()", "Invalid address/Address not supported");
+        return false;
+    }
+
+    // Connect to the server
+    int connectStatus = connect(socketFD, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
+    if (connectStatus < 0) {
+        Log::Error("ConnectToServer()", "Connection failed");
+        return false;
+    }
+    return true;
+}
+
+/*
+    Connect to a receiver on this host, through its Unix socket, and take the shared
+    memory ring it offers for the file data, see shm_ring.hpp
+    @return true if connection is successful, false otherwise
+*/
+bool FileSender::OpenSharedMemoryConnection() {
+
+    socketFD = ShmRing::ConnectUnixSocket(sharedMemoryPath);
+    if (socketFD < 0) {
+        Log::Error("ConnectToServer()", std::format("Connection to '{}' failed", sharedMemoryPath));
+        return false;
+    }
+    return ring.Accept(socketFD);
+}
+
+/*
+    Open the UDP data channel, see udp_transport.hpp
+    The receiver sends the channel's token over the connection once the handshake is done,
+    and listens for UDP on the same port as TCP (so a proxy in between has to relay both)
+    @return true if successful, false otherwise
+*/
+bool FileSender::OpenUdpChannel() {
+
+    // A receiver without --udp sends nothing, don't wait for it forever
+    uint32_t token = 0;
+    pollfd control = {socketFD, POLLIN, 0};
+    if (poll(&control, 1, 5000) <= 0 || Protocol::ReadAll(socketFD, &token, sizeof(token)) == false) {
+        Log::Error("OpenUdpChannel()", "The receiver didn't open a UDP channel, is it running with --udp?");
+        return false;
+    }
+
+    udp = std::make_unique<Udp::Channel>();
+    return udp->Connect(serverIP, serverPort, token, socketFD);
+}
+
+/*
+    Connect to the server
+    @return true if connection is successful, false otherwise
+*/
+bool FileSender::ConnectToServer() {
+
+    // Over TCP, or through shared memory to a receiver on this host (--shm)
+    SSFTP_TRACE(connect_begin, serverPort);
+    const bool connected = sharedMemoryPath.empty() ? OpenTcpConnection() : OpenSharedMemoryConnection();
+    if (connected == false) {
+        SSFTP_TRACE(connect_end, socketFD, false, false);
+        return false;
+    }
+
+    // Every connection is a different link as far as chunk sizes go
+    chunkTuner.Reset();
+
+    // Agree on how to encrypt everything that follows, and time it
+    const auto handshakeStart = std::chrono::steady_clock::now();
+    if (PerformHandshake() == false) {
+        Log::Error("ConnectToServer()", "Handshake failed");
+        SSFTP_TRACE(connect_end, socketFD, false, false);
+        return false;
+    }
+    lastHandshakeMicros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - handshakeStart).count();
+
+    // File data goes over UDP from here on (--udp), everything else stays on this connection
+    if (useUdp && OpenUdpChannel() == false) {
+        SSFTP_TRACE(connect_end, socketFD, false, false);
+        return false;
+    }
+
+    SSFTP_TRACE(connect_end, socketFD, true, lastHandshakeResumed);
+
+    Log::Info("ConnectToServer()", std::format("{} handshake took {:.0f} us",
+        lastHandshakeResumed ? "Resumed" : "Full", lastHandshakeMicros));
+    return true;
+}
+
+/*
+    Agree on a cipher suite and session keys with the receiver
+    @return true if both ends agreed, false otherwise
+
+    The handshake is a single round trip in the common case
+    1. The sender (us) advertises every suite it supports, each with a score telling
+       how fast it runs on this machine, and the hash algorithms it supports
+    2. Right behind it, without waiting, we send our half of the key exchange: either
+       a fresh X25519 public key, or the session ticket from our last connection
+    3. The receiver picks the suite that's fastest on both ends (and a hash algorithm),
+       and sends back its choice along with its half of the key exchange (and a new ticket)
+
+    If the receiver can't use our ticket, it asks us to retry with a public key, which
+    costs one more round trip.
+
+    The receiver gets the final say on the suite so that a single receiver can serve many
+    different senders with a consistent policy, see FileReceiver::PerformHandshake()
+*/
+bool FileSender::PerformHandshake() {
+
+    // Rank our suites once, the CPU isn't going to change between connections
+    if (localSuites.empty()) {
+        const Cpu::Features& features = Cpu::DetectFeatures();
+        localSuites = Crypto::RankCipherSuites(features, benchmarkSuites, allowedSuites);
+        Log::Info("PerformHandshake()", std::format("CPU features: {}", Cpu::DescribeFeatures(features)));
+    }
+
+    // Step 1: Advertise our suites, and the hash algorithms we're fine with
+    if (Protocol::SendSuiteList(socketFD, localSuites) == false ||
+        Protocol::SendHashList(socketFD, localHashes) == false)
+        return false;
+
+    /*
+        Step 2: Our half of the key exchange
+        Present the saved ticket if we have one, which lets both ends skip X25519 entirely
+    */
+    KeyExchange::ClientSession savedSession = {};
+    const bool haveTicket = sessionFile.empty() == false && KeyExchange::LoadClientSession(sessionFile, savedSession);
+
+    Protocol::KeyHello hello = {};
+    KeyExchange::KeyPair keyPair = {};
+    if (KeyExchange::GenerateRandom(hello.clientRandom) == false)
+        return false;
+
+    if (haveTicket) {
+        hello.mode = Protocol::HandshakeMode::Resume;
+        hello.ticket = savedSession.ticket;
+    }
+    else {
+        hello.mode = Protocol::HandshakeMode::Full;
+        if (KeyExchange::GenerateKeyPair(keyPair) == false)
+            return false;
+        hello.clientPublicKey = keyPair.publicKey;
+    }
+
+    if (Protocol::SendKeyHello(socketFD, hello) == false)
+        return false;
+
+    // Step 3: Read back what the receiver picked
+    Byte chosenSuite = 0;
+    if (Protocol::ReadAll(socketFD, &chosenSuite, sizeof(chosenSuite)) == false) {
+        Log::Error("PerformHandshake()", "Error reading chosen cipher suite");
+        return false;
+    }
+
+    // Make sure the receiver picked something we actually offered
+    cipherSuite = static_cast<Crypto::CipherSuite>(chosenSuite);
+    bool offered = std::any_of(localSuites.begin(), localSuites.end(), [this](const Crypto::SuiteScore& entry) {
+        return entry.suite == cipherSuite;
+    });
+    if (offered == false) {
+        Log::Error("PerformHandshake()", "Receiver did not pick any of the offered cipher suites");
+        return false;
+    }
+
+    // Same for the hash algorithm, which comes right after the suite
+    Byte chosenHash = 0;
+    if (Protocol::ReadAll(socketFD, &chosenHash, sizeof(chosenHash)) == false) {
+        Log::Error("PerformHandshake()", "Error reading chosen hash algorithm");
+        return false;
+    }
+    hashAlgorithm = static_cast<Crypto::HashAlgorithm>(chosenHash);
+    if (std::find(localHashes.begin(), localHashes.end(), hashAlgorithm) == localHashes.end()) {
+        Log::Error("PerformHandshake()", "Receiver did not pick any of the offered hash algorithms");
+        return false;
+    }
+
+    Protocol::KeyReply reply = {};
+    if (Protocol::ReadKeyReply(socketFD, reply) == false)
+        return false;
+
+    // The receiver didn't accept our ticket, fall back to a full key exchange
+    if (reply.mode == Protocol::HandshakeMode::RetryFull) {
+        if (KeyExchange::GenerateKeyPair(keyPair) == false)
+            return false;
+        if (Protocol::SendAll(socketFD, keyPair.publicKey.data(), keyPair.publicKey.size()) == false) {
+            Log::Error("PerformHandshake()", "Error sending public key");
+            return false;
+        }
+        if (Protocol::ReadKeyReply(socketFD, reply) == false)
+            return false;
+    }
+
+    /*
+        Work out the input secret for the key derivation
+        - Full handshake: X25519 of our private key and the receiver's public key
+        - Resumed handshake: the resumption secret we saved along with the ticket
+    */
+    KeyExchange::Secret inputSecret = {};
+    if (reply.mode == Protocol::HandshakeMode::Full) {
+        if (KeyExchange::DeriveSharedSecret(keyPair, reply.serverPublicKey, inputSecret) == false)
+            return false;
+    }
+    else if (reply.mode == Protocol::HandshakeMode::Resume && haveTicket) {
+        inputSecret = savedSession.resumptionSecret;
+    }
+    else {
+        Log::Error("PerformHandshake()", "Unexpected handshake mode from receiver");
+        return false;
+    }
+    lastHandshakeResumed = reply.mode == Protocol::HandshakeMode::Resume;
+
+    // Derive this session's keys, and the secret that goes with the new ticket
+    KeyExchange::Secret masterSecret = {};
+    KeyExchange::ClientSession newSession = {};
+    bool derived =
+        KeyExchange::DeriveMasterSecret(inputSecret, lastHandshakeResumed, hello.clientRandom, reply.serverRandom, masterSecret) &&
+        KeyExchange::DeriveSessionKeys(masterSecret, sessionKeys) &&
+        KeyExchange::DeriveResumptionSecret(masterSecret, newSession.resumptionSecret);
+    if (derived == false) {
+        Log::Error("PerformHandshake()", "Error deriving session keys");
+        return false;
+    }
+
+    // Keep the new ticket for the next connection
+    if (sessionFile.empty() == false && reply.ticket.empty() == false) {
+        newSession.expiry = KeyExchange::CurrentTime() + KeyExchange::ticketLifetimeSeconds;
+        newSession.ticket = reply.ticket;
+        KeyExchange::SaveClientSession(sessionFile, newSession);
+    }
+
+    Log::Info("PerformHandshake()", std::format("Using cipher suite {}, hash {}",
+        Crypto::CipherSuiteName(cipherSuite), Crypto::HashAlgorithmName(hashAlgorithm)));
+    return true;
+}
+
+/*
+    Load the contents of a file into a vector
+    @param filename: path to the file
+    @param data: vector to store the file contents
+    @return true if file is loaded successfully, false otherwise
+
+    Normally, the file would be read in chunks and sent to the server,
+    to avoid creating unnecessarily large buffers and wasting memory.
+    But for simplicity, the entire file is read into memory at once.
+*/
+bool FileSender::LoadFileIntoVector(const std::string& filename, std::vector<Byte>& data) {
+    // Open file in binary mode
+    std::ifstream infile(filename, std::ios::binary);
+    if (infile.fail()) {
+        Log::Error("LoadFileIntoVector()", std::format("Failed to open file '{}'", filename));
+        return false;
+    }
+
+    /*
+        Load the file contents into a vector
+        Find the size by seeking to the end, then read everything with a single read() call.
+
+        (This used to be done with `istreambuf_iterator`, which reads the file one byte at a
+        time and grows the vector as it goes. Much shorter, but many times slower, and it
+        showed up badly once directories with thousands of files came into the picture)
+    */
+    infile.seekg(0, std::ios::end);
+    const std::streamsize fileSize = infile.tellg();
+    infile.seekg(0, std::ios::beg);
+    SSFTP_TRACE(file_open, Trace::CurrentFile(), filename.c_str(), fileSize);
+
+    data.resize(fileSize);
+    infile.read(reinterpret_cast<char*>(data.data()), fileSize);
+    SSFTP_TRACE(file_read, Trace::CurrentFile(), infile.gcount());
+    SSFTP_TRACE(file_close, Trace::CurrentFile());
+    if (infile.gcount() != fileSize) {
+        Log::Error("LoadFileIntoVector()", std::format("Failed to read file '{}'", filename));
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+    Encrypt the file contents and send it to the server
+    @param plainFileData: file contents
+    @return true if file is sent successfully, false otherwise
+
+    Similar to LoadFileIntoVector(), the chunks that were read into memory
+    could be encrypted and sent to the server in chunks, to avoid creating
+    unnecessarily large buffers and wasting memory.
+
+    But for simplicity, the entire file is encrypted and sent at once.
+*/
+bool FileSender::EncryptAndSend(std::span<const Byte> plainFileData) {
+
+    /*
+        Encrypt the file contents using the negotiated cipher suite (AES-256-CBC by default)
+        See Crypto::EncryptData() in crypto.cpp for more details
+        
+        The key and IV (Initialization Vector) were derived for this session during the handshake,
+        see FileSender::PerformHandshake() and key_exchange.hpp for more details
+    */
+    std::vector<Byte> encryptedData(Crypto::MaxEncryptedSize(plainFileData.size(), cipherSuite));
+    ssize_t encryptedSize = Crypto::EncryptData(plainFileData, encryptedData, cipherSuite, sessionKeys);
+    if (encryptedSize < 0) {
+        Log::Error("EncryptAndSend()", "Error encrypting file");
+        return false;
+    }
+    encryptedData.resize(encryptedSize);
+
+    return SendEncryptedData(encryptedData);
+}
+
+
+/*
+    Send encrypted data to the server, preceded by its size
+    @param encryptedData: the data to send
+    @return true if the data is sent successfully, false otherwise
+*/
+bool FileSender::SendEncryptedData(const std::vector<Byte>& encryptedData) {
+
+    /*
+        Send size of encrypted data to the server
+        This is done so that the server knows how much data to expect
+
+        We cannot send the size of the file prior to encryption, since AES encryption
+        will change the size of the data (padding will be added)
+        Hence, encryption is carried first, then the size of the vector is taken
+    */
+    size_t fileSize = encryptedData.size();
+    if (Protocol::SendAll(socketFD, &fileSize, sizeof(fileSize)) == false) {
+        Log::Error("SendEncryptedData()", "Error sending file size");
+        return false;
+    }
+    
+    /*
+        Send the encrypted file contents to the server in chunks
+        The chunk size isn't fixed, `chunkTuner` adjusts it as we go, based on how fast
+        the data is going out, see chunk_tuner.hpp
+    */
+    size_t totalBytesSent = 0;
+    size_t totalSize = encryptedData.size();
+    while (totalBytesSent < totalSize) {
+        // Send the min amongst the chunk size, or how much ever is left to send
+        size_t chunkSize = std::min(chunkTuner.ChunkSize(), totalSize - totalBytesSent);
+
+        // Wait for our turn if we're being rate limited
+        ReloadRatesIfRequested();
+        globalBucket.Acquire(chunkSize);
+
+        // Into the socket, the shared memory ring, or the UDP channel, each takes what fits
+        const auto sendStart = std::chrono::steady_clock::now();
+        ssize_t sentBytes = SendPayloadSome(encryptedData.data() + totalBytesSent, chunkSize);
+        if (sentBytes <= 0) {
+            Log::Error("SendEncryptedData()", "Error sending encrypted file");
+            return false;
+        }
+        chunkTuner.OnChunkSent(socketFD, sentBytes, std::chrono::steady_clock::now() - sendStart);
+        SSFTP_TRACE(chunk_send, Trace::CurrentFile(), sentBytes, totalBytesSent);
+
+        // send() may take less than the whole chunk, carry on from wherever it stopped
+        totalBytesSent += sentBytes;
+    }
+
+    /*
+        The following code is equivalent to the above while loop, but is more readable
+        It does not send the file in chunks, instead opting to send it out all at once
+
+        This is not recommended for operation however, as it can lead to memory issues
+
+        Still, if you feel like the above loop is too complicated, you can use this instead
+    */
+    /* 
+        int sentBytes = send(socketFD, encryptedData.data(), encryptedData.size(), 0);
+        if (sentBytes < 0) {
+            Log::Error("SendEncryptedData()", "Error sending encrypted file");
+            return false;
+        }
+    */
+
+    return true;
+}
+
+
+/*
+    Send file data, through the shared memory ring or the UDP channel if there is one,
+    the socket otherwise
+    @param data: the data to send
+    @param size: how many bytes
+    @return true if everything was sent, false otherwise
+*/
+bool FileSender::SendPayload(const Byte* data, size_t size) {
+    if (ring.IsOpen())
+        return ring.Write(data, size);
+    if (udp)
+        return udp->Write(data, size);
+    return Protocol::SendAll(socketFD, data, size);
+}
+
+/*
+    Same as SendPayload(), but only as much as fits right now
+    @return how many bytes were sent, 0 or less on error (like send())
+*/
+ssize_t FileSender::SendPayloadSome(const Byte* data, size_t size) {
+    if (ring.IsOpen())
+        return static_cast<ssize_t>(ring.WriteSome(data, size));
+    if (udp)
+        return static_cast<ssize_t>(udp->WriteSome(data, size));
+    return send(socketFD, data, size, 0);
+}
+
+
+/*
+    Re-read the rate config, if we've been asked to with SIGHUP
+    @return true if the rates were re-read, false otherwise
+*/
+bool FileSender::ReloadRatesIfRequested() {
+
+    if (RateLimit::TakeReloadRequest() == false || rateConfigFile.empty())
+        return false;
+
+    uint64_t globalRate = globalBucket.Rate();
+    if (RateLimit::LoadRateConfig(rateConfigFile, globalRate, transferRate) == false)
+        return false;
+
+    globalBucket.SetRate(globalRate);
+    Log::Info("ReloadRatesIfRequested()", std::format("Rates are now {} B/s overall, {} B/s per file (0 = unlimited)",
+        globalRate, transferRate));
+    return true;
+}
+
+
+/*
+    Calculate hash of the file and send it to the server
+    @param data: file contents
+    @return true if hash is sent successfully, false otherwise
+*/
+bool FileSender::CalculateHashAndSend(std::span<const Byte> data) {
+
+    // Calculate hash of the file
+    Crypto::Digest hash;
+    bool hashStatus = Crypto::CalculateHash(data, hash, hashAlgorithm, hashThreads);
+    if (hashStatus == false) {
+        Log::Error("CalculateHashAndSend()", "Error calculating hash");
+        return false;
+    }
+
+    /*
+        Normally, you'd also encrypt the hash of the file using `Crypto::EncryptData()`
+        and send it to the server.
+        But for simplicity, the hash is sent as is.
+    */
+    if (Protocol::SendAll(socketFD, hash.data(), hash.size()) == false) {
+        Log::Error("CalculateHashAndSend()", "Error sending hash");
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+    Send a file to the server
+    @param filename: path to the file to send
+    @return true if file is sent successfully, false otherwise
+*/
+bool FileSender::SendFile(const std::string& filename) {
+
+    Trace::BeginFile();
+    
+    // -- Step 1 --
+    // Load the file into a vector
+    std::vector<Byte> plainFileData;
+    bool loadedData = LoadFileIntoVector(filename, plainFileData);
+    if (loadedData == false) {
+        Log::Error("SendFile()", "Error loading file");
+        return false;
+    }
+    
+    // -- Step 2 --
+    // Encrypt and send the file to the server
+    bool sentToServer = EncryptAndSend(plainFileData);
+    if (sentToServer == false) {
+        Log::Error("SendFile()", "Error sending encrypted file");
+        return false;
+    }
+    
+    // -- Step 3 --
+    // Calculate hash and send it to the server
+    bool sentHash = CalculateHashAndSend(plainFileData);
+    if (sentHash == false) {
+        Log::Error("SendFile()", "Error sending hash");
+        return false;
+    }
+
+    Log::Success("SendFile()", std::format("File {} sent successfully!", filename));
+    return true;
+}
+
+
+/*
+    Send a file along with the name to save it as, for a receiver daemon (-D)
+    @param filename: path to the file to send
+    @param name: where the receiver should save it, relative to its directory
+    @return true if file is sent successfully, false otherwise
+
+    A daemon doesn't know up front what's coming, so every file is announced with a
+    NamedFile message first: its name and size, encrypted like everything else.
+    After that come the same three steps as SendFile().
+*/
+bool FileSender::SendNamedFile(const std::string& filename, const std::string& name) {
+
+    Trace::BeginFile();
+
+    // -- Step 1 --
+    std::vector<Byte> plainFileData;
+    if (LoadFileIntoVector(filename, plainFileData) == false) {
+        Log::Error("SendNamedFile()", "Error loading file");
+        return false;
+    }
+
+    // -- Steps 2 and 3 --
+    if (SendNamedData(plainFileData, name) == false)
+        return false;
+
+    Log::Success("SendNamedFile()", std::format("File {} sent successfully as {}!", filename, name));
+    return true;
+}
+
+/*
+    Send data that's already in memory as a named file, for a receiver daemon (-D)
+    @param data: contents of the file
+    @param name: where the receiver should save it, relative to its directory
+    @return true if sent successfully, false otherwise (the connection is closed then)
+
+    Steps 2 and 3 of SendNamedFile(), for callers that make up the data themselves,
+    like tools/load_generator.cpp, which mustn't be held back by reading files
+*/
+bool FileSender::SendNamedData(std::span<const Byte> data, const std::string& name) {
+    std::vector<Byte> header;
+    Protocol::SerializeNamedFileHeader(name, data.size(), header);
+    return SendNamedMessage(static_cast<Byte>(Protocol::MessageType::NamedFile), header, data);
+}
+
+/*
+    Send part of a named file, for a receiver daemon (-D), see Protocol::MessageType::NamedFileChunk
+    @param data: this part of the file
+    @param name: where the receiver should save the file, relative to its directory
+    @param fileSize: size of the whole file
+    @param offset: where in the file this part goes, parts must be sent in order
+    @return true if sent successfully, false otherwise (the connection is closed then)
+
+    Other files can be sent between two parts of a file, that's the point, see SendScheduledFiles()
+*/
+bool FileSender::SendNamedChunk(std::span<const Byte> data, const std::string& name, uint64_t fileSize, uint64_t offset) {
+    std::vector<Byte> header;
+    Protocol::SerializeNamedChunkHeader(name, fileSize, offset, header);
+    return SendNamedMessage(static_cast<Byte>(Protocol::MessageType::NamedFileChunk), header, data);
+}
+
+/*
+    Send a named file or chunk: its message type, its header, then the data and its hash
+    @param type: the message type
+    @param header: the header, before encryption
+    @param data: the file, or the chunk
+    @return true if sent successfully, false otherwise (the connection is closed then)
+*/
+bool FileSender::SendNamedMessage(Byte type, const std::vector<Byte>& header, std::span<const Byte> data) {
+
+    // The header goes out like a (very small) file of its own
+    bool sent =
+        Protocol::SendAll(socketFD, &type, sizeof(type)) &&
+        EncryptAndSend(header) &&
+        EncryptAndSend(data) &&
+        CalculateHashAndSend(data);
+    if (sent == false) {
+        // Part of the file may be out, the receiver can't make sense of anything we'd send next
+        Log::Error("SendNamedMessage()", "Error sending file");
+        CloseConnection();
+        return false;
+    }
+    return true;
+}
+
+/*
+    Tell a receiver daemon that we're done, so it can move on to the next sender
+    @return true if sent successfully, false otherwise
+*/
+bool FileSender::EndSession() {
+    const Byte type = static_cast<Byte>(Protocol::MessageType::SessionEnd);
+    if (Protocol::SendAll(socketFD, &type, sizeof(type)) == false) {
+        Log::Error("EndSession()", "Error ending the session");
+        return false;
+    }
+    return true;
+}
+
+
+/*
+    Send a sparse file to the server, skipping its holes
+    @param filename: path to the file to send
+    @return true if file is sent successfully, false otherwise
+
+    Same three steps as SendFile(), except that step 1 only loads the data extents of the
+    file (see Sparse::MapDataExtents()), behind a map of where they go. The holes are
+    never read, encrypted, hashed or sent, see FileReceiver::ReceiveSparseFile() for how
+    they're recreated on the other end.
+*/
+bool FileSender::SendSparseFile(const std::string& filename) {
+
+    Trace::BeginFile();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat fileInfo = {};
+    if (fd < 0 || fstat(fd, &fileInfo) != 0) {
+        Log::Error("SendSparseFile()", std::format("Failed to open file '{}'", filename));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    // -- Step 1 --
+    // Map out the data extents, and load the map followed by the data into a vector
+    const uint64_t fileSize = fileInfo.st_size;
+    std::vector<Sparse::Extent> extents;
+    std::vector<Byte> plainData;
+    bool loadedData = Sparse::MapDataExtents(fd, fileSize, extents);
+    if (loadedData) {
+        Protocol::SerializeExtentMap(fileSize, extents, plainData);
+        loadedData = Sparse::ReadExtents(fd, extents, plainData);
+    }
+    close(fd);
+
+    if (loadedData == false) {
+        Log::Error("SendSparseFile()", "Error loading file");
+        return false;
+    }
+
+    // -- Steps 2 and 3 --
+    // Encrypt and send, then hash and send, exactly like SendFile()
+    if (EncryptAndSend(plainData) == false || CalculateHashAndSend(plainData) == false) {
+        Log::Error("SendSparseFile()", "Error sending file");
+        return false;
+    }
+
+    const uint64_t dataSize = plainData.size() - Protocol::extentMapHeaderSize - extents.size() * Protocol::extentMapEntrySize;
+    Log::Success("SendSparseFile()", std::format("File {} sent successfully! {} of {} bytes were data ({} extents), {} bytes of holes skipped",
+        filename, dataSize, fileSize, extents.size(), fileSize - dataSize));
+    return true;
+}
+
+
+/*
+    Send a whole directory tree to the server
+    @param root: directory to send
+    @param threads: number of threads used to walk the tree and to load/encrypt files
+    @return true if the tree is sent successfully, false otherwise
+
+    Sending a tree one file at a time (load, encrypt, send, hash, repeat) leaves the
+    network idle while we read from disk, and the disk idle while we send. Instead,
+    three groups of threads work at the same time:
+
+    1. Scanner threads walk the tree (see Tree::ParallelScan()), and hand every entry to
+       the main thread, and every file to the loader threads
+    2. Loader threads load, encrypt and hash files, up to `maxFilesInFlight` at a time
+    3. The main thread (this function) sends whatever is ready, in the order it
+       became ready:
+       - entries are grouped into batches, so that the receiver learns about directories
+         and file sizes early and can create/preallocate them before any contents arrive
+       - file contents are sent as soon as a loader is done with them, in chunks tagged
+         with the file's id so the receiver knows where they go. Files that are ready at
+         the same time take turns, and the whole thing can be rate limited, see SetRates()
+
+    Everything goes through a single queue (`outbox`), and an entry is always put in there
+    before its file is handed to a loader, so an entry is always sent before its contents.
+
+    With an index (--incremental, see file_index.hpp), the scanners look every entry up in
+    it, and if the receiver still has what the index describes, entries that haven't changed
+    go no further: they're never loaded, and the receiver never hears of them. Every entry
+    goes into the new index, which is saved once the transfer is done.
+
+    A file that can't be read (no permission, gone since the scan...) doesn't stop the
+    others: the receiver is told to forget its entry, it's left out of the new index so
+    that the next transfer tries again, and it's listed at the end.
+*/
+bool FileSender::SendDirectory(const std::string& root, const unsigned threads) {
+
+    // Entries are sent in batches of up to this many
+    constexpr size_t maxBatchSize = 1024;
+    // Files loaded and encrypted, but not yet sent, at most
+    constexpr ptrdiff_t maxFilesInFlight = 64;
+
+    struct PreparedFile {
+        uint32_t id;
+        std::string path;
+        bool ready;
+        std::vector<Byte> encryptedData;
+        Crypto::Digest hash;
+    };
+    using OutboxItem = std::variant<Tree::Entry, PreparedFile>;
+
+    WorkQueue<OutboxItem> outbox(maxBatchSize * 4);
+    WorkQueue<Tree::Entry> loadQueue(maxBatchSize * 4);
+    std::counting_semaphore<> filesInFlight(maxFilesInFlight);
+    std::atomic<uint32_t> nextId = 0;
+    std::atomic<bool> aborted = false;
+    bool scanComplete = true;
+
+    const auto startTime = std::chrono::steady_clock::now();
+
+    // Incremental mode: what the last transfer sent, and whether the receiver still has it
+    FileIndex::Index index;
+    bool receiverInSync = false;
+    if (indexFile.empty() == false && ExchangeIndexSummary(index, receiverInSync) == false)
+        return false;
+
+    /*
+        Everything the scan finds, for the new index. Unchanged entries keep the hash the
+        index had, files that are sent get theirs (matched by id) once they're ready
+    */
+    struct ScannedEntry {
+        FileIndex::Record record;
+        uint32_t id;
+    };
+    std::vector<ScannedEntry> scanned;
+    std::mutex scannedMutex;
+    std::unordered_map<uint32_t, Crypto::Digest> sentHashes;
+    // Files that couldn't be read, by id
+    std::unordered_map<uint32_t, std::string> skippedFiles;
+    std::atomic<uint64_t> entriesSkipped = 0;
+
+    // Loader threads: take a file, load, encrypt and hash it, and put it in the outbox
+    auto loader = [&]() {
+        while (std::optional<Tree::Entry> entry = loadQueue.Pop()) {
+            filesInFlight.acquire();
+            if (aborted)
+                return;
+
+            PreparedFile file = {entry->id, entry->fullPath, false, {}, {}};
+            std::vector<Byte> plainFileData;
+            Trace::SetFile(entry->id);
+            file.ready =
+                LoadFileIntoVector(entry->fullPath, plainFileData) &&
+                Crypto::EncryptData(plainFileData, file.encryptedData, cipherSuite, sessionKeys) &&
+                Crypto::CalculateHash(plainFileData, file.hash, hashAlgorithm);
+
+            if (file.ready == false)
+                Log::Error("SendDirectory()", std::format("Error preparing file '{}', skipping it", entry->fullPath));
+
+            outbox.Push(std::move(file));
+        }
+    };
+
+    /*
+        Producer thread: run the parallel scan, then wait for the loaders to finish
+        Entries get their id here, in the scanner callback, and go to the outbox before
+        the loaders ever see them
+    */
+    std::thread producer([&]() {
+        std::vector<std::thread> loaders;
+        for (unsigned i = 0; i < threads; i++)
+            loaders.emplace_back(loader);
+
+        scanComplete = Tree::ParallelScan(root, threads, [&](Tree::Entry&& entry) {
+            entry.id = nextId++;
+
+            if (indexFile.empty() == false) {
+                const FileIndex::Record* known = index.Find(entry.relativePath);
+                const bool skip = receiverInSync && known != nullptr && FileIndex::Unchanged(*known, entry);
+                {
+                    std::lock_guard<std::mutex> lock(scannedMutex);
+                    scanned.push_back({FileIndex::MakeRecord(entry, skip ? known->hash : std::array<Byte, 32>{}), entry.id});
+                }
+                if (skip) {
+                    entriesSkipped++;
+                    return;
+                }
+            }
+
+            Tree::Entry forLoader = entry;
+            if (outbox.Push(std::move(entry)) && forLoader.kind == Tree::EntryKind::File)
+                loadQueue.Push(std::move(forLoader));
+        });
+
+        loadQueue.Close();
+        for (std::thread& thread : loaders)
+            thread.join();
+        outbox.Close();
+    });
+
+    // Stop all the other threads, used when the main thread runs into an error
+    auto abortTransfer = [&]() {
+        aborted = true;
+        loadQueue.Close();
+        outbox.Close();
+        filesInFlight.release(maxFilesInFlight + threads);
+        producer.join();
+        return false;
+    };
+
+    // Encrypt and send a batch of entries
+    std::vector<Tree::Entry> batch;
+    auto flushBatch = [&]() {
+        if (batch.empty())
+            return true;
+
+        std::vector<Byte> plainBatch, encryptedBatch;
+        Protocol::SerializeTreeEntries(batch, plainBatch);
+        batch.clear();
+
+        const Byte type = static_cast<Byte>(Protocol::MessageType::TreeEntries);
+        return Crypto::EncryptData(plainBatch, encryptedBatch, cipherSuite, sessionKeys) &&
+            Protocol::SendAll(socketFD, &type, sizeof(type)) &&
+            SendEncryptedData(encryptedBatch);
+    };
+
+    /*
+        Files whose contents are being sent, and how far along each one is
+        Several files are sent at the same time, taking turns chunk by chunk, see
+        RateLimit::FairScheduler. Without this, a small file that's ready would have to
+        wait for a large one to be sent in full.
+    */
+    struct ActiveFile {
+        PreparedFile file;
+        size_t offset;
+    };
+    std::unordered_map<uint32_t, ActiveFile> activeFiles;
+    RateLimit::FairScheduler scheduler(chunkTuner.ChunkSize(), transferRate);
+
+    // A file is done once all of its contents are out, let a loader start on the next one
+    uint64_t filesSent = 0, directoriesSent = 0, bytesSent = 0;
+    auto finishFile = [&]() {
+        filesSent++;
+        filesInFlight.release();
+    };
+
+    /*
+        Main loop
+        1. Take whatever has come out of the outbox. We only wait for it when there's
+           nothing else to do, otherwise we just check what's immediately available
+        2. Send the entries gathered so far as soon as the outbox runs dry, so that a half
+           full batch goes out as soon as the scanners fall behind
+        3. Otherwise, send the next chunk of whichever file's turn it is
+    */
+    while (true) {
+        const bool idle = batch.empty() && scheduler.Empty();
+        std::optional<OutboxItem> item = idle ? outbox.Pop() : outbox.TryPop();
+
+        // Step 1
+        if (item.has_value()) {
+            if (Tree::Entry* entry = std::get_if<Tree::Entry>(&*item)) {
+                if (entry->kind == Tree::EntryKind::Directory)
+                    directoriesSent++;
+                batch.push_back(std::move(*entry));
+
+                if (batch.size() >= maxBatchSize && flushBatch() == false) {
+                    Log::Error("SendDirectory()", "Error sending directory entries");
+                    return abortTransfer();
+                }
+                continue;
+            }
+
+            // A new file is ready, make sure the receiver has seen its entry, then announce it
+            PreparedFile& file = std::get<PreparedFile>(*item);
+            if (flushBatch() == false) {
+                Log::Error("SendDirectory()", "Error sending directory entries");
+                return abortTransfer();
+            }
+
+            // Or couldn't be read, then the receiver drops its entry and we carry on
+            if (file.ready == false) {
+                const Byte type = static_cast<Byte>(Protocol::MessageType::TreeFileSkipped);
+                if (Protocol::SendAll(socketFD, &type, sizeof(type)) == false ||
+                    Protocol::SendAll(socketFD, &file.id, sizeof(file.id)) == false) {
+                    Log::Error("SendDirectory()", "Error sending directory entries");
+                    return abortTransfer();
+                }
+                skippedFiles[file.id] = std::move(file.path);
+                filesInFlight.release();
+                continue;
+            }
+
+            const Byte type = static_cast<Byte>(Protocol::MessageType::TreeFile);
+            const uint64_t encryptedSize = file.encryptedData.size();
+            bool sent =
+                Protocol::SendAll(socketFD, &type, sizeof(type)) &&
+                Protocol::SendAll(socketFD, &file.id, sizeof(file.id)) &&
+                Protocol::SendAll(socketFD, &encryptedSize, sizeof(encryptedSize)) &&
+                Protocol::SendAll(socketFD, file.hash.data(), file.hash.size());
+            if (sent == false) {
+                Log::Error("SendDirectory()", "Error sending file contents");
+                return abortTransfer();
+            }
+
+            const uint32_t fileId = file.id;
+            if (indexFile.empty() == false)
+                sentHashes[fileId] = file.hash;
+            if (encryptedSize == 0)
+                finishFile();
+            else {
+                scheduler.AddFlow(fileId, encryptedSize);
+                activeFiles.emplace(fileId, ActiveFile{std::move(file), 0});
+            }
+            continue;
+        }
+
+        // The outbox is closed and everything has been sent
+        if (idle)
+            break;
+
+        // Step 2
+        if (batch.empty() == false) {
+            if (flushBatch() == false) {
+                Log::Error("SendDirectory()", "Error sending directory entries");
+                return abortTransfer();
+            }
+            continue;
+        }
+
+        // Step 3
+        if (ReloadRatesIfRequested())
+            scheduler.SetFlowRate(transferRate);
+
+        uint32_t id = 0;
+        size_t length = 0;
+        RateLimit::Clock::duration wait;
+        if (scheduler.Next(id, length, wait) == false) {
+            // Every file is being held back by its own rate. Nap, but not for so long that
+            // we'd miss new files showing up in the outbox (those can go right away)
+            std::this_thread::sleep_for(std::min<RateLimit::Clock::duration>(wait, std::chrono::milliseconds(10)));
+            continue;
+        }
+
+        ActiveFile& active = activeFiles.at(id);
+        globalBucket.Acquire(length);
+
+        const Byte type = static_cast<Byte>(Protocol::MessageType::TreeFileData);
+        const uint32_t chunkLength = length;
+        const auto sendStart = std::chrono::steady_clock::now();
+        bool sent =
+            Protocol::SendAll(socketFD, &type, sizeof(type)) &&
+            Protocol::SendAll(socketFD, &id, sizeof(id)) &&
+            Protocol::SendAll(socketFD, &chunkLength, sizeof(chunkLength)) &&
+            SendPayload(active.file.encryptedData.data() + active.offset, length);
+        if (sent == false) {
+            Log::Error("SendDirectory()", "Error sending file contents");
+            return abortTransfer();
+        }
+        SSFTP_TRACE(chunk_send, id, length, active.offset);
+
+        // The chunk size picked by the tuner is how much a file gets to send per turn
+        chunkTuner.OnChunkSent(socketFD, length, std::chrono::steady_clock::now() - sendStart);
+        scheduler.SetQuantum(chunkTuner.ChunkSize());
+
+        active.offset += length;
+        bytesSent += length;
+        if (active.offset == active.file.encryptedData.size()) {
+            activeFiles.erase(id);
+            finishFile();
+        }
+    }
+
+    producer.join();
+
+    // Incremental mode: the new index, and its summary for the receiver to keep
+    if (indexFile.empty() == false) {
+        std::vector<FileIndex::Record> records;
+        records.reserve(scanned.size());
+        for (ScannedEntry& entry : scanned) {
+            if (skippedFiles.contains(entry.id))
+                continue;
+            auto hash = sentHashes.find(entry.id);
+            if (hash != sentHashes.end())
+                entry.record.hash = hash->second;
+            records.push_back(std::move(entry.record));
+        }
+        index.Assign(std::move(records));
+
+        const FileIndex::Summary summary = index.Summarize();
+        const Byte type = static_cast<Byte>(Protocol::MessageType::IndexUpdate);
+        bool sent =
+            Protocol::SendAll(socketFD, &type, sizeof(type)) &&
+            Protocol::SendAll(socketFD, &summary.entries, sizeof(summary.entries)) &&
+            Protocol::SendAll(socketFD, summary.digest.data(), summary.digest.size());
+        if (sent == false) {
+            Log::Error("SendDirectory()", "Error sending the index summary");
+            return false;
+        }
+    }
+
+    // Tell the receiver we're done, and how many files it should have gotten
+    const Byte type = static_cast<Byte>(Protocol::MessageType::TreeEnd);
+    if (Protocol::SendAll(socketFD, &type, sizeof(type)) == false ||
+        Protocol::SendAll(socketFD, &filesSent, sizeof(filesSent)) == false) {
+        Log::Error("SendDirectory()", "Error finishing directory transfer");
+        return false;
+    }
+
+    /*
+        If the receiver fails to save some file after all, it won't save the summary either,
+        so the next transfer won't match and sends everything again
+    */
+    if (indexFile.empty() == false) {
+        if (index.Save(indexFile) == false)
+            Log::Warning("SendDirectory()", "Could not save the index, the next transfer will send everything");
+        Log::Info("SendDirectory()", std::format("{} unchanged entries skipped, index of {} entries saved to {}",
+            entriesSkipped.load(), index.Size(), indexFile));
+    }
+
+    if (scanComplete == false)
+        Log::Warning("SendDirectory()", "Parts of the directory could not be read and were skipped");
+    if (skippedFiles.empty() == false) {
+        Log::Warning("SendDirectory()", std::format("{} files could not be read and were skipped:", skippedFiles.size()));
+        for (const auto& [id, path] : skippedFiles)
+            Log::Warning("SendDirectory()", path);
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    Log::Success("SendDirectory()", std::format(
+        "Sent {} files and {} directories ({:.1f} MB) in {:.2f} s: {:.0f} files/s, {:.1f} MB/s",
+        filesSent, directoriesSent, bytesSent / 1e6, seconds, filesSent / seconds, bytesSent / 1e6 / seconds));
+    return true;
+}
+
+
+/*
+    Send the receiver the summary of the index, and find out whether it still has what the index says
+    @param index: the index, loaded from `indexFile`
+    @param receiverInSync: true if only new or changed entries need to be sent
+    @return true if successful, false otherwise
+
+    An empty index (the first run) never matches, even a receiver that saved an empty
+    summary should get everything
+*/
+bool FileSender::ExchangeIndexSummary(FileIndex::Index& index, bool& receiverInSync) {
+
+    receiverInSync = false;
+    const auto startTime = std::chrono::steady_clock::now();
+    if (index.Load(indexFile) == false)
+        Log::Warning("ExchangeIndexSummary()", "Starting over with an empty index");
+    const FileIndex::Summary summary = index.Summarize();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    const Byte type = static_cast<Byte>(Protocol::MessageType::IndexSummary);
+    Byte reply = 0;
+    bool exchanged =
+        Protocol::SendAll(socketFD, &type, sizeof(type)) &&
+        Protocol::SendAll(socketFD, &summary.entries, sizeof(summary.entries)) &&
+        Protocol::SendAll(socketFD, summary.digest.data(), summary.digest.size()) &&
+        Protocol::ReadAll(socketFD, &reply, sizeof(reply));
+    if (exchanged == false) {
+        Log::Error("ExchangeIndexSummary()", "Error exchanging the index summary");
+        return false;
+    }
+
+    receiverInSync = reply == 1 && index.Size() > 0;
+    Log::Info("ExchangeIndexSummary()", std::format("Index of {} entries loaded in {:.3f} s, {}", index.Size(), seconds,
+        receiverInSync ? "the receiver is in sync, sending only what changed" : "the receiver is not in sync, sending everything"));
+    return true;
+}
+
+
+/*
+    Send many small files, packed together into segments
+    @param fileNames: paths to the files to send, they're saved under their file name only
+    @return true if all the files are sent successfully, false otherwise
+
+    Each segment is sent exactly like a single file would be by SendFile(): size, encrypted
+    contents, hash. See Protocol::PackedFile for what's inside a segment, and
+    FileReceiver::ReceivePackedFiles() for the other end.
+
+    A file that's larger than a whole segment simply gets a segment of its own.
+*/
+bool FileSender::SendPackedFiles(const std::vector<std::string>& fileNames) {
+
+    std::vector<Byte> segment;
+    std::vector<Protocol::PackedFile> index;
+
+    // Encrypt, send and hash the current segment, then start a new one
+    auto flushSegment = [&]() {
+        if (index.empty())
+            return true;
+
+        const size_t filesInSegment = index.size();
+        Protocol::FinishPackedSegment(segment, index);
+        bool sent = EncryptAndSend(segment) && CalculateHashAndSend(segment);
+
+        Log::Info("SendPackedFiles()", std::format("Sent a segment of {} files ({} bytes)", filesInSegment, segment.size()));
+        segment.clear();
+        index.clear();
+        return sent;
+    };
+
+    std::vector<Byte> contents;
+    for (const std::string& fileName : fileNames) {
+        if (LoadFileIntoVector(fileName, contents) == false) {
+            Log::Error("SendPackedFiles()", "Error loading file");
+            return false;
+        }
+
+        // Send what we have if this file doesn't fit
+        if (segment.size() + contents.size() > Protocol::maxPackedSegmentSize || index.size() >= Protocol::maxPackedFiles) {
+            if (flushSegment() == false) {
+                Log::Error("SendPackedFiles()", "Error sending segment");
+                return false;
+            }
+        }
+
+        index.push_back({std::filesystem::path(fileName).filename().string(), segment.size(), contents.size()});
+        segment.insert(segment.end(), contents.begin(), contents.end());
+    }
+
+    if (flushSegment() == false) {
+        Log::Error("SendPackedFiles()", "Error sending segment");
+        return false;
+    }
+
+    Log::Success("SendPackedFiles()", std::format("{} files sent successfully!", fileNames.size()));
+    return true;
+}
+
+
+/*
+    Load part of a file into a vector
+    @param filename: path to the file
+    @param offset: where the part starts
+    @param length: how long it is
+    @param data: vector to store the part in
+    @return true if all of it was loaded, false otherwise
+*/
+bool FileSender::LoadFileRange(const std::string& filename, uint64_t offset, uint64_t length, std::vector<Byte>& data) {
+    std::ifstream infile(filename, std::ios::binary);
+    if (infile.fail()) {
+        Log::Error("LoadFileRange()", std::format("Failed to open file '{}'", filename));
+        return false;
+    }
+
+    infile.seekg(offset, std::ios::beg);
+    data.resize(length);
+    infile.read(reinterpret_cast<char*>(data.data()), length);
+    if (static_cast<uint64_t>(infile.gcount()) != length) {
+        Log::Error("LoadFileRange()", std::format("Failed to read file '{}'", filename));
+        return false;
+    }
+    return true;
+}
+
+/*
+    Send a batch of files by name to a receiver daemon (-D), in the order a scheduling policy picks
+    @param fileNames: paths to the files to send, they're saved under their file name only
+    @param weights: weight of each file for WFQ, empty for all equal
+    @param policy: how to order them, see scheduler.hpp
+    @param chunkSize: send files larger than this in chunks of this size, with other files
+                      in between, 0 to always send files whole
+    @return true if all the files are sent successfully, false otherwise
+
+    Only the order changes, every file goes out just like SendNamedFile() would send it,
+    or as a series of SendNamedChunk(). A file counts as complete once its last byte (and
+    hash) is in the socket, and the mean and tail of those times are reported at the end.
+
+    Alongside, what the other policies would have given is estimated from the same file
+    sizes at the throughput this run got, so the policies can be compared in a single run.
+    That leaves out the per-file costs (an open, a header, a hash), which weigh more the
+    smaller the files and the chunks are, so an actual run of each is still worth doing,
+    see tests/schedule_benchmark.py
+*/
+bool FileSender::SendScheduledFiles(const std::vector<std::string>& fileNames, const std::vector<double>& weights,
+    Schedule::Policy policy, uint64_t chunkSize) {
+
+    // The sizes are all the scheduler needs
+    std::vector<Schedule::Job> jobs;
+    uint64_t totalBytes = 0;
+    for (size_t i = 0; i < fileNames.size(); i++) {
+        std::error_code error;
+        const uint64_t size = std::filesystem::file_size(fileNames[i], error);
+        if (error) {
+            Log::Error("SendScheduledFiles()", std::format("Failed to open file '{}'", fileNames[i]));
+            return false;
+        }
+        jobs.push_back({size, i < weights.size() ? weights[i] : 1.0});
+        totalBytes += size;
+    }
+
+    const std::vector<Schedule::Slice> plan = Schedule::Plan(jobs, policy, chunkSize);
+    std::vector<double> completionSeconds(jobs.size(), 0);
+
+    const auto startTime = std::chrono::steady_clock::now();
+    std::vector<Byte> data;
+    for (const Schedule::Slice& slice : plan) {
+        const std::string& fileName = fileNames[slice.job];
+        const std::string name = std::filesystem::path(fileName).filename().string();
+        const bool whole = slice.offset == 0 && slice.length == jobs[slice.job].size;
+
+        Trace::BeginFile();
+        bool sent;
+        if (whole) {
+            sent =
+                LoadFileIntoVector(fileName, data) &&
+                data.size() == jobs[slice.job].size &&
+                SendNamedData(data, name);
+        }
+        else {
+            sent =
+                LoadFileRange(fileName, slice.offset, slice.length, data) &&
+                SendNamedChunk(data, name, jobs[slice.job].size, slice.offset);
+        }
+        if (sent == false) {
+            Log::Error("SendScheduledFiles()", std::format("Error sending file '{}'", fileName));
+            return false;
+        }
+
+        if (slice.offset + slice.length == jobs[slice.job].size)
+            completionSeconds[slice.job] = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    }
+
+    if (EndSession() == false)
+        return false;
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    auto describe = [](const Schedule::Latency& latency) {
+        return std::format("mean {:.2f} ms, p50 {:.2f} ms, p95 {:.2f} ms, p99 {:.2f} ms, max {:.2f} ms",
+            latency.mean * 1e3, latency.p50 * 1e3, latency.p95 * 1e3, latency.p99 * 1e3, latency.max * 1e3);
+    };
+
+    Log::Success("SendScheduledFiles()", std::format("Sent {} files ({:.1f} MB) in {} slices, {}{}, in {:.3f} s",
+        jobs.size(), totalBytes / 1e6, plan.size(), Schedule::PolicyName(policy),
+        chunkSize > 0 ? std::format(" interleaved in {} byte chunks", chunkSize) : "", seconds));
+    Log::Info("SendScheduledFiles()", std::format("Completion latency ({}): {}",
+        Schedule::PolicyName(policy), describe(Schedule::Summarize(completionSeconds))));
+
+    // The same batch under every policy, at the throughput we got
+    const double secondsPerByte = totalBytes > 0 ? seconds / totalBytes : 0;
+    for (Schedule::Policy other : {Schedule::Policy::Fifo, Schedule::Policy::ShortestFirst, Schedule::Policy::WeightedFair}) {
+        std::vector<double> estimate;
+        for (uint64_t bytes : Schedule::CompletionBytes(jobs, Schedule::Plan(jobs, other, chunkSize)))
+            estimate.push_back(bytes * secondsPerByte);
+        Log::Info("SendScheduledFiles()", std::format("Estimated completion latency ({}): {}",
+            Schedule::PolicyName(other), describe(Schedule::Summarize(estimate))));
+    }
+    return true;
+}
+
+
+/*
+    Close the connection
+*/
+void FileSender::CloseConnection() {
+
+    // Report what the chunk tuner ended up with, if we sent anything worth reporting
+    const ChunkTuner::Metrics& metrics = chunkTuner.GetMetrics();
+    if (socketFD != -1 && metrics.bytesSent > 0 && metrics.samples == 0)
+        Log::Info("CloseConnection()", std::format("Chunk size {} KB, too little data sent to tune it", metrics.chunkSize / 1024));
+    else if (socketFD != -1 && metrics.bytesSent > 0) {
+        Log::Info("CloseConnection()", std::format(
+            "Chunk size {} KB after {} adjustments ({} samples), goodput {:.1f} MB/s, RTT {} us, send queue {} bytes",
+            metrics.chunkSize / 1024, metrics.adjustments, metrics.samples, metrics.goodputBytesPerSecond / 1e6,
+            metrics.rttMicros, metrics.sendQueueBytes));
+    }
+
+    ring.Close();
+
+    /*
+        Don't hang up before the receiver has everything that went over UDP. Flush() also
+        stops early if the receiver hangs up first, which it does once it has everything
+        (its last ACKs may not have made it back)
+    */
+    if (udp) {
+        udp->Flush();
+        Log::Info("CloseConnection()", std::format("UDP channel: {}", udp->Describe()));
+        udp.reset();
+    }
+
+    if (socketFD != -1) {
+        close(socketFD);
+        socketFD = -1;
+    }
+
+    return;
+}
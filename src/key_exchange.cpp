@@ -0,0 +1,433 @@
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/core_names.h>
+#include <openssl/rand.h>
+#include <fstream>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../include/key_exchange.hpp"
+#include "../include/logger.hpp"
+
+/*
+    X25519 and HKDF through OpenSSL's EVP interface
+
+    The main functions used here are:
+    - EVP_PKEY_Q_keygen(): Generates a key pair of the given type ("X25519")
+    - EVP_PKEY_get_raw_public_key()/EVP_PKEY_get_raw_private_key(): Export the raw 32 byte keys
+    - EVP_PKEY_derive(): Computes the shared secret from our private key and their public key
+    - EVP_KDF_derive(): Runs a key derivation function, HKDF-SHA256 in our case
+
+    HKDF takes some input keying material (a secret), a salt, and an "info" string, and
+    stretches them into as many bytes of key material as we ask for. Different info strings
+    give completely unrelated outputs, which is how we get several independent keys (session
+    key, resumption secret) out of a single master secret.
+*/
+
+namespace KeyExchange {
+
+    /*
+        HKDF-SHA256, salted with the pre-shared key
+        @param secret: input keying material
+        @param info: context string, see the labels used below
+        @param output: buffer for the derived bytes
+        @param outputSize: number of bytes to derive
+        @return true if successful, false otherwise
+    */
+    static bool Hkdf(const Secret& secret, const std::vector<Byte>& info, Byte* output, size_t outputSize) {
+
+        EVP_KDF* kdf = EVP_KDF_fetch(NULL, "HKDF", NULL);
+        if (kdf == nullptr) {
+            Log::Error("Hkdf()", "HKDF is not available");
+            return false;
+        }
+
+        EVP_KDF_CTX* ctx = EVP_KDF_CTX_new(kdf);
+        EVP_KDF_free(kdf);
+        if (ctx == nullptr) {
+            Log::Error("Hkdf()", "Error creating KDF context");
+            return false;
+        }
+
+        // OSSL_PARAM wants non-const pointers, even though it doesn't modify anything
+        char digestName[] = "SHA256";
+        OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, digestName, 0),
+            OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, const_cast<Byte*>(secret.data()), secret.size()),
+            OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT, const_cast<Byte*>(Crypto::preSharedKey.data()), Crypto::preSharedKey.size()),
+            OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, const_cast<Byte*>(info.data()), info.size()),
+            OSSL_PARAM_construct_end()
+        };
+
+        int deriveStatus = EVP_KDF_derive(ctx, output, outputSize, params);
+        EVP_KDF_CTX_free(ctx);
+
+        if (deriveStatus != 1) {
+            Log::Error("Hkdf()", "Error deriving key material");
+            return false;
+        }
+
+        return true;
+    }
+
+    /*
+        Build an HKDF info string from a label and (optionally) both ends' random bytes
+    */
+    static std::vector<Byte> MakeInfo(const std::string& label, const Random* clientRandom = nullptr, const Random* serverRandom = nullptr) {
+
+        std::vector<Byte> info(label.begin(), label.end());
+        if (clientRandom != nullptr)
+            info.insert(info.end(), clientRandom->begin(), clientRandom->end());
+        if (serverRandom != nullptr)
+            info.insert(info.end(), serverRandom->begin(), serverRandom->end());
+
+        return info;
+    }
+
+    // Tickets start with a short, public name for the key that sealed them
+    constexpr size_t ticketKeyNameSize = 4;
+
+    /*
+        Name a ticket key: the first few bytes of its SHA-256 hash
+        Lets the receiver tell a ticket sealed with some other key apart from a tampered one
+    */
+    static bool TicketKeyName(const Secret& ticketKey, Byte* name) {
+        Crypto::Digest hash;
+        if (Crypto::CalculateHash(ticketKey, hash) == false)
+            return false;
+
+        std::memcpy(name, hash.data(), ticketKeyNameSize);
+        return true;
+    }
+
+    /*
+        Fill a buffer with cryptographically secure random bytes
+        @param random: buffer to fill
+        @return true if successful, false otherwise
+    */
+    bool GenerateRandom(Random& random) {
+        if (RAND_bytes(random.data(), random.size()) != 1) {
+            Log::Error("GenerateRandom()", "Error generating random bytes");
+            return false;
+        }
+        return true;
+    }
+
+    /*
+        Generate an ephemeral X25519 key pair
+        @param keyPair: the generated key pair
+        @return true if successful, false otherwise
+    */
+    bool GenerateKeyPair(KeyPair& keyPair) {
+
+        EVP_PKEY* pkey = EVP_PKEY_Q_keygen(NULL, NULL, "X25519");
+        if (pkey == nullptr) {
+            Log::Error("GenerateKeyPair()", "Error generating X25519 key pair");
+            return false;
+        }
+
+        // Export both halves as raw bytes, so they can be kept in plain arrays
+        size_t privateKeyLen = keyPair.privateKey.size();
+        size_t publicKeyLen = keyPair.publicKey.size();
+        bool exported =
+            EVP_PKEY_get_raw_private_key(pkey, keyPair.privateKey.data(), &privateKeyLen) == 1 &&
+            EVP_PKEY_get_raw_public_key(pkey, keyPair.publicKey.data(), &publicKeyLen) == 1;
+
+        EVP_PKEY_free(pkey);
+
+        if (exported == false) {
+            Log::Error("GenerateKeyPair()", "Error exporting X25519 key pair");
+            return false;
+        }
+
+        return true;
+    }
+
+    /*
+        Compute the X25519 shared secret
+        @param ours: our key pair
+        @param theirs: the other end's public key
+        @param shared: the shared secret, identical on both ends
+        @return true if successful, false otherwise
+    */
+    bool DeriveSharedSecret(const KeyPair& ours, const PublicKey& theirs, Secret& shared) {
+
+        EVP_PKEY* privateKey = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL, ours.privateKey.data(), ours.privateKey.size());
+        EVP_PKEY* peerKey = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, theirs.data(), theirs.size());
+        EVP_PKEY_CTX* ctx = privateKey != nullptr ? EVP_PKEY_CTX_new(privateKey, NULL) : nullptr;
+
+        /*
+            EVP_PKEY_derive() also rejects the all-zero result you get from a malicious
+            low-order public key, so we don't need to check for that ourselves
+        */
+        size_t sharedLen = shared.size();
+        bool derived =
+            peerKey != nullptr && ctx != nullptr &&
+            EVP_PKEY_derive_init(ctx) == 1 &&
+            EVP_PKEY_derive_set_peer(ctx, peerKey) == 1 &&
+            EVP_PKEY_derive(ctx, shared.data(), &sharedLen) == 1;
+
+        EVP_PKEY_CTX_free(ctx);
+        EVP_PKEY_free(peerKey);
+        EVP_PKEY_free(privateKey);
+
+        if (derived == false) {
+            Log::Error("DeriveSharedSecret()", "Error computing X25519 shared secret");
+            return false;
+        }
+
+        return true;
+    }
+
+    /*
+        Derive the master secret of a session
+        @param inputSecret: the X25519 shared secret, or the resumption secret from a ticket
+        @param resumed: true if `inputSecret` is a resumption secret
+        @param clientRandom: random bytes picked by the sender
+        @param serverRandom: random bytes picked by the receiver
+        @param masterSecret: the derived master secret
+        @return true if successful, false otherwise
+
+        Both random values go into the derivation, so even a resumed session (which starts
+        from the same resumption secret every time) gets brand new keys
+    */
+    bool DeriveMasterSecret(const Secret& inputSecret, bool resumed, const Random& clientRandom,
+        const Random& serverRandom, Secret& masterSecret) {
+
+        const std::string label = resumed ? "ssftp resumed master" : "ssftp master";
+        return Hkdf(inputSecret, MakeInfo(label, &clientRandom, &serverRandom), masterSecret.data(), masterSecret.size());
+    }
+
+    /*
+        Derive the session's encryption key and IV from the master secret
+        @param masterSecret: see DeriveMasterSecret()
+        @param keys: the derived key and IV
+        @return true if successful, false otherwise
+    */
+    bool DeriveSessionKeys(const Secret& masterSecret, Crypto::SessionKeys& keys) {
+
+        // One HKDF call for both, the first 32 bytes are the key and the next 16 the IV
+        std::array<Byte, sizeof(keys.key) + sizeof(keys.iv)> keyMaterial;
+        if (Hkdf(masterSecret, MakeInfo("ssftp session keys"), keyMaterial.data(), keyMaterial.size()) == false)
+            return false;
+
+        std::memcpy(keys.key.data(), keyMaterial.data(), keys.key.size());
+        std::memcpy(keys.iv.data(), keyMaterial.data() + keys.key.size(), keys.iv.size());
+        return true;
+    }
+
+    /*
+        Derive the secret that goes into the session ticket
+        @param masterSecret: see DeriveMasterSecret()
+        @param resumptionSecret: the derived resumption secret
+        @return true if successful, false otherwise
+    */
+    bool DeriveResumptionSecret(const Secret& masterSecret, Secret& resumptionSecret) {
+        return Hkdf(masterSecret, MakeInfo("ssftp resumption"), resumptionSecret.data(), resumptionSecret.size());
+    }
+
+    /*
+        Seal a resumption secret into a ticket, only the holder of `ticketKey` can open it
+        @param ticketKey: the receiver's ticket key
+        @param resumptionSecret: the secret to seal
+        @param ticket: the sealed ticket
+        @return true if successful, false otherwise
+
+        Ticket contents, before encryption: [32 byte resumption secret][u64 expiry time]
+        AES-256-GCM both hides the secret and stops anyone from tampering with the expiry.
+        The sealed contents are prefixed with the name of the ticket key, in the clear
+    */
+    bool IssueTicket(const Secret& ticketKey, const Secret& resumptionSecret, std::vector<Byte>& ticket) {
+
+        const uint64_t expiry = CurrentTime() + ticketLifetimeSeconds;
+
+        std::vector<Byte> contents(resumptionSecret.begin(), resumptionSecret.end());
+        const Byte* expiryBytes = reinterpret_cast<const Byte*>(&expiry);
+        contents.insert(contents.end(), expiryBytes, expiryBytes + sizeof(expiry));
+
+        std::vector<Byte> sealed;
+        const Crypto::SessionKeys ticketKeys = {ticketKey, {}};
+        if (Crypto::EncryptData(contents, sealed, Crypto::CipherSuite::Aes256Gcm, ticketKeys) == false) {
+            Log::Error("IssueTicket()", "Error sealing session ticket");
+            return false;
+        }
+
+        // Put the key name in front, see TicketKeyName()
+        ticket.resize(ticketKeyNameSize);
+        if (TicketKeyName(ticketKey, ticket.data()) == false)
+            return false;
+        ticket.insert(ticket.end(), sealed.begin(), sealed.end());
+
+        return true;
+    }
+
+    /*
+        Open a ticket issued by IssueTicket()
+        @param ticketKey: the receiver's ticket key
+        @param ticket: the ticket presented by the sender
+        @param resumptionSecret: the secret sealed inside
+        @return true if the ticket is genuine and hasn't expired, false otherwise
+    */
+    bool RedeemTicket(const Secret& ticketKey, const std::vector<Byte>& ticket, Secret& resumptionSecret) {
+
+        /*
+            A ticket sealed with some other key is expected after a receiver restart without a
+            ticket key file. Those are turned down quietly by comparing key names, so that only
+            tickets that really were tampered with end up failing decryption
+        */
+        std::array<Byte, ticketKeyNameSize> keyName;
+        if (ticket.size() < ticketKeyNameSize || TicketKeyName(ticketKey, keyName.data()) == false)
+            return false;
+        if (std::memcmp(ticket.data(), keyName.data(), ticketKeyNameSize) != 0)
+            return false;
+
+        std::vector<Byte> contents;
+        const std::vector<Byte> sealed(ticket.begin() + ticketKeyNameSize, ticket.end());
+        const Crypto::SessionKeys ticketKeys = {ticketKey, {}};
+        if (Crypto::DecryptData(sealed, contents, Crypto::CipherSuite::Aes256Gcm, ticketKeys) == false)
+            return false;
+
+        uint64_t expiry = 0;
+        if (contents.size() != resumptionSecret.size() + sizeof(expiry))
+            return false;
+
+        std::memcpy(resumptionSecret.data(), contents.data(), resumptionSecret.size());
+        std::memcpy(&expiry, contents.data() + resumptionSecret.size(), sizeof(expiry));
+
+        return CurrentTime() < expiry;
+    }
+
+    /*
+        Write a file only its owner can read, for keys and secrets
+        @param path: the file, replaced if it exists
+        @param data: what to write
+        @param size: how many bytes
+        @return true if everything was written, false otherwise
+
+        std::ofstream creates files with the default mode (0666 less the umask, so usually
+        readable by everyone). Anyone who can read the ticket key can open every ticket, and
+        with it derive the keys of every resumed session, so the file is created 0600.
+        fchmod() covers a file left over from before, which O_CREAT doesn't touch
+    */
+    static bool WriteSecretFile(const std::string& path, const Byte* data, size_t size) {
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0)
+            return false;
+        if (fchmod(fd, 0600) != 0) {
+            close(fd);
+            return false;
+        }
+
+        size_t totalBytesWritten = 0;
+        while (totalBytesWritten < size) {
+            ssize_t bytesWritten = write(fd, data + totalBytesWritten, size - totalBytesWritten);
+            if (bytesWritten <= 0) {
+                close(fd);
+                return false;
+            }
+            totalBytesWritten += bytesWritten;
+        }
+        return close(fd) == 0;
+    }
+
+    /*
+        Load the receiver's ticket key from a file, creating a random one if it doesn't exist
+        @param path: file holding the key
+        @param ticketKey: the loaded key
+        @return true if successful, false otherwise
+    */
+    bool LoadOrCreateTicketKey(const std::string& path, Secret& ticketKey) {
+
+        std::ifstream infile(path, std::ios::binary);
+        if (infile.good()) {
+            infile.read(reinterpret_cast<char*>(ticketKey.data()), ticketKey.size());
+            if (infile.gcount() != static_cast<std::streamsize>(ticketKey.size())) {
+                Log::Error("LoadOrCreateTicketKey()", std::format("Ticket key file '{}' is corrupt", path));
+                return false;
+            }
+            return true;
+        }
+
+        // No key yet, make one and save it for next time
+        if (RAND_bytes(ticketKey.data(), ticketKey.size()) != 1) {
+            Log::Error("LoadOrCreateTicketKey()", "Error generating ticket key");
+            return false;
+        }
+
+        if (WriteSecretFile(path, ticketKey.data(), ticketKey.size()) == false) {
+            Log::Error("LoadOrCreateTicketKey()", std::format("Failed to create ticket key file '{}'", path));
+            return false;
+        }
+        return true;
+    }
+
+    /*
+        Load a previously saved client session
+        @param path: file the session was saved to
+        @param session: the loaded session
+        @return true if a usable (present and not expired) session was loaded, false otherwise
+
+        File layout: [u64 expiry][32 byte resumption secret][u16 ticket size][ticket]
+    */
+    bool LoadClientSession(const std::string& path, ClientSession& session) {
+
+        std::ifstream infile(path, std::ios::binary);
+        if (infile.fail())
+            return false;
+
+        uint16_t ticketSize = 0;
+        infile.read(reinterpret_cast<char*>(&session.expiry), sizeof(session.expiry));
+        infile.read(reinterpret_cast<char*>(session.resumptionSecret.data()), session.resumptionSecret.size());
+        infile.read(reinterpret_cast<char*>(&ticketSize), sizeof(ticketSize));
+        if (infile.fail() || ticketSize > maxTicketSize)
+            return false;
+
+        session.ticket.resize(ticketSize);
+        infile.read(reinterpret_cast<char*>(session.ticket.data()), ticketSize);
+        if (infile.fail())
+            return false;
+
+        // Don't bother presenting a ticket the receiver is going to turn down anyway
+        return CurrentTime() < session.expiry;
+    }
+
+    /*
+        Save a client session for the next connection
+        @param path: file to save the session to
+        @param session: the session to save
+        @return true if successful, false otherwise
+    */
+    bool SaveClientSession(const std::string& path, const ClientSession& session) {
+
+        // Build the whole file first, so that it goes out in a single write()
+        const uint16_t ticketSize = session.ticket.size();
+        std::vector<Byte> contents(sizeof(session.expiry) + session.resumptionSecret.size() + sizeof(ticketSize) + ticketSize);
+        Byte* position = contents.data();
+        std::memcpy(position, &session.expiry, sizeof(session.expiry));
+        position += sizeof(session.expiry);
+        std::memcpy(position, session.resumptionSecret.data(), session.resumptionSecret.size());
+        position += session.resumptionSecret.size();
+        std::memcpy(position, &ticketSize, sizeof(ticketSize));
+        position += sizeof(ticketSize);
+        std::memcpy(position, session.ticket.data(), ticketSize);
+
+        if (WriteSecretFile(path, contents.data(), contents.size()) == false) {
+            Log::Error("SaveClientSession()", std::format("Failed to create session file '{}'", path));
+            return false;
+        }
+        return true;
+    }
+
+    /*
+        Seconds since the Unix epoch, used for ticket expiry
+    */
+    uint64_t CurrentTime() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()
+        ).count();
+    }
+};
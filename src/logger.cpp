@@ -1,6 +1,16 @@
+#include <atomic>
+
 #include "../include/logger.hpp"
 
 namespace Log {
+
+    // Set by SetQuiet(), silences Success() and Info()
+    static std::atomic<bool> quietMode = false;
+
+    void SetQuiet(bool quiet) {
+        quietMode = quiet;
+    }
+
     void Error(const std::string& functionName, const std::string& message) {
         std::cerr << std::format(
             RED_START "[ERROR] {}: {}\n" RESET_COLOR,
@@ -9,6 +19,8 @@ namespace Log {
     }
 
     void Success(const std::string& functionName, const std::string& message) {
+        if (quietMode)
+            return;
         std::cout << std::format(
             GREEN_START "[SUCCESS] {}: {}\n" RESET_COLOR,
             functionName, message
@@ -16,6 +28,8 @@ namespace Log {
     }
 
     void Info(const std::string& functionName, const std::string& message) {
+        if (quietMode)
+            return;
         std::cout << std::format(
             "{}: {}\n",
             functionName, message
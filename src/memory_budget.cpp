@@ -0,0 +1,129 @@
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <format>
+#include <unistd.h>
+
+#include "../include/memory_budget.hpp"
+
+namespace MemoryBudget {
+
+    // Everything is behind one mutex, reservations are per file, not per byte
+    static std::mutex mutex;
+    static std::condition_variable released;
+    static uint64_t limit = 0;
+    static uint64_t used = 0;
+    static uint64_t peak = 0;
+    static uint64_t waits = 0;
+
+    void SetLimit(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        limit = bytes;
+        released.notify_all();
+    }
+
+    uint64_t Limit() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return limit;
+    }
+
+    /*
+        The physical memory of the machine, the cap when there's no budget
+        Nothing could ever hold more than that at once anyway
+    */
+    static uint64_t PhysicalMemory() {
+        static const uint64_t bytes = [] {
+            const long pages = sysconf(_SC_PHYS_PAGES);
+            const long pageSize = sysconf(_SC_PAGESIZE);
+            return pages > 0 && pageSize > 0 ? static_cast<uint64_t>(pages) * pageSize : UINT64_MAX;
+        }();
+        return bytes;
+    }
+
+    // MaxReservation(), with the mutex held
+    static uint64_t MaxReservationLocked() {
+        return limit == 0 ? PhysicalMemory() : limit;
+    }
+
+    uint64_t MaxReservation() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return MaxReservationLocked();
+    }
+
+    uint64_t CurrentUsage() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return used;
+    }
+
+    uint64_t PeakUsage() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return peak;
+    }
+
+    uint64_t Waits() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return waits;
+    }
+
+    std::string Describe() {
+        std::lock_guard<std::mutex> lock(mutex);
+        const std::string budget = limit == 0 ? "unlimited" : std::format("{:.1f} MB", limit / 1e6);
+        return std::format("{:.1f} MB in use, peak {:.1f} MB, budget {}, {} waits for room",
+            used / 1e6, peak / 1e6, budget, waits);
+    }
+
+    /*
+        Reserve memory, see memory_budget.hpp
+        @param size: bytes to reserve
+        @param wait: wait for room, or go over the budget right away
+        Refused (Granted() is false) if it's larger than MaxReservation()
+    */
+    Reservation::Reservation(uint64_t size, bool wait) : bytes(0) {
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        // Fits, or never will (the limit can be lowered while we wait)
+        const auto tooLarge = [size]() {
+            return size > MaxReservationLocked();
+        };
+        const auto fits = [size]() {
+            return limit == 0 || used + size <= limit;
+        };
+        if (wait && tooLarge() == false && fits() == false) {
+            waits++;
+            released.wait(lock, [&]() { return tooLarge() || fits(); });
+        }
+        if (tooLarge()) {
+            granted = false;
+            return;
+        }
+
+        bytes = size;
+        used += size;
+        peak = std::max(peak, used);
+    }
+
+    Reservation::~Reservation() {
+        if (bytes == 0)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        used -= bytes;
+        released.notify_all();
+    }
+
+    Reservation::Reservation(Reservation&& other) noexcept : bytes(other.bytes), granted(other.granted) {
+        other.bytes = 0;
+    }
+
+    Reservation& Reservation::operator=(Reservation&& other) noexcept {
+        if (this != &other) {
+            // Give back what we held, and take over the other one's
+            Reservation old(std::move(*this));
+            bytes = other.bytes;
+            granted = other.granted;
+            other.bytes = 0;
+        }
+        return *this;
+    }
+};
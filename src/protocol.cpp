@@ -0,0 +1,617 @@
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../include/protocol.hpp"
+#include "../include/logger.hpp"
+
+namespace Protocol {
+
+    /*
+        Send exactly `size` bytes
+        @param socketFD: socket to send on
+        @param data: bytes to send
+        @param size: number of bytes to send
+        @return true if everything was sent, false otherwise
+    */
+    bool SendAll(int socketFD, const void* data, size_t size) {
+
+        const Byte* bytes = static_cast<const Byte*>(data);
+        size_t totalBytesSent = 0;
+
+        // Keep calling send() until the kernel has taken everything
+        while (totalBytesSent < size) {
+            ssize_t sentBytes = send(socketFD, bytes + totalBytesSent, size - totalBytesSent, MSG_NOSIGNAL);
+            if (sentBytes <= 0)
+                return false;
+            totalBytesSent += sentBytes;
+        }
+
+        return true;
+    }
+
+    /*
+        Read exactly `size` bytes
+        @param socketFD: socket to read from
+        @param data: buffer to read into, must hold at least `size` bytes
+        @param size: number of bytes to read
+        @return true if everything was read, false on error or if the peer hung up
+    */
+    bool ReadAll(int socketFD, void* data, size_t size) {
+
+        Byte* bytes = static_cast<Byte*>(data);
+        size_t totalBytesRead = 0;
+
+        // read() returning 0 means the other end closed the connection
+        while (totalBytesRead < size) {
+            ssize_t bytesRead = read(socketFD, bytes + totalBytesRead, size - totalBytesRead);
+            if (bytesRead <= 0)
+                return false;
+            totalBytesRead += bytesRead;
+        }
+
+        return true;
+    }
+
+    /*
+        Advertise the cipher suites we support, along with their scores
+        Wire format: [u8 count] then count x [u8 suite][u32 score]
+        @param socketFD: socket to send on
+        @param suites: suites to advertise, see Crypto::RankCipherSuites()
+        @return true if sent successfully, false otherwise
+    */
+    bool SendSuiteList(int socketFD, const std::vector<Crypto::SuiteScore>& suites) {
+
+        // Build the whole message first, so that it goes out in a single send()
+        std::vector<Byte> message;
+        message.push_back(static_cast<Byte>(suites.size()));
+        for (const Crypto::SuiteScore& entry : suites) {
+            message.push_back(static_cast<Byte>(entry.suite));
+
+            const Byte* score = reinterpret_cast<const Byte*>(&entry.score);
+            message.insert(message.end(), score, score + sizeof(entry.score));
+        }
+
+        if (SendAll(socketFD, message.data(), message.size()) == false) {
+            Log::Error("SendSuiteList()", "Error sending cipher suite list");
+            return false;
+        }
+
+        return true;
+    }
+
+    /*
+        Read the list of cipher suites the other end advertised, see SendSuiteList()
+        @param socketFD: socket to read from
+        @param suites: the advertised suites
+        @return true if read successfully, false otherwise
+    */
+    bool ReadSuiteList(int socketFD, std::vector<Crypto::SuiteScore>& suites) {
+
+        Byte count = 0;
+        if (ReadAll(socketFD, &count, sizeof(count)) == false) {
+            Log::Error("ReadSuiteList()", "Error reading number of cipher suites");
+            return false;
+        }
+        if (count > maxAdvertisedSuites) {
+            Log::Error("ReadSuiteList()", "Peer advertised too many cipher suites");
+            return false;
+        }
+
+        suites.clear();
+        for (Byte i = 0; i < count; i++) {
+            Byte suite = 0;
+            uint32_t score = 0;
+            if (ReadAll(socketFD, &suite, sizeof(suite)) == false ||
+                ReadAll(socketFD, &score, sizeof(score)) == false) {
+                Log::Error("ReadSuiteList()", "Error reading cipher suite list");
+                return false;
+            }
+
+            suites.push_back({static_cast<Crypto::CipherSuite>(suite), score});
+        }
+
+        return true;
+    }
+
+    /*
+        Advertise the hash algorithms we support, most preferred first
+        Wire format: [u8 count] then count x [u8 algorithm]
+        @param socketFD: socket to send on
+        @param algorithms: algorithms to advertise
+        @return true if sent successfully, false otherwise
+    */
+    bool SendHashList(int socketFD, const std::vector<Crypto::HashAlgorithm>& algorithms) {
+
+        std::vector<Byte> message;
+        message.push_back(static_cast<Byte>(algorithms.size()));
+        for (Crypto::HashAlgorithm algorithm : algorithms)
+            message.push_back(static_cast<Byte>(algorithm));
+
+        if (SendAll(socketFD, message.data(), message.size()) == false) {
+            Log::Error("SendHashList()", "Error sending hash algorithm list");
+            return false;
+        }
+
+        return true;
+    }
+
+    /*
+        Read the list of hash algorithms the other end advertised, see SendHashList()
+        @param socketFD: socket to read from
+        @param algorithms: the advertised algorithms
+        @return true if read successfully, false otherwise
+    */
+    bool ReadHashList(int socketFD, std::vector<Crypto::HashAlgorithm>& algorithms) {
+
+        Byte count = 0;
+        if (ReadAll(socketFD, &count, sizeof(count)) == false) {
+            Log::Error("ReadHashList()", "Error reading number of hash algorithms");
+            return false;
+        }
+        if (count > maxAdvertisedHashes) {
+            Log::Error("ReadHashList()", "Peer advertised too many hash algorithms");
+            return false;
+        }
+
+        std::vector<Byte> list(count);
+        if (ReadAll(socketFD, list.data(), list.size()) == false) {
+            Log::Error("ReadHashList()", "Error reading hash algorithm list");
+            return false;
+        }
+
+        algorithms.clear();
+        for (Byte algorithm : list)
+            algorithms.push_back(static_cast<Crypto::HashAlgorithm>(algorithm));
+
+        return true;
+    }
+
+    /*
+        Append a length-prefixed ticket to a message
+    */
+    static void AppendTicket(std::vector<Byte>& message, const std::vector<Byte>& ticket) {
+        const uint16_t ticketSize = ticket.size();
+        const Byte* sizeBytes = reinterpret_cast<const Byte*>(&ticketSize);
+        message.insert(message.end(), sizeBytes, sizeBytes + sizeof(ticketSize));
+        message.insert(message.end(), ticket.begin(), ticket.end());
+    }
+
+    /*
+        Read a length-prefixed ticket
+    */
+    static bool ReadTicket(int socketFD, std::vector<Byte>& ticket) {
+        uint16_t ticketSize = 0;
+        if (ReadAll(socketFD, &ticketSize, sizeof(ticketSize)) == false)
+            return false;
+        if (ticketSize > KeyExchange::maxTicketSize)
+            return false;
+
+        ticket.resize(ticketSize);
+        return ReadAll(socketFD, ticket.data(), ticket.size());
+    }
+
+    /*
+        Send the sender's half of the key exchange, see KeyHello
+        @param socketFD: socket to send on
+        @param hello: the message
+        @return true if successful, false otherwise
+    */
+    bool SendKeyHello(int socketFD, const KeyHello& hello) {
+
+        std::vector<Byte> message;
+        message.push_back(static_cast<Byte>(hello.mode));
+        message.insert(message.end(), hello.clientRandom.begin(), hello.clientRandom.end());
+
+        if (hello.mode == HandshakeMode::Resume)
+            AppendTicket(message, hello.ticket);
+        else
+            message.insert(message.end(), hello.clientPublicKey.begin(), hello.clientPublicKey.end());
+
+        if (SendAll(socketFD, message.data(), message.size()) == false) {
+            Log::Error("SendKeyHello()", "Error sending key exchange");
+            return false;
+        }
+
+        return true;
+    }
+
+    /*
+        Read the sender's half of the key exchange, see KeyHello
+        @param socketFD: socket to read from
+        @param hello: the message
+        @return true if successful, false otherwise
+    */
+    bool ReadKeyHello(int socketFD, KeyHello& hello) {
+
+        Byte mode = 0;
+        bool readStatus =
+            ReadAll(socketFD, &mode, sizeof(mode)) &&
+            ReadAll(socketFD, hello.clientRandom.data(), hello.clientRandom.size());
+
+        hello.mode = static_cast<HandshakeMode>(mode);
+        if (readStatus) {
+            if (hello.mode == HandshakeMode::Resume)
+                readStatus = ReadTicket(socketFD, hello.ticket);
+            else if (hello.mode == HandshakeMode::Full)
+                readStatus = ReadAll(socketFD, hello.clientPublicKey.data(), hello.clientPublicKey.size());
+            else
+                readStatus = false;
+        }
+
+        if (readStatus == false) {
+            Log::Error("ReadKeyHello()", "Error reading key exchange");
+            return false;
+        }
+
+        return true;
+    }
+
+    /*
+        Send the receiver's half of the key exchange, see KeyReply
+        @param socketFD: socket to send on
+        @param reply: the message
+        @return true if successful, false otherwise
+    */
+    bool SendKeyReply(int socketFD, const KeyReply& reply) {
+
+        std::vector<Byte> message;
+        message.push_back(static_cast<Byte>(reply.mode));
+
+        if (reply.mode != HandshakeMode::RetryFull) {
+            message.insert(message.end(), reply.serverRandom.begin(), reply.serverRandom.end());
+            if (reply.mode == HandshakeMode::Full)
+                message.insert(message.end(), reply.serverPublicKey.begin(), reply.serverPublicKey.end());
+            AppendTicket(message, reply.ticket);
+        }
+
+        if (SendAll(socketFD, message.data(), message.size()) == false) {
+            Log::Error("SendKeyReply()", "Error sending key exchange");
+            return false;
+        }
+
+        return true;
+    }
+
+    /*
+        Read the receiver's half of the key exchange, see KeyReply
+        @param socketFD: socket to read from
+        @param reply: the message
+        @return true if successful, false otherwise
+    */
+    bool ReadKeyReply(int socketFD, KeyReply& reply) {
+
+        Byte mode = 0;
+        bool readStatus = ReadAll(socketFD, &mode, sizeof(mode));
+
+        reply.mode = static_cast<HandshakeMode>(mode);
+        if (readStatus && reply.mode != HandshakeMode::RetryFull) {
+            readStatus = ReadAll(socketFD, reply.serverRandom.data(), reply.serverRandom.size());
+            if (readStatus && reply.mode == HandshakeMode::Full)
+                readStatus = ReadAll(socketFD, reply.serverPublicKey.data(), reply.serverPublicKey.size());
+            if (readStatus)
+                readStatus = ReadTicket(socketFD, reply.ticket);
+        }
+
+        if (readStatus == false) {
+            Log::Error("ReadKeyReply()", "Error reading key exchange");
+            return false;
+        }
+
+        return true;
+    }
+
+    // Append the raw bytes of a fixed size value to a buffer
+    template <typename T>
+    static void AppendValue(std::vector<Byte>& buffer, const T& value) {
+        const Byte* bytes = reinterpret_cast<const Byte*>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+    }
+
+    // Read a fixed size value from a buffer at `offset`, moving `offset` past it
+    template <typename T>
+    static bool TakeValue(const std::vector<Byte>& buffer, size_t& offset, T& value) {
+        if (buffer.size() - offset < sizeof(value))
+            return false;
+        std::memcpy(&value, buffer.data() + offset, sizeof(value));
+        offset += sizeof(value);
+        return true;
+    }
+
+    /*
+        Pack a batch of tree entries into bytes (before encryption)
+        @param entries: entries to pack, only the relative path is sent
+        @param batch: the packed bytes
+    */
+    void SerializeTreeEntries(const std::vector<Tree::Entry>& entries, std::vector<Byte>& batch) {
+
+        batch.clear();
+        AppendValue(batch, static_cast<uint32_t>(entries.size()));
+
+        for (const Tree::Entry& entry : entries) {
+            AppendValue(batch, entry.id);
+            AppendValue(batch, static_cast<uint8_t>(entry.kind));
+            AppendValue(batch, entry.size);
+            AppendValue(batch, entry.mode);
+            AppendValue(batch, static_cast<uint16_t>(entry.relativePath.size()));
+            batch.insert(batch.end(), entry.relativePath.begin(), entry.relativePath.end());
+        }
+    }
+
+    /*
+        Unpack a batch made by SerializeTreeEntries()
+        @param batch: the packed bytes
+        @param entries: the unpacked entries
+        @return true if the batch is well formed, false otherwise
+    */
+    bool ParseTreeEntries(const std::vector<Byte>& batch, std::vector<Tree::Entry>& entries) {
+
+        size_t offset = 0;
+        uint32_t count = 0;
+        if (TakeValue(batch, offset, count) == false)
+            return false;
+
+        entries.clear();
+        for (uint32_t i = 0; i < count; i++) {
+            Tree::Entry entry = {};
+            uint8_t kind = 0;
+            uint16_t pathLength = 0;
+
+            bool parsed =
+                TakeValue(batch, offset, entry.id) &&
+                TakeValue(batch, offset, kind) &&
+                TakeValue(batch, offset, entry.size) &&
+                TakeValue(batch, offset, entry.mode) &&
+                TakeValue(batch, offset, pathLength);
+            if (parsed == false || pathLength > maxPathLength || batch.size() - offset < pathLength)
+                return false;
+
+            entry.kind = static_cast<Tree::EntryKind>(kind);
+            if (entry.kind != Tree::EntryKind::Directory && entry.kind != Tree::EntryKind::File)
+                return false;
+
+            entry.relativePath.assign(reinterpret_cast<const char*>(batch.data() + offset), pathLength);
+            offset += pathLength;
+
+            entries.push_back(std::move(entry));
+        }
+
+        return offset == batch.size();
+    }
+
+    /*
+        Append the index to a segment whose file contents are already in place
+        @param segment: file contents, packed back to back, the index is appended to it
+        @param index: where each file is within the segment
+    */
+    void FinishPackedSegment(std::vector<Byte>& segment, const std::vector<PackedFile>& index) {
+
+        const uint64_t contentsSize = segment.size();
+        for (const PackedFile& file : index) {
+            AppendValue(segment, static_cast<uint16_t>(file.name.size()));
+            segment.insert(segment.end(), file.name.begin(), file.name.end());
+            AppendValue(segment, file.offset);
+            AppendValue(segment, file.length);
+        }
+
+        AppendValue(segment, contentsSize);
+        AppendValue(segment, static_cast<uint32_t>(index.size()));
+    }
+
+    /*
+        Read the index of a segment made by FinishPackedSegment()
+        @param segment: the decrypted segment
+        @param index: where each file is within the segment
+        @return true if the segment is well formed, false otherwise
+    */
+    bool ParsePackedSegment(const std::vector<Byte>& segment, std::vector<PackedFile>& index) {
+
+        // The trailer tells us where the index starts, and how many entries it has
+        uint64_t contentsSize = 0;
+        uint32_t count = 0;
+        constexpr size_t trailerSize = sizeof(contentsSize) + sizeof(count);
+        if (segment.size() < trailerSize)
+            return false;
+
+        const size_t indexEnd = segment.size() - trailerSize;
+        size_t offset = indexEnd;
+        TakeValue(segment, offset, contentsSize);
+        TakeValue(segment, offset, count);
+        if (contentsSize > indexEnd || count > maxPackedFiles)
+            return false;
+
+        // Copy the index into a buffer of its own, so that TakeValue() stops at its end
+        const std::vector<Byte> indexBytes(segment.begin() + contentsSize, segment.begin() + indexEnd);
+        offset = 0;
+
+        index.clear();
+        for (uint32_t i = 0; i < count; i++) {
+            PackedFile file = {};
+            uint16_t nameLength = 0;
+            if (TakeValue(indexBytes, offset, nameLength) == false || indexBytes.size() - offset < nameLength)
+                return false;
+
+            file.name.assign(reinterpret_cast<const char*>(indexBytes.data() + offset), nameLength);
+            offset += nameLength;
+
+            bool parsed =
+                TakeValue(indexBytes, offset, file.offset) &&
+                TakeValue(indexBytes, offset, file.length);
+            if (parsed == false || file.offset > contentsSize || file.length > contentsSize - file.offset)
+                return false;
+
+            index.push_back(std::move(file));
+        }
+
+        return offset == indexBytes.size();
+    }
+
+    /*
+        Write the extent map of a sparse file at the start of a buffer
+        @param fileSize: size of the file, holes included
+        @param extents: the file's data extents
+        @param buffer: the map is appended here, followed by the extents' contents later on
+    */
+    void SerializeExtentMap(uint64_t fileSize, const std::vector<Sparse::Extent>& extents, std::vector<Byte>& buffer) {
+
+        AppendValue(buffer, fileSize);
+        AppendValue(buffer, static_cast<uint32_t>(extents.size()));
+        for (const Sparse::Extent& extent : extents) {
+            AppendValue(buffer, extent.offset);
+            AppendValue(buffer, extent.length);
+        }
+    }
+
+    /*
+        Read an extent map written by SerializeExtentMap()
+        @param buffer: the decrypted map and contents
+        @param fileSize: size of the file, holes included
+        @param extents: the file's data extents
+        @param dataOffset: where the extents' contents start in `buffer`
+        @return true if the map is well formed, false otherwise
+    */
+    bool ParseExtentMap(const std::vector<Byte>& buffer, uint64_t& fileSize,
+        std::vector<Sparse::Extent>& extents, size_t& dataOffset) {
+
+        size_t offset = 0;
+        uint32_t count = 0;
+        if (TakeValue(buffer, offset, fileSize) == false || TakeValue(buffer, offset, count) == false)
+            return false;
+        if (count > (buffer.size() - offset) / extentMapEntrySize)
+            return false;
+
+        // Extents must be in order, not overlap, and stay within the file
+        extents.clear();
+        uint64_t previousEnd = 0, totalLength = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            Sparse::Extent extent = {};
+            TakeValue(buffer, offset, extent.offset);
+            TakeValue(buffer, offset, extent.length);
+
+            if (extent.offset < previousEnd || extent.offset > fileSize || extent.length > fileSize - extent.offset)
+                return false;
+
+            previousEnd = extent.offset + extent.length;
+            totalLength += extent.length;
+            extents.push_back(extent);
+        }
+
+        dataOffset = offset;
+        return buffer.size() - offset == totalLength;
+    }
+
+    // Start of every sidecar, so that a random file is never mistaken for one
+    constexpr std::array<Byte, 8> storedFileMagic = {'S', 'S', 'F', 'T', 'P', 'S', 'T', '1'};
+
+    /*
+        Write the sidecar of a stored file
+        @param info: what to write
+        @param buffer: the sidecar's contents
+    */
+    void SerializeStoredFileInfo(const StoredFileInfo& info, std::vector<Byte>& buffer) {
+
+        buffer.insert(buffer.end(), storedFileMagic.begin(), storedFileMagic.end());
+        AppendValue(buffer, static_cast<uint8_t>(info.suite));
+        AppendValue(buffer, static_cast<uint8_t>(info.hashAlgorithm));
+        AppendValue(buffer, info.encryptedSize);
+        buffer.insert(buffer.end(), info.expectedHash.begin(), info.expectedHash.end());
+        AppendValue(buffer, static_cast<uint16_t>(info.sealedKeys.size()));
+        buffer.insert(buffer.end(), info.sealedKeys.begin(), info.sealedKeys.end());
+    }
+
+    /*
+        Read a sidecar written by SerializeStoredFileInfo()
+        @param buffer: the sidecar's contents
+        @param info: what was in it
+        @return true if the sidecar is well formed, false otherwise
+    */
+    bool ParseStoredFileInfo(const std::vector<Byte>& buffer, StoredFileInfo& info) {
+
+        if (buffer.size() < storedFileMagic.size() ||
+            std::equal(storedFileMagic.begin(), storedFileMagic.end(), buffer.begin()) == false)
+            return false;
+
+        size_t offset = storedFileMagic.size();
+        uint8_t suite = 0, hashAlgorithm = 0;
+        uint16_t sealedKeysSize = 0;
+        if (TakeValue(buffer, offset, suite) == false ||
+            TakeValue(buffer, offset, hashAlgorithm) == false ||
+            TakeValue(buffer, offset, info.encryptedSize) == false ||
+            buffer.size() - offset < Crypto::hashSize)
+            return false;
+
+        info.suite = static_cast<Crypto::CipherSuite>(suite);
+        info.hashAlgorithm = static_cast<Crypto::HashAlgorithm>(hashAlgorithm);
+        info.expectedHash.assign(buffer.begin() + offset, buffer.begin() + offset + Crypto::hashSize);
+        offset += Crypto::hashSize;
+
+        if (TakeValue(buffer, offset, sealedKeysSize) == false || buffer.size() - offset != sealedKeysSize)
+            return false;
+        info.sealedKeys.assign(buffer.begin() + offset, buffer.end());
+        return true;
+    }
+
+    /*
+        Build the header of a named transfer (before encryption)
+        @param name: where to save the file, relative to the receiver's directory
+        @param fileSize: size of the file (before encryption)
+        @param buffer: the header
+    */
+    void SerializeNamedFileHeader(const std::string& name, uint64_t fileSize, std::vector<Byte>& buffer) {
+        AppendValue(buffer, fileSize);
+        AppendValue(buffer, static_cast<uint16_t>(name.size()));
+        buffer.insert(buffer.end(), name.begin(), name.end());
+    }
+
+    /*
+        Read a header built by SerializeNamedFileHeader()
+        @param buffer: the decrypted header
+        @param name: where to save the file, not checked for safety yet
+        @param fileSize: size of the file
+        @return true if the header is well formed, false otherwise
+    */
+    bool ParseNamedFileHeader(const std::vector<Byte>& buffer, std::string& name, uint64_t& fileSize) {
+
+        size_t offset = 0;
+        uint16_t nameLength = 0;
+        if (TakeValue(buffer, offset, fileSize) == false || TakeValue(buffer, offset, nameLength) == false)
+            return false;
+        if (nameLength == 0 || nameLength > maxPathLength || buffer.size() - offset != nameLength)
+            return false;
+
+        name.assign(buffer.begin() + offset, buffer.end());
+        return true;
+    }
+
+    /*
+        Build the header of a chunk of a named transfer (before encryption)
+        @param name: where to save the file, relative to the receiver's directory
+        @param fileSize: size of the whole file (before encryption)
+        @param offset: where in the file this chunk goes
+        @param buffer: the header
+    */
+    void SerializeNamedChunkHeader(const std::string& name, uint64_t fileSize, uint64_t offset, std::vector<Byte>& buffer) {
+        AppendValue(buffer, offset);
+        SerializeNamedFileHeader(name, fileSize, buffer);
+    }
+
+    /*
+        Read a header built by SerializeNamedChunkHeader()
+        @param buffer: the decrypted header
+        @param name: where to save the file, not checked for safety yet
+        @param fileSize: size of the whole file
+        @param offset: where in the file this chunk goes
+        @return true if the header is well formed, false otherwise
+    */
+    bool ParseNamedChunkHeader(const std::vector<Byte>& buffer, std::string& name, uint64_t& fileSize, uint64_t& offset) {
+
+        size_t position = 0;
+        if (TakeValue(buffer, position, offset) == false)
+            return false;
+        const std::vector<Byte> fileHeader(buffer.begin() + position, buffer.end());
+        return ParseNamedFileHeader(fileHeader, name, fileSize) && offset <= fileSize;
+    }
+};
@@ -0,0 +1,259 @@
+#include <fstream>
+#include <format>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cctype>
+#include <csignal>
+
+#include "../include/rate_limiter.hpp"
+#include "../include/logger.hpp"
+
+namespace RateLimit {
+
+    // How much of a burst a bucket allows, as a fraction of a second's worth of its rate
+    constexpr double burstSeconds = 0.02;
+    // Never allow less of a burst than this, so that a full chunk always fits in an empty bucket
+    constexpr double minimumBurst = 64 * 1024;
+
+    TokenBucket::TokenBucket(uint64_t bytesPerSecond) {
+        rate = 0;
+        tokens = 0;
+        capacity = 0;
+        lastRefill = Clock::now();
+        SetRate(bytesPerSecond);
+    }
+
+    /*
+        Add the tokens that accumulated since the last refill, up to the bucket's capacity
+        @param now: current time
+    */
+    void TokenBucket::Refill(Clock::time_point now) {
+        const double elapsed = std::chrono::duration<double>(now - lastRefill).count();
+        tokens = std::min(capacity, tokens + elapsed * rate);
+        lastRefill = now;
+    }
+
+    /*
+        Change the rate, takes effect from the next chunk
+        @param bytesPerSecond: new rate, 0 for unlimited
+
+        The bucket is refilled at the old rate first, so that the time that has already
+        passed is accounted for at the rate that was in effect back then
+    */
+    void TokenBucket::SetRate(uint64_t bytesPerSecond) {
+        if (rate != 0)
+            Refill(Clock::now());
+        else {
+            // Coming from unlimited, start with a full bucket
+            lastRefill = Clock::now();
+            tokens = std::max(static_cast<double>(bytesPerSecond) * burstSeconds, minimumBurst);
+        }
+
+        rate = bytesPerSecond;
+        capacity = std::max(static_cast<double>(rate) * burstSeconds, minimumBurst);
+        tokens = std::min(tokens, capacity);
+    }
+
+    /*
+        How long until the bucket is out of debt, and a chunk can be sent
+        @return zero if a chunk can be sent right now
+    */
+    Clock::duration TokenBucket::TimeUntilReady() {
+        if (rate == 0)
+            return Clock::duration::zero();
+
+        Refill(Clock::now());
+        if (tokens >= 0)
+            return Clock::duration::zero();
+
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(-tokens / rate));
+    }
+
+    /*
+        Take tokens for a chunk that is about to be sent
+        @param bytes: size of the chunk
+    */
+    void TokenBucket::Consume(size_t bytes) {
+        if (rate == 0)
+            return;
+
+        Refill(Clock::now());
+        tokens -= static_cast<double>(bytes);
+    }
+
+    /*
+        Sleep until a chunk can be sent, then take its tokens
+        @param bytes: size of the chunk
+
+        We sleep for exactly as long as it takes to pay off the debt, instead of polling,
+        so a rate limited transfer uses next to no CPU while it waits
+    */
+    void TokenBucket::Acquire(size_t bytes) {
+        const Clock::duration wait = TimeUntilReady();
+        if (wait > Clock::duration::zero())
+            std::this_thread::sleep_for(wait);
+        Consume(bytes);
+    }
+
+
+    FairScheduler::FairScheduler(size_t quantumBytes, uint64_t bytesPerSecondPerFlow) {
+        quantum = std::max<size_t>(quantumBytes, 1);
+        flowRate = bytesPerSecondPerFlow;
+    }
+
+    // Change the rate of every flow, current and future
+    void FairScheduler::SetFlowRate(uint64_t bytesPerSecondPerFlow) {
+        flowRate = bytesPerSecondPerFlow;
+        for (Flow& flow : flows)
+            flow.bucket.SetRate(flowRate);
+    }
+
+    // Change how much each flow may send per turn, takes effect from the next turn
+    void FairScheduler::SetQuantum(size_t quantumBytes) {
+        quantum = std::max<size_t>(quantumBytes, 1);
+    }
+
+    // Add a flow with `bytes` to send, `id` is handed back by Next()
+    void FairScheduler::AddFlow(uint32_t id, uint64_t bytes) {
+        flows.push_back({id, bytes, 0, TokenBucket(flowRate)});
+    }
+
+    /*
+        Pick the next chunk to send
+        @param id: flow the chunk belongs to
+        @param length: size of the chunk
+        @param wait: how long until a flow that's held back by its rate can send again
+        @return true if a chunk was picked, false if every flow is waiting (or there are none)
+
+        The flow at the front of the line is the one whose turn it is. It gets a fresh
+        quantum at the start of its turn, and goes to the back once the quantum is used up.
+        Empty flows (nothing to send) are finished on the spot, so they're never in the line.
+    */
+    bool FairScheduler::Next(uint32_t& id, size_t& length, Clock::duration& wait) {
+
+        wait = Clock::duration::max();
+        for (size_t visited = 0; visited < flows.size(); visited++) {
+            Flow& flow = flows.front();
+
+            // Held back by its own bucket, let the next one go first
+            const Clock::duration flowWait = flow.bucket.TimeUntilReady();
+            if (flowWait > Clock::duration::zero()) {
+                wait = std::min(wait, flowWait);
+                flows.push_back(std::move(flow));
+                flows.pop_front();
+                continue;
+            }
+
+            if (flow.deficit == 0)
+                flow.deficit = quantum;
+
+            id = flow.id;
+            length = static_cast<size_t>(std::min(flow.deficit, flow.remaining));
+            flow.deficit -= length;
+            flow.remaining -= length;
+            flow.bucket.Consume(length);
+
+            if (flow.remaining == 0)
+                flows.pop_front();
+            else if (flow.deficit == 0) {
+                flows.push_back(std::move(flow));
+                flows.pop_front();
+            }
+            return true;
+        }
+
+        return false;
+    }
+
+    /*
+        Parse a rate like "500K", "10M" or "1G" (bytes per second, powers of 1024)
+        @param text: the rate, a plain number is in bytes per second, "0" is unlimited
+        @param bytesPerSecond: the parsed rate
+        @return true if the rate is valid, false otherwise
+    */
+    bool ParseRate(const std::string& text, uint64_t& bytesPerSecond) {
+
+        size_t digits = 0;
+        while (digits < text.size() && std::isdigit(static_cast<unsigned char>(text[digits])))
+            digits++;
+        if (digits == 0 || digits > 15 || text.size() - digits > 1)
+            return false;
+
+        uint64_t multiplier = 1;
+        if (digits < text.size()) {
+            switch (std::toupper(static_cast<unsigned char>(text[digits]))) {
+                case 'K': multiplier = 1024ull; break;
+                case 'M': multiplier = 1024ull * 1024; break;
+                case 'G': multiplier = 1024ull * 1024 * 1024; break;
+                default: return false;
+            }
+        }
+
+        bytesPerSecond = std::stoull(text.substr(0, digits)) * multiplier;
+        return true;
+    }
+
+    /*
+        Read the rates from a config file, one "<name> <rate>" per line
+        @param path: file to read
+        @param globalRate: rate of the global bucket
+        @param transferRate: rate of each file's bucket
+        @return true if the file was read, false otherwise
+    */
+    bool LoadRateConfig(const std::string& path, uint64_t& globalRate, uint64_t& transferRate) {
+
+        std::ifstream config(path);
+        if (config.fail()) {
+            Log::Error("LoadRateConfig()", std::format("Failed to open rate config '{}'", path));
+            return false;
+        }
+
+        std::string name, value;
+        while (config >> name >> value) {
+            uint64_t rate = 0;
+            if (ParseRate(value, rate) == false) {
+                Log::Error("LoadRateConfig()", std::format("Invalid rate '{}' for '{}'", value, name));
+                return false;
+            }
+
+            if (name == "rate")
+                globalRate = rate;
+            else if (name == "transfer-rate")
+                transferRate = rate;
+            else
+                Log::Warning("LoadRateConfig()", std::format("Unknown setting '{}', ignoring it", name));
+        }
+
+        return true;
+    }
+
+    // Set from the signal handler, so it has to be lock free
+    static std::atomic<bool> reloadRequested = false;
+    static_assert(std::atomic<bool>::is_always_lock_free);
+
+    static void OnReloadSignal(int) {
+        reloadRequested = true;
+    }
+
+    /*
+        Ask for the rate config to be re-read whenever the process gets SIGHUP
+
+        SA_RESTART makes the kernel restart a send() or read() that the signal interrupted,
+        instead of failing it with EINTR
+    */
+    void InstallReloadSignal() {
+        struct sigaction action = {};
+        action.sa_handler = OnReloadSignal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGHUP, &action, nullptr);
+    }
+
+    /*
+        @return true if SIGHUP arrived since the last call, false otherwise
+    */
+    bool TakeReloadRequest() {
+        return reloadRequested.exchange(false);
+    }
+};
@@ -1,14 +1,21 @@
 #include <iostream>
-#include <fstream>
 #include <format>
-#include <cstring>
-#include <sys/socket.h>
-#include <netinet/in.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <thread>
 #include <unistd.h>
+#include <optional>
 
 #include "../include/crypto.hpp"
+#include "../include/file_receiver.hpp"
 #include "../include/logger.hpp"
-#include "../include/utils.hpp"
+#include "../include/memory_budget.hpp"
+#include "../include/rate_limiter.hpp"
+#include "../include/shm_ring.hpp"
+#include "../include/store.hpp"
+#include "../include/work_queue.hpp"
 
 /*
     [IMPORTANT NOTE]
@@ -18,319 +25,240 @@
 */
 
 /*
-    `FileReceiver` is a class to receive files from the sender
-    
-    Throughout the program, the term "client" is used to refer to the sender, and
-    "server" is used to refer to the receiver.
-
-    However, normally, the client AND the server can do both; send and receive files.
-    I have not called the class `Server` for this very reason, a client can receive files
-    as well. The class `FileReceiver` is not called `Client` for the same reason.
-    
-    In this implementation, the client is the sender, and the server is the receiver.
-    Get used to it for this program, but remember that this is not the case in a real SFTP.
+    Set by SIGTERM/SIGINT, tells a daemon (-D) to shut down once it's done with the
+    connected senders. A second signal means "now", and exits without waiting
 */
-class FileReceiver {
-private:
-    // Socket FD for the sender (client)
-    int clientSocket;
-
-    // Receiver (server) information
-    int serverFD;
-    sockaddr_in address;
-    int addrlen;
-    int serverPort;
-
-    /*
-        There are three main steps involved in receiving data from the client
-        (in this implementation of SFTP)
-        1. Read the file size, and file sent by the client
-        2. Decrypt the file data (There isn't a function for this, its done in ReceiveFile())
-        3. Verify the hash of the decrypted data
-        4. Write the decrypted data to a file (No function for this either, its done in ReceiveFile())
-
-        Although these steps can be combined into a single function, they are kept separate
-        for better readability and maintainability
-
-        These are private functions since they are only used internally by the class
-        and are not meant to be called by the user
-    */
-    // Step 1
-    bool ReadFromClient(std::vector<Byte>& encryptedData);
-    // Step 3
-    bool ReadAndVerifyHash(std::vector<Byte>& decryptedData);
-
-public:
-    FileReceiver(const int port) {
-
-        clientSocket = -1;
-
-        serverFD = -1;
-        address = {};
-        addrlen = sizeof(address);
-        serverPort = port;
-     
-        return;
-    }
-    
-    ~FileReceiver() {
-        CloseConnection();
-    }
-
-    bool InitializeServer();
-    bool AcceptConnection();
-    bool ReceiveFile(const std::string& filename);
-    void CloseConnection();
-};
-
-/*
-    Initialize the server
-    @return true if initialization is successful, false otherwise
-*/
-bool FileReceiver::InitializeServer() {
-        
-    /*
-        Set server address information
-        AF_INET: IPv4
-        INADDR_ANY: Bind to any address
-        htons: Convert port number to network byte order
-    */
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(serverPort);
-    
-    // Create socket file descriptor
-    serverFD = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverFD == 0) {
-        Log::Error("InitializeServer()", "Socket creation error");
-        return false;
-    }
-
-    // Bind the socket to the port
-    int bindStatus = bind(serverFD, (struct sockaddr*)&address, sizeof(address));   
-    if (bindStatus < 0) {
-        Log::Error("InitializeServer()", "Bind error");
-        return false;
-    }
-
-    // Start listening for connections
-    int listenStatus = listen(serverFD, 3);
-    if (listenStatus < 0) {
-        Log::Error("InitializeServer()", "Listen error");
-        return false;
-    }
+static std::atomic<bool> stopRequested = false;
 
-    Log::Info("InitializeServer()", std::format("Server listening on port {}", serverPort));
-    return true;
+static void RequestStop(int) {
+    if (stopRequested.exchange(true))
+        _exit(1);
 }
 
-/*
-    Accept a connection
-    @return true if connection is accepted, false otherwise
-*/
-bool FileReceiver::AcceptConnection() {
-    
-    // Accept a connection from the client
-    clientSocket = accept(serverFD, (struct sockaddr*)&address, (socklen_t*)&addrlen);
-    
-    if (clientSocket < 0) {
-        Log::Error("AcceptConnection()", "Accept error");
-        return false;
-    }
-    
-    return true;
-}
 
+int main(int argc, char* argv[]) {
 
-/*
-    Read the file size, and file sent by the client
-    @param encryptedData: vector to store the encrypted data
-    @return true if data is read successfully, false otherwise
-*/
-bool FileReceiver::ReadFromClient(std::vector<Byte>& encryptedData) {
-    
-    // Read the size of file to be received
-    size_t fileSize = -1;
-    if (read(clientSocket, &fileSize, sizeof(fileSize)) != sizeof(fileSize)) {
-        // This ensures that the file size is read correctly, and is not corrupted
-        Log::Error("ReadFromClient()", "Error reading file size");
-        return false;
-    }
+    std::cout << std::endl;
 
-    // Read the file data based on the file size
-    int bytesRead;
-    size_t totalBytesRead = 0;
-    std::string buffer(32768, '\0');
-
-    // Main loop to read file data
-    while (totalBytesRead < fileSize) {
-        /*
-            While reading file data, we might accidently read any further data that
-            the client will send as well (in this program, we're reading the hash of 
-            file later as well).
-            To avoid this, we need to calculate how much data to read each iteration, so
-            that we don't accidently read more than we're supposed to.
-
-            `bytesToRead` will read either `buffer.size()` data, or the amount of data
-            that's yet to be read
-        */
-        size_t bytesToRead = std::min(buffer.size(), fileSize - totalBytesRead);
-        bytesRead = read(clientSocket, &buffer[0], bytesToRead);
-
-        if (bytesRead <= 0) {
-            Log::Error("ReadFromClient()", "Error reading file data");
-            return false;
-        }
+    // Configuration
+    constexpr int serverPort = 8080;
 
-        // Insert the `buffer` at `encryptedData.end()`.
-        encryptedData.insert(encryptedData.end(), buffer.begin(), buffer.begin() + bytesRead);
-        totalBytesRead += bytesRead;
+    if (argc < 3) {
+        Log::Error("main()", std::format("Usage: {} [-f <filename>] [-n <number_of_files>] [-d <directory>] [-D <directory>] [-b <connections>] [--bench-suites] [--ticket-key <file>] [--threads <n>] [--pack] [--sparse] [--hash <sha256|blake3>] [--cipher <name>] [--store] [--background-unseal] [--memory-budget <size>] [--direct-io <size>] [--idle-timeout <seconds>] [--shm <socket>] [--ring-size <size>] [--udp] [--quiet]", argv[0]));
+        return -1;
     }
 
     /*
-        The following code is equivalent to the above while loop, but is more readable
-        It does not read the file in chunks, instead opting to read it out all at once
-
-        This is not recommended for operation however, as it can lead to memory issues
-        Still, if you feel like the above loop is too complicated, you can use this instead
+        Optional flags come after the file name/number of files
+        --bench-suites: measure the cipher suites at startup, instead of estimating
+                        their speed from the CPU features
+        --ticket-key <file>: keep the session ticket key in this file, so that senders
+                             can resume their sessions even after a restart
+        --threads <n>: threads used to decrypt and write a directory (-d), and to hash each file
+                       of -f and -n with BLAKE3, defaults to the number of cores
+        --pack: the files of -n arrive packed into segments, see ReceivePackedFiles()
+        --sparse: the file of -f arrives without its holes, see ReceiveSparseFile()
+        --hash <sha256|blake3>: only accept this hash algorithm, by default BLAKE3 is
+                                picked when the sender supports it, SHA-256 otherwise
+        --cipher <name>: only accept this cipher suite: aes256gcm, chacha20poly1305, aes256cbc,
+                         or, from a sender started with the same --cipher, caesar or null,
+                         which protect nothing (null is for benchmarking the transport alone)
+        --store: save the files of -f and -n encrypted, to be decrypted later with -u,
+                 see store.hpp
+        --background-unseal: with --store and -n, decrypt the stored files on a background
+                             thread while the rest are still arriving
+        --memory-budget <size>: most memory files in flight may hold at once ("512M", "2G"...,
+                                0 for unlimited, the default), see memory_budget.hpp
+        --direct-io <size>: write files of at least <size> bytes ("64M", "0" for all of them)
+                            with O_DIRECT, so that they don't fill the page cache, see SaveDirect()
+        --idle-timeout <seconds>: with -D, drop a sender that sends nothing for this long,
+                                  default 300, 0 to wait forever
+        --shm <socket>: serve senders on this host through a Unix socket at this path and
+                        shared memory, instead of TCP, see shm_ring.hpp
+        --ring-size <size>: size of each sender's shared memory ring, default 8M
+        --udp: take the file data over UDP, on the same port number as TCP, from a sender
+               started with --udp, see udp_transport.hpp. Not with -D
+        --quiet: only print errors and warnings, for a daemon (-D) under heavy load
+                 (see tools/load_generator.cpp), where printing every session costs more than serving it
     */
-    /* 
-        bytesRead = read(clientSocket, &buffer[0], fileSize);
-        if (bytesRead < 0) {
-            Log::Error("ReadFromClient()", "Error reading file data");
-            return false;
+    bool benchmarkSuites = false;
+    bool packFiles = false;
+    bool sparseFile = false;
+    bool storeFiles = false;
+    bool backgroundUnseal = false;
+    std::string ticketKeyFile;
+    uint64_t memoryBudget = 0;
+    uint64_t directIoThreshold = UINT64_MAX;
+    unsigned idleTimeout = 300;
+    std::string sharedMemoryPath;
+    uint64_t ringCapacity = ShmRing::defaultCapacity;
+    bool useUdp = false;
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<Crypto::HashAlgorithm> hashes = {Crypto::HashAlgorithm::Blake3, Crypto::HashAlgorithm::Sha256};
+    std::vector<Crypto::CipherSuite> suites;
+    for (int i = 3; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--bench-suites")
+            benchmarkSuites = true;
+        else if (option == "--ticket-key" && i + 1 < argc)
+            ticketKeyFile = argv[++i];
+        else if (option == "--pack")
+            packFiles = true;
+        else if (option == "--sparse")
+            sparseFile = true;
+        else if (option == "--store")
+            storeFiles = true;
+        else if (option == "--background-unseal")
+            backgroundUnseal = true;
+        else if (option == "--memory-budget" && i + 1 < argc) {
+            // Same suffixes as the sender's rates
+            if (RateLimit::ParseRate(argv[++i], memoryBudget) == false) {
+                Log::Error("main()", std::format("Invalid memory budget {}", argv[i]));
+                return -1;
+            }
+        }
+        else if (option == "--direct-io" && i + 1 < argc) {
+            if (RateLimit::ParseRate(argv[++i], directIoThreshold) == false) {
+                Log::Error("main()", std::format("Invalid direct I/O size {}", argv[i]));
+                return -1;
+            }
+        }
+        else if (option == "--idle-timeout" && i + 1 < argc) {
+            try {
+                idleTimeout = std::max(std::stoi(argv[++i]), 0);
+            }
+            catch (std::invalid_argument&) {
+                Log::Error("main()", "Invalid idle timeout");
+                return -1;
+            }
+        }
+        else if (option == "--shm" && i + 1 < argc)
+            sharedMemoryPath = argv[++i];
+        else if (option == "--ring-size" && i + 1 < argc) {
+            if (RateLimit::ParseRate(argv[++i], ringCapacity) == false || ringCapacity == 0) {
+                Log::Error("main()", std::format("Invalid ring size {}", argv[i]));
+                return -1;
+            }
+        }
+        else if (option == "--udp")
+            useUdp = true;
+        else if (option == "--quiet")
+            Log::SetQuiet(true);
+        else if (option == "--hash" && i + 1 < argc) {
+            Crypto::HashAlgorithm hash = Crypto::HashAlgorithm::None;
+            if (Crypto::ParseHashAlgorithm(argv[++i], hash) == false) {
+                Log::Error("main()", std::format("Unknown hash algorithm {}", argv[i]));
+                return -1;
+            }
+            hashes = {hash};
+        }
+        else if (option == "--cipher" && i + 1 < argc) {
+            Crypto::CipherSuite suite = Crypto::CipherSuite::None;
+            if (Crypto::ParseCipherSuite(argv[++i], suite) == false) {
+                Log::Error("main()", std::format("Unknown cipher suite {}", argv[i]));
+                return -1;
+            }
+            suites = {suite};
+        }
+        else if (option == "--threads" && i + 1 < argc) {
+            try {
+                threads = std::max(std::stoi(argv[++i]), 1);
+            }
+            catch (std::invalid_argument&) {
+                Log::Error("main()", "Invalid number of threads");
+                return -1;
+            }
+        }
+        else {
+            Log::Error("main()", std::format("Unknown option {}", option));
+            return -1;
         }
-        totalBytesRead = bytesRead;
-        encryptedData.insert(encryptedData.end(), buffer.begin(), buffer.begin() + bytesRead);
-    */ 
-
-    // Verify that the file data was read correctly
-    if (totalBytesRead != fileSize) {
-        Log::Error("ReadFromClient()", std::format("File size mismatch, expected {} bytes, but read {} bytes", fileSize, totalBytesRead));
-        return false;
-    }
-
-    return true;
-}
-
-/*
-    Verify the hash of the decrypted data
-    @param decryptedData: decrypted data
-    @return true if hash is verified successfully, false otherwise
-*/
-bool FileReceiver::ReadAndVerifyHash(std::vector<Byte>& decryptedData) {
-
-    // Read hash sent by sender
-    std::vector<Byte> receivedHash(32);
-    int bytesRead = read(clientSocket, receivedHash.data(), receivedHash.size());
-    if (bytesRead != receivedHash.size()) {
-        Log::Error("ReadAndVerifyHash()", "Error reading hash");
-        return false;
     }
 
-    // Calculate hash of decrypted data
-    std::vector<Byte> hash(32);
-    bool hashStatus = Crypto::CalculateHash(decryptedData, hash);
-    if (hashStatus == false) {
-        Log::Error("ReadAndVerifyHash()", "Error calculating hash");
-        return false;
+    std::string flag = argv[1];
+    if (storeFiles && (packFiles || sparseFile)) {
+        Log::Error("main()", "--store can't be combined with --pack or --sparse");
+        return -1;
     }
-
-    // Compare the received hash with the calculated hash
-    if (hash != receivedHash) {
-        Log::Error("ReadAndVerifyHash()", "Hash mismatch, file contents are invalid");
-        return false;
+    // The daemon serves many senders at once, and the UDP channel is one per port
+    if (useUdp && (sharedMemoryPath.empty() == false || flag == "-D")) {
+        Log::Error("main()", "--udp can't be combined with --shm or -D");
+        return -1;
     }
+    MemoryBudget::SetLimit(memoryBudget);
 
-    return true;
-}
-
-
-
-/*
-    Receive a file from the client
-    @param filename: path to the file to save
-    @return true if file is received successfully, false otherwise
-*/
-bool FileReceiver::ReceiveFile(const std::string& filename) {
-    
-    std::vector<Byte> encryptedData;
-    std::vector<Byte> decryptedData;
-
-    // -- Step 1 --
-    // Read the file size, and file sent by the client
-    bool readStatus = ReadFromClient(encryptedData);
-    if (readStatus == false) {
-        Log::Error("ReceiveFile()", "Error reading file sent by client");
-        return false;
-    }
+    /*
+        argv[1] = -u
+        argv[2] = file name
 
-    // -- Step 2 --
-    // Decrypt the Data
-    bool decryptionStatus = Crypto::DecryptData(encryptedData, decryptedData);
-    if (decryptionStatus == false) {
-        Log::Error("ReceiveFile()", "Decryption failed");
-        return false;
+        Decrypt and verify a file that was received with --store, no connection involved
+    */
+    if (flag == "-u") {
+        if (Store::Unseal(argv[2], threads) == false)
+            return 1;
+        Log::Success("main()", std::format("File {} unsealed successfully!", argv[2]));
+        return 0;
     }
 
-    // -- Step 3 --
-    // Verify the hash of the decrypted data
-    bool hashStatus = ReadAndVerifyHash(decryptedData);
-    if (hashStatus == false) {
-        Log::Error("ReceiveFile()", "Error verifying hash");
-        return false;
-    }
+    FileReceiver receiver(serverPort, benchmarkSuites);
+    receiver.UseTicketKeyFile(ticketKeyFile);
+    receiver.SetHashAlgorithms(hashes);
+    receiver.SetCipherSuites(suites);
+    receiver.SetHashThreads(threads);
+    receiver.UseSharedMemory(sharedMemoryPath, ringCapacity);
+    receiver.UseUdp(useUdp);
+    receiver.UseDirectIo(directIoThreshold);
+    receiver.SetIdleTimeout(idleTimeout);
 
-    // -- Step 4 --
-    // Write decrypted Data to file
-    std::ofstream outfile(filename, std::ios::binary);
-    if (!outfile) {
-        Log::Error("ReceiveFile()", std::format("Failed to create file '{}'", filename));
-        return false;
-    }
-    outfile.write(reinterpret_cast<const char*>(decryptedData.data()), decryptedData.size());
-    outfile.close();
+    if (receiver.InitializeServer() == false)
+        return 1;
 
-    Log::Success("ReceiveFile()", std::format("File saved as {} successfully!", filename));
-    return true;
-}
+    /*
+        argv[1] = -b
+        argv[2] = number of connections
 
-/*
-    Close the connection
-*/
-void FileReceiver::CloseConnection() {
-    
-    if (clientSocket != -1) {
-        close(clientSocket);
-        clientSocket = -1;
-    }
+        Handshake benchmark, no files are transferred
+        The sender connects `2 * <connections>` times, half of them with a full handshake
+        and half of them resumed, see main() in sender.cpp
+    */
+    if (flag == "-b") {
+        int numberOfConnections = 0;
+        try {
+            numberOfConnections = std::stoi(argv[2]);
+        }
+        catch (std::invalid_argument&) {
+            Log::Error("main()", "Invalid number of connections");
+            return -1;
+        }
 
-    if (serverFD != -1) {
-        close(serverFD);
-        serverFD = -1;
+        for (int i = 0; i < 2 * numberOfConnections; i++) {
+            if (receiver.AcceptConnection() == false)
+                return 1;
+        }
+        return 0;
     }
 
-    return;
-}
-
-
-int main(int argc, char* argv[]) {
-
-    std::cout << std::endl;
-
-    // Configuration
-    constexpr int serverPort = 8080;
+    /*
+        argv[1] = -D
+        argv[2] = directory
 
-    if (argc < 3) {
-        Log::Error("main()", std::format("Usage: {} [-f <filename>] [-n <number_of_files>]", argv[0]));
-        return -1;
+        Run as a daemon, receiving the files of every sender (several at once) into the given
+        directory until SIGTERM or SIGINT. Senders need --named, so that every file
+        carries its own name
+    */
+    if (flag == "-D") {
+        struct sigaction action = {};
+        action.sa_handler = RequestStop;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGTERM, &action, nullptr);
+        sigaction(SIGINT, &action, nullptr);
+
+        if (receiver.RunDaemon(argv[2], stopRequested) == false)
+            return 1;
+        return 0;
     }
 
-    std::string flag = argv[1];
-    FileReceiver receiver(serverPort);
-
-    if (receiver.InitializeServer() == false)
-        return 1;
     if (receiver.AcceptConnection() == false)
         return 1;
 
@@ -355,6 +283,7 @@ int main(int argc, char* argv[]) {
         argv[2] = file name
 
         The user wants to receive a single file, and not a number of files
+        With --sparse, the file arrives without its holes (the sender needs --sparse as well)
     */
     if (flag == "-f") {
         if (argc < 3) {
@@ -363,7 +292,14 @@ int main(int argc, char* argv[]) {
         }
 
         std::string fileNameToSaveAs = argv[2];
-        if (receiver.ReceiveFile(fileNameToSaveAs) == false)
+        bool received = false;
+        if (storeFiles)
+            received = receiver.StoreFile(fileNameToSaveAs);
+        else if (sparseFile)
+            received = receiver.ReceiveSparseFile(fileNameToSaveAs);
+        else
+            received = receiver.ReceiveFile(fileNameToSaveAs);
+        if (received == false)
             return 1;
     }
 
@@ -381,6 +317,7 @@ int main(int argc, char* argv[]) {
         argv[2] = number of files
 
         The user wants to receive a number of files, and not a single file
+        With --pack, they arrive packed into segments (the sender needs --pack as well)
     */
     else if (flag == "-n") {
         if (argc < 3) {
@@ -397,11 +334,66 @@ int main(int argc, char* argv[]) {
             return -1;
         }
     
-        for (int i = 1; i <= numberOfFiles; i++) {
-            const std::string fileNameToSaveAs = std::format("tests/recv/perftest_{}KB.txt", i);
-            if (receiver.ReceiveFile(fileNameToSaveAs) == false)
+        const auto startTime = std::chrono::steady_clock::now();
+        if (packFiles) {
+            if (receiver.ReceivePackedFiles("tests/recv", numberOfFiles) == false)
                 return 1;
         }
+        else if (storeFiles) {
+            /*
+                Stored files are handed to the background thread as soon as they land, so
+                decrypting overlaps with receiving, without ever holding up the socket
+            */
+            WorkQueue<std::string> stored(numberOfFiles);
+            std::atomic<bool> unsealed = true;
+            std::thread unsealer;
+            if (backgroundUnseal) {
+                unsealer = std::thread([&]() {
+                    while (std::optional<std::string> fileName = stored.Pop())
+                        if (Store::Unseal(*fileName) == false)
+                            unsealed = false;
+                });
+            }
+
+            bool received = true;
+            for (int i = 1; i <= numberOfFiles && received; i++) {
+                const std::string fileNameToSaveAs = std::format("tests/recv/perftest_{}KB.txt", i);
+                received = receiver.StoreFile(fileNameToSaveAs);
+                if (received && backgroundUnseal)
+                    stored.Push(fileNameToSaveAs);
+            }
+
+            stored.Close();
+            if (unsealer.joinable())
+                unsealer.join();
+            if (received == false || unsealed == false)
+                return 1;
+        }
+        else {
+            for (int i = 1; i <= numberOfFiles; i++) {
+                const std::string fileNameToSaveAs = std::format("tests/recv/perftest_{}KB.txt", i);
+                if (receiver.ReceiveFile(fileNameToSaveAs) == false)
+                    return 1;
+            }
+        }
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        Log::Info("main()", std::format("Received {} files {} in {:.3f} s: {:.0f} files/s",
+            numberOfFiles, packFiles ? "packed" : (storeFiles ? "into the store" : "one by one"), seconds, numberOfFiles / seconds));
+        Log::Info("main()", std::format("Memory: {}", MemoryBudget::Describe()));
+    }
+
+    /*
+        argv[1] = -d
+        argv[2] = directory
+
+        The user wants to receive a whole directory tree, and save it into the given directory
+    */
+    else if (flag == "-d") {
+        std::string destination = argv[2];
+        if (receiver.ReceiveDirectory(destination, threads) == false)
+            return 1;
+        Log::Info("main()", std::format("Memory: {}", MemoryBudget::Describe()));
     }
 
     /*
@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <numeric>
+#include <deque>
+#include <queue>
+#include <cmath>
+
+#include "../include/scheduler.hpp"
+
+namespace Schedule {
+
+    /*
+        Parse a policy name: fifo, sjf or wfq
+        @param name: the name
+        @param policy: the parsed policy
+        @return true if the name is valid, false otherwise
+    */
+    bool ParsePolicy(const std::string& name, Policy& policy) {
+        if (name == "fifo")
+            policy = Policy::Fifo;
+        else if (name == "sjf")
+            policy = Policy::ShortestFirst;
+        else if (name == "wfq")
+            policy = Policy::WeightedFair;
+        else
+            return false;
+        return true;
+    }
+
+    const char* PolicyName(Policy policy) {
+        switch (policy) {
+            case Policy::Fifo:          return "fifo";
+            case Policy::ShortestFirst: return "sjf";
+            case Policy::WeightedFair:  return "wfq";
+        }
+        return "unknown";
+    }
+
+    /*
+        WFQ, see the top of scheduler.hpp
+        @param jobs: the files
+        @param chunkSize: size of the pieces each file is sent in, 0 for whole files
+        @return the slices to send, in order
+
+        Every file is backlogged from the start, so there's no need to track the virtual
+        time of the link: a piece's finish time is just the previous piece's plus its own
+        length over the file's weight. Ties go to the file given first.
+    */
+    static std::vector<Slice> PlanWeightedFair(const std::vector<Job>& jobs, uint64_t chunkSize) {
+
+        struct Piece {
+            double finish;
+            size_t job;
+            uint64_t offset;
+        };
+        auto later = [](const Piece& a, const Piece& b) {
+            return a.finish != b.finish ? a.finish > b.finish : a.job > b.job;
+        };
+        auto pieceLength = [&](size_t job, uint64_t offset) {
+            const uint64_t left = jobs[job].size - offset;
+            return chunkSize > 0 ? std::min(chunkSize, left) : left;
+        };
+        // A weight of 0 (or less) would never get a turn, treat it as the smallest possible one instead
+        auto weight = [&](size_t job) {
+            return std::max(jobs[job].weight, 1e-9);
+        };
+
+        std::priority_queue<Piece, std::vector<Piece>, decltype(later)> next(later);
+        for (size_t job = 0; job < jobs.size(); job++)
+            next.push({pieceLength(job, 0) / weight(job), job, 0});
+
+        std::vector<Slice> plan;
+        while (next.empty() == false) {
+            Piece piece = next.top();
+            next.pop();
+
+            const uint64_t length = pieceLength(piece.job, piece.offset);
+            plan.push_back({piece.job, piece.offset, length});
+
+            piece.offset += length;
+            if (piece.offset < jobs[piece.job].size) {
+                piece.finish += pieceLength(piece.job, piece.offset) / weight(piece.job);
+                next.push(piece);
+            }
+        }
+        return plan;
+    }
+
+    /*
+        Decide the order a batch is sent in
+        @param jobs: the files, in the order they were given
+        @param policy: the policy to order them by
+        @param chunkSize: interleave files larger than this, in chunks of this size, 0 to never split a file
+        @return the slices to send, in order
+    */
+    std::vector<Slice> Plan(const std::vector<Job>& jobs, Policy policy, uint64_t chunkSize) {
+
+        if (policy == Policy::WeightedFair)
+            return PlanWeightedFair(jobs, chunkSize);
+
+        // FIFO keeps the order given, SJF sorts by size (keeping the order given between equal sizes)
+        std::vector<size_t> order(jobs.size());
+        std::iota(order.begin(), order.end(), 0);
+        if (policy == Policy::ShortestFirst) {
+            std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                return jobs[a].size < jobs[b].size;
+            });
+        }
+
+        /*
+            Split into the files sent whole and the ones sent in chunks, each still in order.
+            Until a large file is started, files go in order. Once it is, its chunks take
+            turns with the small files, until it's done
+        */
+        std::vector<size_t> rank(jobs.size());
+        std::deque<size_t> whole, chunked;
+        for (size_t i = 0; i < order.size(); i++) {
+            rank[order[i]] = i;
+            if (chunkSize > 0 && jobs[order[i]].size > chunkSize)
+                chunked.push_back(order[i]);
+            else
+                whole.push_back(order[i]);
+        }
+
+        std::vector<Slice> plan;
+        uint64_t offset = 0;
+        bool chunkWasLast = false;
+        while (whole.empty() == false || chunked.empty() == false) {
+            bool chunkTurn;
+            if (chunked.empty())
+                chunkTurn = false;
+            else if (whole.empty())
+                chunkTurn = true;
+            else if (offset > 0)
+                chunkTurn = chunkWasLast == false;
+            else
+                chunkTurn = rank[chunked.front()] < rank[whole.front()];
+
+            if (chunkTurn) {
+                const size_t job = chunked.front();
+                const uint64_t length = std::min(chunkSize, jobs[job].size - offset);
+                plan.push_back({job, offset, length});
+                offset += length;
+                if (offset == jobs[job].size) {
+                    chunked.pop_front();
+                    offset = 0;
+                }
+            }
+            else {
+                const size_t job = whole.front();
+                plan.push_back({job, 0, jobs[job].size});
+                whole.pop_front();
+            }
+            chunkWasLast = chunkTurn;
+        }
+        return plan;
+    }
+
+    /*
+        When each job would complete if the plan was sent at a constant rate
+        @param jobs: the files
+        @param plan: the slices, from Plan()
+        @return for each job, the bytes sent up to and including its last slice
+    */
+    std::vector<uint64_t> CompletionBytes(const std::vector<Job>& jobs, const std::vector<Slice>& plan) {
+        std::vector<uint64_t> completion(jobs.size(), 0);
+        uint64_t sent = 0;
+        for (const Slice& slice : plan) {
+            sent += slice.length;
+            completion[slice.job] = sent;
+        }
+        return completion;
+    }
+
+    /*
+        Summarize per-file completion times
+        @param seconds: completion time of each file, in any order
+        @return their mean and percentiles (nearest rank), all zero for an empty set
+    */
+    Latency Summarize(std::vector<double> seconds) {
+        if (seconds.empty())
+            return {0, 0, 0, 0, 0};
+
+        std::sort(seconds.begin(), seconds.end());
+        auto percentile = [&](double p) {
+            const size_t index = static_cast<size_t>(std::ceil(p / 100.0 * seconds.size()));
+            return seconds[std::min(std::max(index, size_t(1)) - 1, seconds.size() - 1)];
+        };
+
+        const double total = std::accumulate(seconds.begin(), seconds.end(), 0.0);
+        return {total / seconds.size(), percentile(50), percentile(95), percentile(99), seconds.back()};
+    }
+};
@@ -1,15 +1,19 @@
 #include <iostream>
-#include <fstream>
 #include <format>
-#include <cstring>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <future>
+#include <filesystem>
+#include <fstream>
+#include <cstdio>
 
 #include "../include/crypto.hpp"
+#include "../include/file_sender.hpp"
 #include "../include/logger.hpp"
-#include "../include/utils.hpp"
-
+#include "../include/rate_limiter.hpp"
+#include "../include/scheduler.hpp"
+#include "../include/sender_pool.hpp"
 
 /*
     [IMPORTANT NOTE]
@@ -18,317 +22,312 @@
     3. This is meant for educational purposes only.
 */
 
-/*
-    `FileSender` is a class to send files to the receiver
-    
-    Throughout the program, the term "client" is used to refer to the sender, and
-    "server" is used to refer to the receiver.
-
-    However, normally, the client AND the server can do both; send and receive files.
-    I have not called the class `Client` for this very reason, a server can send files
-    as well. The class `FileReceiver` is not called `Server` for the same reason.
-    
-    In this implementation, the client is the sender, and the server is the receiver.
-    Get used to it for this program, but remember that this is not the case in a real SFTP.
-*/
-
-class FileSender {
-private:
-    // Sender (client) socket
-    int socketFD;
+int main(int argc, char* argv[]) {
 
-    // Receiver (server) address information
-    sockaddr_in serverAddr;
-    std::string serverIP;
-    int serverPort;
+    std::cout << std::endl;
 
-    /*
-        There are three main steps involved in sending data to the server
-        (in this implementation of SFTP)
-        1. Load the file contents into a vector
-        2. Encrypt the file contents and send it to the server
-        3. Calculate hash of the file and send it to the server
+    // Configuration
+    const std::string serverIP("127.0.0.1");
+    int serverPort = 8080;
 
-        Although these steps can be combined into a single function, they are kept separate
-        for better readability and maintainability
+    // Handle flags
+    if (argc < 3) {
+        Log::Error("main()", std::format("Usage: {} [-f <filename>] [-n <number_of_files>] [-d <directory>] [-l <list_file>] [-b <connections>] [--bench-suites] [--session-file <file>] [--no-resume] [--threads <n>] [--pack] [--sparse] [--rate <rate>] [--transfer-rate <rate>] [--rate-config <file>] [--hash <sha256|blake3>] [--cipher <name>] [--named] [--connections <n>] [--port <port>] [--shm <socket>] [--udp] [--incremental <index_file>] [--schedule <fifo|sjf|wfq>] [--interleave <size>]", argv[0]));
+        return -1;
+    }
 
-        These are private functions since they are only used internally by the class
-        and are not meant to be called by the user
+    /*
+        Optional flags come after the file name/number of files
+        --bench-suites: measure the cipher suites at startup, instead of estimating
+                        their speed from the CPU features
+        --session-file <file>: where to keep the session ticket (default .ssftp_session)
+        --no-resume: always do a full handshake
+        --threads <n>: threads used to walk and load a directory (-d), and to hash each file
+                       of -f and -n with BLAKE3, defaults to the number of cores
+        --pack: pack the files of -n into segments, see SendPackedFiles()
+        --sparse: skip the holes of the file sent with -f, see SendSparseFile()
+        --rate <rate>: limit how fast we send, in bytes per second ("10M", "500K"...)
+        --transfer-rate <rate>: limit each file of a directory (-d) to this rate
+        --rate-config <file>: read the two rates above from this file, and re-read it
+                              on SIGHUP, see RateLimit::LoadRateConfig()
+        --hash <sha256|blake3>: only offer this hash algorithm, both are offered by default
+                                and the receiver picks one
+        --cipher <name>: only offer this cipher suite: aes256gcm, chacha20poly1305, aes256cbc,
+                         or, to a receiver started with the same --cipher, caesar or null,
+                         which protect nothing, see crypto_policies.hpp
+        --named: send the files of -f and -n with their names, to a receiver daemon (-D),
+                 see SendNamedFile()
+        --connections <n>: with -n and --named, send the files over a pool of <n> connections,
+                           see sender_pool.hpp
+        --port <port>: connect to this port instead of 8080, e.g. to go through
+                       tools/wan_proxy.cpp
+        --shm <socket>: send to a receiver on this host, started with the same --shm,
+                        through its Unix socket and shared memory instead of TCP, see shm_ring.hpp
+        --udp: send the file data over UDP, with congestion control of our own, to a receiver
+               started with --udp, see udp_transport.hpp. Faster than TCP on lossy links
+        --incremental <index_file>: with -d, only send what changed since the transfer that
+                                    saved this index, see file_index.hpp
+        --schedule <fifo|sjf|wfq>: with -l, or -n and --named, the order to send the files in,
+                                   default fifo, see scheduler.hpp
+        --interleave <size>: with --schedule, send files larger than <size> ("64K", "1M"...) in
+                             chunks of that size, with other files in between
     */
-    // Step 1
-    bool LoadFileIntoVector(const std::string& filename, std::vector<Byte>& data);
-    // Step 2
-    bool EncryptAndSend(const std::vector<Byte>& data);
-    // Step 3
-    bool CalculateHashAndSend(const std::vector<Byte>& data);
-
-public:
-    FileSender(const std::string& ip, const int port) {
-
-        socketFD = -1;
-
-        serverAddr = {};
-        serverIP = ip;
-        serverPort = port;
-
-        return;
+    bool benchmarkSuites = false;
+    bool packFiles = false;
+    bool sparseFile = false;
+    bool namedFiles = false;
+    int connections = 0;
+    std::string sessionFile = ".ssftp_session";
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+    uint64_t globalRate = 0, transferRate = 0;
+    std::string rateConfigFile;
+    std::string sharedMemoryPath;
+    bool useUdp = false;
+    std::string indexFile;
+    std::vector<Crypto::HashAlgorithm> hashes = {Crypto::HashAlgorithm::Blake3, Crypto::HashAlgorithm::Sha256};
+    std::vector<Crypto::CipherSuite> suites;
+    bool scheduled = false;
+    Schedule::Policy policy = Schedule::Policy::Fifo;
+    uint64_t interleave = 0;
+    for (int i = 3; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--bench-suites")
+            benchmarkSuites = true;
+        else if (option == "--session-file" && i + 1 < argc)
+            sessionFile = argv[++i];
+        else if (option == "--no-resume")
+            sessionFile.clear();
+        else if (option == "--schedule" && i + 1 < argc) {
+            scheduled = true;
+            if (Schedule::ParsePolicy(argv[++i], policy) == false) {
+                Log::Error("main()", std::format("Unknown scheduling policy {}", argv[i]));
+                return -1;
+            }
+        }
+        else if (option == "--interleave" && i + 1 < argc) {
+            // Same suffixes as the rates
+            scheduled = true;
+            if (RateLimit::ParseRate(argv[++i], interleave) == false) {
+                Log::Error("main()", std::format("Invalid chunk size {}", argv[i]));
+                return -1;
+            }
+        }
+        else if (option == "--pack")
+            packFiles = true;
+        else if (option == "--sparse")
+            sparseFile = true;
+        else if (option == "--named")
+            namedFiles = true;
+        else if (option == "--port" && i + 1 < argc) {
+            try {
+                serverPort = std::stoi(argv[++i]);
+            }
+            catch (std::invalid_argument&) {
+                Log::Error("main()", "Invalid port");
+                return -1;
+            }
+        }
+        else if (option == "--shm" && i + 1 < argc)
+            sharedMemoryPath = argv[++i];
+        else if (option == "--udp")
+            useUdp = true;
+        else if (option == "--incremental" && i + 1 < argc)
+            indexFile = argv[++i];
+        else if (option == "--connections" && i + 1 < argc) {
+            try {
+                connections = std::max(std::stoi(argv[++i]), 1);
+            }
+            catch (std::invalid_argument&) {
+                Log::Error("main()", "Invalid number of connections");
+                return -1;
+            }
+        }
+        else if ((option == "--rate" || option == "--transfer-rate") && i + 1 < argc) {
+            if (RateLimit::ParseRate(argv[++i], option == "--rate" ? globalRate : transferRate) == false) {
+                Log::Error("main()", std::format("Invalid rate {}", argv[i]));
+                return -1;
+            }
+        }
+        else if (option == "--rate-config" && i + 1 < argc) {
+            rateConfigFile = argv[++i];
+            if (RateLimit::LoadRateConfig(rateConfigFile, globalRate, transferRate) == false)
+                return -1;
+        }
+        else if (option == "--hash" && i + 1 < argc) {
+            Crypto::HashAlgorithm hash = Crypto::HashAlgorithm::None;
+            if (Crypto::ParseHashAlgorithm(argv[++i], hash) == false) {
+                Log::Error("main()", std::format("Unknown hash algorithm {}", argv[i]));
+                return -1;
+            }
+            hashes = {hash};
+        }
+        else if (option == "--cipher" && i + 1 < argc) {
+            Crypto::CipherSuite suite = Crypto::CipherSuite::None;
+            if (Crypto::ParseCipherSuite(argv[++i], suite) == false) {
+                Log::Error("main()", std::format("Unknown cipher suite {}", argv[i]));
+                return -1;
+            }
+            suites = {suite};
+        }
+        else if (option == "--threads" && i + 1 < argc) {
+            try {
+                threads = std::max(std::stoi(argv[++i]), 1);
+            }
+            catch (std::invalid_argument&) {
+                Log::Error("main()", "Invalid number of threads");
+                return -1;
+            }
+        }
+        else {
+            Log::Error("main()", std::format("Unknown option {}", option));
+            return -1;
+        }
     }
 
-    ~FileSender() {
-        CloseConnection();
+    std::string flag = argv[1];
+    if (namedFiles && (packFiles || sparseFile)) {
+        Log::Error("main()", "--named can't be combined with --pack or --sparse");
+        return -1;
     }
-
-    bool ConnectToServer();
-    bool SendFile(const std::string& fileName);
-    void CloseConnection();
-};
-
-
-/*
-    Connect to the server
-    @return true if connection is successful, false otherwise
-*/
-bool FileSender::ConnectToServer() {
-        
-    // Set server information
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(serverPort);
-
-    // Create a socket - IPv4, TCP
-    socketFD = socket(AF_INET, SOCK_STREAM, 0);
-    if (socketFD < 0) {
-        Log::Error("ConnectToServer()", "Socket creation error");
-        return false;
+    if (connections > 0 && (flag != "-n" || namedFiles == false)) {
+        Log::Error("main()", "--connections needs -n and --named");
+        return -1;
     }
-
-    // Convert addresses from text to binary form
-    int inetStatus = inet_pton(AF_INET, serverIP.c_str(), &serverAddr.sin_addr);
-    if (inetStatus <= 0) {
-        Log::Error("ConnectToServer()", "Invalid address/Address not supported");
-        return false;
+    if (indexFile.empty() == false && flag != "-d") {
+        Log::Error("main()", "--incremental needs -d");
+        return -1;
     }
-
-    // Connect to the server
-    int connectStatus = connect(socketFD, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
-    if (connectStatus < 0) {
-        Log::Error("ConnectToServer()", "Connection failed");
-        return false;
+    if (scheduled && flag != "-l" && (flag != "-n" || namedFiles == false || connections > 0)) {
+        Log::Error("main()", "--schedule and --interleave need -l, or -n and --named (without --connections)");
+        return -1;
     }
-
-    return true;
-}
-
-/*
-    Load the contents of a file into a vector
-    @param filename: path to the file
-    @param data: vector to store the file contents
-    @return true if file is loaded successfully, false otherwise
-
-    Normally, the file would be read in chunks and sent to the server,
-    to avoid creating unnecessarily large buffers and wasting memory.
-    But for simplicity, the entire file is read into memory at once.
-*/
-bool FileSender::LoadFileIntoVector(const std::string& filename, std::vector<Byte>& data) {
-    // Open file in binary mode
-    std::ifstream infile(filename, std::ios::binary);
-    if (infile.fail()) {
-        Log::Error("LoadFileIntoVector()", std::format("Failed to open file '{}'", filename));
-        return false;
+    if (useUdp && (sharedMemoryPath.empty() == false || connections > 0)) {
+        Log::Error("main()", "--udp can't be combined with --shm or --connections");
+        return -1;
     }
 
-    // Load the file contents into a vector
-    // istreambuf_iterator reads the file contents as a stream of bytes
-    data = std::vector<Byte>((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
-
-    return true;
-}
-
-
-/*
-    Encrypt the file contents and send it to the server
-    @param plainFileData: file contents
-    @return true if file is sent successfully, false otherwise
-
-    Similar to LoadFileIntoVector(), the chunks that were read into memory
-    could be encrypted and sent to the server in chunks, to avoid creating
-    unnecessarily large buffers and wasting memory.
-
-    But for simplicity, the entire file is encrypted and sent at once.
-*/
-bool FileSender::EncryptAndSend(const std::vector<Byte>& plainFileData) {
-
-    /*
-        Encrypt the file contents using AES-256-CBC encryption
-        See Crypto::EncryptData() in crypto.cpp for more details
-        
-        In a normal implementation of SFTP, the file would be encrypted using the server's public key
-        and decrypted using the server's private key.
-        However, for simplicity, a pre-shared key is used here along with a pre-shared IV (Initialization Vector)
-        See Crypto::EncryptData() in crypto.cpp for more details
-        The pre-shared key and IV are hardcoded in crypto.hpp
-
-        You can use any 256 bit key and 128 bit IV for encryption
-    */
-    std::vector<Byte> encryptedData;
-    bool encryptionStatus = Crypto::EncryptData(plainFileData, encryptedData);
-    if (encryptionStatus == false) {
-        Log::Error("EncryptAndSend()", "Error encrypting file");
-        return false;
+    FileSender sender(serverIP, serverPort, benchmarkSuites);
+    sender.UseSessionFile(sessionFile);
+    sender.SetRates(globalRate, transferRate);
+    sender.SetHashAlgorithms(hashes);
+    sender.SetCipherSuites(suites);
+    sender.SetHashThreads(threads);
+    sender.UseSharedMemory(sharedMemoryPath);
+    sender.UseUdp(useUdp);
+    sender.UseIndex(indexFile);
+    if (rateConfigFile.empty() == false) {
+        sender.UseRateConfig(rateConfigFile);
+        RateLimit::InstallReloadSignal();
     }
 
     /*
-        Send size of encrypted data to the server
-        This is done so that the server knows how much data to expect
+        argv[1] = -b
+        argv[2] = number of connections
 
-        We cannot send the size of the file prior to encryption, since AES encryption
-        will change the size of the data (padding will be added)
-        Hence, encryption is carried first, then the size of the vector is taken
+        Handshake benchmark, measures how long it takes to set up a connection
+        Connects <connections> times with a full handshake (the saved ticket is thrown away
+        before each one), then <connections> times resuming with the saved ticket.
+        Run the receiver with the same -b <connections>
     */
-    size_t fileSize = encryptedData.size();
-    int bytesSent = send(socketFD, &fileSize, sizeof(fileSize), 0);
-    if (bytesSent < 0) {
-        Log::Error("EncryptAndSend()", "Error sending file size");
-        return false;
-    }
-    
-    // Send the encrypted file contents to the server in 1024 byte chunks
-    size_t totalBytesSent = 0;
-    size_t totalSize = encryptedData.size();
-    while (totalBytesSent < totalSize) {
-        // Send the min amongst 1024 bytes, or how much ever is left to send
-        size_t chunkSize = std::min(static_cast<size_t>(32768), totalSize - totalBytesSent);
-
-        int sentBytes = send(socketFD, encryptedData.data() + totalBytesSent, chunkSize, 0);
-        if (sentBytes < 0) {
-            Log::Error("EncryptAndSend()", "Error sending encrypted file");
-            return false;
+    if (flag == "-b") {
+        int numberOfConnections = 0;
+        try {
+            numberOfConnections = std::stoi(argv[2]);
+        }
+        catch (std::invalid_argument&) {
+            Log::Error("main()", "Invalid number of connections");
+            return -1;
+        }
+        if (sessionFile.empty()) {
+            Log::Error("main()", "The handshake benchmark needs a session file, drop --no-resume");
+            return -1;
         }
 
-        totalBytesSent += chunkSize;
-    }
-
-    /*
-        The following code is equivalent to the above while loop, but is more readable
-        It does not send the file in chunks, instead opting to send it out all at once
+        std::vector<double> fullTimes, resumedTimes;
+        for (int i = 0; i < 2 * numberOfConnections; i++) {
+            const bool wantFull = i < numberOfConnections;
+            if (wantFull)
+                std::remove(sessionFile.c_str());
 
-        This is not recommended for operation however, as it can lead to memory issues
+            if (sender.ConnectToServer() == false)
+                return 1;
+            sender.CloseConnection();
 
-        Still, if you feel like the above loop is too complicated, you can use this instead
-    */
-    /* 
-        int sentBytes = send(socketFD, encryptedData.data(), encryptedData.size(), 0);
-        if (sentBytes < 0) {
-            Log::Error("EncryptAndSend()", "Error sending encrypted file");
-            return false;
+            if (sender.LastHandshakeResumed())
+                resumedTimes.push_back(sender.LastHandshakeMicros());
+            else
+                fullTimes.push_back(sender.LastHandshakeMicros());
         }
-    */
-
-    return true;
-}
-
 
-/*
-    Calculate hash of the file and send it to the server
-    @param data: file contents
-    @return true if hash is sent successfully, false otherwise
-*/
-bool FileSender::CalculateHashAndSend(const std::vector<Byte>& data) {
-
-    // Calculate hash of the file
-    std::vector<Byte> hash(32, 0);
-    bool hashStatus = Crypto::CalculateHash(data, hash);
-    if (hashStatus == false) {
-        Log::Error("CalculateHashAndSend()", "Error calculating hash");
-        return false;
+        // Mean and median of each kind of handshake
+        auto report = [](const std::string& kind, std::vector<double>& times) {
+            if (times.empty())
+                return;
+            std::sort(times.begin(), times.end());
+            double total = 0;
+            for (double time : times)
+                total += time;
+            Log::Info("main()", std::format("{} handshakes: {}, mean {:.0f} us, median {:.0f} us",
+                kind, times.size(), total / times.size(), times[times.size() / 2]));
+        };
+        report("Full", fullTimes);
+        report("Resumed", resumedTimes);
+        return 0;
     }
 
     /*
-        Normally, you'd also encrypt the hash of the file using `Crypto::EncryptData()`
-        and send it to the server.
-        But for simplicity, the hash is sent as is.
-    */
-    int sentBytes = send(socketFD, &hash[0], hash.size(), 0);
-    if (sentBytes < 0) {
-        Log::Error("CalculateHashAndSend()", "Error sending hash");
-        return false;
-    }
-
-    return true;
-}
-
-
-/*
-    Send a file to the server
-    @param filename: path to the file to send
-    @return true if file is sent successfully, false otherwise
-*/
-bool FileSender::SendFile(const std::string& filename) {
-    
-    // -- Step 1 --
-    // Load the file into a vector
-    std::vector<Byte> plainFileData;
-    bool loadedData = LoadFileIntoVector(filename, plainFileData);
-    if (loadedData == false) {
-        Log::Error("SendFile()", "Error loading file");
-        return false;
-    }
-    
-    // -- Step 2 --
-    // Encrypt and send the file to the server
-    bool sentToServer = EncryptAndSend(plainFileData);
-    if (sentToServer == false) {
-        Log::Error("SendFile()", "Error sending encrypted file");
-        return false;
-    }
-    
-    // -- Step 3 --
-    // Calculate hash and send it to the server
-    bool sentHash = CalculateHashAndSend(plainFileData);
-    if (sentHash == false) {
-        Log::Error("SendFile()", "Error sending hash");
-        return false;
-    }
-
-    Log::Success("SendFile()", std::format("File {} sent successfully!", filename));
-    return true;
-}
-
-
-/*
-    Close the connection
-*/
-void FileSender::CloseConnection() {
-
-    if (socketFD != -1) {
-        close(socketFD);
-        socketFD = -1;
-    }
-
-    return;
-}
+        argv[1] = -n
+        argv[2] = number of files
+        with --named --connections <n>
 
+        Same files as -n below, but handed to a SenderPool, which sends them over <n>
+        connections at once. This is how a program linking libssftp would send them
+    */
+    if (connections > 0) {
+        int numberOfFiles = 0;
+        try {
+            numberOfFiles = std::stoi(argv[2]);
+        }
+        catch (std::invalid_argument&) {
+            Log::Error("main()", "Invalid number of files");
+            return -1;
+        }
 
-int main(int argc, char* argv[]) {
+        Ssftp::PoolOptions options;
+        options.serverIP = serverIP;
+        options.serverPort = serverPort;
+        options.sharedMemoryPath = sharedMemoryPath;
+        options.connections = connections;
+        options.sessionFile = sessionFile;
+        options.hashes = hashes;
+        options.suites = suites;
+
+        const auto startTime = std::chrono::steady_clock::now();
+        Ssftp::SenderPool pool(options);
+        if (pool.Start() == false)
+            return 1;
 
-    std::cout << std::endl;
+        std::vector<std::future<bool>> sent;
+        for (int j = 1; j <= numberOfFiles; j++) {
+            const std::string fileToSend = std::format("tests/send/perftest_{}KB.txt", j);
+            sent.push_back(pool.SendFile(fileToSend, std::filesystem::path(fileToSend).filename().string()));
+        }
 
-    // Configuration
-    const std::string serverIP("127.0.0.1");
-    constexpr int serverPort = 8080;
+        int failed = 0;
+        for (std::future<bool>& result : sent)
+            failed += result.get() ? 0 : 1;
+        pool.Shutdown();
 
-    // Handle flags
-    if (argc < 3) {
-        Log::Error("main()", std::format("Usage: {} [-f <filename>] [-n <number_of_files>]", argv[0]));
-        return -1;
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        Log::Info("main()", std::format("Sent {} files over {} connections in {:.3f} s: {:.0f} files/s",
+            numberOfFiles - failed, connections, seconds, numberOfFiles / seconds));
+        return failed == 0 ? 0 : 1;
     }
 
     // Connect to the server
-    FileSender sender(serverIP, serverPort);
     if (sender.ConnectToServer() == false)
         return 1;
 
-    std::string flag = argv[1];
-
     /*
         The client is now ready to send files, and the
         "configration" is done
@@ -350,6 +349,10 @@ int main(int argc, char* argv[]) {
         argv[2] = file name
 
         The user wants to send a single file, and not a number of files
+        With --sparse, only the parts of the file that hold data are sent
+        (run the receiver with --sparse as well)
+        With --named, the file is sent under its own name (without the directories
+        leading up to it) to a receiver daemon
     */
     if (flag == "-f") {
         if (argc < 3) {
@@ -358,7 +361,14 @@ int main(int argc, char* argv[]) {
         }
 
         std::string fileToSend = argv[2];
-        if (sender.SendFile(fileToSend) == false)
+        bool sent = false;
+        if (namedFiles)
+            sent = sender.SendNamedFile(fileToSend, std::filesystem::path(fileToSend).filename().string()) && sender.EndSession();
+        else if (sparseFile)
+            sent = sender.SendSparseFile(fileToSend);
+        else
+            sent = sender.SendFile(fileToSend);
+        if (sent == false)
             return 1;
         return 0;
     }
@@ -380,6 +390,10 @@ int main(int argc, char* argv[]) {
         The files are named `perftest_<number>KB.txt`, where <number> is the
         number of files to send
         The files are located in the `tests/send` directory
+
+        With --pack, the files are packed together instead of being sent one by one
+        (run the receiver with --pack as well). Either way, the time taken is reported
+        in files/s, so the two can be compared
     */
     else if (flag == "-n") {
         if (argc < 3) {
@@ -396,11 +410,92 @@ int main(int argc, char* argv[]) {
             return -1;
         }
 
-        for (int j = 1; j <= numberOfFiles; j++) {
-            const std::string fileToSend = std::format("tests/send/perftest_{}KB.txt", j);
-            if (sender.SendFile(fileToSend) == false)
+        std::vector<std::string> filesToSend;
+        for (int j = 1; j <= numberOfFiles; j++)
+            filesToSend.push_back(std::format("tests/send/perftest_{}KB.txt", j));
+
+        const auto startTime = std::chrono::steady_clock::now();
+        if (packFiles) {
+            if (sender.SendPackedFiles(filesToSend) == false)
+                return 1;
+        }
+        else if (namedFiles && scheduled) {
+            if (sender.SendScheduledFiles(filesToSend, {}, policy, interleave) == false)
                 return 1;
         }
+        else if (namedFiles) {
+            for (const std::string& fileToSend : filesToSend) {
+                if (sender.SendNamedFile(fileToSend, std::filesystem::path(fileToSend).filename().string()) == false)
+                    return 1;
+            }
+            if (sender.EndSession() == false)
+                return 1;
+        }
+        else {
+            for (const std::string& fileToSend : filesToSend) {
+                if (sender.SendFile(fileToSend) == false)
+                    return 1;
+            }
+        }
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        Log::Info("main()", std::format("Sent {} files {} in {:.3f} s: {:.0f} files/s",
+            numberOfFiles, packFiles ? "packed" : (namedFiles ? "by name" : "one by one"), seconds, numberOfFiles / seconds));
+        return 0;
+    }
+
+    /*
+        argv[1] = -d
+        argv[2] = directory
+
+        The user wants to send a whole directory, along with everything inside it
+        Run the receiver with -d as well, see SendDirectory() for how it works
+    */
+    else if (flag == "-d") {
+        std::string directoryToSend = argv[2];
+        if (sender.SendDirectory(directoryToSend, threads) == false)
+            return 1;
+        return 0;
+    }
+    /*
+        argv[1] = -l
+        argv[2] = list file
+
+        The user wants to send the files listed in a file, one path per line, by name to a
+        receiver daemon (-D). A path may be followed by a tab and a weight, which only WFQ
+        looks at (1 by default). They go in the order of the list, unless --schedule says
+        otherwise, see SendScheduledFiles()
+    */
+    else if (flag == "-l") {
+        std::ifstream list(argv[2]);
+        if (list.fail()) {
+            Log::Error("main()", std::format("Failed to open list '{}'", argv[2]));
+            return -1;
+        }
+
+        std::vector<std::string> filesToSend;
+        std::vector<double> weights;
+        std::string line;
+        while (std::getline(list, line)) {
+            if (line.empty())
+                continue;
+            const size_t tab = line.find('\t');
+            double weight = 1;
+            if (tab != std::string::npos) {
+                try {
+                    weight = std::stod(line.substr(tab + 1));
+                }
+                catch (std::invalid_argument&) {
+                    Log::Error("main()", std::format("Invalid weight in '{}'", line));
+                    return -1;
+                }
+            }
+            filesToSend.push_back(line.substr(0, tab));
+            weights.push_back(weight);
+        }
+
+        if (sender.SendScheduledFiles(filesToSend, weights, policy, interleave) == false)
+            return 1;
         return 0;
     }
     /*
@@ -0,0 +1,140 @@
+#include <format>
+
+#include "../include/logger.hpp"
+#include "../include/sender_pool.hpp"
+
+namespace Ssftp {
+
+    /*
+        Hand the file to the pool, and suspend the coroutine until it's sent
+        @param handle: the coroutine to resume once the file is sent
+        @return true to stay suspended, false to resume right away (the pool is shut down)
+    */
+    bool SendAwaitable::await_suspend(std::coroutine_handle<> handle) {
+        return pool.SendFile(filename, name, [this, handle](bool result) {
+            sent = result;
+            handle.resume();
+        });
+    }
+
+    SenderPool::SenderPool(const PoolOptions& poolOptions) : jobs(std::max<size_t>(poolOptions.maxQueued, 1)) {
+        options = poolOptions;
+        options.connections = std::max<size_t>(options.connections, 1);
+        started = false;
+        stopped = false;
+    }
+
+    SenderPool::~SenderPool() {
+        Shutdown();
+    }
+
+    /*
+        Open every connection, and start sending
+        @return true if every connection was opened, false otherwise (nothing is started)
+    */
+    bool SenderPool::Start() {
+
+        if (started || stopped)
+            return started;
+
+        for (size_t i = 0; i < options.connections; i++) {
+            auto sender = std::make_unique<FileSender>(options.serverIP, options.serverPort);
+            // Connections can't share a ticket file, they'd overwrite each other's tickets
+            sender->UseSessionFile(options.sessionFile.empty() ? "" : std::format("{}.{}", options.sessionFile, i));
+            sender->SetHashAlgorithms(options.hashes);
+            sender->SetCipherSuites(options.suites);
+            sender->UseSharedMemory(options.sharedMemoryPath);
+
+            if (sender->ConnectToServer() == false) {
+                Log::Error("SenderPool::Start()", std::format("Could not open connection {} of {}", i + 1, options.connections));
+                senders.clear();
+                return false;
+            }
+            senders.push_back(std::move(sender));
+        }
+
+        for (std::unique_ptr<FileSender>& sender : senders)
+            workers.emplace_back(&SenderPool::Work, this, std::ref(*sender));
+
+        started = true;
+        return true;
+    }
+
+    /*
+        Send every job that comes along over one connection, until the queue is closed
+        @param sender: this thread's connection
+    */
+    void SenderPool::Work(FileSender& sender) {
+
+        while (std::optional<Job> job = jobs.Pop()) {
+            // The last file broke the connection, open a new one for this file
+            if (sender.IsConnected() == false && sender.ConnectToServer() == false)
+                sender.CloseConnection();
+
+            const bool sent = sender.IsConnected() && sender.SendNamedFile(job->filename, job->name);
+            if (job->done)
+                job->done(sent);
+        }
+
+        if (sender.IsConnected())
+            sender.EndSession();
+        sender.CloseConnection();
+    }
+
+    /*
+        Send a file, and call `done` once it's sent
+        @param filename: path to the file to send
+        @param name: where the receiver should save it, relative to its directory
+        @param done: called with whether the file was sent, on one of the pool's threads
+        @return true if the file was queued, false if the pool isn't running (`done` is never called)
+
+        Blocks while PoolOptions::maxQueued files are already waiting
+    */
+    bool SenderPool::SendFile(const std::string& filename, const std::string& name, Completion done) {
+        if (started == false || stopped)
+            return false;
+        return jobs.Push({filename, name, std::move(done)});
+    }
+
+    /*
+        Send a file
+        @param filename: path to the file to send
+        @param name: where the receiver should save it, relative to its directory
+        @return a future that's set to whether the file was sent
+    */
+    std::future<bool> SenderPool::SendFile(const std::string& filename, const std::string& name) {
+
+        auto promise = std::make_shared<std::promise<bool>>();
+        std::future<bool> future = promise->get_future();
+        if (SendFile(filename, name, [promise](bool sent) { promise->set_value(sent); }) == false)
+            promise->set_value(false);
+        return future;
+    }
+
+    /*
+        Send a file from a coroutine, `co_await` the result
+        @param filename: path to the file to send
+        @param name: where the receiver should save it, relative to its directory
+        @return an awaitable that resumes with whether the file was sent
+    */
+    SendAwaitable SenderPool::SendFileAsync(const std::string& filename, const std::string& name) {
+        return SendAwaitable(*this, filename, name);
+    }
+
+    /*
+        Send everything that's queued, then end every session and close the connections
+        Nothing can be sent afterwards
+    */
+    void SenderPool::Shutdown() {
+
+        if (stopped)
+            return;
+        stopped = true;
+
+        jobs.Close();
+        for (std::thread& worker : workers)
+            worker.join();
+        workers.clear();
+        senders.clear();
+    }
+};
@@ -0,0 +1,456 @@
+#include <atomic>
+#include <new>
+#include <thread>
+#include <format>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../include/logger.hpp"
+#include "../include/shm_ring.hpp"
+
+namespace ShmRing {
+
+    /*
+        The start of the shared memory, the ring's data follows on the next page
+        Each counter has a cache line to itself, otherwise every update by one side would
+        take the line away from the other side even when it's only reading its own counter
+    */
+    struct Ring::Header {
+        uint64_t capacity;
+        // Bytes ever written (sender), and bytes ever read (receiver)
+        alignas(64) std::atomic<uint64_t> head;
+        alignas(64) std::atomic<uint64_t> tail;
+        // Set by a side that's about to sleep, cleared by whoever wakes it
+        alignas(64) std::atomic<uint32_t> readerWaiting;
+        alignas(64) std::atomic<uint32_t> writerWaiting;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "The ring's counters are shared between processes");
+    static constexpr size_t dataOffset = 4096;
+
+    // Before going to sleep, give the other side a few chances to catch up
+    static constexpr int yieldsBeforeSleeping = 16;
+    // Sleep at most this long before checking again, in milliseconds
+    static constexpr int sleepSliceMillis = 100;
+
+    int ConnectUnixSocket(const std::string& path) {
+
+        sockaddr_un address = {};
+        if (path.size() >= sizeof(address.sun_path)) {
+            Log::Error("ConnectUnixSocket()", std::format("Socket path '{}' is too long", path));
+            return -1;
+        }
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path.c_str(), path.size());
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    int ListenUnixSocket(const std::string& path, int backlog) {
+
+        sockaddr_un address = {};
+        if (path.size() >= sizeof(address.sun_path)) {
+            Log::Error("ListenUnixSocket()", std::format("Socket path '{}' is too long", path));
+            return -1;
+        }
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path.c_str(), path.size());
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+
+        // A socket file left over from an earlier run would make bind() fail
+        unlink(path.c_str());
+        if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(fd, backlog) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+
+    Ring::Ring() : header(nullptr), data(nullptr), capacity(0), mappedSize(0), head(0), tail(0),
+        memoryFD(-1), dataEvent(-1), spaceEvent(-1), peerFD(-1) {}
+
+    Ring::~Ring() {
+        Close();
+    }
+
+    Ring::Ring(Ring&& other) noexcept : Ring() {
+        *this = std::move(other);
+    }
+
+    Ring& Ring::operator=(Ring&& other) noexcept {
+        if (this != &other) {
+            Close();
+            std::swap(header, other.header);
+            std::swap(data, other.data);
+            std::swap(capacity, other.capacity);
+            std::swap(mappedSize, other.mappedSize);
+            std::swap(head, other.head);
+            std::swap(tail, other.tail);
+            std::swap(memoryFD, other.memoryFD);
+            std::swap(dataEvent, other.dataEvent);
+            std::swap(spaceEvent, other.spaceEvent);
+            std::swap(peerFD, other.peerFD);
+        }
+        return *this;
+    }
+
+    void Ring::Close() {
+        if (header != nullptr)
+            munmap(header, mappedSize);
+        for (int fd : {memoryFD, dataEvent, spaceEvent}) {
+            if (fd >= 0)
+                close(fd);
+        }
+
+        // The control socket isn't ours, only watched
+        header = nullptr;
+        data = nullptr;
+        capacity = mappedSize = 0;
+        head = tail = 0;
+        memoryFD = dataEvent = spaceEvent = peerFD = -1;
+    }
+
+    /*
+        Map the shared memory
+        @param fd: the memfd
+        @param size: its size, header included
+        @return true if successful, false otherwise
+    */
+    bool Ring::Map(int fd, size_t size) {
+        static_assert(sizeof(Header) <= dataOffset);
+
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (memory == MAP_FAILED) {
+            Log::Error("Map()", std::format("mmap() failed: {}", strerror(errno)));
+            return false;
+        }
+        header = static_cast<Header*>(memory);
+        data = static_cast<Byte*>(memory) + dataOffset;
+        mappedSize = size;
+        return true;
+    }
+
+    // Seals the memory must carry, so that its size can't change under either side's mapping
+    static constexpr int requiredSeals = F_SEAL_SHRINK | F_SEAL_GROW;
+
+    /*
+        Create the ring and pass it on, see shm_ring.hpp
+        The memfd and both eventfds go over the socket in one message, along with a single
+        byte (a message has to carry at least one). The memfd is sealed at its size first,
+        F_SEAL_SEAL keeps the sender from adding seals of its own (F_SEAL_WRITE...)
+    */
+    bool Ring::Offer(int socket, uint64_t size) {
+
+        Close();
+        size = std::max<uint64_t>(size, 4096);
+        memoryFD = memfd_create("ssftp-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        dataEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        spaceEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (memoryFD < 0 || dataEvent < 0 || spaceEvent < 0 || ftruncate(memoryFD, dataOffset + size) != 0 ||
+            fcntl(memoryFD, F_ADD_SEALS, requiredSeals | F_SEAL_SEAL) != 0) {
+            Log::Error("Offer()", std::format("Error creating the shared memory ring: {}", strerror(errno)));
+            Close();
+            return false;
+        }
+        if (Map(memoryFD, dataOffset + size) == false) {
+            Close();
+            return false;
+        }
+
+        // The memfd starts out zeroed, so only the capacity needs setting
+        new (header) Header();
+        header->capacity = size;
+        capacity = size;
+
+        const int fds[3] = {memoryFD, dataEvent, spaceEvent};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+        Byte marker = 1;
+        iovec payload = {&marker, sizeof(marker)};
+
+        msghdr message = {};
+        message.msg_iov = &payload;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr* rights = CMSG_FIRSTHDR(&message);
+        rights->cmsg_level = SOL_SOCKET;
+        rights->cmsg_type = SCM_RIGHTS;
+        rights->cmsg_len = CMSG_LEN(sizeof(fds));
+        std::memcpy(CMSG_DATA(rights), fds, sizeof(fds));
+
+        if (sendmsg(socket, &message, MSG_NOSIGNAL) != sizeof(marker)) {
+            Log::Error("Offer()", "Error sending the ring to the sender");
+            Close();
+            return false;
+        }
+
+        peerFD = socket;
+        return true;
+    }
+
+    bool Ring::Accept(int socket) {
+
+        Close();
+        int fds[3] = {-1, -1, -1};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+        Byte marker = 0;
+        iovec payload = {&marker, sizeof(marker)};
+
+        msghdr message = {};
+        message.msg_iov = &payload;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t received;
+        do {
+            received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+        } while (received < 0 && errno == EINTR);
+
+        cmsghdr* rights = CMSG_FIRSTHDR(&message);
+        if (received != sizeof(marker) || rights == nullptr || rights->cmsg_type != SCM_RIGHTS ||
+            rights->cmsg_len != CMSG_LEN(sizeof(fds))) {
+            Log::Error("Accept()", "The receiver didn't offer a shared memory ring, is it running with --shm?");
+            return false;
+        }
+        std::memcpy(fds, CMSG_DATA(rights), sizeof(fds));
+        memoryFD = fds[0];
+        dataEvent = fds[1];
+        spaceEvent = fds[2];
+
+        // Trust the size of the memory, not what's written in it, and only if it can't change
+        const int seals = fcntl(memoryFD, F_GET_SEALS);
+        if (seals < 0 || (seals & requiredSeals) != requiredSeals) {
+            Log::Error("Accept()", "The shared memory ring isn't sealed, its size could change under us");
+            Close();
+            return false;
+        }
+        struct stat memoryInfo = {};
+        if (fstat(memoryFD, &memoryInfo) != 0 || memoryInfo.st_size <= static_cast<off_t>(dataOffset) ||
+            Map(memoryFD, memoryInfo.st_size) == false) {
+            Log::Error("Accept()", "Error mapping the shared memory ring");
+            Close();
+            return false;
+        }
+        capacity = memoryInfo.st_size - dataOffset;
+        if (header->capacity != capacity) {
+            Log::Error("Accept()", "The shared memory ring is malformed");
+            Close();
+            return false;
+        }
+
+        peerFD = socket;
+        return true;
+    }
+
+    /*
+        Wait until there's data to read (forData), or room to write
+        @return true to check again, false if the other side went away and nothing changed
+
+        Yield a few times first, the other side is usually just about to get there. Then
+        raise our flag, check once more (the other side may have moved before seeing the
+        flag), and sleep on our eventfd and the control socket.
+    */
+    bool Ring::WaitFor(bool forData) {
+
+        // Only the other side's counter comes from the header, a bad one counts as ready, for the caller to catch
+        const auto ready = [this, forData]() {
+            if (forData)
+                return header->head.load(std::memory_order_seq_cst) != tail;
+            return head - header->tail.load(std::memory_order_seq_cst) != capacity;
+        };
+
+        for (int i = 0; i < yieldsBeforeSleeping; i++) {
+            if (ready())
+                return true;
+            std::this_thread::yield();
+        }
+
+        std::atomic<uint32_t>& waiting = forData ? header->readerWaiting : header->writerWaiting;
+        waiting.store(1, std::memory_order_seq_cst);
+        if (ready()) {
+            waiting.store(0, std::memory_order_relaxed);
+            return true;
+        }
+
+        pollfd watched[2] = {
+            {forData ? dataEvent : spaceEvent, POLLIN, 0},
+            {peerFD, POLLRDHUP, 0},
+        };
+        if (poll(watched, 2, sleepSliceMillis) < 0 && errno != EINTR)
+            return false;
+
+        if (watched[0].revents & POLLIN) {
+            uint64_t count;
+            [[maybe_unused]] ssize_t drained = read(watched[0].fd, &count, sizeof(count));
+        }
+
+        // Whatever is already in the ring can still be read after the sender is gone
+        if (watched[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+            waiting.store(0, std::memory_order_relaxed);
+            return ready();
+        }
+        return true;
+    }
+
+    // Wake the other side if it's asleep, see WaitFor()
+    void Ring::Wake(bool forData) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::atomic<uint32_t>& waiting = forData ? header->readerWaiting : header->writerWaiting;
+        if (waiting.load(std::memory_order_relaxed) != 0 && waiting.exchange(0) != 0) {
+            const uint64_t one = 1;
+            [[maybe_unused]] ssize_t written = write(forData ? dataEvent : spaceEvent, &one, sizeof(one));
+        }
+    }
+
+    /*
+        Check the counter the other side published, before copying anything based on it
+        @param headNow: the head, ours or the sender's
+        @param tailNow: the tail, ours or the receiver's
+        @param function: who's asking, for the log
+        @return true if the ring holds no more than it can, false (and the ring is closed) otherwise
+
+        Both counters only go up, and the head is never more than a ring's worth ahead of
+        the tail. Anything else (a head that ran ahead or went back, a tail past the head)
+        would have the copies run off the end of the mapping, so the connection is over.
+    */
+    bool Ring::CheckPeer(uint64_t headNow, uint64_t tailNow, const char* function) {
+        if (headNow - tailNow <= capacity)
+            return true;
+        Log::Error(function, "The other side corrupted the shared memory ring, closing it");
+        Close();
+        return false;
+    }
+
+    size_t Ring::WriteSome(const Byte* bytes, size_t size) {
+
+        if (header == nullptr || size == 0)
+            return 0;
+
+        // Only we move the head, the tail can only move forward (more room) behind our back
+        uint64_t tailNow = header->tail.load(std::memory_order_acquire);
+        while (head - tailNow == capacity) {
+            if (WaitFor(false) == false)
+                return 0;
+            tailNow = header->tail.load(std::memory_order_acquire);
+        }
+        if (CheckPeer(head, tailNow, "WriteSome()") == false)
+            return 0;
+
+        // Up to the end of the ring, then wrap around to the start
+        const size_t length = static_cast<size_t>(std::min<uint64_t>(size, capacity - (head - tailNow)));
+        const size_t position = head % capacity;
+        const size_t firstPart = std::min<size_t>(length, capacity - position);
+        std::memcpy(data + position, bytes, firstPart);
+        std::memcpy(data, bytes + firstPart, length - firstPart);
+
+        head += length;
+        header->head.store(head, std::memory_order_release);
+        Wake(true);
+        return length;
+    }
+
+    size_t Ring::ReadSome(Byte* bytes, size_t size) {
+
+        if (header == nullptr || size == 0)
+            return 0;
+
+        uint64_t headNow = header->head.load(std::memory_order_acquire);
+        while (headNow == tail) {
+            if (WaitFor(true) == false)
+                return 0;
+            headNow = header->head.load(std::memory_order_acquire);
+        }
+        if (CheckPeer(headNow, tail, "ReadSome()") == false)
+            return 0;
+
+        const size_t length = static_cast<size_t>(std::min<uint64_t>(size, headNow - tail));
+        const size_t position = tail % capacity;
+        const size_t firstPart = std::min<size_t>(length, capacity - position);
+        std::memcpy(bytes, data + position, firstPart);
+        std::memcpy(bytes + firstPart, data, length - firstPart);
+
+        tail += length;
+        header->tail.store(tail, std::memory_order_release);
+        Wake(false);
+        return length;
+    }
+
+    bool Ring::Write(const void* bytes, size_t size) {
+        const Byte* next = static_cast<const Byte*>(bytes);
+        while (size > 0) {
+            const size_t written = WriteSome(next, size);
+            if (written == 0)
+                return false;
+            next += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    bool Ring::Read(void* bytes, size_t size) {
+        Byte* next = static_cast<Byte*>(bytes);
+        while (size > 0) {
+            const size_t read = ReadSome(next, size);
+            if (read == 0)
+                return false;
+            next += read;
+            size -= read;
+        }
+        return true;
+    }
+
+    bool Ring::ReadToFile(int fileFD, uint64_t size) {
+
+        if (header == nullptr)
+            return false;
+
+        while (size > 0) {
+            uint64_t headNow = header->head.load(std::memory_order_acquire);
+            while (headNow == tail) {
+                if (WaitFor(true) == false)
+                    return false;
+                headNow = header->head.load(std::memory_order_acquire);
+            }
+            if (CheckPeer(headNow, tail, "ReadToFile()") == false)
+                return false;
+
+            // One write() per contiguous piece, straight out of the shared memory
+            const size_t position = tail % capacity;
+            const size_t length = static_cast<size_t>(std::min<uint64_t>({size, headNow - tail, capacity - position}));
+            const ssize_t written = write(fileFD, data + position, length);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0) {
+                Log::Error("ReadToFile()", std::format("Error writing file: {}", strerror(errno)));
+                return false;
+            }
+
+            tail += written;
+            header->tail.store(tail, std::memory_order_release);
+            Wake(false);
+            size -= written;
+        }
+        return true;
+    }
+};
@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <cerrno>
+#include <format>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../include/sparse.hpp"
+#include "../include/logger.hpp"
+
+namespace Sparse {
+
+    /*
+        Find the data extents of a file
+        @param fd: file to map, open for reading
+        @param fileSize: size of the file
+        @param extents: the data extents, in order
+        @return true if successful, false otherwise
+
+        Starting from offset 0, SEEK_DATA jumps to the start of the next data extent, and
+        SEEK_HOLE from there jumps to its end (every file has an implicit hole at its end,
+        so this always succeeds). Repeat until SEEK_DATA says there's no data left (ENXIO).
+
+        Note that file systems track holes in whole blocks, so a few zeros around the
+        edges of an extent may still be sent, and a hole may show up as data on file
+        systems that don't keep track of them (which is still correct, just not sparse)
+    */
+    bool MapDataExtents(int fd, uint64_t fileSize, std::vector<Extent>& extents) {
+
+        extents.clear();
+        off_t position = 0;
+        while (static_cast<uint64_t>(position) < fileSize) {
+            off_t dataStart = lseek(fd, position, SEEK_DATA);
+            if (dataStart < 0 && errno == ENXIO)
+                break;
+
+            // SEEK_DATA isn't supported here, treat everything from here on as data
+            if (dataStart < 0 && errno == EINVAL) {
+                extents.push_back({static_cast<uint64_t>(position), fileSize - position});
+                break;
+            }
+
+            off_t dataEnd = dataStart < 0 ? -1 : lseek(fd, dataStart, SEEK_HOLE);
+            if (dataEnd < 0) {
+                Log::Error("MapDataExtents()", "Error looking for holes in file");
+                return false;
+            }
+
+            // The file may have grown since we got its size, don't go past what we were told
+            dataEnd = std::min<off_t>(dataEnd, fileSize);
+            if (dataEnd > dataStart)
+                extents.push_back({static_cast<uint64_t>(dataStart), static_cast<uint64_t>(dataEnd - dataStart)});
+            position = dataEnd;
+        }
+
+        return true;
+    }
+
+    /*
+        Read the given extents of a file, appending them to a buffer back to back
+        @param fd: file to read from
+        @param extents: the extents to read, see MapDataExtents()
+        @param data: buffer to append to
+        @return true if successful, false otherwise
+    */
+    bool ReadExtents(int fd, const std::vector<Extent>& extents, std::vector<Byte>& data) {
+
+        uint64_t totalLength = 0;
+        for (const Extent& extent : extents)
+            totalLength += extent.length;
+        data.reserve(data.size() + totalLength);
+
+        for (const Extent& extent : extents) {
+            size_t start = data.size();
+            data.resize(start + extent.length);
+
+            uint64_t done = 0;
+            while (done < extent.length) {
+                ssize_t bytesRead = pread(fd, data.data() + start + done, extent.length - done, extent.offset + done);
+                if (bytesRead <= 0) {
+                    Log::Error("ReadExtents()", "Error reading file data, did the file shrink?");
+                    return false;
+                }
+                done += bytesRead;
+            }
+        }
+
+        return true;
+    }
+
+    /*
+        Recreate a sparse file from its data extents
+        @param path: file to create (or replace)
+        @param fileSize: size of the file, including any trailing hole
+        @param extents: where each piece of data goes
+        @param data: the extents' contents, back to back, as produced by ReadExtents()
+        @return true if successful, false otherwise
+
+        The file is truncated to nothing and then extended to its full size with ftruncate(),
+        which leaves it as one big hole. Writing the extents in place fills in the data, and
+        everything we never write to stays a hole, no zeros ever hit the disk.
+
+        (Updating an existing file in place would need to punch the holes out explicitly,
+        with fallocate(FALLOC_FL_PUNCH_HOLE), since the old data would still be there.
+        Starting from an empty file saves us from that)
+    */
+    bool WriteExtents(const std::string& path, uint64_t fileSize, const std::vector<Extent>& extents, const Byte* data) {
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            Log::Error("WriteExtents()", std::format("Failed to create file '{}'", path));
+            return false;
+        }
+
+        bool written = ftruncate(fd, fileSize) == 0;
+        for (const Extent& extent : extents) {
+            uint64_t done = 0;
+            while (written && done < extent.length) {
+                ssize_t bytesWritten = pwrite(fd, data + done, extent.length - done, extent.offset + done);
+                written = bytesWritten > 0;
+                done += std::max<ssize_t>(bytesWritten, 0);
+            }
+            data += extent.length;
+        }
+
+        close(fd);
+        if (written == false) {
+            Log::Error("WriteExtents()", std::format("Failed to write file '{}'", path));
+            return false;
+        }
+
+        return true;
+    }
+};
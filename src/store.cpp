@@ -0,0 +1,236 @@
+#include <fstream>
+#include <format>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../include/store.hpp"
+#include "../include/logger.hpp"
+#include "../include/protocol.hpp"
+
+namespace Store {
+
+    // How much the pipe between the socket and the file may hold, bigger means fewer splice() calls
+    constexpr int pipeSize = 1024 * 1024;
+    // Buffer size of the read()/write() fallback
+    constexpr size_t copyBufferSize = 256 * 1024;
+
+    /*
+        Move bytes from a socket into a file with read() and write()
+        @param socketFD: socket to read from
+        @param fileFD: file to write to
+        @param size: number of bytes to move
+        @return true if everything was moved, false otherwise
+    */
+    static bool CopyToFile(int socketFD, int fileFD, uint64_t size) {
+
+        std::vector<Byte> buffer(static_cast<size_t>(std::min<uint64_t>(size, copyBufferSize)));
+        while (size > 0) {
+            const ssize_t bytesRead = read(socketFD, buffer.data(), static_cast<size_t>(std::min<uint64_t>(size, buffer.size())));
+            if (bytesRead <= 0) {
+                Log::Error("CopyToFile()", "Error reading file data");
+                return false;
+            }
+
+            if (write(fileFD, buffer.data(), bytesRead) != bytesRead) {
+                Log::Error("CopyToFile()", "Error writing file data");
+                return false;
+            }
+            size -= bytesRead;
+        }
+
+        return true;
+    }
+
+    /*
+        Move exactly `size` bytes from a socket into a file, without copying them into user space
+        @param socketFD: socket to read from
+        @param fileFD: file to write to, at its current offset
+        @param size: number of bytes to move
+        @return true if everything was moved, false on error or if the peer hung up
+
+        splice() only works when one end is a pipe, so it takes two hops:
+        socket -> pipe, then pipe -> file. Both only move references to pages around.
+        We never ask for more than what's left of this file, so whatever the sender
+        sends next (the hash) stays in the socket.
+    */
+    bool SpliceToFile(int socketFD, int fileFD, uint64_t size) {
+
+    #if defined(__linux__)
+        int pipeFDs[2];
+        if (pipe2(pipeFDs, O_CLOEXEC) != 0)
+            return CopyToFile(socketFD, fileFD, size);
+
+        // Best effort, the default pipe only holds 64 KB
+        int capacity = fcntl(pipeFDs[1], F_SETPIPE_SZ, pipeSize);
+        if (capacity <= 0)
+            capacity = 64 * 1024;
+
+        bool moved = true;
+        uint64_t remaining = size;
+        while (remaining > 0) {
+            const size_t wanted = static_cast<size_t>(std::min<uint64_t>(remaining, capacity));
+            ssize_t inPipe = splice(socketFD, nullptr, pipeFDs[1], nullptr, wanted, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (inPipe < 0 && errno == EINTR)
+                continue;
+
+            // Not supported for this socket/file system, nothing was taken out of the socket yet
+            if (inPipe < 0 && errno == EINVAL && remaining == size) {
+                close(pipeFDs[0]);
+                close(pipeFDs[1]);
+                return CopyToFile(socketFD, fileFD, size);
+            }
+            if (inPipe <= 0) {
+                Log::Error("SpliceToFile()", "Error reading file data");
+                moved = false;
+                break;
+            }
+            remaining -= inPipe;
+
+            // Empty the pipe into the file before filling it again
+            while (inPipe > 0) {
+                const ssize_t toFile = splice(pipeFDs[0], nullptr, fileFD, nullptr, inPipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (toFile < 0 && errno == EINTR)
+                    continue;
+                if (toFile <= 0) {
+                    Log::Error("SpliceToFile()", "Error writing file data");
+                    moved = false;
+                    break;
+                }
+                inPipe -= toFile;
+            }
+            if (moved == false)
+                break;
+        }
+
+        close(pipeFDs[0]);
+        close(pipeFDs[1]);
+        return moved;
+    #else
+        return CopyToFile(socketFD, fileFD, size);
+    #endif
+    }
+
+    /*
+        Read a whole file into a vector
+        @param path: file to read
+        @param data: its contents
+        @return true if successful, false otherwise
+    */
+    static bool ReadWholeFile(const std::string& path, std::vector<Byte>& data) {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (file.fail()) {
+            Log::Error("ReadWholeFile()", std::format("Failed to open '{}'", path));
+            return false;
+        }
+
+        data.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(data.data()), data.size());
+        return file.good() || data.empty();
+    }
+
+    /*
+        Write the sidecar of a stored file
+        @param filename: the file's final name, the sidecar goes next to "<filename>.sealed"
+        @param suite: cipher suite the data was encrypted with
+        @param hashAlgorithm: algorithm of `expectedHash`
+        @param keys: the session's keys, sealed before they're written
+        @param encryptedSize: size of the stored ciphertext
+        @param expectedHash: hash of the plaintext, as sent by the sender
+        @return true if successful, false otherwise
+
+        The keys are sealed with AES-256-GCM, so a sidecar that was tampered with fails to
+        unseal instead of decrypting the file with garbage keys
+    */
+    bool SaveMetadata(const std::string& filename, Crypto::CipherSuite suite, Crypto::HashAlgorithm hashAlgorithm,
+        const Crypto::SessionKeys& keys, uint64_t encryptedSize, const std::vector<Byte>& expectedHash) {
+
+        std::vector<Byte> plainKeys(keys.key.begin(), keys.key.end());
+        plainKeys.insert(plainKeys.end(), keys.iv.begin(), keys.iv.end());
+
+        Protocol::StoredFileInfo info = {suite, hashAlgorithm, encryptedSize, expectedHash, {}};
+        if (Crypto::EncryptData(plainKeys, info.sealedKeys, Crypto::CipherSuite::Aes256Gcm) == false) {
+            Log::Error("SaveMetadata()", "Error sealing session keys");
+            return false;
+        }
+
+        std::vector<Byte> sidecar;
+        Protocol::SerializeStoredFileInfo(info, sidecar);
+
+        const std::string path = filename + metadataSuffix;
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(sidecar.data()), sidecar.size());
+        if (file.fail()) {
+            Log::Error("SaveMetadata()", std::format("Failed to write '{}'", path));
+            return false;
+        }
+
+        return true;
+    }
+
+    /*
+        Decrypt and verify a stored file, and replace the stored pair with the plaintext
+        @param filename: the file's final name, as given to the receiver
+        @param threads: threads used to hash it, BLAKE3 only
+        @return true if the file was decrypted and its hash matched, false otherwise
+
+        The same three steps FileReceiver::ReceiveFile() would have done right away,
+        only reading the ciphertext from disk instead of from the socket
+    */
+    bool Unseal(const std::string& filename, unsigned threads) {
+
+        const std::string dataPath = filename + dataSuffix;
+        const std::string metadataPath = filename + metadataSuffix;
+
+        // Unseal the session keys first, there's no point reading the data without them
+        std::vector<Byte> sidecar, plainKeys;
+        Protocol::StoredFileInfo info = {};
+        if (ReadWholeFile(metadataPath, sidecar) == false || Protocol::ParseStoredFileInfo(sidecar, info) == false) {
+            Log::Error("Unseal()", std::format("Missing or malformed metadata for '{}'", filename));
+            return false;
+        }
+
+        Crypto::SessionKeys keys = {};
+        if (Crypto::DecryptData(info.sealedKeys, plainKeys, Crypto::CipherSuite::Aes256Gcm) == false ||
+            plainKeys.size() != keys.key.size() + keys.iv.size()) {
+            Log::Error("Unseal()", std::format("Could not unseal the session keys of '{}'", filename));
+            return false;
+        }
+        std::copy(plainKeys.begin(), plainKeys.begin() + keys.key.size(), keys.key.begin());
+        std::copy(plainKeys.begin() + keys.key.size(), plainKeys.end(), keys.iv.begin());
+
+        std::vector<Byte> encryptedData, decryptedData;
+        if (ReadWholeFile(dataPath, encryptedData) == false)
+            return false;
+        if (encryptedData.size() != info.encryptedSize) {
+            Log::Error("Unseal()", std::format("'{}' is {} bytes, expected {}", dataPath, encryptedData.size(), info.encryptedSize));
+            return false;
+        }
+
+        // Decrypt, and check the hash the sender sent along
+        Crypto::Digest hash;
+        bool verified =
+            Crypto::DecryptData(encryptedData, decryptedData, info.suite, keys) &&
+            Crypto::CalculateHash(decryptedData, hash, info.hashAlgorithm, threads) &&
+            std::equal(hash.begin(), hash.end(), info.expectedHash.begin(), info.expectedHash.end());
+        if (verified == false) {
+            Log::Error("Unseal()", std::format("'{}' failed to decrypt or verify", filename));
+            return false;
+        }
+
+        std::ofstream outfile(filename, std::ios::binary);
+        outfile.write(reinterpret_cast<const char*>(decryptedData.data()), decryptedData.size());
+        outfile.close();
+        if (outfile.fail()) {
+            Log::Error("Unseal()", std::format("Failed to write '{}'", filename));
+            return false;
+        }
+
+        std::remove(dataPath.c_str());
+        std::remove(metadataPath.c_str());
+        return true;
+    }
+};
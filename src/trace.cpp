@@ -0,0 +1,40 @@
+#include <atomic>
+#include <time.h>
+
+#include "../include/trace.hpp"
+
+#ifdef SSFTP_TRACE_ENABLED
+/*
+    The probes' semaphores, in the .probes section where tracers expect to find them
+    (that's what `dtrace -G` would generate for a provider file)
+*/
+#define SSFTP_TRACE_DEFINE_SEMAPHORE(name) \
+    extern "C" { __attribute__((section(".probes"))) volatile unsigned short ssftp_##name##_semaphore = 0; }
+SSFTP_TRACE_PROBES(SSFTP_TRACE_DEFINE_SEMAPHORE)
+#undef SSFTP_TRACE_DEFINE_SEMAPHORE
+#endif
+
+namespace Trace {
+
+    static std::atomic<uint64_t> lastFileId = 0;
+    static thread_local uint64_t currentFile = 0;
+
+    uint64_t Now() {
+        timespec now = {};
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + now.tv_nsec;
+    }
+
+    uint64_t BeginFile() {
+        currentFile = ++lastFileId;
+        return currentFile;
+    }
+
+    void SetFile(uint64_t id) {
+        currentFile = id;
+    }
+
+    uint64_t CurrentFile() {
+        return currentFile;
+    }
+};
@@ -0,0 +1,151 @@
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/tree.hpp"
+#include "../include/logger.hpp"
+
+namespace Tree {
+
+    /*
+        Walk a directory tree using several threads
+        @param root: directory to walk
+        @param threads: number of threads to walk with
+        @param onEntry: called for every directory and regular file below `root`
+        @return true if the whole tree was walked, false if some of it couldn't be read
+
+        The threads share a stack of directories that still need to be listed.
+        Each thread pops a directory, lists it, reports its entries, and pushes any
+        subdirectories back onto the stack for whichever thread is free next.
+
+        The walk is over once the stack is empty *and* no thread is in the middle of
+        listing a directory (since that directory could still add more work).
+
+        We use opendir()/readdir()/fstatat() directly rather than std::filesystem, because
+        fstatat() relative to the open directory saves the kernel from resolving the full
+        path again for every single entry.
+    */
+    bool ParallelScan(const std::string& root, unsigned threads, const std::function<void(Entry&&)>& onEntry) {
+
+        std::vector<std::string> pending = {""};
+        unsigned busyThreads = 0;
+        bool complete = true;
+
+        std::mutex mutex;
+        std::condition_variable workAvailable;
+
+        auto worker = [&]() {
+            while (true) {
+                // Wait for a directory to list, or for the walk to be over
+                std::string relativeDir;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    workAvailable.wait(lock, [&] { return pending.empty() == false || busyThreads == 0; });
+                    if (pending.empty())
+                        return;
+
+                    relativeDir = std::move(pending.back());
+                    pending.pop_back();
+                    busyThreads++;
+                }
+
+                const std::string fullDir = relativeDir.empty() ? root : root + "/" + relativeDir;
+                std::vector<std::string> subdirectories;
+
+                DIR* dir = opendir(fullDir.c_str());
+                if (dir == nullptr) {
+                    Log::Warning("ParallelScan()", std::format("Cannot open directory '{}', skipping it", fullDir));
+                    std::lock_guard<std::mutex> lock(mutex);
+                    complete = false;
+                }
+                else {
+                    while (dirent* item = readdir(dir)) {
+                        const std::string name = item->d_name;
+                        if (name == "." || name == "..")
+                            continue;
+
+                        struct stat info;
+                        if (fstatat(dirfd(dir), item->d_name, &info, AT_SYMLINK_NOFOLLOW) != 0)
+                            continue;
+
+                        Entry entry = {};
+                        entry.relativePath = relativeDir.empty() ? name : relativeDir + "/" + name;
+                        entry.fullPath = fullDir + "/" + name;
+                        entry.mode = info.st_mode & 07777;
+                        entry.modifiedNanos = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+                        entry.inode = info.st_ino;
+
+                        if (S_ISDIR(info.st_mode)) {
+                            entry.kind = EntryKind::Directory;
+                            subdirectories.push_back(entry.relativePath);
+                        }
+                        else if (S_ISREG(info.st_mode)) {
+                            entry.kind = EntryKind::File;
+                            entry.size = info.st_size;
+                        }
+                        else {
+                            // Symlinks, sockets, devices... not supported
+                            continue;
+                        }
+
+                        // Report the directory *before* it goes on the stack, so that it's
+                        // always reported before anything inside it
+                        onEntry(std::move(entry));
+                    }
+                    closedir(dir);
+                }
+
+                // Hand the subdirectories to whoever is free, and mark ourselves as idle
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    for (std::string& subdirectory : subdirectories)
+                        pending.push_back(std::move(subdirectory));
+                    busyThreads--;
+                }
+                workAvailable.notify_all();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < std::max(threads, 1u); i++)
+            workers.emplace_back(worker);
+        for (std::thread& thread : workers)
+            thread.join();
+
+        return complete;
+    }
+
+    /*
+        Check that a path received over the network stays inside the destination directory
+        @param relativePath: path to check
+        @return true if the path is relative and has no ".." components, false otherwise
+
+        Without this check, a malicious sender could write to "../../home/user/.bashrc"
+    */
+    bool IsSafeRelativePath(const std::string& relativePath) {
+
+        if (relativePath.empty() || relativePath.front() == '/')
+            return false;
+
+        size_t start = 0;
+        while (start <= relativePath.size()) {
+            size_t end = relativePath.find('/', start);
+            if (end == std::string::npos)
+                end = relativePath.size();
+
+            const std::string component = relativePath.substr(start, end - start);
+            if (component.empty() || component == "." || component == "..")
+                return false;
+
+            start = end + 1;
+        }
+
+        return true;
+    }
+};
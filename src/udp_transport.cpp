@@ -0,0 +1,1035 @@
+#include <format>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <cerrno>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "../include/logger.hpp"
+#include "../include/udp_transport.hpp"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+namespace Udp {
+
+    /*
+        The two kinds of packets, both start with the channel's token
+        Fields are in host byte order, like everything else this program sends
+    */
+    enum PacketType : uint8_t {
+        DataPacket = 1,
+        AckPacket = 2,
+    };
+
+    // Followed by `length` bytes of the stream, starting at `offset`
+    struct DataHeader {
+        uint32_t token;
+        uint8_t type;
+        uint8_t unused;
+        uint16_t length;
+        uint64_t packetNumber;
+        uint64_t offset;
+        // The oldest packet the sender is still waiting to hear about, older ones needn't be acknowledged again
+        uint64_t oldestInFlight;
+    };
+
+    // Followed by `rangeCount` AckRanges of packet numbers received, newest first
+    struct AckHeader {
+        uint32_t token;
+        uint8_t type;
+        uint8_t rangeCount;
+        uint16_t unused;
+        // How long the receiver sat on the newest packet before acknowledging it
+        uint32_t ackDelayMicros;
+        uint32_t unused2;
+        // The newest packet received
+        uint64_t largest;
+        // How far into the stream the receiver has room for (flow control)
+        uint64_t maxOffset;
+    };
+
+    // Packets [largest + 1 - gap - length, largest + 1 - gap), relative to keep ACKs small
+    struct AckRange {
+        uint32_t gap;
+        uint32_t length;
+    };
+
+    static_assert(sizeof(DataHeader) == 32 && sizeof(AckHeader) == 32 && sizeof(AckRange) == 8);
+
+    static constexpr size_t maxPacket = sizeof(DataHeader) + maxPayload;
+    static constexpr size_t maxAckRanges = 32;
+    // The most packets sent in one go, and received in one go
+    static constexpr size_t maxBatch = 16;
+    static constexpr size_t receiveBatch = 32;
+    // Packet number ranges the receiver remembers, older holes were long since declared lost
+    static constexpr size_t maxRememberedRanges = 64;
+    // Socket buffers, enough to ride out a burst
+    static constexpr int socketBufferSize = 4 * 1024 * 1024;
+
+    // A packet is lost once this many later ones have been acknowledged (like TCP's 3 duplicate ACKs)
+    static constexpr uint64_t packetThreshold = 3;
+    // Congestion window before there's an RTT to size it by, and its floor, in packets
+    static constexpr uint64_t initialWindow = 32;
+    static constexpr uint64_t minimumWindow = 16;
+    // RTT assumed before the first sample, in microseconds
+    static constexpr double initialRtt = 10000;
+
+    // BBR's gains: 2/ln(2) doubles the rate every round in startup, then drain what that queued up
+    static constexpr double startupGain = 2.885;
+    static constexpr double drainGain = 1 / startupGain;
+    static constexpr double cycleGains[8] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+    // The receiver acknowledges every second packet, or one that's been waiting this long
+    static constexpr unsigned packetsPerAck = 2;
+    static constexpr auto maxAckDelay = std::chrono::milliseconds(1);
+    // and at least this often, so a lost ACK doesn't stall the sender
+    static constexpr auto ackInterval = std::chrono::milliseconds(50);
+    // Check on the control socket (and `stopping`) at least this often
+    static constexpr auto idleInterval = std::chrono::milliseconds(100);
+    // Flush() gives up after this long without any progress
+    static constexpr auto flushTimeout = std::chrono::seconds(30);
+
+    /*
+        Add [start, end) to a set of disjoint ranges, merging it with its neighbours
+        @param ranges: start -> end of each range
+    */
+    static void AddRange(std::map<uint64_t, uint64_t>& ranges, uint64_t start, uint64_t end) {
+
+        auto next = ranges.upper_bound(start);
+        if (next != ranges.begin()) {
+            auto previous = std::prev(next);
+            if (previous->second >= start) {
+                if (previous->second >= end)
+                    return;
+                start = previous->first;
+                next = ranges.erase(previous);
+            }
+        }
+        while (next != ranges.end() && next->first <= end) {
+            end = std::max(end, next->second);
+            next = ranges.erase(next);
+        }
+        ranges[start] = end;
+    }
+
+    static double Micros(std::chrono::steady_clock::duration duration) {
+        return std::chrono::duration<double, std::micro>(duration).count();
+    }
+
+    static void SetBufferSizes(int fd) {
+        // Root can go over net.core.rmem_max (wmem_max), everyone else gets what they get
+        for (auto [force, normal] : {std::pair{SO_SNDBUFFORCE, SO_SNDBUF}, std::pair{SO_RCVBUFFORCE, SO_RCVBUF}}) {
+            if (setsockopt(fd, SOL_SOCKET, force, &socketBufferSize, sizeof(socketBufferSize)) != 0)
+                setsockopt(fd, SOL_SOCKET, normal, &socketBufferSize, sizeof(socketBufferSize));
+        }
+    }
+
+    int ListenSocket(int port) {
+
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            Log::Error("ListenSocket()", std::format("Error creating UDP socket: {}", strerror(errno)));
+            return -1;
+        }
+        const int enable = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        SetBufferSizes(fd);
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+            Log::Error("ListenSocket()", std::format("Error binding UDP port {}: {}", port, strerror(errno)));
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+
+    Channel::~Channel() {
+        Close();
+    }
+
+    // Common to both ends, set up and start the worker thread
+    void Channel::Start(int socket, uint32_t channelToken, int control, bool sender) {
+        udpFD = socket;
+        token = channelToken;
+        controlFD = control;
+        isSender = sender;
+        buffer.assign(bufferSize, 0);
+        stopping = false;
+        peerGone = false;
+        stats = Stats();
+
+        const auto now = Clock::now();
+        deliveredTime = firstSentTime = cycleStart = lastSendTime = nextSendTime = lastAckSent = now;
+        worker = std::thread(sender ? &Channel::SenderLoop : &Channel::ReceiverLoop, this);
+    }
+
+    bool Channel::Connect(const std::string& ip, int port, uint32_t channelToken, int control) {
+
+        Close();
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        if (inet_pton(AF_INET, ip.c_str(), &address.sin_addr) <= 0) {
+            Log::Error("Connect()", std::format("Invalid address '{}'", ip));
+            return false;
+        }
+
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        wakeFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (fd < 0 || wakeFD < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+            Log::Error("Connect()", std::format("Error opening the UDP channel: {}", strerror(errno)));
+            if (fd >= 0)
+                close(fd);
+            Close();
+            return false;
+        }
+        SetBufferSizes(fd);
+
+        // If the kernel takes UDP_SEGMENT at all, it can split our batches into packets itself
+        int segmentSize = 0;
+        socklen_t optionSize = sizeof(segmentSize);
+        useGso = getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segmentSize, &optionSize) == 0;
+
+        Start(fd, channelToken, control, true);
+        return true;
+    }
+
+    bool Channel::Listen(int socket, uint32_t channelToken, int control) {
+
+        Close();
+        wakeFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (socket < 0 || wakeFD < 0) {
+            Log::Error("Listen()", std::format("Error opening the UDP channel: {}", strerror(errno)));
+            if (socket >= 0)
+                close(socket);
+            Close();
+            return false;
+        }
+        Start(socket, channelToken, control, false);
+        return true;
+    }
+
+    void Channel::Close() {
+        if (worker.joinable()) {
+            stopping = true;
+            Wake();
+            worker.join();
+        }
+        for (int* fd : {&udpFD, &wakeFD}) {
+            if (*fd >= 0)
+                close(*fd);
+            *fd = -1;
+        }
+        // The control socket isn't ours, only watched
+        controlFD = -1;
+    }
+
+    void Channel::Wake() {
+        const uint64_t one = 1;
+        [[maybe_unused]] ssize_t written = write(wakeFD, &one, sizeof(one));
+    }
+
+    Stats Channel::GetStats() const {
+        std::lock_guard lock(mutex);
+        return stats;
+    }
+
+    std::string Channel::Describe() const {
+        const Stats current = GetStats();
+        if (isSender) {
+            return std::format("{} packets sent, {} lost, {} retransmitted, min RTT {:.2f} ms, "
+                "smoothed RTT {:.2f} ms, bandwidth estimate {:.1f} MB/s", current.packetsSent,
+                current.packetsLost, current.packetsRetransmitted, current.minRttMicros / 1000,
+                current.smoothedRttMicros / 1000, current.bandwidth / 1e6);
+        }
+        return std::format("{} packets received, {} duplicates, {} ACKs sent",
+            current.packetsReceived, current.duplicates, current.acksSent);
+    }
+
+
+    /*
+        The user's side of the channel
+
+        The sender's user only ever writes to the stream past `writeOffset`, and the worker
+        only ever reads what's before it (and past `ackedOffset`), so the copies themselves
+        happen outside the lock. Same on the receiver, with `readOffset` and `contiguousOffset`.
+    */
+    size_t Channel::WriteSome(const Byte* bytes, size_t size) {
+
+        if (size == 0 || isSender == false || worker.joinable() == false)
+            return 0;
+
+        std::unique_lock lock(mutex);
+        changed.wait(lock, [this]() { return peerGone || writeOffset - ackedOffset < bufferSize; });
+        if (peerGone)
+            return 0;
+        const uint64_t start = writeOffset;
+        const size_t length = static_cast<size_t>(std::min<uint64_t>(size, bufferSize - (writeOffset - ackedOffset)));
+        lock.unlock();
+
+        const size_t position = start % bufferSize;
+        const size_t firstPart = std::min(length, bufferSize - position);
+        std::memcpy(buffer.data() + position, bytes, firstPart);
+        std::memcpy(buffer.data(), bytes + firstPart, length - firstPart);
+
+        lock.lock();
+        writeOffset += length;
+        lock.unlock();
+        Wake();
+        return length;
+    }
+
+    size_t Channel::ReadSome(Byte* bytes, size_t size) {
+
+        if (size == 0 || isSender || worker.joinable() == false)
+            return 0;
+
+        std::unique_lock lock(mutex);
+        changed.wait(lock, [this]() { return peerGone || contiguousOffset > readOffset; });
+        if (contiguousOffset == readOffset)
+            return 0;
+        const uint64_t start = readOffset;
+        const size_t length = static_cast<size_t>(std::min<uint64_t>(size, contiguousOffset - readOffset));
+        lock.unlock();
+
+        const size_t position = start % bufferSize;
+        const size_t firstPart = std::min(length, bufferSize - position);
+        std::memcpy(bytes, buffer.data() + position, firstPart);
+        std::memcpy(bytes + firstPart, buffer.data(), length - firstPart);
+
+        // Only wake the worker to tell the sender about the room once there's a fair bit of it
+        lock.lock();
+        readOffset += length;
+        const bool update = readOffset + bufferSize - advertisedLimit >= bufferSize / 8;
+        lock.unlock();
+        if (update)
+            Wake();
+        return length;
+    }
+
+    bool Channel::Write(const void* bytes, size_t size) {
+        const Byte* next = static_cast<const Byte*>(bytes);
+        while (size > 0) {
+            const size_t written = WriteSome(next, size);
+            if (written == 0)
+                return false;
+            next += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    bool Channel::Read(void* bytes, size_t size) {
+        Byte* next = static_cast<Byte*>(bytes);
+        while (size > 0) {
+            const size_t read = ReadSome(next, size);
+            if (read == 0)
+                return false;
+            next += read;
+            size -= read;
+        }
+        return true;
+    }
+
+    bool Channel::ReadToFile(int fileFD, uint64_t size) {
+
+        if (isSender || worker.joinable() == false)
+            return false;
+
+        while (size > 0) {
+            std::unique_lock lock(mutex);
+            changed.wait(lock, [this]() { return peerGone || contiguousOffset > readOffset; });
+            if (contiguousOffset == readOffset)
+                return false;
+            const uint64_t start = readOffset;
+            const size_t position = start % bufferSize;
+            const size_t length = static_cast<size_t>(std::min<uint64_t>({size, contiguousOffset - start, bufferSize - position}));
+            lock.unlock();
+
+            // One write() per contiguous piece, straight out of the buffer
+            const ssize_t written = write(fileFD, buffer.data() + position, length);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0) {
+                Log::Error("ReadToFile()", std::format("Error writing file: {}", strerror(errno)));
+                return false;
+            }
+
+            lock.lock();
+            readOffset += written;
+            const bool update = readOffset + bufferSize - advertisedLimit >= bufferSize / 8;
+            lock.unlock();
+            if (update)
+                Wake();
+            size -= written;
+        }
+        return true;
+    }
+
+    bool Channel::Flush() {
+
+        if (isSender == false || worker.joinable() == false)
+            return false;
+
+        std::unique_lock lock(mutex);
+        uint64_t lastAcked = ackedOffset;
+        while (ackedOffset < writeOffset && peerGone == false) {
+            if (changed.wait_for(lock, flushTimeout) == std::cv_status::timeout && ackedOffset == lastAcked) {
+                Log::Error("Flush()", "The receiver stopped acknowledging data");
+                return false;
+            }
+            lastAcked = ackedOffset;
+        }
+        return ackedOffset == writeOffset;
+    }
+
+
+    /*
+        Sender's worker: send what's waiting as fast as the congestion controller allows,
+        and process ACKs as they come in
+    */
+    void Channel::SenderLoop() {
+
+        std::vector<mmsghdr> messages(receiveBatch);
+        std::vector<iovec> vectors(receiveBatch);
+        std::vector<Byte> packets(receiveBatch * maxPacket);
+        for (size_t i = 0; i < receiveBatch; i++) {
+            vectors[i] = {packets.data() + i * maxPacket, maxPacket};
+            messages[i].msg_hdr = {};
+            messages[i].msg_hdr.msg_iov = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        bool watchControl = true;
+        while (stopping == false) {
+            auto now = Clock::now();
+            {
+                std::lock_guard lock(mutex);
+                knownWriteOffset = writeOffset;
+            }
+
+            // Losses by time, and the probe timeout for when ACKs stop coming altogether
+            DetectLosses(now);
+            if (inFlight.empty() == false) {
+                const double probeTimeout = (smoothedRtt > 0 ? smoothedRtt + std::max(4 * rttVariance, 1000.0) : 2 * initialRtt)
+                    * (1u << std::min(probeTimeouts, 6u));
+                if (Micros(now - lastSendTime) >= probeTimeout) {
+                    // Send the oldest packet's data again, which gets an ACK out of the receiver
+                    probeTimeouts++;
+                    MarkLost(inFlight.begin());
+                }
+            }
+
+            while (now >= nextSendTime && SendPackets(now))
+                now = Clock::now();
+
+            // Sleep until the next packet is due, a loss timer runs out, or something comes in
+            Clock::time_point wakeAt = now + idleInterval;
+            const bool haveData = lostRanges.empty() == false || sentOffset < std::min(knownWriteOffset, peerLimit);
+            if (haveData && bytesInFlight + maxPayload <= CongestionWindow())
+                wakeAt = std::min(wakeAt, nextSendTime);
+            if (inFlight.empty() == false) {
+                const double lossDelay = std::max(9.0 / 8 * std::max(latestRtt, smoothedRtt), 1000.0);
+                if (anyAcked && inFlight.begin()->first < largestAcked)
+                    wakeAt = std::min(wakeAt, inFlight.begin()->second.sentTime + std::chrono::microseconds(static_cast<int64_t>(lossDelay)));
+                const double probeTimeout = (smoothedRtt > 0 ? smoothedRtt + std::max(4 * rttVariance, 1000.0) : 2 * initialRtt)
+                    * (1u << std::min(probeTimeouts, 6u));
+                wakeAt = std::min(wakeAt, lastSendTime + std::chrono::microseconds(static_cast<int64_t>(probeTimeout)));
+            }
+
+            pollfd watched[3] = {
+                {udpFD, POLLIN, 0},
+                {wakeFD, POLLIN, 0},
+                {watchControl ? controlFD : -1, POLLRDHUP, 0},
+            };
+            const auto wait = std::max(wakeAt - now, Clock::duration::zero());
+            const timespec timeout = {
+                static_cast<time_t>(std::chrono::duration_cast<std::chrono::seconds>(wait).count()),
+                static_cast<long>((wait % std::chrono::seconds(1)) / std::chrono::nanoseconds(1)),
+            };
+            if (ppoll(watched, 3, &timeout, nullptr) < 0 && errno != EINTR)
+                break;
+
+            if (watched[1].revents & POLLIN) {
+                uint64_t count;
+                [[maybe_unused]] ssize_t drained = read(wakeFD, &count, sizeof(count));
+            }
+            if (watched[2].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+                std::lock_guard lock(mutex);
+                peerGone = true;
+                watchControl = false;
+                changed.notify_all();
+            }
+
+            // All the ACKs waiting, a batch at a time
+            while (watched[0].revents & POLLIN) {
+                const int received = recvmmsg(udpFD, messages.data(), receiveBatch, MSG_DONTWAIT, nullptr);
+                if (received <= 0)
+                    break;
+                now = Clock::now();
+                for (int i = 0; i < received; i++)
+                    OnAck(packets.data() + i * maxPacket, messages[i].msg_len, now);
+                if (received < static_cast<int>(receiveBatch))
+                    break;
+            }
+        }
+
+        std::lock_guard lock(mutex);
+        peerGone = true;
+        changed.notify_all();
+    }
+
+    /*
+        Send one batch of packets, if the congestion window and the pacing allow
+        Lost data goes first, then new data
+        @return true if anything was sent
+    */
+    bool Channel::SendPackets(Clock::time_point now) {
+
+        const double rate = PacingRate();
+        const uint64_t window = CongestionWindow();
+        // About a millisecond's worth at a time, any more and the packets leave in bursts
+        const size_t batchLimit = std::clamp<size_t>(static_cast<size_t>(rate / 1000 / maxPacket), 2, maxBatch);
+
+        outgoing.resize(maxBatch * maxPacket);
+        std::vector<size_t> sizes;
+        size_t batchBytes = 0;
+        uint64_t retransmissions = 0;
+
+        while (sizes.size() < batchLimit && bytesInFlight + maxPayload <= window) {
+
+            // What to send: a lost range (or what's left of it), or the next new piece of the stream
+            uint64_t offset;
+            uint64_t length;
+            bool retransmission = false;
+            if (lostRanges.empty() == false) {
+                auto& [start, end] = lostRanges.front();
+                // Already delivered by some other packet, in the meantime
+                const auto covering = ackedRanges.upper_bound(start);
+                if (end <= ackedOffset || (covering != ackedRanges.begin() && std::prev(covering)->second >= end)) {
+                    lostRanges.pop_front();
+                    continue;
+                }
+                offset = start;
+                length = std::min<uint64_t>(end - start, maxPayload);
+                start += length;
+                if (start == end)
+                    lostRanges.pop_front();
+                retransmission = true;
+            }
+            else {
+                const uint64_t limit = std::min(knownWriteOffset, peerLimit);
+                if (sentOffset >= limit) {
+                    // Out of data: the delivery rate this measures says nothing about the link
+                    appLimitedUntil = std::max<uint64_t>(delivered + bytesInFlight, 1);
+                    break;
+                }
+                offset = sentOffset;
+                length = std::min<uint64_t>(limit - sentOffset, maxPayload);
+                sentOffset += length;
+            }
+
+            Byte* packet = outgoing.data() + batchBytes;
+            DataHeader header = {};
+            header.token = token;
+            header.type = DataPacket;
+            header.length = static_cast<uint16_t>(length);
+            header.packetNumber = nextPacketNumber++;
+            header.offset = offset;
+            header.oldestInFlight = inFlight.empty() ? header.packetNumber : inFlight.begin()->first;
+            std::memcpy(packet, &header, sizeof(header));
+
+            const size_t position = offset % bufferSize;
+            const size_t firstPart = std::min<size_t>(length, bufferSize - position);
+            std::memcpy(packet + sizeof(header), buffer.data() + position, firstPart);
+            std::memcpy(packet + sizeof(header) + firstPart, buffer.data(), length - firstPart);
+
+            if (appLimitedUntil != 0 && delivered >= appLimitedUntil)
+                appLimitedUntil = 0;
+            inFlight[header.packetNumber] = {offset, static_cast<uint32_t>(length), now,
+                delivered, deliveredTime, firstSentTime, appLimitedUntil != 0};
+            bytesInFlight += length;
+            retransmissions += retransmission;
+
+            sizes.push_back(sizeof(header) + length);
+            batchBytes += sizes.back();
+        }
+
+        if (sizes.empty())
+            return false;
+
+        Transmit(outgoing.data(), sizes);
+        {
+            std::lock_guard lock(mutex);
+            stats.packetsSent += sizes.size();
+            stats.packetsRetransmitted += retransmissions;
+        }
+        lastSendTime = now;
+
+        // The next batch is due once this one has gone out at the pacing rate
+        nextSendTime = std::max(nextSendTime, now - std::chrono::milliseconds(1)) +
+            std::chrono::nanoseconds(static_cast<int64_t>(batchBytes / rate * 1e9));
+        return true;
+    }
+
+    /*
+        Send a batch of packets, lying back to back in `packets`
+        With GSO it's a single send, the kernel cuts it into packets of the first one's size,
+        so that only works when they're all that size except maybe the last. Otherwise one
+        sendmmsg(), with a message per packet.
+    */
+    void Channel::Transmit(const Byte* packets, const std::vector<size_t>& sizes) {
+
+        size_t total = 0;
+        bool uniform = true;
+        for (size_t i = 0; i < sizes.size(); i++) {
+            total += sizes[i];
+            if (i + 1 < sizes.size() ? sizes[i] != sizes[0] : sizes[i] > sizes[0])
+                uniform = false;
+        }
+
+        if (useGso && uniform && sizes.size() > 1) {
+            iovec vector = {const_cast<Byte*>(packets), total};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(uint16_t))] = {};
+            msghdr message = {};
+            message.msg_iov = &vector;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            cmsghdr* segment = CMSG_FIRSTHDR(&message);
+            segment->cmsg_level = SOL_UDP;
+            segment->cmsg_type = UDP_SEGMENT;
+            segment->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            const uint16_t segmentSize = static_cast<uint16_t>(sizes[0]);
+            std::memcpy(CMSG_DATA(segment), &segmentSize, sizeof(segmentSize));
+
+            if (sendmsg(udpFD, &message, 0) >= 0)
+                return;
+            // No GSO on this path after all (EIO from a device that can't), don't try again
+            if (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)
+                useGso = false;
+            else
+                return;
+        }
+
+        std::vector<mmsghdr> messages(sizes.size());
+        std::vector<iovec> vectors(sizes.size());
+        size_t position = 0;
+        for (size_t i = 0; i < sizes.size(); i++) {
+            vectors[i] = {const_cast<Byte*>(packets) + position, sizes[i]};
+            messages[i] = {};
+            messages[i].msg_hdr.msg_iov = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            position += sizes[i];
+        }
+        // What doesn't go out (the receiver's port closed, say) is simply lost, and sent again
+        size_t sent = 0;
+        while (sent < sizes.size()) {
+            const int count = sendmmsg(udpFD, messages.data() + sent, sizes.size() - sent, 0);
+            if (count <= 0)
+                break;
+            sent += count;
+        }
+    }
+
+    void Channel::OnAck(const Byte* packet, size_t size, Clock::time_point now) {
+
+        AckHeader header;
+        if (size < sizeof(header))
+            return;
+        std::memcpy(&header, packet, sizeof(header));
+        if (header.token != token || header.type != AckPacket || size < sizeof(header) + header.rangeCount * sizeof(AckRange))
+            return;
+
+        peerLimit = std::max(peerLimit, header.maxOffset);
+
+        // Every packet in the ranges that's still in flight has now been delivered
+        bool newlyAcked = false;
+        const uint64_t largest = header.largest;
+        uint64_t newestNumber = 0;
+        SentPacket newest = {};
+        for (size_t i = 0; i < header.rangeCount; i++) {
+            AckRange range;
+            std::memcpy(&range, packet + sizeof(header) + i * sizeof(range), sizeof(range));
+            if (range.gap + static_cast<uint64_t>(range.length) > largest + 1)
+                break;
+            const uint64_t end = largest + 1 - range.gap;
+            const uint64_t start = end - range.length;
+
+            auto acked = inFlight.lower_bound(start);
+            while (acked != inFlight.end() && acked->first < end) {
+                if (newlyAcked == false || acked->first > newestNumber) {
+                    newestNumber = acked->first;
+                    newest = acked->second;
+                }
+                newlyAcked = true;
+
+                bytesInFlight -= acked->second.length;
+                delivered += acked->second.length;
+                AddRange(ackedRanges, acked->second.offset, acked->second.offset + acked->second.length);
+                acked = inFlight.erase(acked);
+            }
+        }
+        if (header.rangeCount == 0 || newlyAcked == false)
+            return;
+        deliveredTime = now;
+        firstSentTime = newest.sentTime;
+        probeTimeouts = 0;
+
+        // The newest packet acknowledged gives the RTT sample, minus however long the receiver held on to it
+        if (newestNumber == largest) {
+            const double sample = Micros(now - newest.sentTime);
+            minRtt = minRtt == 0 ? sample : std::min(minRtt, sample);
+            latestRtt = sample - header.ackDelayMicros >= minRtt ? sample - header.ackDelayMicros : sample;
+            if (smoothedRtt == 0) {
+                smoothedRtt = latestRtt;
+                rttVariance = latestRtt / 2;
+            }
+            else {
+                rttVariance = 0.75 * rttVariance + 0.25 * std::abs(smoothedRtt - latestRtt);
+                smoothedRtt = 0.875 * smoothedRtt + 0.125 * latestRtt;
+            }
+        }
+        if (anyAcked == false || largest > largestAcked)
+            largestAcked = largest;
+        anyAcked = true;
+
+        OnPacketAcked(newest, now);
+        DetectLosses(now);
+
+        // Everything below the first hole has been delivered, that's room for the user
+        uint64_t cumulative = ackedOffset;
+        while (ackedRanges.empty() == false && ackedRanges.begin()->first <= cumulative) {
+            cumulative = std::max(cumulative, ackedRanges.begin()->second);
+            ackedRanges.erase(ackedRanges.begin());
+        }
+
+        std::lock_guard lock(mutex);
+        stats.minRttMicros = minRtt;
+        stats.smoothedRttMicros = smoothedRtt;
+        stats.bandwidth = bottleneckBandwidth;
+        if (cumulative != ackedOffset) {
+            ackedOffset = cumulative;
+            changed.notify_all();
+        }
+    }
+
+    /*
+        Take a delivery rate sample from the newest packet an ACK covered, and feed it to the model
+        The rate is how much was delivered between that packet being sent and it being
+        acknowledged, over how long that took. Or over how long sending it all took, if
+        that was longer: ACKs that were held up and then arrive in a bunch would make the
+        link look faster than it is, but it can't deliver faster than we sent
+    */
+    void Channel::OnPacketAcked(const SentPacket& packet, Clock::time_point now) {
+
+        const double interval = std::max(Micros(now - packet.deliveredTime), Micros(packet.sentTime - packet.firstSentTime)) / 1e6;
+        if (interval <= 0)
+            return;
+        const double sample = (delivered - packet.delivered) / interval;
+
+        // One round trip is over once a packet sent after the previous one ended is delivered
+        bool roundStart = false;
+        if (packet.delivered >= nextRoundDelivered) {
+            nextRoundDelivered = delivered;
+            round++;
+            roundBandwidth[round % roundBandwidth.size()] = 0;
+            roundStart = true;
+        }
+
+        // When we ran out of data, the sample is only a lower bound, only use it if it's a new high
+        if (packet.appLimited == false || sample > bottleneckBandwidth) {
+            double& slot = roundBandwidth[round % roundBandwidth.size()];
+            slot = std::max(slot, sample);
+            bottleneckBandwidth = *std::max_element(roundBandwidth.begin(), roundBandwidth.end());
+        }
+        UpdateModel(now, roundStart);
+    }
+
+    /*
+        BBR's state machine, simplified
+        - Startup: double the rate every round trip until the bandwidth stops growing
+          (less than 25% more for 3 rounds in a row)
+        - Drain: slow down until what startup queued up at the bottleneck is gone
+        - ProbeBandwidth: cruise at the estimated bandwidth, one round in eight a bit faster
+          to see if there's more, and the next one a bit slower to drain what that queued
+    */
+    void Channel::UpdateModel(Clock::time_point now, bool roundStart) {
+
+        if (mode == Mode::Startup && roundStart) {
+            if (bottleneckBandwidth >= fullBandwidth * 1.25) {
+                fullBandwidth = bottleneckBandwidth;
+                fullBandwidthRounds = 0;
+            }
+            else if (++fullBandwidthRounds >= 3) {
+                mode = Mode::Drain;
+            }
+        }
+        if (mode == Mode::Drain && bytesInFlight <= bottleneckBandwidth * minRtt / 1e6) {
+            mode = Mode::ProbeBandwidth;
+            cycleIndex = 0;
+            cycleStart = now;
+        }
+        if (mode == Mode::ProbeBandwidth && Micros(now - cycleStart) > minRtt) {
+            cycleIndex = (cycleIndex + 1) % std::size(cycleGains);
+            cycleStart = now;
+        }
+    }
+
+    // Bytes per second
+    double Channel::PacingRate() const {
+        const double bandwidth = bottleneckBandwidth > 0 ? bottleneckBandwidth
+            : initialWindow * maxPayload / ((smoothedRtt > 0 ? smoothedRtt : initialRtt) / 1e6);
+        switch (mode) {
+            case Mode::Startup: return startupGain * bandwidth;
+            case Mode::Drain: return drainGain * bandwidth;
+            default: return cycleGains[cycleIndex] * bandwidth;
+        }
+    }
+
+    // Bytes, two bandwidth-delay products, to keep the link busy while ACKs are on their way back
+    uint64_t Channel::CongestionWindow() const {
+        if (minRtt == 0 || bottleneckBandwidth == 0)
+            return initialWindow * maxPayload;
+        const double gain = mode == Mode::Startup ? startupGain : 2;
+        const double window = gain * bottleneckBandwidth * minRtt / 1e6;
+        return std::max(static_cast<uint64_t>(window), minimumWindow * maxPayload);
+    }
+
+    /*
+        Declare packets lost, see udp_transport.hpp
+        Packets are sent in order, so once one isn't lost yet, none of the later ones are either
+    */
+    void Channel::DetectLosses(Clock::time_point now) {
+
+        if (anyAcked == false)
+            return;
+        const double lossDelay = std::max(9.0 / 8 * std::max(latestRtt, smoothedRtt), 1000.0);
+        auto packet = inFlight.begin();
+        while (packet != inFlight.end() && packet->first < largestAcked) {
+            if (packet->first + packetThreshold > largestAcked && Micros(now - packet->second.sentTime) < lossDelay)
+                break;
+            auto lost = packet++;
+            MarkLost(lost);
+        }
+    }
+
+    // Its data goes back in the queue, to go out again in a new packet
+    void Channel::MarkLost(std::map<uint64_t, SentPacket>::iterator packet) {
+        bytesInFlight -= packet->second.length;
+        lostRanges.emplace_back(packet->second.offset, packet->second.offset + packet->second.length);
+        inFlight.erase(packet);
+
+        std::lock_guard lock(mutex);
+        stats.packetsLost++;
+    }
+
+
+    /*
+        Receiver's worker: put the stream back together, and acknowledge what arrived
+    */
+    void Channel::ReceiverLoop() {
+
+        std::vector<mmsghdr> messages(receiveBatch);
+        std::vector<iovec> vectors(receiveBatch);
+        std::vector<sockaddr_in> sources(receiveBatch);
+        std::vector<Byte> packets(receiveBatch * maxPacket);
+
+        bool watchControl = true;
+        while (stopping == false) {
+            pollfd watched[3] = {
+                {udpFD, POLLIN, 0},
+                {wakeFD, POLLIN, 0},
+                {watchControl ? controlFD : -1, POLLRDHUP, 0},
+            };
+            // Wake up in time to send an ACK that's been put off
+            const auto wait = unackedPackets > 0
+                ? std::clamp<Clock::duration>(ackDeadline - Clock::now(), Clock::duration::zero(), ackInterval)
+                : Clock::duration(ackInterval);
+            const timespec timeout = {0, static_cast<long>(std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count())};
+            if (ppoll(watched, 3, &timeout, nullptr) < 0 && errno != EINTR)
+                break;
+
+            if (watched[1].revents & POLLIN) {
+                uint64_t count;
+                [[maybe_unused]] ssize_t drained = read(wakeFD, &count, sizeof(count));
+            }
+            if (watched[2].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+                std::lock_guard lock(mutex);
+                peerGone = true;
+                watchControl = false;
+                changed.notify_all();
+            }
+
+            // Everything waiting, a batch at a time
+            const unsigned alreadyUnacked = unackedPackets;
+            while (watched[0].revents & POLLIN) {
+                for (size_t i = 0; i < receiveBatch; i++) {
+                    vectors[i] = {packets.data() + i * maxPacket, maxPacket};
+                    messages[i].msg_hdr = {};
+                    messages[i].msg_hdr.msg_iov = &vectors[i];
+                    messages[i].msg_hdr.msg_iovlen = 1;
+                    messages[i].msg_hdr.msg_name = &sources[i];
+                    messages[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+                }
+                const int received = recvmmsg(udpFD, messages.data(), receiveBatch, MSG_DONTWAIT, nullptr);
+                if (received <= 0)
+                    break;
+
+                const auto now = Clock::now();
+                uint64_t limit;
+                {
+                    std::lock_guard lock(mutex);
+                    limit = readOffset + bufferSize;
+                }
+                uint64_t duplicates = 0;
+                for (int i = 0; i < received; i++) {
+                    uint32_t packetToken;
+                    if (messages[i].msg_len < sizeof(DataHeader))
+                        continue;
+                    std::memcpy(&packetToken, packets.data() + i * maxPacket, sizeof(packetToken));
+                    if (packetToken != token)
+                        continue;
+                    // ACKs go back wherever the data comes from (which may be a proxy)
+                    peer = sources[i];
+                    havePeer = true;
+                    duplicates += OnData(packets.data() + i * maxPacket, messages[i].msg_len, limit, now) == false;
+                }
+                {
+                    std::lock_guard lock(mutex);
+                    stats.packetsReceived += received;
+                    stats.duplicates += duplicates;
+                }
+                if (received < static_cast<int>(receiveBatch))
+                    break;
+            }
+
+            const auto now = Clock::now();
+            bool windowUpdate = false;
+            {
+                std::lock_guard lock(mutex);
+                if (receivedOffset != contiguousOffset) {
+                    contiguousOffset = receivedOffset;
+                    changed.notify_all();
+                }
+                windowUpdate = readOffset + bufferSize - advertisedLimit >= bufferSize / 8;
+            }
+
+            /*
+                Acknowledge right away when something's off (a hole, a packet out of order,
+                a duplicate: the sender is waiting to hear about it) or there's more room,
+                otherwise every second packet, and never sit on one for more than maxAckDelay
+            */
+            if (alreadyUnacked == 0 && unackedPackets > 0)
+                ackDeadline = now + maxAckDelay;
+            const bool due = ackNow || windowUpdate || unackedPackets >= packetsPerAck ||
+                (unackedPackets > 0 && now >= ackDeadline) || now - lastAckSent >= ackInterval;
+            if (havePeer && due)
+                SendAck(now);
+        }
+
+        std::lock_guard lock(mutex);
+        peerGone = true;
+        changed.notify_all();
+    }
+
+    /*
+        Take in a data packet
+        @param limit: how far into the stream there's room
+        @return false if it was nothing new
+    */
+    bool Channel::OnData(const Byte* packet, size_t size, uint64_t limit, Clock::time_point now) {
+
+        DataHeader header;
+        std::memcpy(&header, packet, sizeof(header));
+        if (header.type != DataPacket || size != sizeof(header) + header.length)
+            return true;
+
+        // Past the window we gave, no room for it: drop it without acknowledging it
+        const uint64_t end = header.offset + header.length;
+        if (end > limit)
+            return true;
+
+        // Anything but the packet right after the newest one means a hole (or one filled late)
+        const uint64_t expected = receivedPackets.empty() ? 0 : largestReceived + 1;
+        if (header.packetNumber != expected)
+            ackNow = true;
+        unackedPackets++;
+
+        AddRange(receivedPackets, header.packetNumber, header.packetNumber + 1);
+        if (header.packetNumber >= largestReceived) {
+            largestReceived = header.packetNumber;
+            largestReceivedTime = now;
+        }
+
+        // Forget what the sender no longer cares about, so the holes it gave up on don't fill every ACK
+        while (receivedPackets.size() > 1 && (receivedPackets.size() > maxRememberedRanges ||
+            receivedPackets.begin()->second <= header.oldestInFlight))
+            receivedPackets.erase(receivedPackets.begin());
+
+        // Only the part we don't have yet, the part before receivedOffset may already be getting read
+        if (end <= receivedOffset) {
+            ackNow = true;
+            return false;
+        }
+        const uint64_t start = std::max(header.offset, receivedOffset);
+        const Byte* payload = packet + sizeof(header) + (start - header.offset);
+        const size_t length = end - start;
+        const size_t position = start % bufferSize;
+        const size_t firstPart = std::min(length, bufferSize - position);
+        std::memcpy(buffer.data() + position, payload, firstPart);
+        std::memcpy(buffer.data(), payload + firstPart, length - firstPart);
+
+        AddRange(receivedRanges, start, end);
+        while (receivedRanges.empty() == false && receivedRanges.begin()->first <= receivedOffset) {
+            receivedOffset = std::max(receivedOffset, receivedRanges.begin()->second);
+            receivedRanges.erase(receivedRanges.begin());
+        }
+        return true;
+    }
+
+    // The newest ranges of packet numbers we have, and how much room there is
+    void Channel::SendAck(Clock::time_point now) {
+
+        Byte packet[sizeof(AckHeader) + maxAckRanges * sizeof(AckRange)];
+        AckHeader header = {};
+        header.token = token;
+        header.type = AckPacket;
+        header.largest = largestReceived;
+        header.ackDelayMicros = static_cast<uint32_t>(std::min(Micros(now - largestReceivedTime), 1e9));
+        {
+            std::lock_guard lock(mutex);
+            advertisedLimit = readOffset + bufferSize;
+            stats.acksSent++;
+        }
+        header.maxOffset = advertisedLimit;
+
+        size_t count = 0;
+        for (auto range = receivedPackets.rbegin(); range != receivedPackets.rend() && count < maxAckRanges; ++range, ++count) {
+            const AckRange relative = {static_cast<uint32_t>(largestReceived + 1 - range->second),
+                static_cast<uint32_t>(range->second - range->first)};
+            std::memcpy(packet + sizeof(header) + count * sizeof(relative), &relative, sizeof(relative));
+        }
+        header.rangeCount = static_cast<uint8_t>(count);
+        std::memcpy(packet, &header, sizeof(header));
+
+        sendto(udpFD, packet, sizeof(header) + count * sizeof(AckRange), MSG_DONTWAIT,
+            reinterpret_cast<const sockaddr*>(&peer), sizeof(peer));
+        lastAckSent = now;
+        unackedPackets = 0;
+        ackNow = false;
+    }
+};
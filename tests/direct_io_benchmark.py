@@ -0,0 +1,188 @@
+"""
+    Compares the receiver's buffered and direct (O_DIRECT, --direct-io) write paths, by
+    throughput and by what they do to the page cache of everything else on the box
+
+    Usage, from the tests/ directory, after building:
+        python3 direct_io_benchmark.py [--size <MB>] [--hot <MB>] [--runs <n>] [--scratch <dir>] [--cipher <name>]
+
+    A "hot" file stands in for the working set of another service on the same box: it's
+    read in full before each transfer, so that all of it is cached. Then a --size MB file
+    is sent with -f, and for each write path we report:
+    - throughput, from starting the sender until the receiver has saved the file and exited
+    - the most the kernel's Dirty and Cached counters (/proc/meminfo) grew during the transfer
+    - how much of the hot file is still cached afterwards (mincore()), and how fast it
+      reads back, which is what the other service would see
+
+    --scratch must be on a file system with O_DIRECT support (ext4, xfs, btrfs...), the
+    default is this directory. Eviction only shows once the transfer is large compared to
+    the memory that's free, pick --size and --hot accordingly. The file the sender reads is
+    dropped from the cache before every run, so that it doesn't count against either path.
+"""
+
+import argparse
+import ctypes
+import mmap
+import os
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+repo_root = os.path.abspath(os.path.join(os.path.dirname(__file__), ".."))
+receiver = os.path.join(repo_root, "receiver.out")
+sender = os.path.join(repo_root, "sender.out")
+
+libc = ctypes.CDLL(None, use_errno=True)
+
+# Extra receiver arguments, per write path
+write_paths = {
+    "buffered": [],
+    "direct": ["--direct-io", "0"],
+}
+
+
+def resident_fraction(path):
+    """
+        How much of a file is in the page cache, with mincore()
+        @return fraction of its pages that are resident, 0 to 1
+    """
+    size = os.path.getsize(path)
+    page = mmap.PAGESIZE
+    pages = (size + page - 1) // page
+    with open(path, "rb") as file:
+        # Mapping a file doesn't read it, mincore() then tells which of its pages are cached
+        mapping = mmap.mmap(file.fileno(), size, prot=mmap.PROT_READ | mmap.PROT_WRITE, flags=mmap.MAP_PRIVATE)
+        vector = (ctypes.c_ubyte * pages)()
+        start = ctypes.c_char.from_buffer(mapping)
+        status = libc.mincore(ctypes.c_void_p(ctypes.addressof(start)), ctypes.c_size_t(size), vector)
+        del start
+        mapping.close()
+    if status != 0:
+        return 0.0
+    return sum(byte & 1 for byte in vector) / pages
+
+
+def read_through(path):
+    """
+        Read a file in full, through the page cache
+        @return how fast, in MB/s
+    """
+    start = time.monotonic()
+    with open(path, "rb") as file:
+        while file.read(4 * 1024 * 1024):
+            pass
+    return os.path.getsize(path) / (time.monotonic() - start) / 1e6
+
+
+def drop_from_cache(path):
+    """
+        Drop a file's (clean) pages from the page cache
+    """
+    fd = os.open(path, os.O_RDONLY)
+    os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+    os.close(fd)
+
+
+def meminfo(fields=("Dirty", "Cached")):
+    """
+        @return the given /proc/meminfo counters, in bytes
+    """
+    values = {}
+    with open("/proc/meminfo") as file:
+        for line in file:
+            name, value = line.split(":", 1)
+            if name in fields:
+                values[name] = int(value.split()[0]) * 1024
+    return values
+
+
+def run_transfer(receiver_args, sender_args, scratch):
+    """
+        Run one transfer, watching /proc/meminfo while it runs
+        @return (completion time in seconds, peak Dirty growth, peak Cached growth), or None if it failed
+    """
+    baseline = meminfo()
+    peak = dict(baseline)
+    done = threading.Event()
+
+    def watch():
+        while not done.is_set():
+            for name, value in meminfo().items():
+                peak[name] = max(peak[name], value)
+            time.sleep(0.005)
+
+    watcher = threading.Thread(target=watch)
+    recv = subprocess.Popen([receiver] + receiver_args, cwd=scratch,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    time.sleep(0.3)
+
+    watcher.start()
+    start = time.monotonic()
+    sent = subprocess.run([sender] + sender_args + ["--no-resume"], cwd=scratch,
+                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, timeout=600)
+    received = recv.wait(timeout=600)
+    elapsed = time.monotonic() - start
+    done.set()
+    watcher.join()
+
+    if sent.returncode != 0 or received != 0:
+        return None
+    return elapsed, peak["Dirty"] - baseline["Dirty"], peak["Cached"] - baseline["Cached"]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Buffered against O_DIRECT writes on the receiver")
+    parser.add_argument("--size", type=int, default=2048, help="size of the file sent, in MB")
+    parser.add_argument("--hot", type=int, default=512, help="size of the co-located working set, in MB")
+    parser.add_argument("--runs", type=int, default=3, help="runs of each write path, the fastest one counts")
+    parser.add_argument("--scratch", default=".", help="where to put the test files, needs O_DIRECT support")
+    parser.add_argument("--cipher", help="cipher suite for both ends, 'null' to leave encryption out")
+    args = parser.parse_args()
+
+    for executable in (receiver, sender):
+        if not os.path.exists(executable):
+            print(f"Missing {executable}, build the project first")
+            return 1
+
+    failed = False
+    with tempfile.TemporaryDirectory(dir=args.scratch) as scratch:
+        sent_file = os.path.join(scratch, "sent.bin")
+        hot_file = os.path.join(scratch, "hot.bin")
+        for path, size in ((sent_file, args.size), (hot_file, args.hot)):
+            with open(path, "wb") as file:
+                for _ in range(size):
+                    file.write(os.urandom(1024 * 1024))
+                os.fsync(file.fileno())
+
+        cipher = ["--cipher", args.cipher] if args.cipher else []
+        print(f"{args.size} MB file, {args.hot} MB co-located working set")
+        print(f"{'path':<10} {'MB/s':>8} {'dirty MB':>9} {'cached MB':>10} {'hot cached':>11} {'hot MB/s':>9}")
+        for name, extra in write_paths.items():
+            results = []
+            for _ in range(args.runs):
+                received_file = os.path.join(scratch, "received.bin")
+                drop_from_cache(sent_file)
+                read_through(hot_file)
+
+                result = run_transfer(["-f", received_file] + extra + cipher, ["-f", sent_file] + cipher, scratch)
+                if result is None:
+                    failed = True
+                    break
+                hot_resident = resident_fraction(hot_file)
+                hot_speed = read_through(hot_file)
+                results.append((result, hot_resident, hot_speed))
+                os.remove(received_file)
+
+            if len(results) < args.runs:
+                print(f"{name:<10}   FAILED")
+                continue
+            (elapsed, dirty, cached), hot_resident, hot_speed = min(results, key=lambda result: result[0][0])
+            print(f"{name:<10} {args.size * 1024 * 1024 / elapsed / 1e6:8.1f} {dirty / 1e6:9.1f} {cached / 1e6:10.1f} "
+                  f"{hot_resident * 100:10.1f}% {hot_speed:9.1f}")
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
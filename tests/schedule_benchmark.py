@@ -0,0 +1,118 @@
+"""
+    Compares the scheduling policies of a batch sent to a receiver daemon (see include/scheduler.hpp)
+    by the completion latency of each file
+
+    Usage, from the tests/ directory, after building:
+        python3 schedule_benchmark.py [--large <MB>] [--files <n>] [--interleave <size>] [--runs <n>] [--scratch <dir>] [--cipher <name>]
+
+    The batch is the worst case for sending in order: one large file, listed first, followed
+    by many small ones. It's sent with every policy, whole and interleaved, to a fresh
+    receiver daemon each time, and the received files are checked against the originals.
+    Each combination is run --runs times, and the run with the lowest mean counts.
+
+    A file's completion latency runs from the start of the batch until its last byte is
+    sent, as reported by the sender (see FileSender::SendScheduledFiles()).
+"""
+
+import argparse
+import filecmp
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+repo_root = os.path.abspath(os.path.join(os.path.dirname(__file__), ".."))
+receiver = os.path.join(repo_root, "receiver.out")
+sender = os.path.join(repo_root, "sender.out")
+
+# The sender's summary of the run, "Completion latency (<policy>): mean <x> ms, p50 <x> ms, ..."
+latency_line = re.compile(r"Completion latency \(\w+\): mean ([\d.]+) ms, p50 ([\d.]+) ms, "
+                          r"p95 ([\d.]+) ms, p99 ([\d.]+) ms, max ([\d.]+) ms")
+
+
+def run_batch(list_file, receiver_args, sender_args, scratch, expected):
+    """
+        Send the batch to a fresh receiver daemon, and check what it received
+        @return (mean, p50, p95, p99, max) in ms, or None if it failed
+    """
+    received_dir = os.path.join(scratch, "received")
+    shutil.rmtree(received_dir, ignore_errors=True)
+
+    recv = subprocess.Popen([receiver, "-D", received_dir, "--quiet"] + receiver_args, cwd=scratch,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    time.sleep(0.3)
+
+    sent = subprocess.run([sender, "-l", list_file, "--no-resume"] + sender_args, cwd=scratch,
+                          capture_output=True, text=True, timeout=300)
+    recv.terminate()
+    recv.wait(timeout=300)
+
+    match = latency_line.search(sent.stdout + sent.stderr)
+    if sent.returncode != 0 or match is None:
+        return None
+    for path in expected:
+        if not filecmp.cmp(path, os.path.join(received_dir, os.path.basename(path)), shallow=False):
+            return None
+    return tuple(float(value) for value in match.groups())
+
+
+def main():
+    parser = argparse.ArgumentParser(description="FIFO, SJF and WFQ on a batch with a large file in front")
+    parser.add_argument("--large", type=int, default=256, help="size of the large file, in MB")
+    parser.add_argument("--files", type=int, default=200, help="number of small files behind it")
+    parser.add_argument("--interleave", default="1M", help="chunk size for the interleaved runs")
+    parser.add_argument("--runs", type=int, default=3, help="runs of each combination, the best one counts")
+    parser.add_argument("--scratch", default="/dev/shm", help="where to put the test files")
+    parser.add_argument("--cipher", help="cipher suite for both ends")
+    args = parser.parse_args()
+
+    for executable in (receiver, sender):
+        if not os.path.exists(executable):
+            print(f"Missing {executable}, build the project first")
+            return 1
+
+    failed = False
+    with tempfile.TemporaryDirectory(dir=args.scratch) as scratch:
+        batch = [os.path.join(scratch, "large.bin")]
+        with open(batch[0], "wb") as file:
+            for _ in range(args.large):
+                file.write(os.urandom(1024 * 1024))
+        for i in range(args.files):
+            batch.append(os.path.join(scratch, f"small_{i}.bin"))
+            with open(batch[-1], "wb") as file:
+                file.write(os.urandom(1024 + (i * 2654435761) % (64 * 1024)))
+
+        list_file = os.path.join(scratch, "batch.txt")
+        with open(list_file, "w") as file:
+            file.write("\n".join(batch) + "\n")
+
+        cipher = ["--cipher", args.cipher] if args.cipher else []
+        print(f"{args.large} MB file, then {args.files} files of 1-65 KB")
+        print(f"{'policy':<24} {'mean':>9} {'p50':>9} {'p95':>9} {'p99':>9} {'max':>9}  (ms)")
+        for interleave in (None, args.interleave):
+            for policy in ("fifo", "sjf", "wfq"):
+                name = policy + (f" + interleave {interleave}" if interleave else "")
+                sender_args = ["--schedule", policy] + (["--interleave", interleave] if interleave else []) + cipher
+
+                results = []
+                for _ in range(args.runs):
+                    result = run_batch(list_file, cipher, sender_args, scratch, batch)
+                    if result is None:
+                        failed = True
+                        break
+                    results.append(result)
+
+                if len(results) < args.runs:
+                    print(f"{name:<24}   FAILED")
+                    continue
+                best = min(results)
+                print(f"{name:<24} " + " ".join(f"{value:9.2f}" for value in best))
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
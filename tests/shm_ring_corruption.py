@@ -0,0 +1,216 @@
+"""
+    Checks that a sender can't take down the receiver through the shared memory ring (--shm,
+    see include/shm_ring.hpp) by scribbling over the ring's header, or by resizing its memory
+
+    Usage, from the tests/ directory, after building:
+        python3 shm_ring_corruption.py
+
+    A receiver is started as a daemon (-D) with --shm and --cipher null, and this script
+    connects to it as a sender would: it takes the ring the receiver offers, goes through
+    the handshake (with a random public key, the null cipher leaves everything as is) and
+    sends a file header through the ring. Then it announces the file, and instead of
+    writing it into the ring, breaks the ring:
+    - head: moves the ring's head a long way past the end of the ring
+    - backwards: moves the head behind the tail, as if the counter had wrapped
+    - shrink: truncates the shared memory, which would SIGBUS the receiver on its next read
+
+    Each attack has to end that session only, with the connection closed by the receiver,
+    which keeps running. At the end a real sender.out transfer checks that it still serves
+    senders that behave.
+
+    Exits with 1 if any check fails.
+"""
+
+import fcntl
+import mmap
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+repo_root = os.path.abspath(os.path.join(os.path.dirname(__file__), ".."))
+receiver = os.path.join(repo_root, "receiver.out")
+sender = os.path.join(repo_root, "sender.out")
+
+ring_size = 1024 * 1024
+
+# Layout of ShmRing::Ring::Header, each counter on a cache line of its own
+head_offset = 64
+tail_offset = 128
+reader_waiting_offset = 192
+
+data_offset = 4096
+
+# Wire values, see include/crypto.hpp and include/protocol.hpp
+null_cipher = 5
+sha256 = 1
+handshake_full = 0
+named_file = 5
+
+
+def read_exactly(connection, size):
+    data = b""
+    while len(data) < size:
+        more = connection.recv(size - len(data))
+        if not more:
+            raise ConnectionError("receiver closed the connection")
+        data += more
+    return data
+
+
+def start_session(socket_path):
+    """
+        Connect, take the ring and do the handshake
+        @return the connection, the ring's memfd and its mapping
+    """
+    connection = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    connection.connect(socket_path)
+    _, fds, _, _ = socket.recv_fds(connection, 1, 3)
+    memory_fd, data_event = fds[0], fds[1]
+    os.close(fds[2])
+    ring = mmap.mmap(memory_fd, os.fstat(memory_fd).st_size)
+
+    # One suite, one hash, and a full handshake
+    hello = bytes([1, null_cipher]) + struct.pack("<I", 1000) + bytes([1, sha256])
+    hello += bytes([handshake_full]) + os.urandom(32) + os.urandom(32)
+    connection.sendall(hello)
+
+    # The choice, then mode, random, public key and a length-prefixed ticket
+    read_exactly(connection, 2 + 1 + 32 + 32)
+    ticket_size, = struct.unpack("<H", read_exactly(connection, 2))
+    read_exactly(connection, ticket_size)
+    return connection, memory_fd, data_event, ring
+
+
+def receiver_hung_up(connection):
+    """
+        @return true if the receiver closed the connection, within a few seconds
+    """
+    connection.settimeout(5)
+    try:
+        return connection.recv(1) == b""
+    except (socket.timeout, ConnectionError):
+        return False
+
+
+def wait_for_tail(ring, position):
+    """
+        Wait until the receiver has read the ring up to `position`
+        @return true if it did, within a few seconds
+    """
+    deadline = time.monotonic() + 5
+    while time.monotonic() < deadline:
+        if struct.unpack_from("<Q", ring, tail_offset)[0] == position:
+            return True
+        time.sleep(0.01)
+    return False
+
+
+def wake_receiver(ring, data_event):
+    struct.pack_into("<I", ring, reader_waiting_offset, 0)
+    os.write(data_event, struct.pack("<Q", 1))
+
+
+def attack(socket_path, name):
+    """
+        Send a file header through the ring, announce the file, then break the ring
+        @return an error message, or None if the receiver dropped the session cleanly
+    """
+    connection, memory_fd, data_event, ring = start_session(socket_path)
+
+    # The header of a named file, see Protocol::SerializeNamedFileHeader()
+    file_name = f"{name}.bin".encode()
+    file_size = 8 * ring_size
+    header = struct.pack("<QH", file_size, len(file_name)) + file_name
+    connection.sendall(bytes([named_file]) + struct.pack("<Q", len(header)))
+    ring[data_offset:data_offset + len(header)] = header
+    struct.pack_into("<Q", ring, head_offset, len(header))
+    wake_receiver(ring, data_event)
+    if wait_for_tail(ring, len(header)) == False:
+        return "the receiver didn't read the header"
+
+    # The file's size, the receiver then reads that much out of the ring
+    connection.sendall(struct.pack("<Q", file_size))
+
+    if name == "head":
+        struct.pack_into("<Q", ring, head_offset, len(header) + 64 * ring_size)
+    elif name == "backwards":
+        struct.pack_into("<Q", ring, head_offset, len(header) - 1)
+    elif name == "shrink":
+        try:
+            os.ftruncate(memory_fd, data_offset)
+            error = "the ring's memory could be truncated"
+        except OSError:
+            seals = fcntl.fcntl(memory_fd, fcntl.F_GET_SEALS)
+            error = None if seals & fcntl.F_SEAL_SHRINK and seals & fcntl.F_SEAL_GROW else "the ring's memory isn't sealed"
+        # Sealed, the receiver just waits for data that never comes, until we hang up
+        struct.pack_into("<Q", ring, head_offset, len(header) + ring_size)
+    wake_receiver(ring, data_event)
+
+    hung_up = receiver_hung_up(connection) if name != "shrink" else True
+    connection.close()
+    ring.close()
+    os.close(memory_fd)
+    os.close(data_event)
+    if name == "shrink":
+        return error
+    return None if hung_up else "the receiver didn't drop the session"
+
+
+def main():
+    if os.path.exists(receiver) == False or os.path.exists(sender) == False:
+        print("receiver.out or sender.out not found, build first")
+        sys.exit(1)
+
+    failures = 0
+    with tempfile.TemporaryDirectory() as scratch:
+        socket_path = os.path.join(scratch, "ring.sock")
+        received = os.path.join(scratch, "received")
+        daemon = subprocess.Popen([receiver, "-D", received, "--shm", socket_path, "--ring-size", str(ring_size),
+                                   "--cipher", "null", "--quiet"],
+                                  cwd=scratch, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        time.sleep(0.3)
+
+        for name in ["head", "backwards", "shrink"]:
+            try:
+                error = attack(socket_path, name)
+            except (OSError, ConnectionError) as exception:
+                error = str(exception)
+            if daemon.poll() is not None:
+                error = f"the receiver died (exit status {daemon.returncode})"
+            if error is None:
+                print(f"\033[92m{name}: session dropped, receiver still running\033[0m")
+            else:
+                print(f"\033[91m{name}: {error}\033[0m")
+                failures += 1
+            if daemon.poll() is not None:
+                break
+
+        # A sender that behaves still gets through
+        if daemon.poll() is None:
+            path = os.path.join(scratch, "file.bin")
+            with open(path, "wb") as f:
+                f.write(os.urandom(3 * ring_size + 12345))
+            with open(os.path.join(scratch, "list.txt"), "w") as f:
+                f.write(path + "\n")
+            subprocess.run([sender, "-l", "list.txt", "--shm", socket_path, "--cipher", "null", "--no-resume"], cwd=scratch,
+                           stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, timeout=60)
+            saved = os.path.join(received, "file.bin")
+            if os.path.exists(saved) and open(saved, "rb").read() == open(path, "rb").read():
+                print("\033[92mtransfer after the attacks: ok\033[0m")
+            else:
+                print("\033[91mtransfer after the attacks: file missing or different\033[0m")
+                failures += 1
+
+            daemon.terminate()
+        daemon.wait(timeout=30)
+
+    print(f"{failures} failures" if failures else "The receiver survived every attack")
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
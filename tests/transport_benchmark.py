@@ -0,0 +1,113 @@
+"""
+    Compares loopback TCP with the shared memory transport (--shm, see include/shm_ring.hpp)
+    for transfers between a sender and a receiver on the same host
+
+    Usage, from the tests/ directory, after building:
+        python3 transport_benchmark.py [--size <MB>] [--files <n>] [--runs <n>] [--scratch <dir>] [--cipher <name>]
+
+    Two workloads go over each transport:
+    - one large file (-f), where the cost is copying the data around
+    - a directory of many small files (-d), where it's the number of messages
+
+    Each is run --runs times, and the best time is kept. The time runs from starting the
+    sender until the receiver has saved everything and exited. Put --scratch on a tmpfs
+    (the default is /dev/shm) so that the disk doesn't hide the difference, and pass
+    --cipher null so that encryption doesn't either (see include/crypto_policies.hpp).
+"""
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+repo_root = os.path.abspath(os.path.join(os.path.dirname(__file__), ".."))
+receiver = os.path.join(repo_root, "receiver.out")
+sender = os.path.join(repo_root, "sender.out")
+
+# Extra arguments for both ends, per transport
+transports = {
+    "tcp": [],
+    "shm": ["--shm", "ssftp-benchmark.sock"],
+}
+
+
+def run_transfer(receiver_args, sender_args, scratch):
+    """
+        Run one transfer
+        @return completion time in seconds, or None if it failed
+    """
+    recv = subprocess.Popen([receiver] + receiver_args, cwd=scratch,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    time.sleep(0.3)
+
+    start = time.monotonic()
+    sent = subprocess.run([sender] + sender_args + ["--no-resume"], cwd=scratch,
+                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, timeout=300)
+    received = recv.wait(timeout=300)
+    elapsed = time.monotonic() - start
+
+    if sent.returncode != 0 or received != 0:
+        return None
+    return elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Loopback TCP against shared memory")
+    parser.add_argument("--size", type=int, default=256, help="size of the large file, in MB")
+    parser.add_argument("--files", type=int, default=2000, help="number of small files")
+    parser.add_argument("--runs", type=int, default=3, help="runs of each transfer, the best one counts")
+    parser.add_argument("--scratch", default="/dev/shm", help="where to put the test files")
+    parser.add_argument("--cipher", help="cipher suite for both ends, 'null' to measure the transport alone")
+    args = parser.parse_args()
+
+    for executable in (receiver, sender):
+        if not os.path.exists(executable):
+            print(f"Missing {executable}, build the project first")
+            return 1
+
+    failed = False
+    with tempfile.TemporaryDirectory(dir=args.scratch) as scratch:
+        large_file = os.path.join(scratch, "large.bin")
+        with open(large_file, "wb") as file:
+            for _ in range(args.size):
+                file.write(os.urandom(1024 * 1024))
+
+        small_dir = os.path.join(scratch, "small")
+        os.makedirs(small_dir)
+        for i in range(args.files):
+            with open(os.path.join(small_dir, f"file_{i}.bin"), "wb") as file:
+                file.write(os.urandom(1024 + i % 4096))
+        small_bytes = sum(os.path.getsize(os.path.join(small_dir, f)) for f in os.listdir(small_dir))
+
+        workloads = [
+            (f"{args.size} MB file", ["-f", "large.received"], ["-f", large_file], args.size * 1024 * 1024),
+            (f"{args.files} small files", ["-d", "small.received"], ["-d", small_dir], small_bytes),
+        ]
+
+        cipher = ["--cipher", args.cipher] if args.cipher else []
+        for name, receiver_args, sender_args, payload in workloads:
+            for transport, extra in transports.items():
+                extra = extra + cipher
+                times = []
+                for _ in range(args.runs):
+                    elapsed = run_transfer(receiver_args + extra, sender_args + extra, scratch)
+                    if elapsed is None:
+                        failed = True
+                        break
+                    times.append(elapsed)
+                    shutil.rmtree(os.path.join(scratch, "small.received"), ignore_errors=True)
+
+                if len(times) < args.runs:
+                    print(f"{name:<20} {transport:<4}   FAILED")
+                    continue
+                best = min(times)
+                print(f"{name:<20} {transport:<4} {best:8.3f} s  {payload / best / 1e6:8.1f} MB/s")
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,198 @@
+"""
+    Runs transfers through the WAN emulator (tools/wan_proxy.cpp) under a few typical
+    link conditions, and records how long each one took
+
+    Usage, from the tests/ directory, after building:
+        python3 wan_scenarios.py [--csv results.csv] [--scenario <name>] ... [--transport tcp|udp|both]
+
+    For every scenario, the proxy is started with that scenario's settings, and each
+    workload is sent through it: receiver.out listens on 8080 as usual, the proxy listens
+    on 9090 and forwards to it, and sender.out connects to 9090.
+
+    The completion time runs from starting the sender until the receiver has saved
+    everything and exited, so it includes the handshake and the time the data spends in
+    the emulated link. Throughput is the payload size divided by that time.
+
+    Compare the results before and after a change to see how it does on a slow or long
+    link, without needing one. --transport udp (or both) sends the file data over the UDP
+    channel (--udp on both ends, see include/udp_transport.hpp) instead of TCP.
+
+    The two don't see loss (--loss) the same way. UDP datagrams are really dropped, but the
+    proxy only sees TCP as a byte stream, so for TCP it holds data back the way a Reno
+    sender would after a loss (see tools/wan_proxy.cpp). Those results are labelled
+    "modeled" (the loss column of the CSV), they're an estimate, not a measurement of the
+    same kind as the UDP ones.
+
+    Every transfer is checked with verify_tree.out (see tools/verify_tree.cpp) afterwards,
+    a transfer that was fast but wrong counts as failed.
+"""
+
+import argparse
+import csv
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+repo_root = os.path.abspath(os.path.join(os.path.dirname(__file__), ".."))
+receiver = os.path.join(repo_root, "receiver.out")
+sender = os.path.join(repo_root, "sender.out")
+proxy = os.path.join(repo_root, "wan_proxy.out")
+verifier = os.path.join(repo_root, "verify_tree.out")
+
+proxy_port = "9090"
+
+# Link conditions, as wan_proxy.out arguments (delays are one way, rates in bytes per second)
+# None means no proxy at all, straight over loopback, as a baseline
+scenarios = {
+    "loopback":         None,
+    "lan":              ["--delay", "0.25", "--rate", "100M"],
+    "broadband":        ["--delay", "15", "--jitter", "3", "--rate", "4M"],
+    "transcontinental": ["--delay", "40", "--jitter", "5", "--rate", "10M"],
+    "lossy":            ["--delay", "25", "--jitter", "5", "--rate", "8M", "--reorder", "2", "--reorder-delay", "50"],
+    "loss-1":           ["--delay", "20", "--rate", "10M", "--loss", "1"],
+    "loss-3":           ["--delay", "20", "--rate", "10M", "--loss", "3"],
+    "loss-5":           ["--delay", "20", "--rate", "10M", "--loss", "5"],
+}
+
+# Extra arguments for both ends, per transport
+transports = {
+    "tcp": [],
+    "udp": ["--udp"],
+}
+
+
+def loss_kind(link, transport):
+    """
+        How a scenario's loss reaches a transport, see the top of this file
+        @return "none", "real" (UDP, dropped datagrams) or "modeled" (TCP, emulated Reno)
+    """
+    if link is None or "--loss" not in link:
+        return "none"
+    return "modeled" if transport == "tcp" else "real"
+
+
+def make_workloads(scratch):
+    """
+        What gets sent in every scenario
+        @param scratch: directory for the large file
+        @return list of (name, receiver args, sender args, payload bytes, what was sent, where it arrived)
+    """
+    small_files = [os.path.join(repo_root, "tests", "send", f"perftest_{i}KB.txt") for i in range(1, 16)]
+    if not all(os.path.exists(f) for f in small_files):
+        os.makedirs(os.path.join(repo_root, "tests", "send"), exist_ok=True)
+        subprocess.run([sys.executable, "generate_files.py"], cwd=os.path.join(repo_root, "tests"), check=True)
+    small_bytes = sum(os.path.getsize(f) for f in small_files)
+
+    large_file = os.path.join(scratch, "large.bin")
+    with open(large_file, "wb") as file:
+        file.write(os.urandom(16 * 1024 * 1024))
+
+    send_dir = os.path.join(repo_root, "tests", "send")
+    recv_dir = os.path.join(repo_root, "tests", "recv")
+    large_received = os.path.join(scratch, "large.received")
+    return [
+        ("15 small files", ["-n", "15"], ["-n", "15"], small_bytes, send_dir, recv_dir),
+        ("15 small files, packed", ["-n", "15", "--pack"], ["-n", "15", "--pack"], small_bytes, send_dir, recv_dir),
+        ("16 MB file", ["-f", large_received], ["-f", large_file], 16 * 1024 * 1024, large_file, large_received),
+    ]
+
+
+def run_transfer(receiver_args, sender_args, port):
+    """
+        Run one transfer
+        @return completion time in seconds, or None if it failed
+    """
+    os.makedirs(os.path.join(repo_root, "tests", "recv"), exist_ok=True)
+    recv = subprocess.Popen([receiver] + receiver_args, cwd=repo_root,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    time.sleep(0.3)
+
+    start = time.monotonic()
+    sent = subprocess.run([sender] + sender_args + ["--port", port, "--no-resume"], cwd=repo_root,
+                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, timeout=300)
+    received = recv.wait(timeout=300)
+    elapsed = time.monotonic() - start
+
+    if sent.returncode != 0 or received != 0:
+        return None
+    return elapsed
+
+
+def verify(expected, received):
+    """
+        Check that a transfer arrived intact, with verify_tree.out --csv
+        @return its CSV row, as a dict, or None if it couldn't run
+    """
+    result = subprocess.run([verifier, expected, received, "--csv"], capture_output=True, text=True, timeout=300)
+    rows = list(csv.DictReader(result.stdout.splitlines()))
+    return rows[0] if rows else None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Transfers through an emulated WAN link")
+    parser.add_argument("--csv", help="also write the results to this CSV file")
+    parser.add_argument("--scenario", action="append", choices=scenarios.keys(),
+                        help="only run this scenario (can be repeated)")
+    parser.add_argument("--transport", choices=["tcp", "udp", "both"], default="tcp",
+                        help="what the file data goes over")
+    args = parser.parse_args()
+    chosen = list(transports.keys()) if args.transport == "both" else [args.transport]
+
+    for executable in (receiver, sender, proxy, verifier):
+        if not os.path.exists(executable):
+            print(f"Missing {executable}, build the project first")
+            return 1
+
+    results = []
+    with tempfile.TemporaryDirectory() as scratch:
+        workloads = make_workloads(scratch)
+
+        for scenario in args.scenario or scenarios.keys():
+            link = scenarios[scenario]
+            link_proxy = None
+            port = "8080"
+            if link is not None:
+                link_proxy = subprocess.Popen([proxy, "--listen", proxy_port, "--target", "8080"] + link,
+                                              stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+                port = proxy_port
+                time.sleep(0.2)
+
+            try:
+                for name, receiver_args, sender_args, payload, expected, received in workloads:
+                    for transport in chosen:
+                        extra = transports[transport]
+                        elapsed = run_transfer(receiver_args + extra, sender_args + extra, port)
+                        if elapsed:
+                            check = verify(expected, received)
+                            if check is None or check["mismatched"] != "0" or check["missing"] != "0":
+                                elapsed = None
+                        throughput = payload / elapsed / 1e6 if elapsed else 0
+                        loss = loss_kind(link, transport)
+                        results.append((scenario, name, transport, loss, elapsed, throughput))
+
+                        status = f"{elapsed:8.3f} s  {throughput:8.2f} MB/s" if elapsed else "  FAILED"
+                        label = transport + (" (modeled loss)" if loss == "modeled" else "")
+                        print(f"{scenario:<18} {name:<24} {label:<19} {status}")
+            finally:
+                if link_proxy is not None:
+                    link_proxy.terminate()
+                    link_proxy.wait()
+
+    if args.csv:
+        with open(args.csv, "w", newline="") as file:
+            writer = csv.writer(file)
+            writer.writerow(["scenario", "workload", "transport", "loss", "seconds", "mb_per_second"])
+            for scenario, name, transport, loss, elapsed, throughput in results:
+                writer.writerow([scenario, name, transport, loss, f"{elapsed:.4f}" if elapsed else "", f"{throughput:.3f}"])
+
+    if any(loss == "modeled" for _, _, _, loss, _, _ in results):
+        print("(modeled loss): the proxy emulates a Reno sender's response to loss for TCP, "
+              "UDP datagrams are really dropped, see the top of wan_scenarios.py")
+
+    return 0 if all(elapsed for _, _, _, _, elapsed, _ in results) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,142 @@
+#include <iostream>
+#include <format>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include <fstream>
+#include <iterator>
+
+#include "../include/crypto.hpp"
+#include "../include/logger.hpp"
+
+/*
+    Hash benchmark, compares SHA-256 and BLAKE3 across input sizes and thread counts
+
+    Usage: ./hash_benchmark.out [max threads]
+           ./hash_benchmark.out --digest <file> [threads]
+
+    Each (algorithm, size, threads) combination hashes the same buffer over and over for
+    a fixed amount of time, and the throughput is reported in MB/s. SHA-256 is only run
+    with a single thread, it can't split up a single input.
+
+    Thread counts past the number of cores won't help (the threads just take turns), so
+    keep an eye on the core count printed at the top when reading the results.
+
+    --digest only prints the BLAKE3 hash of a file, in hex, so that the implementation can
+    be checked against the official test vectors (see tests/blake3_vectors.py).
+*/
+
+// Run every measurement for at least this long
+constexpr std::chrono::milliseconds minimumDuration{300};
+
+/*
+    Measure how fast an algorithm hashes a buffer
+    @param data: buffer to hash
+    @param algorithm: hash algorithm
+    @param threads: threads to use, BLAKE3 only
+    @return throughput in MB/s, or 0 if hashing failed
+*/
+static double Measure(const std::vector<Byte>& data, Crypto::HashAlgorithm algorithm, unsigned threads) {
+
+    Crypto::Digest hash;
+    size_t iterations = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::steady_clock::duration::zero();
+    do {
+        if (Crypto::CalculateHash(data, hash, algorithm, threads) == false)
+            return 0;
+        iterations++;
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed < minimumDuration);
+
+    const double seconds = std::chrono::duration<double>(elapsed).count();
+    return static_cast<double>(data.size()) * iterations / seconds / (1024 * 1024);
+}
+
+/*
+    Print the BLAKE3 hash of a file
+    @param path: file to hash, read into memory whole
+    @param threads: threads to hash it with
+    @return 0 on success, -1 if the file can't be read or hashed
+*/
+static int PrintDigest(const std::string& path, unsigned threads) {
+
+    std::ifstream file(path, std::ios::binary);
+    if (file.is_open() == false) {
+        Log::Error("PrintDigest()", std::format("Can't open {}", path));
+        return -1;
+    }
+    const std::vector<Byte> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    Crypto::Digest hash;
+    if (Crypto::CalculateHash(data, hash, Crypto::HashAlgorithm::Blake3, threads) == false)
+        return -1;
+
+    for (Byte byte : hash)
+        std::cout << std::format("{:02x}", byte);
+    std::cout << std::endl;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+
+    if (argc > 2 && std::string(argv[1]) == "--digest") {
+        unsigned threads = 1;
+        if (argc > 3) {
+            try {
+                threads = std::max(std::stoi(argv[3]), 1);
+            }
+            catch (std::invalid_argument&) {
+                Log::Error("main()", std::format("Usage: {} --digest <file> [threads]", argv[0]));
+                return -1;
+            }
+        }
+        return PrintDigest(argv[2], threads);
+    }
+
+    unsigned maxThreads = 8;
+    if (argc > 1) {
+        try {
+            maxThreads = std::max(std::stoi(argv[1]), 1);
+        }
+        catch (std::invalid_argument&) {
+            Log::Error("main()", std::format("Usage: {} [max threads]", argv[0]));
+            return -1;
+        }
+    }
+
+    const std::vector<size_t> sizes = {
+        1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 256 * 1024 * 1024
+    };
+    std::vector<unsigned> threadCounts;
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2)
+        threadCounts.push_back(threads);
+
+    Log::Info("main()", std::format("{} cores, CPU features: {}",
+        std::thread::hardware_concurrency(), Cpu::DescribeFeatures(Cpu::DetectFeatures())));
+
+    // Header: size, SHA-256, then BLAKE3 with each thread count
+    std::cout << std::format("{:>10} {:>12}", "size", "SHA-256");
+    for (unsigned threads : threadCounts)
+        std::cout << std::format(" {:>12}", std::format("BLAKE3 x{}", threads));
+    std::cout << "  (MB/s)" << std::endl;
+
+    for (size_t size : sizes) {
+        // Anything but zeros, so that nothing could take a shortcut
+        std::vector<Byte> data(size);
+        for (size_t i = 0; i < size; i++)
+            data[i] = static_cast<Byte>(i * 31 + (i >> 8));
+
+        const std::string label = size >= 1024 * 1024 ? std::format("{} MB", size / (1024 * 1024)) : std::format("{} KB", size / 1024);
+        std::cout << std::format("{:>10} {:>12.0f}", label, Measure(data, Crypto::HashAlgorithm::Sha256, 1));
+        for (unsigned threads : threadCounts)
+            std::cout << std::format(" {:>12.0f}", Measure(data, Crypto::HashAlgorithm::Blake3, threads));
+        std::cout << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,337 @@
+#include <iostream>
+#include <format>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+
+#include "../include/file_sender.hpp"
+#include "../include/logger.hpp"
+#include "../include/rate_limiter.hpp"
+
+/*
+    Load generator, many concurrent senders against one receiver daemon
+
+    Usage: ./load_generator.out [--sessions <n>] [--concurrency <n>] [--files <n>] [--size <distribution>]
+                                [--max-size <size>] [--ip <address>] [--port <port>] [--seed <n>] [--csv]
+
+    Start a receiver daemon first, ideally writing to a tmpfs and with --quiet:
+        ./receiver.out -D /dev/shm/load --quiet
+
+    --concurrency worker threads (default 64) each run one sender session after another
+    until --sessions sessions (default 1000) have run: connect, do a full handshake, send
+    --files named files (default 10), end the session and hang up. Every session is a new
+    connection with a new key exchange, the most expensive case for the receiver.
+
+    File sizes are drawn from --size:
+    - "64K": every file is the same size (the default)
+    - "lognormal:<median>:<sigma>": most files near the median, a few much larger, like
+      most real file systems, e.g. "lognormal:32K:1.5"
+    - "pareto:<minimum>:<alpha>": heavy tailed, a handful of huge files carry most of the
+      bytes, e.g. "pareto:4K:1.1". The smaller alpha, the heavier the tail
+    Sizes are capped at --max-size (default 16M). The file contents come from a single
+    buffer of --max-size random bytes made at startup, so nothing is ever read from disk
+    and the receiver is the only thing being measured.
+
+    While running, every second prints how many sessions started and how many MB went out
+    in that second. Raise --concurrency until those stop growing: that's the receiver's
+    saturation point, past it the setup latency grows instead (connections wait in the
+    receiver's listen queue). At the end it prints
+    - sessions and connections accepted per second
+    - aggregate throughput, bytes of file data sent per second
+    - latency percentiles of setting up a connection (TCP connect + handshake), of sending a
+      file, and of a whole session. Latencies are measured on the sender, a file counts as
+      sent once it's all in the socket, the receiver may still be writing it
+    With --csv, a CSV header and a single row instead, for benchmark scripts.
+*/
+
+using Clock = std::chrono::steady_clock;
+
+// Where file sizes come from, see the top of this file
+struct SizeDistribution {
+    enum class Kind { Fixed, LogNormal, Pareto };
+
+    Kind kind = Kind::Fixed;
+    // Fixed: the size. LogNormal: the median and sigma. Pareto: the minimum and alpha
+    double first = 64 * 1024;
+    double second = 0;
+    uint64_t maxSize = 16 * 1024 * 1024;
+
+    /*
+        Draw a file size
+        @param random: the worker's random number generator
+        @return the size, at most maxSize
+    */
+    uint64_t Draw(std::mt19937_64& random) const {
+        double size = first;
+        if (kind == Kind::LogNormal)
+            size = std::lognormal_distribution<double>(std::log(first), second)(random);
+        else if (kind == Kind::Pareto) {
+            // Inverse transform: U in (0, 1] gives minimum / U^(1/alpha)
+            const double u = 1.0 - std::uniform_real_distribution<double>(0.0, 1.0)(random);
+            size = first / std::pow(u, 1.0 / second);
+        }
+        return std::min(static_cast<uint64_t>(std::max(size, 0.0)), maxSize);
+    }
+};
+
+/*
+    Parse a size distribution, as given on the command line
+    @param text: "64K", "lognormal:<median>:<sigma>" or "pareto:<minimum>:<alpha>"
+    @param distribution: the parsed distribution, its maxSize is left alone
+    @return true if the text made sense, false otherwise
+*/
+static bool ParseDistribution(const std::string& text, SizeDistribution& distribution) {
+
+    const size_t firstColon = text.find(':');
+    uint64_t size = 0;
+    if (firstColon == std::string::npos) {
+        if (RateLimit::ParseRate(text, size) == false)
+            return false;
+        distribution.kind = SizeDistribution::Kind::Fixed;
+        distribution.first = static_cast<double>(size);
+        return true;
+    }
+
+    const size_t secondColon = text.find(':', firstColon + 1);
+    if (secondColon == std::string::npos)
+        return false;
+    const std::string kind = text.substr(0, firstColon);
+    if (RateLimit::ParseRate(text.substr(firstColon + 1, secondColon - firstColon - 1), size) == false || size == 0)
+        return false;
+
+    double shape = 0;
+    try {
+        shape = std::stod(text.substr(secondColon + 1));
+    }
+    catch (std::exception&) {
+        return false;
+    }
+    if (shape <= 0)
+        return false;
+
+    if (kind == "lognormal")
+        distribution.kind = SizeDistribution::Kind::LogNormal;
+    else if (kind == "pareto")
+        distribution.kind = SizeDistribution::Kind::Pareto;
+    else
+        return false;
+    distribution.first = static_cast<double>(size);
+    distribution.second = shape;
+    return true;
+}
+
+// What one worker measured, merged at the end
+struct WorkerResults {
+    std::vector<double> setupMicros;
+    std::vector<double> fileMicros;
+    std::vector<double> sessionMicros;
+    uint64_t failedSessions = 0;
+};
+
+/*
+    Get a percentile of a set of latencies
+    @param values: the latencies, sorted
+    @param percentile: 0 to 100
+    @return the latency, 0 if there are none
+*/
+static double Percentile(const std::vector<double>& values, double percentile) {
+    if (values.empty())
+        return 0;
+    const size_t index = static_cast<size_t>(std::ceil(percentile / 100.0 * values.size()));
+    return values[std::min(std::max(index, size_t(1)) - 1, values.size() - 1)];
+}
+
+// "p50 / p90 / p99 / p99.9 / max" of a set of latencies, in ms
+static std::string DescribeLatencies(std::vector<double>& values) {
+    std::sort(values.begin(), values.end());
+    return std::format("p50 {:.2f}  p90 {:.2f}  p99 {:.2f}  p99.9 {:.2f}  max {:.2f} ms ({} samples)",
+        Percentile(values, 50) / 1000, Percentile(values, 90) / 1000, Percentile(values, 99) / 1000,
+        Percentile(values, 99.9) / 1000, values.empty() ? 0.0 : values.back() / 1000, values.size());
+}
+
+int main(int argc, char* argv[]) {
+
+    uint64_t sessions = 1000;
+    unsigned concurrency = 64;
+    uint64_t filesPerSession = 10;
+    SizeDistribution distribution;
+    std::string serverIP = "127.0.0.1";
+    int serverPort = 8080;
+    uint64_t seed = 1;
+    bool csv = false;
+
+    const std::string usage = std::format("Usage: {} [--sessions <n>] [--concurrency <n>] [--files <n>] [--size <distribution>] "
+        "[--max-size <size>] [--ip <address>] [--port <port>] [--seed <n>] [--csv]", argv[0]);
+
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        try {
+            if (option == "--sessions" && i + 1 < argc)
+                sessions = std::stoull(argv[++i]);
+            else if (option == "--concurrency" && i + 1 < argc)
+                concurrency = std::max(std::stoi(argv[++i]), 1);
+            else if (option == "--files" && i + 1 < argc)
+                filesPerSession = std::stoull(argv[++i]);
+            else if (option == "--port" && i + 1 < argc)
+                serverPort = std::stoi(argv[++i]);
+            else if (option == "--seed" && i + 1 < argc)
+                seed = std::stoull(argv[++i]);
+            else if (option == "--ip" && i + 1 < argc)
+                serverIP = argv[++i];
+            else if (option == "--csv")
+                csv = true;
+            else if (option == "--size" && i + 1 < argc) {
+                if (ParseDistribution(argv[++i], distribution) == false) {
+                    Log::Error("main()", std::format("Invalid size distribution {}", argv[i]));
+                    return -1;
+                }
+            }
+            else if (option == "--max-size" && i + 1 < argc) {
+                if (RateLimit::ParseRate(argv[++i], distribution.maxSize) == false || distribution.maxSize == 0) {
+                    Log::Error("main()", std::format("Invalid size {}", argv[i]));
+                    return -1;
+                }
+            }
+            else {
+                Log::Error("main()", usage);
+                return -1;
+            }
+        }
+        catch (std::exception&) {
+            Log::Error("main()", std::format("Invalid value for {}", option));
+            return -1;
+        }
+    }
+
+    // Every file is a slice of this buffer, random so that nothing could compress it
+    std::vector<Byte> pool(distribution.maxSize);
+    std::mt19937_64 poolRandom(seed);
+    for (size_t i = 0; i + sizeof(uint64_t) <= pool.size(); i += sizeof(uint64_t)) {
+        const uint64_t value = poolRandom();
+        std::memcpy(pool.data() + i, &value, sizeof(value));
+    }
+
+    // A thousand senders printing every file would measure the terminal, not the receiver
+    Log::SetQuiet(true);
+
+    std::atomic<uint64_t> nextSession = 0;
+    std::atomic<uint64_t> sessionsStarted = 0, connectionsAccepted = 0, bytesSent = 0, filesSent = 0;
+    std::atomic<bool> finished = false;
+    std::vector<WorkerResults> results(concurrency);
+
+    const auto startTime = Clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned worker = 0; worker < concurrency; worker++) {
+        workers.emplace_back([&, worker]() {
+            WorkerResults& mine = results[worker];
+            std::mt19937_64 random(seed * 1000003 + worker);
+
+            for (uint64_t session = nextSession++; session < sessions; session = nextSession++) {
+                sessionsStarted++;
+                const auto sessionStart = Clock::now();
+
+                // No session file, every connection does a full handshake
+                FileSender sender(serverIP, serverPort);
+                sender.UseSessionFile("");
+                if (sender.ConnectToServer() == false) {
+                    mine.failedSessions++;
+                    continue;
+                }
+                connectionsAccepted++;
+                mine.setupMicros.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sessionStart).count());
+
+                bool sent = true;
+                for (uint64_t file = 0; file < filesPerSession && sent; file++) {
+                    const uint64_t size = distribution.Draw(random);
+                    const uint64_t offset = std::uniform_int_distribution<uint64_t>(0, pool.size() - size)(random);
+
+                    const auto fileStart = Clock::now();
+                    sent = sender.SendNamedData(std::span<const Byte>(pool.data() + offset, size), std::format("s{}_f{}.bin", session, file));
+                    if (sent) {
+                        mine.fileMicros.push_back(std::chrono::duration<double, std::micro>(Clock::now() - fileStart).count());
+                        bytesSent += size;
+                        filesSent++;
+                    }
+                }
+
+                if (sent == false || sender.EndSession() == false) {
+                    mine.failedSessions++;
+                    continue;
+                }
+                sender.CloseConnection();
+                mine.sessionMicros.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sessionStart).count());
+            }
+        });
+    }
+
+    // A line every second, to see where the rate stops growing
+    std::thread progress([&]() {
+        uint64_t lastSessions = 0, lastBytes = 0;
+        auto lastTime = Clock::now();
+        while (finished == false) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            const auto now = Clock::now();
+            if (now - lastTime < std::chrono::seconds(1))
+                continue;
+            const double seconds = std::chrono::duration<double>(now - lastTime).count();
+            const uint64_t started = sessionsStarted, sentBytes = bytesSent;
+            if (csv == false)
+                std::cerr << std::format("{:>8.1f} s  {:>8.0f} sessions/s  {:>10.1f} MB/s  ({} of {} sessions)\n",
+                    std::chrono::duration<double>(now - startTime).count(), (started - lastSessions) / seconds,
+                    (sentBytes - lastBytes) / seconds / 1e6, started, sessions);
+            lastSessions = started;
+            lastBytes = sentBytes;
+            lastTime = now;
+        }
+    });
+
+    for (std::thread& worker : workers)
+        worker.join();
+    finished = true;
+    progress.join();
+
+    const double seconds = std::chrono::duration<double>(Clock::now() - startTime).count();
+
+    // Merge what every worker measured
+    WorkerResults all;
+    for (WorkerResults& worker : results) {
+        all.setupMicros.insert(all.setupMicros.end(), worker.setupMicros.begin(), worker.setupMicros.end());
+        all.fileMicros.insert(all.fileMicros.end(), worker.fileMicros.begin(), worker.fileMicros.end());
+        all.sessionMicros.insert(all.sessionMicros.end(), worker.sessionMicros.begin(), worker.sessionMicros.end());
+        all.failedSessions += worker.failedSessions;
+    }
+    std::sort(all.setupMicros.begin(), all.setupMicros.end());
+    std::sort(all.fileMicros.begin(), all.fileMicros.end());
+    std::sort(all.sessionMicros.begin(), all.sessionMicros.end());
+
+    const double throughput = bytesSent / seconds / 1e6;
+    if (csv) {
+        std::cout << "sessions,concurrency,failed,files,bytes,seconds,connections_per_second,mb_per_second,"
+                     "setup_p50_ms,setup_p99_ms,file_p50_ms,file_p99_ms,session_p50_ms,session_p99_ms" << std::endl;
+        std::cout << std::format("{},{},{},{},{},{:.3f},{:.1f},{:.2f},{:.3f},{:.3f},{:.3f},{:.3f},{:.3f},{:.3f}",
+            sessions, concurrency, all.failedSessions, filesSent.load(), bytesSent.load(), seconds,
+            connectionsAccepted / seconds, throughput,
+            Percentile(all.setupMicros, 50) / 1000, Percentile(all.setupMicros, 99) / 1000,
+            Percentile(all.fileMicros, 50) / 1000, Percentile(all.fileMicros, 99) / 1000,
+            Percentile(all.sessionMicros, 50) / 1000, Percentile(all.sessionMicros, 99) / 1000) << std::endl;
+    }
+    else {
+        std::cout << std::format("{} sessions ({} failed) over {} concurrent senders in {:.2f} s\n",
+            sessions, all.failedSessions, concurrency, seconds);
+        std::cout << std::format("  accepted:   {:.1f} connections/s\n", connectionsAccepted / seconds);
+        std::cout << std::format("  throughput: {:.2f} MB/s, {} files, {:.1f} MB\n", throughput, filesSent.load(), bytesSent / 1e6);
+        std::cout << std::format("  setup:      {}\n", DescribeLatencies(all.setupMicros));
+        std::cout << std::format("  file:       {}\n", DescribeLatencies(all.fileMicros));
+        std::cout << std::format("  session:    {}\n", DescribeLatencies(all.sessionMicros));
+    }
+
+    return all.failedSessions == 0 ? 0 : 1;
+}
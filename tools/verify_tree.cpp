@@ -0,0 +1,301 @@
+#include <iostream>
+#include <format>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <span>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../include/crypto.hpp"
+#include "../include/logger.hpp"
+#include "../include/tree.hpp"
+
+/*
+    Tree verifier, checks that a transfer arrived intact
+
+    Usage: ./verify_tree.out <expected> <received> [--threads <n>] [--hash <sha256|blake3>] [--csv]
+
+    <expected> and <received> are two directories, or two files. Both trees are walked with
+    Tree::ParallelScan(), then every entry of <expected> is looked up at the same relative
+    path in <received>:
+    - missing: not there, or a directory where a file should be (or the other way around)
+    - mismatch: a different size, or the same size and a different hash
+    - extra: only in <received>. Reported, but not an error, a receiver never deletes anything
+
+    Files are mapped with mmap() and hashed in place with Crypto::CalculateHash(), several
+    files at once, one per thread, largest first so that a big file found last doesn't leave
+    every other thread idle. When there are fewer files than threads, the spare threads go
+    into hashing each file (BLAKE3 only). A size difference is reported without reading either file.
+
+    Prints every problem, then how much was hashed and how fast (both trees' bytes, per second).
+    With --csv, prints a CSV header and a single row instead, for benchmark scripts (see
+    tests/wan_scenarios.py). Exits with 0 if the trees match, 1 if they don't, -1 on bad usage.
+
+    This replaces comparing the files one after another in Python, which takes minutes for a
+    tree of a few GB. tests/test.py uses it when it has been built.
+*/
+
+// What became of an entry of <expected>
+enum class Outcome : uint8_t {
+    Match,
+    Mismatch,
+    Missing,
+    Unreadable
+};
+
+// An entry of <expected>, and where it should be in <received>
+struct Check {
+    std::string relativePath;
+    std::string expectedPath;
+    std::string receivedPath;
+    Tree::EntryKind kind;
+    uint64_t size;
+    Outcome outcome;
+};
+
+/*
+    Walk a tree, or take a single file
+    @param root: directory (or file) to walk
+    @param threads: threads to walk with
+    @param entries: every entry found, by relative path ("" for a single file)
+    @return true if all of it was walked, false otherwise
+*/
+static bool Scan(const std::string& root, unsigned threads, std::unordered_map<std::string, Tree::Entry>& entries) {
+
+    std::error_code error;
+    if (std::filesystem::is_regular_file(root, error)) {
+        entries[""] = {0, Tree::EntryKind::File, std::filesystem::file_size(root, error), 0, "", root, 0, 0};
+        return error.value() == 0;
+    }
+
+    std::mutex mutex;
+    return Tree::ParallelScan(root, threads, [&](Tree::Entry&& entry) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string relativePath = entry.relativePath;
+        entries.emplace(std::move(relativePath), std::move(entry));
+    });
+}
+
+/*
+    Hash a file in place, through a read-only mapping
+    @param path: the file
+    @param algorithm: hash algorithm
+    @param threads: threads to hash it with, BLAKE3 only
+    @param digest: the hash
+    @param size: the file's size, as it was when it was mapped
+    @return true if successful, false if it couldn't be read
+*/
+static bool HashFile(const std::string& path, Crypto::HashAlgorithm algorithm, unsigned threads, Crypto::Digest& digest, uint64_t& size) {
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat info = {};
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return false;
+    }
+    size = info.st_size;
+
+    // mmap() can't map 0 bytes
+    if (size == 0) {
+        close(fd);
+        return Crypto::CalculateHash(std::span<const Byte>(), digest, algorithm, threads);
+    }
+
+    // The mapping keeps the file open, the descriptor isn't needed anymore
+    void* memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+        return false;
+
+    // Read ahead aggressively, and drop pages behind us, every byte is read exactly once
+    madvise(memory, size, MADV_SEQUENTIAL);
+    const bool hashed = Crypto::CalculateHash(std::span<const Byte>(static_cast<const Byte*>(memory), size), digest, algorithm, threads);
+    munmap(memory, size);
+    return hashed;
+}
+
+/*
+    Compare one file of <expected> with its counterpart in <received>
+    @param check: the file, its outcome is filled in
+    @param algorithm: hash algorithm
+    @param threads: threads to hash each file with
+    @param bytesHashed: incremented by the bytes read on both sides
+*/
+static void CompareFile(Check& check, Crypto::HashAlgorithm algorithm, unsigned threads, std::atomic<uint64_t>& bytesHashed) {
+
+    Crypto::Digest expectedHash, receivedHash;
+    uint64_t expectedSize = 0, receivedSize = 0;
+
+    if (HashFile(check.expectedPath, algorithm, threads, expectedHash, expectedSize) == false) {
+        check.outcome = Outcome::Unreadable;
+        return;
+    }
+    bytesHashed += expectedSize;
+    if (HashFile(check.receivedPath, algorithm, threads, receivedHash, receivedSize) == false) {
+        check.outcome = Outcome::Unreadable;
+        return;
+    }
+    bytesHashed += receivedSize;
+
+    check.outcome = expectedSize == receivedSize && expectedHash == receivedHash ? Outcome::Match : Outcome::Mismatch;
+}
+
+int main(int argc, char* argv[]) {
+
+    if (argc < 3) {
+        Log::Error("main()", std::format("Usage: {} <expected> <received> [--threads <n>] [--hash <sha256|blake3>] [--csv]", argv[0]));
+        return -1;
+    }
+
+    const std::string expectedRoot = argv[1];
+    const std::string receivedRoot = argv[2];
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+    Crypto::HashAlgorithm algorithm = Crypto::HashAlgorithm::Blake3;
+    bool csv = false;
+
+    for (int i = 3; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--threads" && i + 1 < argc) {
+            try {
+                threads = std::max(std::stoi(argv[++i]), 1);
+            }
+            catch (std::invalid_argument&) {
+                Log::Error("main()", "Invalid number of threads");
+                return -1;
+            }
+        }
+        else if (option == "--hash" && i + 1 < argc) {
+            if (Crypto::ParseHashAlgorithm(argv[++i], algorithm) == false) {
+                Log::Error("main()", std::format("Unknown hash algorithm {}", argv[i]));
+                return -1;
+            }
+        }
+        else if (option == "--csv")
+            csv = true;
+        else {
+            Log::Error("main()", std::format("Unknown option {}", option));
+            return -1;
+        }
+    }
+
+    const auto startTime = std::chrono::steady_clock::now();
+
+    // Step 1: Walk both trees
+    std::unordered_map<std::string, Tree::Entry> expected, received;
+    if (Scan(expectedRoot, threads, expected) == false) {
+        Log::Error("main()", std::format("Could not read '{}'", expectedRoot));
+        return -1;
+    }
+    Scan(receivedRoot, threads, received);
+
+    // Step 2: Pair them up, anything missing or of the wrong kind is settled right here
+    std::vector<Check> checks;
+    std::vector<size_t> toHash;
+    checks.reserve(expected.size());
+    for (const auto& [relativePath, entry] : expected) {
+        Check check = {relativePath, entry.fullPath, "", entry.kind, entry.size, Outcome::Match};
+        auto counterpart = received.find(relativePath);
+        if (counterpart == received.end() || counterpart->second.kind != entry.kind)
+            check.outcome = Outcome::Missing;
+        else if (entry.kind == Tree::EntryKind::File) {
+            check.receivedPath = counterpart->second.fullPath;
+            if (counterpart->second.size != entry.size)
+                check.outcome = Outcome::Mismatch;
+            else
+                toHash.push_back(checks.size());
+        }
+        checks.push_back(std::move(check));
+    }
+
+    // Largest first, see the top of this file
+    std::sort(toHash.begin(), toHash.end(), [&](size_t a, size_t b) {
+        return checks[a].size > checks[b].size;
+    });
+
+    // Step 3: Hash what's left on every thread, the spare ones (if any) help with each file
+    const unsigned workers = static_cast<unsigned>(std::min<size_t>(threads, std::max<size_t>(toHash.size(), 1)));
+    const unsigned hashThreads = std::max(threads / workers, 1u);
+    std::atomic<size_t> next = 0;
+    std::atomic<uint64_t> bytesHashed = 0;
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < workers; i++) {
+        pool.emplace_back([&]() {
+            for (size_t index = next++; index < toHash.size(); index = next++)
+                CompareFile(checks[toHash[index]], algorithm, hashThreads, bytesHashed);
+        });
+    }
+    for (std::thread& thread : pool)
+        thread.join();
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    // Step 4: Report, in path order so that two runs can be diffed
+    std::sort(checks.begin(), checks.end(), [](const Check& a, const Check& b) {
+        return a.relativePath < b.relativePath;
+    });
+    std::vector<std::string> extras;
+    for (const auto& [relativePath, entry] : received) {
+        if (expected.contains(relativePath) == false)
+            extras.push_back(relativePath);
+    }
+    std::sort(extras.begin(), extras.end());
+
+    size_t files = 0, mismatched = 0, missing = 0;
+    for (const Check& check : checks) {
+        const std::string name = check.relativePath.empty() ? receivedRoot : check.relativePath;
+        files += check.kind == Tree::EntryKind::File;
+        switch (check.outcome) {
+            case Outcome::Match:
+                break;
+            case Outcome::Mismatch:
+                mismatched++;
+                if (csv == false)
+                    Log::Error("main()", std::format("{} does not match", name));
+                break;
+            case Outcome::Missing:
+                missing++;
+                if (csv == false)
+                    Log::Error("main()", std::format("{} is missing", name));
+                break;
+            case Outcome::Unreadable:
+                mismatched++;
+                if (csv == false)
+                    Log::Error("main()", std::format("{} could not be read", name));
+                break;
+        }
+    }
+    if (csv == false) {
+        for (const std::string& extra : extras)
+            Log::Warning("main()", std::format("{} is only in {}", extra, receivedRoot));
+    }
+
+    const double throughput = bytesHashed / seconds / 1e6;
+    if (csv) {
+        std::cout << "files,mismatched,missing,extra,bytes_hashed,seconds,mb_per_second" << std::endl;
+        std::cout << std::format("{},{},{},{},{},{:.4f},{:.1f}", files, mismatched, missing, extras.size(),
+            bytesHashed.load(), seconds, throughput) << std::endl;
+    }
+    else if (mismatched == 0 && missing == 0) {
+        Log::Success("main()", std::format("All {} files match, hashed {:.1f} MB in {:.3f} s ({:.1f} MB/s, {} threads, {})",
+            files, bytesHashed / 1e6, seconds, throughput, threads, Crypto::HashAlgorithmName(algorithm)));
+    }
+    else {
+        Log::Error("main()", std::format("{} of {} entries differ ({} mismatched, {} missing), hashed {:.1f} MB in {:.3f} s ({:.1f} MB/s)",
+            mismatched + missing, checks.size(), mismatched, missing, bytesHashed / 1e6, seconds, throughput));
+    }
+
+    return mismatched == 0 && missing == 0 ? 0 : 1;
+}
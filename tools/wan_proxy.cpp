@@ -0,0 +1,561 @@
+#include <iostream>
+#include <format>
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <csignal>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "../include/logger.hpp"
+#include "../include/rate_limiter.hpp"
+
+/*
+    WAN emulator, a TCP (and UDP) proxy that makes a loopback connection behave like a long distance link
+
+    Usage: ./wan_proxy.out [--listen <port>] [--target <port>] [--delay <ms>] [--jitter <ms>]
+                           [--rate <rate>] [--queue <size>] [--reorder <percent>] [--reorder-delay <ms>]
+                           [--loss <percent>]
+
+        receiver.out ... (listens on 8080)
+        wan_proxy.out --delay 40 --rate 2M (listens on 9090, forwards to 8080)
+        sender.out ... --port 9090
+
+    Over 127.0.0.1 the round trip is a few microseconds and the bandwidth is whatever
+    memcpy() manages, which hides anything that waits on the other end (a handshake, a
+    hash per file) or that only pays off once the pipe is long and thin. The proxy sits
+    in the middle and, separately in each direction
+    - holds every chunk back by --delay, plus or minus up to --jitter (one way, so the
+      round trip gets twice the delay)
+    - lets the chunks out no faster than --rate (bytes per second, "2M" = 2 MiB/s),
+      through a token bucket, like a bottleneck link
+    - keeps at most --queue bytes waiting (the bottleneck's buffer). Once it's full the
+      proxy stops reading, and TCP flow control pushes back on the side that's sending
+    - picks --reorder percent of the chunks to be held back an extra --reorder-delay
+
+    A TCP stream can't actually be reordered, the receiving end would just put it back
+    in order. What a reordered (or lost and retransmitted) segment costs a TCP connection
+    is the wait for the missing piece, with everything behind it held up. So that's what
+    --reorder emulates: the chunk is late, and everything after it waits for it.
+
+    --loss is the same story. A TCP stream can't lose anything either, and with no netem
+    or firewall to drop real segments, the proxy plays the part of a Reno sender that
+    sees --loss percent of its segments dropped (1448 bytes each):
+    - a chunk with a lost segment in it is late by a round trip (the retransmission),
+      and everything after it waits, like with --reorder
+    - the sender halves its congestion window (at most once per round trip), then grows
+      it by a segment per round trip again, or doubles it while under the slow start
+      threshold
+    - the proxy lets no more than a window per round trip through (on top of --rate)
+    That gives the same throughput a real TCP connection gets on a lossy link
+    (about 1.22 * MSS / (RTT * sqrt(loss)), the Mathis formula), which is what matters here.
+
+    UDP on the same port number is relayed too, through a link of its own with the same
+    settings, except that datagrams really are dropped: --loss percent of them at random,
+    and any that arrive to find --queue bytes already waiting (a bottleneck's tail drop).
+    --reorder really reorders them, the held back datagram doesn't hold up the others.
+    That's what the sender's UDP channel (--udp, see include/udp_transport.hpp) goes through.
+
+    Connections are served until the proxy gets SIGINT or SIGTERM. Each one logs its
+    bytes, duration and throughput in both directions when it closes.
+*/
+
+using Clock = std::chrono::steady_clock;
+
+// How much is read from a socket at once, about one large TCP segment train
+constexpr size_t chunkSize = 16 * 1024;
+// TCP segment size assumed by --loss, and the initial window of the emulated sender
+constexpr double segmentSize = 1448;
+constexpr double initialWindow = 10 * segmentSize;
+// Largest datagram relayed
+constexpr size_t maxDatagram = 64 * 1024;
+
+struct LinkOptions {
+    int listenPort = 9090;
+    int targetPort = 8080;
+    std::chrono::microseconds delay{0};
+    std::chrono::microseconds jitter{0};
+    uint64_t rate = 0;
+    uint64_t queueLimit = 4 * 1024 * 1024;
+    double reorderPercent = 0;
+    std::chrono::microseconds reorderDelay{10000};
+    double lossPercent = 0;
+};
+
+static std::atomic<bool> stopRequested = false;
+
+static void RequestStop(int) {
+    stopRequested = true;
+}
+
+/*
+    Forward one direction of a connection through the emulated link
+    @param from: socket to read from
+    @param to: socket to write to
+    @param options: how the link behaves
+    @param label: name of the direction, for the log
+    @param seed: seed of this direction's random numbers
+
+    Runs until `from` is closed and everything queued has been delivered, then shuts
+    down the writing half of `to`, so the other end sees the same EOF
+*/
+static void Forward(int from, int to, const LinkOptions& options, const std::string& label, uint32_t seed) {
+
+    struct Chunk {
+        Clock::time_point due;
+        std::vector<char> data;
+        // Whether --loss already had its go at it, a chunk is lost at most once
+        bool lossChecked = false;
+    };
+
+    std::deque<Chunk> queue;
+    uint64_t queuedBytes = 0, totalBytes = 0;
+    Clock::time_point lastDue = Clock::now();
+    RateLimit::TokenBucket bucket(options.rate);
+
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<int64_t> jitter(-options.jitter.count(), options.jitter.count());
+    std::uniform_real_distribution<double> percent(0, 100);
+
+    // The emulated Reno sender of --loss, see the top of the file
+    const double roundTrip = std::max(2 * std::chrono::duration<double>(options.delay).count(), 0.001);
+    double window = initialWindow;
+    double slowStartThreshold = 1e18;
+    Clock::time_point lastReduction = Clock::now() - std::chrono::hours(1);
+    const auto applyWindow = [&]() {
+        const uint64_t windowRate = static_cast<uint64_t>(window / roundTrip);
+        bucket.SetRate(options.rate == 0 ? windowRate : std::min(options.rate, windowRate));
+    };
+    if (options.lossPercent > 0)
+        applyWindow();
+
+    const auto start = Clock::now();
+    bool readOpen = true;
+    while (readOpen || queue.empty() == false) {
+
+        // Deliver everything that's due, as fast as the bucket allows
+        Clock::duration wait = std::chrono::milliseconds(100);
+        while (queue.empty() == false) {
+            const Clock::time_point now = Clock::now();
+            if (queue.front().due > now) {
+                wait = queue.front().due - now;
+                break;
+            }
+            const Clock::duration untilReady = bucket.TimeUntilReady();
+            if (untilReady > Clock::duration::zero()) {
+                wait = untilReady;
+                break;
+            }
+
+            Chunk& chunk = queue.front();
+
+            // Lost on the way: it's resent a round trip later, and the window is cut
+            if (options.lossPercent > 0 && chunk.lossChecked == false) {
+                const double segments = std::ceil(chunk.data.size() / segmentSize);
+                const double lossChance = 100 * (1 - std::pow(1 - options.lossPercent / 100, segments));
+                chunk.lossChecked = true;
+                if (percent(random) < lossChance) {
+                    chunk.due = now + std::chrono::microseconds(static_cast<int64_t>(roundTrip * 1e6));
+                    lastDue = std::max(lastDue, chunk.due);
+                    if (now - lastReduction > std::chrono::duration<double>(roundTrip)) {
+                        slowStartThreshold = std::max(window / 2, 2 * segmentSize);
+                        window = slowStartThreshold;
+                        lastReduction = now;
+                        applyWindow();
+                    }
+                    continue;
+                }
+                window += window < slowStartThreshold ? chunk.data.size() : segmentSize * chunk.data.size() / window;
+                applyWindow();
+            }
+
+            size_t written = 0;
+            while (written < chunk.data.size()) {
+                const ssize_t bytes = send(to, chunk.data.data() + written, chunk.data.size() - written, MSG_NOSIGNAL);
+                if (bytes <= 0)
+                    return;
+                written += bytes;
+            }
+            bucket.Consume(chunk.data.size());
+            queuedBytes -= chunk.data.size();
+            queue.pop_front();
+        }
+
+        // Only read while the bottleneck's buffer has room, otherwise let TCP push back
+        pollfd source = {from, static_cast<short>(readOpen && queuedBytes < options.queueLimit ? POLLIN : 0), 0};
+        const int timeout = static_cast<int>(std::clamp<int64_t>(
+            std::chrono::ceil<std::chrono::milliseconds>(wait).count(), 0, 100));
+        if (poll(&source, 1, timeout) < 0 && errno != EINTR)
+            break;
+        if ((source.revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+            continue;
+
+        Chunk chunk;
+        chunk.data.resize(chunkSize);
+        const ssize_t bytes = read(from, chunk.data.data(), chunk.data.size());
+        if (bytes <= 0) {
+            readOpen = false;
+            continue;
+        }
+        chunk.data.resize(bytes);
+
+        // When it's due: delay, jitter, maybe held back, but never before the chunk ahead of it
+        std::chrono::microseconds delay = options.delay + std::chrono::microseconds(jitter(random));
+        if (options.reorderPercent > 0 && percent(random) < options.reorderPercent)
+            delay += options.reorderDelay;
+        chunk.due = std::max(Clock::now() + std::max(delay, std::chrono::microseconds(0)), lastDue);
+        lastDue = chunk.due;
+
+        queuedBytes += bytes;
+        totalBytes += bytes;
+        queue.push_back(std::move(chunk));
+    }
+
+    shutdown(to, SHUT_WR);
+
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    Log::Info("Forward()", std::format("{}: {} bytes in {:.3f} s, {:.2f} MB/s",
+        label, totalBytes, seconds, totalBytes / seconds / 1e6));
+}
+
+/*
+    Relay UDP between clients and the target, through the emulated link
+    @param options: how the link behaves
+
+    Every client (source address) gets a socket of its own towards the target, so that
+    the target's answers can be told apart and sent back to the right client. Both
+    directions are shared by all clients, like the two directions of one link.
+    Runs until the proxy is asked to stop.
+*/
+static void RelayDatagrams(const LinkOptions& options) {
+
+    struct Datagram {
+        std::vector<char> data;
+        // Upstream, the client's socket towards the target. Downstream, the client's address
+        int fd;
+        sockaddr_in client;
+    };
+
+    // One direction of the link
+    struct Direction {
+        std::string label;
+        std::multimap<Clock::time_point, Datagram> queue;
+        uint64_t queuedBytes = 0;
+        Clock::time_point lastDue = Clock::now();
+        RateLimit::TokenBucket bucket{0};
+        uint64_t forwarded = 0, lost = 0, dropped = 0, bytes = 0;
+    };
+
+    struct Client {
+        sockaddr_in address;
+        int fd;
+    };
+
+    int listener = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.listenPort);
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        Log::Error("RelayDatagrams()", std::format("Could not listen for UDP on port {}", options.listenPort));
+        if (listener >= 0)
+            close(listener);
+        return;
+    }
+
+    sockaddr_in target = {};
+    target.sin_family = AF_INET;
+    target.sin_port = htons(options.targetPort);
+    inet_pton(AF_INET, "127.0.0.1", &target.sin_addr);
+
+    // Big enough socket buffers that drops only ever happen in our own queue
+    const int bufferSize = 8 * 1024 * 1024;
+    const auto setBuffers = [&](int fd) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bufferSize, sizeof(bufferSize));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &bufferSize, sizeof(bufferSize));
+    };
+    setBuffers(listener);
+
+    Direction upstream{"UDP upstream", {}}, downstream{"UDP downstream", {}};
+    upstream.bucket.SetRate(options.rate);
+    downstream.bucket.SetRate(options.rate);
+    std::vector<Client> clients;
+
+    std::mt19937 random(0x5eed);
+    std::uniform_int_distribution<int64_t> jitter(-options.jitter.count(), options.jitter.count());
+    std::uniform_real_distribution<double> percent(0, 100);
+
+    // Lost, dropped off the end of a full queue, or queued with a delay
+    const auto enqueue = [&](Direction& direction, Datagram&& datagram) {
+        if (options.lossPercent > 0 && percent(random) < options.lossPercent) {
+            direction.lost++;
+            return;
+        }
+        if (direction.queuedBytes + datagram.data.size() > options.queueLimit) {
+            direction.dropped++;
+            return;
+        }
+
+        // A reordered datagram is simply late, without holding up the ones behind it
+        std::chrono::microseconds delay = options.delay + std::chrono::microseconds(jitter(random));
+        Clock::time_point due = Clock::now() + std::max(delay, std::chrono::microseconds(0));
+        if (options.reorderPercent > 0 && percent(random) < options.reorderPercent)
+            due += options.reorderDelay;
+        else {
+            due = std::max(due, direction.lastDue);
+            direction.lastDue = due;
+        }
+        direction.queuedBytes += datagram.data.size();
+        direction.queue.emplace(due, std::move(datagram));
+    };
+
+    // Send what's due, as fast as the bucket allows, and say how long until the next one
+    const auto deliver = [&](Direction& direction, bool toTarget) {
+        Clock::duration wait = std::chrono::milliseconds(100);
+        while (direction.queue.empty() == false) {
+            const Clock::time_point now = Clock::now();
+            auto next = direction.queue.begin();
+            if (next->first > now)
+                return std::min(wait, next->first - now);
+            const Clock::duration untilReady = direction.bucket.TimeUntilReady();
+            if (untilReady > Clock::duration::zero())
+                return std::min(wait, untilReady);
+
+            Datagram& datagram = next->second;
+            if (toTarget)
+                send(datagram.fd, datagram.data.data(), datagram.data.size(), MSG_DONTWAIT);
+            else
+                sendto(listener, datagram.data.data(), datagram.data.size(), MSG_DONTWAIT,
+                    reinterpret_cast<const sockaddr*>(&datagram.client), sizeof(datagram.client));
+            direction.bucket.Consume(datagram.data.size());
+            direction.queuedBytes -= datagram.data.size();
+            direction.forwarded++;
+            direction.bytes += datagram.data.size();
+            direction.queue.erase(next);
+        }
+        return wait;
+    };
+
+    std::vector<char> buffer(maxDatagram);
+    while (stopRequested == false) {
+        const Clock::duration wait = std::min(deliver(upstream, true), deliver(downstream, false));
+
+        std::vector<pollfd> watched = {{listener, POLLIN, 0}};
+        for (const Client& client : clients)
+            watched.push_back({client.fd, POLLIN, 0});
+        const timespec timeout = {0, static_cast<long>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::clamp<Clock::duration>(wait, Clock::duration::zero(), std::chrono::milliseconds(100))).count())};
+        if (ppoll(watched.data(), watched.size(), &timeout, nullptr) < 0 && errno != EINTR)
+            break;
+
+        // From clients, towards the target
+        if (watched[0].revents & POLLIN) {
+            sockaddr_in source = {};
+            socklen_t sourceSize = sizeof(source);
+            ssize_t size;
+            while ((size = recvfrom(listener, buffer.data(), buffer.size(), MSG_DONTWAIT,
+                reinterpret_cast<sockaddr*>(&source), &sourceSize)) > 0) {
+
+                auto client = std::find_if(clients.begin(), clients.end(), [&](const Client& known) {
+                    return known.address.sin_addr.s_addr == source.sin_addr.s_addr && known.address.sin_port == source.sin_port;
+                });
+                if (client == clients.end()) {
+                    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+                    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&target), sizeof(target)) < 0) {
+                        if (fd >= 0)
+                            close(fd);
+                        continue;
+                    }
+                    setBuffers(fd);
+                    clients.push_back({source, fd});
+                    client = std::prev(clients.end());
+                }
+                enqueue(upstream, {std::vector<char>(buffer.data(), buffer.data() + size), client->fd, client->address});
+                sourceSize = sizeof(source);
+            }
+        }
+
+        // From the target, back towards each client
+        for (size_t i = 1; i < watched.size(); i++) {
+            if ((watched[i].revents & POLLIN) == 0)
+                continue;
+            ssize_t size;
+            while ((size = recv(watched[i].fd, buffer.data(), buffer.size(), MSG_DONTWAIT)) > 0)
+                enqueue(downstream, {std::vector<char>(buffer.data(), buffer.data() + size), -1, clients[i - 1].address});
+        }
+    }
+
+    for (const Direction* direction : {&upstream, &downstream}) {
+        if (direction->forwarded + direction->lost + direction->dropped == 0)
+            continue;
+        Log::Info("RelayDatagrams()", std::format("{}: {} datagrams ({} bytes) forwarded, {} lost, {} dropped by a full queue",
+            direction->label, direction->forwarded, direction->bytes, direction->lost, direction->dropped));
+    }
+    for (const Client& client : clients)
+        close(client.fd);
+    close(listener);
+}
+
+/*
+    Connect to the target, on loopback
+    @param port: port to connect to
+    @return the socket, or -1 if the connection failed
+*/
+static int ConnectToTarget(int port) {
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+    Parse a duration in milliseconds, fractions allowed ("0.5")
+    @param text: the duration
+    @param duration: the parsed duration
+    @return true if valid, false otherwise
+*/
+static bool ParseMilliseconds(const std::string& text, std::chrono::microseconds& duration) {
+    try {
+        size_t used = 0;
+        const double milliseconds = std::stod(text, &used);
+        if (used != text.size() || milliseconds < 0)
+            return false;
+        duration = std::chrono::microseconds(static_cast<int64_t>(milliseconds * 1000));
+        return true;
+    }
+    catch (std::exception&) {
+        return false;
+    }
+}
+
+int main(int argc, char* argv[]) {
+
+    LinkOptions options;
+    for (int i = 1; i < argc; i++) {
+        const std::string option = argv[i];
+        const bool hasValue = i + 1 < argc;
+        bool valid = hasValue;
+
+        if (option == "--listen" && hasValue)
+            valid = (options.listenPort = std::atoi(argv[++i])) > 0;
+        else if (option == "--target" && hasValue)
+            valid = (options.targetPort = std::atoi(argv[++i])) > 0;
+        else if (option == "--delay" && hasValue)
+            valid = ParseMilliseconds(argv[++i], options.delay);
+        else if (option == "--jitter" && hasValue)
+            valid = ParseMilliseconds(argv[++i], options.jitter);
+        else if (option == "--reorder-delay" && hasValue)
+            valid = ParseMilliseconds(argv[++i], options.reorderDelay);
+        else if (option == "--rate" && hasValue)
+            valid = RateLimit::ParseRate(argv[++i], options.rate);
+        else if (option == "--queue" && hasValue)
+            valid = RateLimit::ParseRate(argv[++i], options.queueLimit) && options.queueLimit > 0;
+        else if (option == "--loss" && hasValue) {
+            options.lossPercent = std::atof(argv[++i]);
+            valid = options.lossPercent >= 0 && options.lossPercent < 100;
+        }
+        else if (option == "--reorder" && hasValue) {
+            options.reorderPercent = std::atof(argv[++i]);
+            valid = options.reorderPercent >= 0 && options.reorderPercent <= 100;
+        }
+        else
+            valid = false;
+
+        if (valid == false) {
+            Log::Error("main()", std::format("Usage: {} [--listen <port>] [--target <port>] [--delay <ms>] [--jitter <ms>] "
+                "[--rate <rate>] [--queue <size>] [--reorder <percent>] [--reorder-delay <ms>] [--loss <percent>]", argv[0]));
+            return -1;
+        }
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = RequestStop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, nullptr);
+    sigaction(SIGINT, &action, nullptr);
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuseAddress = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.listenPort);
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(listener, 16) < 0) {
+        Log::Error("main()", std::format("Could not listen on port {}", options.listenPort));
+        return 1;
+    }
+
+    Log::Info("main()", std::format("Forwarding port {} to {}: delay {} us, jitter {} us, rate {} B/s (0 = unlimited), "
+        "queue {} bytes, reorder {}% by {} us, loss {}%", options.listenPort, options.targetPort, options.delay.count(),
+        options.jitter.count(), options.rate, options.queueLimit, options.reorderPercent, options.reorderDelay.count(),
+        options.lossPercent));
+
+    // UDP on the same port numbers, for the sender's UDP channel
+    std::thread datagrams(RelayDatagrams, std::cref(options));
+
+    std::vector<std::thread> threads;
+    std::vector<int> sockets;
+    uint32_t connections = 0;
+    while (stopRequested == false) {
+        pollfd waiting = {listener, POLLIN, 0};
+        if (poll(&waiting, 1, 200) <= 0)
+            continue;
+
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0)
+            continue;
+        int target = ConnectToTarget(options.targetPort);
+        if (target < 0) {
+            Log::Error("main()", std::format("Could not connect to port {}", options.targetPort));
+            close(client);
+            continue;
+        }
+
+        // Small writes should go out when the emulated link says so, not when Nagle does
+        int noDelay = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        setsockopt(target, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        connections++;
+        sockets.push_back(client);
+        sockets.push_back(target);
+        threads.emplace_back(Forward, client, target, std::cref(options), std::format("#{} upstream", connections), connections * 2);
+        threads.emplace_back(Forward, target, client, std::cref(options), std::format("#{} downstream", connections), connections * 2 + 1);
+    }
+
+    // Cut whatever is still open, so the forwarding threads can finish
+    for (int fd : sockets)
+        shutdown(fd, SHUT_RDWR);
+    for (std::thread& thread : threads)
+        thread.join();
+    datagrams.join();
+    for (int fd : sockets)
+        close(fd);
+    close(listener);
+    return 0;
+}